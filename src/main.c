@@ -47,17 +47,27 @@
 
 #include <stdio.h>
 #include <stdarg.h>
-#include <windows.h>   // Core Windows API
-#include <winerror.h>  // Windows error API
-#include <winnt.h>     // Additional core API stuff
-#include <winreg.h>    // Registry API
-#include <Shlwapi.h>   // Shell API
-#include <shlobj.h>    // More Shell API
-#include <winuser.h>   // Dialogs and display
-#include <commctrl.h>  // For modern Windows styling (Common Controls)
-#include <winhttp.h>   // For checking for updates
-#include <pathcch.h>   // For long path support and newer file API (Windows 8+)
-#include <strsafe.h>   // Window API safer string handling
+#include <ctype.h>
+#include <share.h>
+#include <windows.h>      // Core Windows API
+#include <winerror.h>     // Windows error API
+#include <winnt.h>        // Additional core API stuff
+#include <winreg.h>       // Registry API
+#include <Shlwapi.h>      // Shell API
+#include <shlobj.h>       // More Shell API
+#include <winuser.h>      // Dialogs and display
+#include <commctrl.h>     // For modern Windows styling (Common Controls)
+#include <winhttp.h>      // For checking for updates
+#include <pathcch.h>      // For long path support and newer file API (Windows 8+)
+#include <strsafe.h>      // Window API safer string handling
+#include <winioctl.h>     // Volume and disk IOCTLs
+#include <bcrypt.h>       // Content hashes for the backup store
+#include <compressapi.h>  // Backup compression (Windows 8+)
+
+#ifdef K8LRT_BENCH
+    #include <math.h>
+    #include <psapi.h>  // Peak working set for the benchmark report
+#endif
 
 //===================================================================//
 //                          -- LOGGING --                            //
@@ -70,14 +80,172 @@ typedef enum {
     LOG_ERROR,
     LOG_FATAL,
     LOG_DEBUG,
+    LOG_VERBOSE,  // Per-file and per-key detail; dropped unless verbose logging is enabled
 } log_level;
 
+// Posted to LOG_LISTENER after the writer thread has appended a batch to the log file
+#define WM_LOG_APPENDED (WM_APP + 5)
+
+#define _LOG_RING_SIZE 512  // Slots in the message ring (power of two)
+#define _LOG_RECORD_MAX 1152  // Formatted line including the timestamp and level prefix
+#define _LOG_BATCH_MAX (64 * 1024)  // Bytes the writer gathers before each fwrite
+#define _LOG_BODY_MAX 1024
+
+// One slot of the ring. `sequence` equals the slot's position when free and position + 1 once published.
+typedef struct {
+    volatile LONG64 sequence;
+    int length;
+    char text[_LOG_RECORD_MAX];
+} log_record;
+
 static BOOL ATTACHED_TO_CONSOLE = FALSE;
 static FILE* LOG_FILE           = NULL;
+static BOOL HEADLESS            = FALSE;  // Running from the command line; stdout is reserved for JSON output
+
+// Bounded multi-producer, single-consumer queue. Producers claim positions with a CAS on LOG_HEAD and publish
+// through the slot sequence; only the writer thread advances LOG_TAIL and LOG_WRITTEN.
+static log_record LOG_RING[_LOG_RING_SIZE];
+static char LOG_BATCH[_LOG_BATCH_MAX];
+static volatile LONG64 LOG_HEAD         = 0;
+static volatile LONG64 LOG_TAIL         = 0;
+static volatile LONG64 LOG_WRITTEN      = 0;  // Positions that have reached the file
+static volatile LONG LOG_SIGNALLED      = FALSE;
+static volatile LONG LOG_STOPPING       = FALSE;
+static volatile LONG LOG_APPEND_PENDING = FALSE;
+static volatile LONG LOG_MIN_RANK       = 1;  // Messages ranked below this are dropped (see log_rank)
+static volatile HWND LOG_LISTENER       = NULL;
+static HANDLE LOG_WAKE                  = NULL;
+static HANDLE LOG_WRITER                = NULL;
+
+// Verbosity order, independent of the enum values so existing levels keep their numbering
+int log_rank(log_level level) {
+    switch (level) {
+        case LOG_VERBOSE:
+            return 0;
+        case LOG_DEBUG:
+            return 1;
+        case LOG_INFO:
+            return 2;
+        case LOG_WARN:
+            return 3;
+        case LOG_ERROR:
+            return 4;
+        case LOG_FATAL:
+        default:
+            return 5;
+    }
+}
 
-void log_msg(log_level level, const char* fmt, ...) {
+// Drop every message less severe than `lowest`
+void log_set_verbosity(log_level lowest) {
+    InterlockedExchange(&LOG_MIN_RANK, log_rank(lowest));
+}
+
+BOOL log_is_verbose(void) {
+    return LOG_MIN_RANK <= log_rank(LOG_VERBOSE);
+}
+
+void log_write(const char* text, size_t length) {
+    fwrite(text, 1, length, LOG_FILE);
+    fflush(LOG_FILE);
+
+#ifndef NDEBUG
+    if (ATTACHED_TO_CONSOLE) {
+        fwrite(text, 1, length, HEADLESS ? stderr : stdout);
+    }
+#endif
+}
+
+// Move every published record into LOG_BATCH and write it out, one fwrite per full batch
+void log_drain(void) {
+    size_t used = 0;
+    for (;;) {
+        const LONG64 pos   = LOG_TAIL;
+        log_record* record = &LOG_RING[pos & (_LOG_RING_SIZE - 1)];
+        if (record->sequence != pos + 1)
+            break;
+
+        if (used + (size_t)record->length > _LOG_BATCH_MAX) {
+            log_write(LOG_BATCH, used);
+            used = 0;
+        }
+        memcpy(LOG_BATCH + used, record->text, (size_t)record->length);
+        used += (size_t)record->length;
+
+        // Hand the slot back to producers for the next lap of the ring
+        InterlockedExchange64(&record->sequence, pos + _LOG_RING_SIZE);
+        InterlockedExchange64(&LOG_TAIL, pos + 1);
+    }
+
+    if (used > 0) {
+        log_write(LOG_BATCH, used);
+        const HWND listener = LOG_LISTENER;
+        if (listener && InterlockedExchange(&LOG_APPEND_PENDING, TRUE) == FALSE)
+            PostMessage(listener, WM_LOG_APPENDED, 0, 0);
+    }
+    InterlockedExchange64(&LOG_WRITTEN, LOG_TAIL);
+}
+
+DWORD WINAPI log_writer_proc(LPVOID param) {
+    (void)param;
+    for (;;) {
+        WaitForSingleObject(LOG_WAKE, INFINITE);
+        InterlockedExchange(&LOG_SIGNALLED, FALSE);
+        const BOOL stopping = LOG_STOPPING;
+        log_drain();
+        if (stopping)
+            break;
+    }
+    return 0;
+}
+
+void log_enqueue(const char* text, int length) {
+    if (!LOG_WRITER) {
+        log_write(text, (size_t)length);
+        return;
+    }
+
+    for (;;) {
+        const LONG64 pos   = LOG_HEAD;
+        log_record* record = &LOG_RING[pos & (_LOG_RING_SIZE - 1)];
+        const LONG64 diff  = record->sequence - pos;
+        if (diff == 0) {
+            if (InterlockedCompareExchange64(&LOG_HEAD, pos + 1, pos) == pos) {
+                memcpy(record->text, text, (size_t)length);
+                record->length = length;
+                InterlockedExchange64(&record->sequence, pos + 1);
+                break;
+            }
+        } else if (diff < 0) {
+            // Ring is full: make sure the writer is awake and give it the core
+            SetEvent(LOG_WAKE);
+            SwitchToThread();
+        }
+    }
+
+    if (InterlockedExchange(&LOG_SIGNALLED, TRUE) == FALSE)
+        SetEvent(LOG_WAKE);
+}
+
+// Block until everything logged so far has been written to the file
+void log_flush(void) {
     if (!LOG_FILE)
         return;
+    if (!LOG_WRITER) {
+        fflush(LOG_FILE);
+        return;
+    }
+
+    const LONG64 target = LOG_HEAD;
+    while (LOG_WRITTEN < target) {
+        SetEvent(LOG_WAKE);
+        Sleep(1);
+    }
+}
+
+void log_msg(log_level level, const char* fmt, ...) {
+    if (!LOG_FILE || log_rank(level) < LOG_MIN_RANK)
+        return;
 
     SYSTEMTIME st;
     GetLocalTime(&st);
@@ -96,6 +264,9 @@ void log_msg(log_level level, const char* fmt, ...) {
         case LOG_FATAL:
             level_str = "FATAL";
             break;
+        case LOG_VERBOSE:
+            level_str = "VERBOSE";
+            break;
         case LOG_DEBUG:
         default:
             level_str = "DEBUG";
@@ -104,55 +275,89 @@ void log_msg(log_level level, const char* fmt, ...) {
 
     va_list args;
     va_start(args, fmt);
-    char body[1024] = {0};
-    vsnprintf(body, 1024, fmt, args);
+    char body[_LOG_BODY_MAX] = {0};
+    vsnprintf(body, _LOG_BODY_MAX, fmt, args);
     va_end(args);
 
-    char msg[2048] = {0};
-    snprintf(msg,
-             2048,
-             "[%04d-%02d-%02d %02d:%02d:%02d.%03d] [%s] %s\n",
-             st.wYear,
-             st.wMonth,
-             st.wDay,
-             st.wHour,
-             st.wMinute,
-             st.wSecond,
-             st.wMilliseconds,
-             level_str,
-             body);
-
-    fprintf(LOG_FILE, "%s", msg);
-    fflush(LOG_FILE);
-
-    if (level == LOG_FATAL) {
-        char msgbox_msg[2048] = {0};
-        snprintf(msgbox_msg, 2048, "A fatal error has occured and K8-LRT must shutdown:\n\n%s", body);
-        MessageBoxA(NULL, msgbox_msg, "Fatal Error", MB_OK | MB_ICONERROR);
+    char msg[_LOG_RECORD_MAX] = {0};
+
+    int length = snprintf(msg,
+                          _LOG_RECORD_MAX,
+                          "[%04d-%02d-%02d %02d:%02d:%02d.%03d] [%s] %s\n",
+                          st.wYear,
+                          st.wMonth,
+                          st.wDay,
+                          st.wHour,
+                          st.wMinute,
+                          st.wSecond,
+                          st.wMilliseconds,
+                          level_str,
+                          body);
+    if (length < 0)
+        return;
+    if (length >= _LOG_RECORD_MAX) {
+        length          = _LOG_RECORD_MAX - 1;
+        msg[length - 1] = '\n';
     }
 
-#ifndef NDEBUG
-    if (ATTACHED_TO_CONSOLE) {
-        printf("%s", msg);
+    log_enqueue(msg, length);
+
+    if (level == LOG_FATAL) {
+        log_flush();
+        if (HEADLESS) {
+            fprintf(stderr, "Fatal error: %s\n", body);
+        } else {
+            char msgbox_msg[2048] = {0};
+            snprintf(msgbox_msg, 2048, "A fatal error has occured and K8-LRT must shutdown:\n\n%s", body);
+            MessageBoxA(NULL, msgbox_msg, "Fatal Error", MB_OK | MB_ICONERROR);
+        }
     }
-#endif
 }
 
 void log_init(const char* filename) {
-    const errno_t result = fopen_s(&LOG_FILE, filename, "a+");  // append (+ read) mode
-    if (result == 0) {
-        log_msg(LOG_INFO, "--- K8-LRT Started ---");
-    } else {
-        MessageBox(NULL, "Failed to initialize logger.", "Fatal", MB_OK | MB_ICONERROR);
+    // Deny other writers but allow readers, so the log viewer can map the file while we append to it
+    LOG_FILE = _fsopen(filename, "a+", _SH_DENYWR);
+    if (!LOG_FILE) {
+        if (HEADLESS)
+            fprintf(stderr, "Failed to initialize logger.\n");
+        else
+            MessageBox(NULL, "Failed to initialize logger.", "Fatal", MB_OK | MB_ICONERROR);
         exit(1);
     }
+
+    for (LONG64 i = 0; i < _LOG_RING_SIZE; i++)
+        LOG_RING[i].sequence = i;
+
+    // Without the writer thread every message is written synchronously, as before
+    LOG_WAKE = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (LOG_WAKE) {
+        LOG_WRITER = CreateThread(NULL, 0, log_writer_proc, NULL, 0, NULL);
+        if (!LOG_WRITER) {
+            CloseHandle(LOG_WAKE);
+            LOG_WAKE = NULL;
+        }
+    }
+
+    log_msg(LOG_INFO, "--- K8-LRT Started ---");
 }
 
 void log_close(void) {
-    if (LOG_FILE) {
-        log_msg(LOG_INFO, "--- K8-LRT Stopped ---");
-        fclose(LOG_FILE);
+    if (!LOG_FILE)
+        return;
+
+    log_msg(LOG_INFO, "--- K8-LRT Stopped ---");
+    if (LOG_WRITER) {
+        InterlockedExchange(&LOG_STOPPING, TRUE);
+        SetEvent(LOG_WAKE);
+        WaitForSingleObject(LOG_WRITER, INFINITE);
+        CloseHandle(LOG_WRITER);
+        CloseHandle(LOG_WAKE);
+        LOG_WRITER = NULL;
+        LOG_WAKE   = NULL;
     }
+
+    fclose(LOG_FILE);
+    LOG_FILE = NULL;
 }
 
 #define _INFO(fmt, ...) log_msg(LOG_INFO, fmt, ##__VA_ARGS__)
@@ -164,6 +369,7 @@ void log_close(void) {
         quick_exit(1);                                                                                                 \
     } while (FALSE)
 #define _LOG(fmt, ...) log_msg(LOG_DEBUG, fmt, ##__VA_ARGS__)
+#define _VERBOSE(fmt, ...) log_msg(LOG_VERBOSE, fmt, ##__VA_ARGS__)
 
 #pragma endregion
 //===================================================================//
@@ -171,78 +377,217 @@ void log_close(void) {
 //===================================================================//
 #pragma region memory
 
-#define INITIAL_STRPOOL_CAPACITY 16
+// Chunks are at least this big; larger allocations get a chunk of their own
+#define _ARENA_CHUNK_SIZE (64 * 1024)
+#define _ARENA_ALIGNMENT 16
 
-typedef struct {
-    char** strings;
-    size_t count;
+typedef struct arena_chunk {
+    struct arena_chunk* next;
     size_t capacity;
+    size_t used;
+} arena_chunk;
 
-    wchar_t** wide_strings;
-    size_t wide_count;
-    size_t wide_capacity;
-} strpool;
-
-// Global string pool instance
-static strpool STRPOOL;
+// Bump allocator over a list of chunks. Chunks are kept after a reset or rewind and reused by later allocations.
+typedef struct {
+    arena_chunk* first;
+    arena_chunk* current;
+} arena;
 
-void strpool_init(void) {
-    STRPOOL.strings = malloc(INITIAL_STRPOOL_CAPACITY * sizeof(char*));
-    if (!STRPOOL.strings)
-        _FATAL("Failed to allocate memory for string pool");
-    STRPOOL.count    = 0;
-    STRPOOL.capacity = INITIAL_STRPOOL_CAPACITY;
+// Position in an arena to rewind to, releasing everything allocated after it
+typedef struct {
+    arena_chunk* chunk;
+    size_t used;
+} arena_mark;
 
-    STRPOOL.wide_strings = malloc(INITIAL_STRPOOL_CAPACITY * sizeof(wchar_t*));
-    if (!STRPOOL.wide_strings)
-        _FATAL("Failed to allocate memory for string pool");
-    STRPOOL.wide_count    = 0;
-    STRPOOL.wide_capacity = INITIAL_STRPOOL_CAPACITY;
-}
+#define _ARENA_ALIGN(n) (((n) + _ARENA_ALIGNMENT - 1) & ~((size_t)_ARENA_ALIGNMENT - 1))
+#define _ARENA_HEADER_SIZE _ARENA_ALIGN(sizeof(arena_chunk))
 
-char* strpool_strdup(const char* str) {
-    if (!str)
+arena_chunk* arena_new_chunk(size_t min_capacity) {
+    const size_t capacity = min_capacity > _ARENA_CHUNK_SIZE ? min_capacity : _ARENA_CHUNK_SIZE;
+    arena_chunk* chunk    = (arena_chunk*)malloc(_ARENA_HEADER_SIZE + capacity);
+    if (!chunk)
         return NULL;
 
-    char* copy = _strdup(str);
-    if (!copy)
-        return NULL;
+    chunk->next     = NULL;
+    chunk->capacity = capacity;
+    chunk->used     = 0;
+    return chunk;
+}
 
-    if (STRPOOL.count >= STRPOOL.capacity) {
-        const size_t new_cap = STRPOOL.capacity * 2;
-        char** new_strs      = realloc(STRPOOL.strings, new_cap * sizeof(char*));
-        if (!new_strs) {
-            free(copy);
+void* arena_alloc(arena* a, size_t size) {
+    size = _ARENA_ALIGN(size ? size : 1);
+
+    if (!a->current) {
+        a->first = a->current = arena_new_chunk(size);
+        if (!a->current)
             return NULL;
+    }
+
+    arena_chunk* chunk = a->current;
+    while (chunk->capacity - chunk->used < size) {
+        if (chunk->next) {
+            // Everything past `current` was released, so the next chunk starts empty
+            chunk       = chunk->next;
+            chunk->used = 0;
+            continue;
         }
-        STRPOOL.strings  = new_strs;
-        STRPOOL.capacity = new_cap;
+
+        arena_chunk* fresh = arena_new_chunk(size);
+        if (!fresh)
+            return NULL;
+        chunk->next = fresh;
+        chunk       = fresh;
+    }
+
+    a->current = chunk;
+    char* ptr  = (char*)chunk + _ARENA_HEADER_SIZE + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+arena_mark arena_save(const arena* a) {
+    arena_mark mark = {.chunk = a->current, .used = a->current ? a->current->used : 0};
+    return mark;
+}
+
+void arena_reset(arena* a) {
+    a->current = a->first;
+    if (a->first)
+        a->first->used = 0;
+}
+
+void arena_rewind(arena* a, arena_mark mark) {
+    if (!mark.chunk) {
+        arena_reset(a);
+        return;
+    }
+
+    a->current       = mark.chunk;
+    mark.chunk->used = mark.used;
+}
+
+void arena_destroy(arena* a) {
+    arena_chunk* chunk = a->first;
+    while (chunk) {
+        arena_chunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
     }
+    a->first = a->current = NULL;
+}
 
-    STRPOOL.strings[STRPOOL.count++] = copy;
+char* arena_strdup(arena* a, const char* str) {
+    const size_t size = strlen(str) + 1;
+    char* copy        = (char*)arena_alloc(a, size);
+    if (copy)
+        memcpy(copy, str, size);
     return copy;
 }
 
-wchar_t* strpool_wstrdup(const wchar_t* str) {
-    if (!str)
+wchar_t* arena_wstrdup(arena* a, const wchar_t* str) {
+    const size_t size = (wcslen(str) + 1) * sizeof(wchar_t);
+    wchar_t* copy     = (wchar_t*)arena_alloc(a, size);
+    if (copy)
+        memcpy(copy, str, size);
+    return copy;
+}
+
+// Allocator for wjoin(), returning `size` bytes from `context` or NULL
+typedef void* (*wjoin_alloc_fn)(void* context, size_t size);
+
+// Joins `base` and `name` with a backslash, unless `base` is empty or already ends in one
+wchar_t* wjoin(wjoin_alloc_fn alloc, void* context, const wchar_t* base, const wchar_t* name) {
+    const size_t base_len = wcslen(base);
+    const size_t name_len = wcslen(name);
+
+    wchar_t* path = (wchar_t*)alloc(context, (base_len + name_len + 2) * sizeof(wchar_t));
+    if (!path)
         return NULL;
 
-    wchar_t* copy = _wcsdup(str);
-    if (!copy)
+    memcpy(path, base, base_len * sizeof(wchar_t));
+    size_t len = base_len;
+    if (len > 0 && path[len - 1] != L'\\')
+        path[len++] = L'\\';
+    memcpy(path + len, name, (name_len + 1) * sizeof(wchar_t));
+
+    return path;
+}
+
+void* wjoin_arena_alloc(void* context, size_t size) {
+    return arena_alloc((arena*)context, size);
+}
+
+void* wjoin_heap_alloc(void* context, size_t size) {
+    return HeapAlloc((HANDLE)context, 0, size);
+}
+
+wchar_t* arena_wjoin(arena* a, const wchar_t* base, const wchar_t* name) {
+    return wjoin(wjoin_arena_alloc, a, base, name);
+}
+
+// For the rm_rf and copy engines, whose paths outlive any one call and are freed with their private heap
+wchar_t* heap_wjoin(HANDLE heap, const wchar_t* base, const wchar_t* name) {
+    return wjoin(wjoin_heap_alloc, heap, base, name);
+}
+
+// Per-thread arena for short-lived temporaries. Callers bracket their use with arena_save/arena_rewind, so loops
+// over directory entries stay at a flat footprint. Threads that exit must call scratch_release.
+static __declspec(thread) arena SCRATCH;
+
+arena* scratch_arena(void) {
+    return &SCRATCH;
+}
+
+void scratch_release(void) {
+    arena_destroy(&SCRATCH);
+}
+
+// Global string pool; everything in it lives until the next strpool_reset
+static arena STRPOOL;
+
+// Guards STRPOOL, which is shared between the UI thread and the worker pool
+static SRWLOCK STRPOOL_LOCK = SRWLOCK_INIT;
+
+void strpool_init(void) {
+    STRPOOL.first = STRPOOL.current = arena_new_chunk(_ARENA_CHUNK_SIZE);
+    if (!STRPOOL.first)
+        _FATAL("Failed to allocate memory for string pool");
+}
+
+void* strpool_bump(size_t size) {
+    AcquireSRWLockExclusive(&STRPOOL_LOCK);
+    void* ptr = arena_alloc(&STRPOOL, size);
+    ReleaseSRWLockExclusive(&STRPOOL_LOCK);
+    return ptr;
+}
+
+char* strpool_alloc(size_t count) {
+    return (char*)strpool_bump(count);
+}
+
+wchar_t* strpool_walloc(size_t count) {
+    return (wchar_t*)strpool_bump(count * sizeof(wchar_t));
+}
+
+char* strpool_strdup(const char* str) {
+    if (!str)
         return NULL;
 
-    if (STRPOOL.wide_count >= STRPOOL.wide_capacity) {
-        const size_t new_cap = STRPOOL.wide_capacity * 2;
-        wchar_t** new_strs   = realloc(STRPOOL.wide_strings, new_cap * sizeof(wchar_t*));
-        if (!new_strs) {
-            free(copy);
-            return NULL;
-        }
-        STRPOOL.wide_strings  = new_strs;
-        STRPOOL.wide_capacity = new_cap;
-    }
+    const size_t size = strlen(str) + 1;
+    char* copy        = strpool_alloc(size);
+    if (copy)
+        memcpy(copy, str, size);
+    return copy;
+}
+
+wchar_t* strpool_wstrdup(const wchar_t* str) {
+    if (!str)
+        return NULL;
 
-    STRPOOL.wide_strings[STRPOOL.wide_count++] = copy;
+    const size_t count = wcslen(str) + 1;
+    wchar_t* copy      = strpool_walloc(count);
+    if (copy)
+        memcpy(copy, str, count * sizeof(wchar_t));
     return copy;
 }
 
@@ -259,7 +604,7 @@ char* strpool_sprintf(const char* fmt, ...) {
         return NULL;
     }
 
-    char* str = malloc(size + 1);
+    char* str = strpool_alloc(size + 1);
     if (!str) {
         va_end(args_copy);
         return NULL;
@@ -268,18 +613,6 @@ char* strpool_sprintf(const char* fmt, ...) {
     vsnprintf(str, size + 1, fmt, args_copy);
     va_end(args_copy);
 
-    if (STRPOOL.count >= STRPOOL.capacity) {
-        const size_t new_capacity = STRPOOL.capacity * 2;
-        char** new_strings        = realloc(STRPOOL.strings, new_capacity * sizeof(char*));
-        if (!new_strings) {
-            free(str);
-            return NULL;
-        }
-        STRPOOL.strings  = new_strings;
-        STRPOOL.capacity = new_capacity;
-    }
-
-    STRPOOL.strings[STRPOOL.count++] = str;
     return str;
 }
 
@@ -296,7 +629,7 @@ wchar_t* strpool_wsprintf(const wchar_t* fmt, ...) {
         return NULL;
     }
 
-    wchar_t* str = malloc((size + 1) * sizeof(wchar_t));
+    wchar_t* str = strpool_walloc(size + 1);
     if (!str) {
         va_end(args_copy);
         return NULL;
@@ -305,74 +638,18 @@ wchar_t* strpool_wsprintf(const wchar_t* fmt, ...) {
     vswprintf(str, size + 1, fmt, args_copy);
     va_end(args_copy);
 
-    if (STRPOOL.wide_count >= STRPOOL.wide_capacity) {
-        const size_t new_capacity = STRPOOL.wide_capacity * 2;
-        wchar_t** new_strings     = realloc(STRPOOL.wide_strings, new_capacity * sizeof(wchar_t*));
-        if (!new_strings) {
-            free(str);
-            return NULL;
-        }
-        STRPOOL.wide_strings  = new_strings;
-        STRPOOL.wide_capacity = new_capacity;
-    }
-
-    STRPOOL.wide_strings[STRPOOL.wide_count++] = str;
     return str;
 }
 
-char* strpool_alloc(size_t count) {
-    char* buffer = malloc(count);
-    if (!buffer)
-        return NULL;
-
-    if (STRPOOL.count >= STRPOOL.capacity) {
-        const size_t new_capacity = STRPOOL.capacity * 2;
-        char** new_strings        = realloc(STRPOOL.strings, new_capacity * sizeof(char*));
-        if (!new_strings) {
-            free(buffer);
-            return NULL;
-        }
-        STRPOOL.strings  = new_strings;
-        STRPOOL.capacity = new_capacity;
-    }
-
-    STRPOOL.strings[STRPOOL.count++] = buffer;
-    return buffer;
-}
-
-wchar_t* strpool_walloc(size_t count) {
-    wchar_t* buffer = malloc(count * sizeof(wchar_t));
-    if (!buffer)
-        return NULL;
-
-    if (STRPOOL.wide_count >= STRPOOL.wide_capacity) {
-        const size_t new_capacity = STRPOOL.wide_capacity * 2;
-        wchar_t** new_strings     = realloc(STRPOOL.wide_strings, new_capacity * sizeof(wchar_t*));
-        if (!new_strings) {
-            free(buffer);
-            return NULL;
-        }
-        STRPOOL.wide_strings  = new_strings;
-        STRPOOL.wide_capacity = new_capacity;
-    }
-
-    STRPOOL.wide_strings[STRPOOL.wide_count++] = buffer;
-    return buffer;
-}
-
 void strpool_destroy(void) {
-    for (size_t i = 0; i < STRPOOL.count; i++)
-        free(STRPOOL.strings[i]);
-    free(STRPOOL.strings);
-
-    for (size_t i = 0; i < STRPOOL.wide_count; i++)
-        free(STRPOOL.wide_strings[i]);
-    free(STRPOOL.wide_strings);
+    arena_destroy(&STRPOOL);
 }
 
+// O(1): the chunks are kept and refilled by the next scan
 void strpool_reset(void) {
-    strpool_destroy();
-    strpool_init();
+    AcquireSRWLockExclusive(&STRPOOL_LOCK);
+    arena_reset(&STRPOOL);
+    ReleaseSRWLockExclusive(&STRPOOL_LOCK);
 }
 
 #pragma endregion
@@ -383,16 +660,20 @@ void strpool_reset(void) {
 
 #include "resource.h"
 
-static HWND H_LISTBOX                    = NULL;
+static HWND H_LIBRARY_LIST               = NULL;
+static HWND H_FILTER_EDIT                = NULL;
 static HWND H_REMOVE_BUTTON              = NULL;
 static HWND H_REMOVE_ALL_BUTTON          = NULL;
 static HWND H_BACKUP_CHECKBOX            = NULL;  // Whether or not we should backup delete filesa
 static HWND H_LOG_VIEWER                 = NULL;
+static HWND H_BATCH_DIALOG               = NULL;  // Open batch removal dialog, redrawn as library sizes come in
 static HWND H_REMOVE_LIB_FOLDER_CHECKBOX = NULL;
 static HWND H_SELECT_LIB_LABEL           = NULL;
 static HWND H_RELOCATE_BUTTON            = NULL;
 
-static HFONT UI_FONT = NULL;
+static HFONT UI_FONT            = NULL;
+static DWORD UI_CONTROL_CLASSES = 0;  // Common control classes registered so far, see ensure_control_classes
+static LONGLONG STARTUP_TICKS   = 0;  // When WinMain started, for logging how long the window took to show
 
 #pragma endregion
 //===================================================================//
@@ -409,18 +690,33 @@ static HFONT UI_FONT = NULL;
 #define _LOGVIEW_H 400
 #define _LOGVIEW_CLASS "K8LRT_LogView\0"
 #define _LOGVIEW_TITLE "Log\0"
+#define _LOG_FILENAME "K8-LRT.log"
 
 #define _STREQ(s1, s2) strcmp(s1, s2) == 0
 #define _IS_CHECKED(checkbox) (IsDlgButtonChecked(hwnd, checkbox) == BST_CHECKED)
-#define _MAX_LIB_COUNT 512
 #define _MAX_KEY_LENGTH 255
 #define _MAX_PATH_NFTS 32768
 
-#define _LIB_CACHE_ROOT "Native Instruments\\Kontakt 8\\LibrariesCache\0"
-#define _DB3_ROOT "Native Instruments\\Kontakt 8\\komplete.db3\0"
-#define _RAS3_ROOT "C:\\Users\\Public\\Documents\\Native Instruments\\Native Access\\ras3\0"
+#define _LIB_CACHE_ROOT L"Native Instruments\\Kontakt 8\\LibrariesCache"  // Below LocalAppData
+#define _DB3_ROOT L"Native Instruments\\Kontakt 8\\komplete.db3"          // Below LocalAppData
+#define _RAS3_ROOT L"Native Instruments\\Native Access\\ras3"            // Below Public Documents
+#define _SERVICE_CENTER_ROOT L"Native Instruments\\Service Center"  // Below Common Files
+#define _LIBRARY_REGISTRY_PATH "SOFTWARE\\Native Instruments"
+#define _LIBRARY_REGISTRY_PATH_W L"SOFTWARE\\Native Instruments"
+#define _REGISTRY_VIEW_COUNT 2
+#define _LIBRARY_FILTER_MAX 128
 
 typedef struct library_entry library_entry;
+typedef struct worker_job worker_job;
+typedef struct orphan_report orphan_report;
+
+typedef struct {
+    int removed;  // Libraries whose per-library steps all succeeded
+    int failed;   // Libraries that failed (or were unknown)
+    int skipped;  // Libraries left untouched because the job was cancelled
+    BOOL shared_cleanup_ok;
+} removal_summary;
+
 
 typedef struct {
     library_entry* library;
@@ -428,6 +724,15 @@ typedef struct {
     BOOL remove_content_dir;
 } remove_lib_dialog_data;
 
+// Rows shown by a virtual (LVS_OWNERDATA) library list: indices into a library table in display order, narrowed to the
+// libraries whose name contains `filter`. The list view itself only knows the row count.
+typedef struct {
+    int* rows;
+    int row_count;
+    int capacity;
+    wchar_t filter[_LIBRARY_FILTER_MAX];
+} library_view;
+
 typedef struct {
     library_entry* libraries;
     int lib_count;
@@ -435,6 +740,14 @@ typedef struct {
     BOOL backup_files;
     BOOL remove_library_folder;
     int selected_count;
+    int sort_column;  // -1 while the list is still in registry order
+    BOOL sort_descending;
+    library_view view;
+
+    // Set while the removal job is running. The dialog stays open to show progress and ends once the job finishes.
+    worker_job* job;
+    removal_summary summary;
+    BOOL cancelled;
 } batch_removal_dialog_data;
 
 typedef struct {
@@ -447,17 +760,72 @@ struct library_entry {
     const char* name;
     // Actual location of library on disk
     const char* content_dir;
+    // SNPID value of the registry key, NULL if it doesn't have one
+    const char* snpid;
+    // Last-write time of the registry key (the later one if it's in both views); an unchanged key isn't re-read on
+    // the next scan
+    FILETIME last_write;
+    // Bit `i` is set if the key exists in REGISTRY_VIEWS[i]
+    BYTE views;
+
+    // Totals for everything under content_dir, filled in by the size indexer once size_known is set
+    BOOL size_known;
+    ULONGLONG size_bytes;
+    ULONGLONG file_count;
+    ULONGLONG last_access;    // Most recent access time (FILETIME ticks) of any file in the library
+    ULONGLONG content_mtime;  // Last-write time of content_dir when the totals were taken
+};
+
+// Libraries are registered below HKLM\SOFTWARE\Native Instruments in either registry view: 32-bit installers end up
+// under WOW6432Node, which is what the 32-bit view maps that path to.
+typedef struct {
+    REGSAM sam;
+    const char* path;  // The view's library key spelled out for the 64-bit view, used for logging and hive backups
+} registry_view;
+
+static const registry_view REGISTRY_VIEWS[_REGISTRY_VIEW_COUNT] = {
+  {KEY_WOW64_64KEY, "SOFTWARE\\Native Instruments"},
+  {KEY_WOW64_32KEY, "SOFTWARE\\WOW6432Node\\Native Instruments"},
 };
 
-static library_entry LIBRARIES[_MAX_LIB_COUNT];
-static int LIB_COUNT      = 0;
-static int SELECTED_INDEX = -1;
+// Offline image the command line works on instead of this machine (--target, --target-hive). Registry and file
+// paths keep their usual spelling everywhere (steps, journal, snapshots) and are only translated where they're
+// opened: see open_registry_key(), known_paths_init() and target_file_path().
+typedef struct {
+    HKEY software;     // The image's SOFTWARE hive, loaded privately with RegLoadAppKeyW(); NULL for this machine
+    const char* root;  // Where the image's system drive is mounted, NULL if only its hive is available
+    const char* hive;  // Full path `software` was loaded from
+    const char* user;  // Profile whose Kontakt caches are cleaned, NULL for none
+} offline_target;
+
+static offline_target TARGET;
+
+// Library table. It and its strings live in LIBRARY_ARENA rather than the string pool so they survive between
+// incremental scans; entries dropped by a scan stay in the arena until compact_libraries() runs.
+static arena LIBRARY_ARENA;
+static library_entry* LIBRARIES = NULL;
+static int LIB_COUNT            = 0;
+static int LIB_CAPACITY         = 0;
+static int LIB_STALE_COUNT      = 0;  // Entries dropped or replaced since the last compaction
+static int SELECTED_INDEX       = -1;
+
+// Open-addressed name -> index hash over LIBRARIES. Slots hold index + 1, 0 marks an empty slot.
+static int* LIB_INDEX         = NULL;
+static int LIB_INDEX_CAPACITY = 0;
 
 // Whether this is the first time querying for libraries
 static BOOL INITIAL_SEARCH     = TRUE;
 static BOOL BACKUP_FILES       = TRUE;
 static BOOL REMOVE_CONTENT_DIR = TRUE;
 
+typedef enum {
+    DB3_EDIT,    // Delete the removed libraries' rows from komplete.db3
+    DB3_DELETE,  // Delete all of komplete.db3, which Kontakt rebuilds with a full rescan
+} db3_mode;
+
+static db3_mode DB3_MODE = DB3_EDIT;
+static BOOL DB3_VACUUM   = FALSE;  // Compact komplete.db3 after its rows were deleted
+
 // Exclusion list - NI products that aren't libraries
 #define KEY_EXCLUSION_LIST_SIZE 42
 static char* KEY_EXCLUSION_LIST[KEY_EXCLUSION_LIST_SIZE] = {
@@ -513,1881 +881,10911 @@ static char* KEY_EXCLUSION_PATTERNS[KEY_EXCLUSION_PATTERNS_SIZE] = {
   "Waves*",
 };
 
+// Extra exclusions, one per line. "Name*" excludes by (case-insensitive) prefix, other wildcards go through
+// PathMatchSpec, anything else is an exact name. Lines starting with '#' are comments.
+#define _EXCLUSIONS_FILE "K8-LRT.exclusions.txt"
+
+typedef struct exclusion_trie_node {
+    struct exclusion_trie_node* child;
+    struct exclusion_trie_node* sibling;
+    unsigned char ch;
+    BOOL terminal;  // A prefix pattern ends here
+} exclusion_trie_node;
+
+// Compiled exclusion filter, rebuilt by load_exclusions() on every scan. Lives in its own arena since the string
+// pool is reset on every scan too.
+static arena EXCLUSION_ARENA;
+static const char** EXCLUDED_NAMES            = NULL;  // Open-addressed hash set, NULL marks an empty slot
+static int EXCLUDED_NAME_COUNT                = 0;
+static int EXCLUDED_NAME_CAPACITY             = 0;
+static exclusion_trie_node* EXCLUDED_PREFIXES = NULL;
+static const char** EXCLUDED_SPECS            = NULL;  // Patterns with wildcards other than a trailing '*'
+static int EXCLUDED_SPEC_COUNT                = 0;
+static int EXCLUDED_SPEC_CAPACITY             = 0;
+
 #pragma endregion
 //===================================================================//
-//                      -- HELPER FUNCTIONS --                       //
+//                         -- WORKER POOL --                         //
 //===================================================================//
-#pragma region helper functions
+#pragma region worker pool
 
-#ifndef NDEBUG
-    #define _ASSERT(condition)                                                                                         \
-        if (!(condition)) {                                                                                            \
-            _ERROR("Debug assertion failed: %s:%d", __FILE__, __LINE__);                                               \
-            __debugbreak();                                                                                            \
-        }
+// Posted to a job's notify window. wparam: completed steps, lparam: total steps
+#define WM_WORKER_PROGRESS (WM_APP + 1)
+// Posted to a job's notify window once the job has finished. lparam: worker_job*
+#define WM_WORKER_DONE (WM_APP + 2)
 
-    #define _NOT_IMPLEMENTED()                                                                                         \
-        do {                                                                                                           \
-            fprintf(stderr, "NOT IMPLEMENTED");                                                                        \
-            quick_exit(1);                                                                                             \
-        } while (FALSE)
-#else
-    #define _ASSERT(condition)                                                                                         \
-        if (!(condition)) {                                                                                            \
-            _ERROR("Debug assertion failed: %s:%d", __FILE__, __LINE__);                                               \
-        }
+#define _WORKER_MAX_THREADS 8
 
-    #define _NOT_IMPLEMENTED()
-#endif
+typedef enum {
+    JOB_REMOVE,
+    JOB_RELOCATE,
+    JOB_RESTORE,
+    JOB_ORPHANS,
+    JOB_SCAN,
+} worker_job_kind;
+
+// A removal or relocation running off the UI thread. The library table must not be modified while a job is running
+// since jobs reference its entries directly.
+struct worker_job {
+    worker_job_kind kind;
+    HWND notify;
+    PTP_WORK work;
+
+    volatile LONG cancelled;
+    volatile LONG completed;
+    volatile LONG total;
 
-wchar_t* make_long_path(const char* path) {
-    if (!path)
-        return NULL;
+    BOOL backup_files;
+    BOOL remove_content;
 
-    const int needed = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
-    if (needed == 0)
-        return NULL;
+    // JOB_REMOVE
+    const library_entry** libraries;
+    int lib_count;
+    removal_summary summary;
 
-    // Allocate buffer: "\\?\" + path + null
-    const size_t buffer_size = needed + 10;  // Extra space for prefix and safety
-    wchar_t* temp            = (wchar_t*)malloc(sizeof(wchar_t) * buffer_size);
-    if (!temp)
-        return NULL;
+    // JOB_RELOCATE
+    char new_path[MAX_PATH];
+    BOOL relocated;
+
+    // JOB_RESTORE
+    char snapshot_path[MAX_PATH];
+    BOOL restored;
+
+    // JOB_ORPHANS: looks for orphans, or with orphans_removing set removes the ones a previous job found. Owns
+    // `orphans`.
+    orphan_report* orphans;
+    BOOL orphans_removing;
+    BOOL orphans_ok;
+
+    // JOB_SCAN: the first scan. Entries are read into `scan_arena`, and `completed` counts the ones in `scan_entries`
+    // that are ready for the UI thread, which has taken `scan_taken` of them into the library table.
+    arena scan_arena;
+    library_entry* scan_entries;
+    int scan_taken;
+    BOOL scanned;
+};
 
-    MultiByteToWideChar(CP_UTF8, 0, path, -1, temp, needed);
+static PTP_POOL WORKER_POOL                 = NULL;
+static PTP_CLEANUP_GROUP WORKER_CLEANUP     = NULL;
+static TP_CALLBACK_ENVIRON WORKER_ENV;
+static worker_job* ACTIVE_JOB               = NULL;  // Only touched from the UI thread
 
-    // Check if already has \\?\ prefix
-    if (wcsncmp(temp, L"\\\\?\\", 4) == 0) {
-        return temp;
+BOOL worker_init(void) {
+    WORKER_POOL = CreateThreadpool(NULL);
+    if (!WORKER_POOL) {
+        _ERROR("Failed to create worker pool (Error: %lu)", GetLastError());
+        return FALSE;
     }
 
-    // Check if it's a UNC path (\\server\share)
-    if (wcsncmp(temp, L"\\\\", 2) == 0) {
-        // UNC path: convert to \\?\UNC\server\share
-        wchar_t* result = strpool_walloc(buffer_size + 10);
-        if (!result) {
-            free(temp);
-            return NULL;
-        }
-        StringCchPrintfW(result, buffer_size + 10, L"\\\\?\\UNC\\%s", temp + 2);
-        free(temp);
-        return result;
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    const DWORD max_threads = min(max(si.dwNumberOfProcessors, 2), _WORKER_MAX_THREADS);
+    SetThreadpoolThreadMaximum(WORKER_POOL, max_threads);
+    SetThreadpoolThreadMinimum(WORKER_POOL, 1);
+
+    WORKER_CLEANUP = CreateThreadpoolCleanupGroup();
+    if (!WORKER_CLEANUP) {
+        _ERROR("Failed to create worker cleanup group (Error: %lu)", GetLastError());
+        CloseThreadpool(WORKER_POOL);
+        WORKER_POOL = NULL;
+        return FALSE;
     }
 
-    // Regular path: add \\?\ prefix
-    wchar_t* result = strpool_walloc(buffer_size);
-    if (!result) {
-        free(temp);
+    InitializeThreadpoolEnvironment(&WORKER_ENV);
+    SetThreadpoolCallbackPool(&WORKER_ENV, WORKER_POOL);
+    SetThreadpoolCallbackCleanupGroup(&WORKER_ENV, WORKER_CLEANUP, NULL);
+
+    _INFO("Initialized worker pool (%lu threads max)", max_threads);
+    return TRUE;
+}
+
+// Queues `callback` on the worker pool. Returns NULL if the work couldn't be created, in which case the caller should
+// run the callback inline.
+PTP_WORK worker_submit(PTP_WORK_CALLBACK callback, void* context) {
+    if (!WORKER_POOL)
+        return NULL;
+
+    const PTP_WORK work = CreateThreadpoolWork(callback, context, &WORKER_ENV);
+    if (!work) {
+        _ERROR("Failed to create worker task (Error: %lu)", GetLastError());
         return NULL;
     }
-    StringCchPrintfW(result, buffer_size, L"\\\\?\\%s", temp);
-    free(temp);
-    return result;
+
+    SubmitThreadpoolWork(work);
+    return work;
 }
 
-char* join_str(const char* prefix, const char* suffix) {
-    return strpool_sprintf("%s%s", prefix, suffix);
+void worker_wait(PTP_WORK work) {
+    if (!work)
+        return;
+    WaitForThreadpoolWorkCallbacks(work, FALSE);
+    CloseThreadpoolWork(work);
 }
 
-char* join_paths(const char* base, const char* tail) {
-    return strpool_sprintf("%s\\%s", base, tail);
+BOOL worker_is_cancelled(worker_job* job) {
+    return job && InterlockedCompareExchange(&job->cancelled, 0, 0) != 0;
 }
 
-wchar_t* join_paths_wide(const wchar_t* base, const wchar_t* tail) {
-    if (!base || !tail)
-        return NULL;
-
-    const size_t base_len   = wcslen(base);
-    const size_t append_len = wcslen(tail);
-    const size_t total      = base_len + append_len + 2;  // +1 for backslash, +1 for null
-
-    wchar_t* result = strpool_walloc(total);
-    if (!result)
-        return NULL;
-
-    wcscpy_s(result, total, base);
+const volatile LONG* worker_cancel_flag(worker_job* job) {
+    return job ? &job->cancelled : NULL;
+}
 
-    // Add backslash if needed
-    if (base_len > 0 && result[base_len - 1] != L'\\') {
-        wcscat_s(result, total, L"\\");
-    }
+void worker_set_total(worker_job* job, LONG total) {
+    if (!job)
+        return;
+    InterlockedExchange(&job->total, total);
+    if (job->notify)
+        PostMessage(job->notify, WM_WORKER_PROGRESS, (WPARAM)job->completed, (LPARAM)total);
+}
 
-    wcscat_s(result, total, tail);
-    return result;
+void worker_set_progress(worker_job* job, LONG completed) {
+    if (!job)
+        return;
+    InterlockedExchange(&job->completed, completed);
+    if (job->notify)
+        PostMessage(job->notify, WM_WORKER_PROGRESS, (WPARAM)completed, (LPARAM)job->total);
 }
 
-char* get_local_appdata_path(void) {
-    PWSTR psz_path = NULL;
+void worker_report_progress(worker_job* job) {
+    if (!job)
+        return;
+    const LONG done = InterlockedIncrement(&job->completed);
+    if (job->notify)
+        PostMessage(job->notify, WM_WORKER_PROGRESS, (WPARAM)done, (LPARAM)job->total);
+}
 
-    const HRESULT hr = SHGetKnownFolderPath(&FOLDERID_LocalAppData, 0, NULL, &psz_path);
-    if (SUCCEEDED(hr)) {
-        char path[MAX_PATH];
-        WideCharToMultiByte(CP_ACP, 0, psz_path, -1, path, MAX_PATH, NULL, NULL);
-        CoTaskMemFree(psz_path);
+#pragma endregion
+//===================================================================//
+//                      -- HELPER FUNCTIONS --                       //
+//===================================================================//
+#pragma region helper functions
 
-        return strpool_strdup(path);
-    } else {
-        _ERROR("Failed to retrieve path. Error code: 0x%08X\n", (UINT)hr);
-    }
+#ifndef NDEBUG
+    #define _ASSERT(condition)                                                                                         \
+        if (!(condition)) {                                                                                            \
+            _ERROR("Debug assertion failed: %s:%d", __FILE__, __LINE__);                                               \
+            __debugbreak();                                                                                            \
+        }
 
-    return NULL;
-}
+    #define _NOT_IMPLEMENTED()                                                                                         \
+        do {                                                                                                           \
+            fprintf(stderr, "NOT IMPLEMENTED");                                                                        \
+            quick_exit(1);                                                                                             \
+        } while (FALSE)
+#else
+    #define _ASSERT(condition)                                                                                         \
+        if (!(condition)) {                                                                                            \
+            _ERROR("Debug assertion failed: %s:%d", __FILE__, __LINE__);                                               \
+        }
 
-void attach_console() {
-    if (AttachConsole(ATTACH_PARENT_PROCESS)) {
-        FILE* f_dummy;
-        freopen_s(&f_dummy, "CONOUT$", "w", stdout);
-        freopen_s(&f_dummy, "CONOUT$", "w", stderr);
-        ATTACHED_TO_CONSOLE = TRUE;
-        _LOG("Attached debug console");
-    } else {
-        ATTACHED_TO_CONSOLE = FALSE;
-        _WARN("Failed to attach debug console (process must be executed from within a shell)");
-    }
-}
+    #define _NOT_IMPLEMENTED()
+#endif
 
-BOOL file_exists(const char* path) {
-    const DWORD dw_attrib = GetFileAttributesA(path);
-    return (dw_attrib != INVALID_FILE_ATTRIBUTES && !(dw_attrib & FILE_ATTRIBUTE_DIRECTORY));
+LONGLONG query_ticks(void) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
 }
 
-BOOL directory_exists(const char* path) {
-    const DWORD dw_attrib = GetFileAttributesA(path);
-    return (dw_attrib != INVALID_FILE_ATTRIBUTES && (dw_attrib & FILE_ATTRIBUTE_DIRECTORY));
+double ticks_to_ms(LONGLONG ticks) {
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    return (double)ticks * 1000.0 / (double)freq.QuadPart;
 }
 
-BOOL has_extension(const char* filename, const char* ext) {
-    const char* extension = strrchr(filename, '.');
-    if (!extension)
-        return FALSE;
-    if (_STREQ(extension, ext))
-        return TRUE;
-    return FALSE;
+#ifdef K8LRT_BENCH
+// Per-file latencies taken by the engines in the benchmark build (see the bench region). The harness sizes the buffer
+// before each phase; samples past its end are dropped.
+static LONGLONG* BENCH_SAMPLES          = NULL;
+static LONG BENCH_SAMPLE_CAPACITY       = 0;
+static volatile LONG BENCH_SAMPLE_COUNT = 0;
+
+void bench_record(LONGLONG ticks) {
+    const LONG index = InterlockedIncrement(&BENCH_SAMPLE_COUNT) - 1;
+    if (index < BENCH_SAMPLE_CAPACITY)
+        BENCH_SAMPLES[index] = ticks;
 }
 
-BOOL rm_rf_recursive(const wchar_t* path) {
-    wchar_t* search_path = join_paths_wide(path, L"*");
-    if (!search_path)
-        return FALSE;
-
-    WIN32_FIND_DATAW find_data;
-    const HANDLE h_find = FindFirstFileW(search_path, &find_data);
-
-    if (h_find == INVALID_HANDLE_VALUE) {
-        return FALSE;
-    }
+    #define _BENCH_SAMPLE_BEGIN() const LONGLONG _bench_start = query_ticks()
+    #define _BENCH_SAMPLE_END() bench_record(query_ticks() - _bench_start)
+#else
+    #define _BENCH_SAMPLE_BEGIN()
+    #define _BENCH_SAMPLE_END()
+#endif
 
-    BOOL success = TRUE;
-    do {
-        if (wcscmp(find_data.cFileName, L".") == 0 || wcscmp(find_data.cFileName, L"..") == 0) {
-            continue;
-        }
+#define _STATS_FILENAME "K8-LRT.stats.json"
+#define _STATS_STEP_MAX 8
 
-        wchar_t* full_path = join_paths_wide(path, find_data.cFileName);
-        if (!full_path) {
-            success = FALSE;
-            break;
-        }
+// Totals the engines add to from any thread. They only ever grow; an operation's share is the difference between its
+// stats_begin() and stats_end().
+typedef enum {
+    STAT_FILES_DELETED,
+    STAT_BYTES_DELETED,
+    STAT_FILES_COPIED,
+    STAT_BYTES_COPIED,
+    STAT_REGISTRY_OPS,
+    STAT_BACKUP_BYTES,
+    STAT_COUNT,
+} stat_counter;
+
+static const char* STAT_NAMES[STAT_COUNT] = {
+  "files_deleted",
+  "bytes_deleted",
+  "files_copied",
+  "bytes_copied",
+  "registry_ops",
+  "backup_bytes",
+};
 
-        if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-            if (!rm_rf_recursive(full_path)) {
-                success = FALSE;
-            }
-        } else {
-            SetFileAttributesW(full_path, FILE_ATTRIBUTE_NORMAL);
-            if (!DeleteFileW(full_path)) {
-                _ERROR("Failed to delete file: %ls (Error: %lu)", full_path, GetLastError());
-                success = FALSE;
-            }
-        }
+// Hot paths timed with QueryPerformanceCounter, named after the function each one covers
+typedef enum {
+    STAT_SCOPE_SCAN,
+    STAT_SCOPE_RM_RF,
+    STAT_SCOPE_COPY,
+    STAT_SCOPE_UPDATE_CHECK,
+    STAT_SCOPE_COUNT,
+} stat_scope;
+
+static const char* STAT_SCOPE_NAMES[STAT_SCOPE_COUNT] = {
+  "scan_libraries",
+  "rm_rf",
+  "copy_directory",
+  "fetch_latest_version",
+};
 
-        if (!success)
-            break;
+static volatile LONG64 STAT_COUNTERS[STAT_COUNT];
+static volatile LONG64 STAT_SCOPE_TICKS[STAT_SCOPE_COUNT];
+static volatile LONG STAT_SCOPE_CALLS[STAT_SCOPE_COUNT];
 
-    } while (FindNextFileW(h_find, &find_data));
+// One scan, removal, relocation, restore or update check. Between stats_begin() and stats_end() the counters hold the
+// values at the start; stats_end() turns them into what the operation added.
+typedef struct {
+    const char* name;
+    SYSTEMTIME started;  // UTC
+    LONGLONG start;
+    double ms;
+    BOOL succeeded;
+    LONG64 counters[STAT_COUNT];
+    LONG64 scope_ticks[STAT_SCOPE_COUNT];
+    LONG scope_calls[STAT_SCOPE_COUNT];
+
+    // The operation's own steps, if it times them (see stats_set_steps)
+    const char* step_names[_STATS_STEP_MAX];
+    LONGLONG step_ticks[_STATS_STEP_MAX];
+    int step_runs[_STATS_STEP_MAX];
+    int step_count;
+} stats_operation;
+
+// Finished operations, kept for K8-LRT.stats.json while the report is enabled
+static BOOL STATS_REPORT              = FALSE;
+static stats_operation* STATS_HISTORY = NULL;
+static int STATS_HISTORY_COUNT        = 0;
+static int STATS_HISTORY_CAPACITY     = 0;
+static SRWLOCK STATS_LOCK             = SRWLOCK_INIT;
+
+void stats_add(stat_counter counter, ULONGLONG amount) {
+    InterlockedAdd64(&STAT_COUNTERS[counter], (LONG64)amount);
+}
 
-    FindClose(h_find);
+// Charges the time since `start` (a query_ticks() value) to `scope`
+void stats_time_scope(stat_scope scope, LONGLONG start) {
+    InterlockedAdd64(&STAT_SCOPE_TICKS[scope], query_ticks() - start);
+    InterlockedIncrement(&STAT_SCOPE_CALLS[scope]);
+}
 
-    if (success) {
-        if (!RemoveDirectoryW(path)) {
-            _ERROR("Failed to remove directory: %ls (Error: %lu)", path, GetLastError());
-            success = FALSE;
-        }
+void stats_begin(stats_operation* op, const char* name) {
+    memset(op, 0, sizeof(*op));
+    op->name = name;
+    GetSystemTime(&op->started);
+    for (int i = 0; i < STAT_COUNT; i++)
+        op->counters[i] = InterlockedCompareExchange64(&STAT_COUNTERS[i], 0, 0);
+    for (int i = 0; i < STAT_SCOPE_COUNT; i++) {
+        op->scope_ticks[i] = InterlockedCompareExchange64(&STAT_SCOPE_TICKS[i], 0, 0);
+        op->scope_calls[i] = InterlockedCompareExchange(&STAT_SCOPE_CALLS[i], 0, 0);
     }
+    op->start = query_ticks();
+}
 
-    return success;
+// Attaches the per-step timings an operation keeps itself, such as the removal stages
+void stats_set_steps(stats_operation* op,
+                     const char* const names[],
+                     const LONGLONG ticks[],
+                     const int runs[],
+                     int count) {
+    op->step_count = min(count, _STATS_STEP_MAX);
+    for (int i = 0; i < op->step_count; i++) {
+        op->step_names[i] = names[i];
+        op->step_ticks[i] = ticks[i];
+        op->step_runs[i]  = runs[i];
+    }
 }
 
-BOOL rm_rf(const wchar_t* directory) {
-    if (!directory)
-        return FALSE;
-    return rm_rf_recursive(directory);
+void stats_write_counters(FILE* file, const LONG64 counters[STAT_COUNT]) {
+    fputc('{', file);
+    for (int i = 0; i < STAT_COUNT; i++)
+        fprintf(file, "%s\"%s\": %lld", i > 0 ? ", " : "", STAT_NAMES[i], counters[i]);
+    fputc('}', file);
 }
 
-BOOL copy_directory_recursive(const wchar_t* src, const wchar_t* dst) {
-    if (!CreateDirectoryW(dst, NULL)) {
-        if (GetLastError() != ERROR_ALREADY_EXISTS) {
-            _ERROR("Failed to create directory: %ls (Error: %lu)", dst, GetLastError());
-            return FALSE;
-        }
+// Rewrites K8-LRT.stats.json with every operation finished so far. Called with STATS_LOCK held.
+void stats_write_report(void) {
+    FILE* file = NULL;
+    if (fopen_s(&file, _STATS_FILENAME, "w") != 0) {
+        _WARN("Failed to write stats report: '%s'", _STATS_FILENAME);
+        return;
     }
 
-    wchar_t* search_path = join_paths_wide(src, L"*");
-    if (!search_path)
-        return FALSE;
-
-    WIN32_FIND_DATAW find_data;
-    const HANDLE h_find = FindFirstFileW(search_path, &find_data);
+    fprintf(file, "{\n  \"version\": \"%s\",\n  \"operations\": [", VER_PRODUCTVERSION_STR);
+    for (int i = 0; i < STATS_HISTORY_COUNT; i++) {
+        const stats_operation* op = &STATS_HISTORY[i];
+        const SYSTEMTIME* st      = &op->started;
+        fprintf(file,
+                "%s\n    {\"name\": \"%s\", \"started\": \"%04d-%02d-%02dT%02d:%02d:%02d.%03dZ\", \"succeeded\": %s, "
+                "\"ms\": %.3f,\n     \"counters\": ",
+                i > 0 ? "," : "",
+                op->name,
+                st->wYear,
+                st->wMonth,
+                st->wDay,
+                st->wHour,
+                st->wMinute,
+                st->wSecond,
+                st->wMilliseconds,
+                op->succeeded ? "true" : "false",
+                op->ms);
+        stats_write_counters(file, op->counters);
+
+        fputs(",\n     \"scopes\": {", file);
+        BOOL first = TRUE;
+        for (int s = 0; s < STAT_SCOPE_COUNT; s++) {
+            if (op->scope_calls[s] == 0)
+                continue;
+            fprintf(file,
+                    "%s\"%s\": {\"calls\": %ld, \"ms\": %.3f}",
+                    first ? "" : ", ",
+                    STAT_SCOPE_NAMES[s],
+                    op->scope_calls[s],
+                    ticks_to_ms(op->scope_ticks[s]));
+            first = FALSE;
+        }
 
-    if (h_find == INVALID_HANDLE_VALUE) {
-        _ERROR("FindFirstFileW failed for: %ls (Error: %lu)", src, GetLastError());
-        return FALSE;
+        fputs("},\n     \"steps\": {", file);
+        first = TRUE;
+        for (int s = 0; s < op->step_count; s++) {
+            if (op->step_runs[s] == 0)
+                continue;
+            fprintf(file,
+                    "%s\"%s\": {\"runs\": %d, \"ms\": %.3f}",
+                    first ? "" : ", ",
+                    op->step_names[s],
+                    op->step_runs[s],
+                    ticks_to_ms(op->step_ticks[s]));
+            first = FALSE;
+        }
+        fputs("}}", file);
     }
 
-    BOOL success = TRUE;
-    do {
-        // Skip . and ..
-        if (wcscmp(find_data.cFileName, L".") == 0 || wcscmp(find_data.cFileName, L"..") == 0) {
-            continue;
-        }
+    LONG64 totals[STAT_COUNT];
+    for (int i = 0; i < STAT_COUNT; i++)
+        totals[i] = InterlockedCompareExchange64(&STAT_COUNTERS[i], 0, 0);
+    fputs("\n  ],\n  \"totals\": ", file);
+    stats_write_counters(file, totals);
+    fputs("\n}\n", file);
 
-        wchar_t* src_path = join_paths_wide(src, find_data.cFileName);
-        wchar_t* dst_path = join_paths_wide(dst, find_data.cFileName);
+    fclose(file);
+}
 
-        if (!src_path || !dst_path) {
-            success = FALSE;
-            break;
-        }
+// Logs one summary line for `op` and, if the report is enabled, adds it to K8-LRT.stats.json
+void stats_end(stats_operation* op, BOOL succeeded) {
+    op->ms        = ticks_to_ms(query_ticks() - op->start);
+    op->succeeded = succeeded;
+    for (int i = 0; i < STAT_COUNT; i++)
+        op->counters[i] = InterlockedCompareExchange64(&STAT_COUNTERS[i], 0, 0) - op->counters[i];
+    for (int i = 0; i < STAT_SCOPE_COUNT; i++) {
+        op->scope_ticks[i] = InterlockedCompareExchange64(&STAT_SCOPE_TICKS[i], 0, 0) - op->scope_ticks[i];
+        op->scope_calls[i] = InterlockedCompareExchange(&STAT_SCOPE_CALLS[i], 0, 0) - op->scope_calls[i];
+    }
 
-        if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-            if (!copy_directory_recursive(src_path, dst_path)) {
-                _ERROR("Failed to copy subdirectory: %ls", src_path);
-                success = FALSE;
-            }
-        } else {
-            COPYFILE2_EXTENDED_PARAMETERS params = {0};
-            params.dwSize                        = sizeof(params);
-            params.dwCopyFlags                   = COPY_FILE_NO_BUFFERING;
+    // Copy throughput is the closest thing to a drive speed we measure, so it goes in the line as well
+    const double copy_ms = ticks_to_ms(op->scope_ticks[STAT_SCOPE_COPY]);
+    const double copy_mb = (double)op->counters[STAT_BYTES_COPIED] / (1024.0 * 1024.0);
 
-            const HRESULT hr = CopyFile2(src_path, dst_path, &params);
-            if (FAILED(hr)) {
-                _ERROR("Failed to copy file: %ls to %ls (HRESULT: 0x%08X)", src_path, dst_path, hr);
-                success = FALSE;
+    char scopes[256] = "";
+    for (int i = 0; i < STAT_SCOPE_COUNT; i++) {
+        if (op->scope_calls[i] == 0)
+            continue;
+        const size_t len = strlen(scopes);
+        StringCchPrintfA(scopes + len,
+                         sizeof(scopes) - len,
+                         "%s%s %.2f ms x%ld",
+                         len > 0 ? ", " : "; ",
+                         STAT_SCOPE_NAMES[i],
+                         ticks_to_ms(op->scope_ticks[i]),
+                         op->scope_calls[i]);
+    }
+
+    _INFO("Stats for %s (%s): %.2f ms, deleted %lld file(s) / %lld bytes, copied %lld file(s) / %lld bytes (%.1f "
+          "MB/s), %lld registry op(s), %lld bytes backed up%s",
+          op->name,
+          succeeded ? "succeeded" : "failed",
+          op->ms,
+          op->counters[STAT_FILES_DELETED],
+          op->counters[STAT_BYTES_DELETED],
+          op->counters[STAT_FILES_COPIED],
+          op->counters[STAT_BYTES_COPIED],
+          copy_ms > 0.0 ? copy_mb * 1000.0 / copy_ms : 0.0,
+          op->counters[STAT_REGISTRY_OPS],
+          op->counters[STAT_BACKUP_BYTES],
+          scopes);
+
+    AcquireSRWLockExclusive(&STATS_LOCK);
+    if (STATS_REPORT) {
+        if (STATS_HISTORY_COUNT == STATS_HISTORY_CAPACITY) {
+            const int new_cap      = STATS_HISTORY_CAPACITY ? STATS_HISTORY_CAPACITY * 2 : 16;
+            stats_operation* grown = (stats_operation*)realloc(STATS_HISTORY, new_cap * sizeof(stats_operation));
+            if (grown) {
+                STATS_HISTORY          = grown;
+                STATS_HISTORY_CAPACITY = new_cap;
             }
         }
-
-        if (!success)
-            break;
-
-    } while (FindNextFileW(h_find, &find_data));
-
-    FindClose(h_find);
-    return success;
+        if (STATS_HISTORY_COUNT < STATS_HISTORY_CAPACITY)
+            STATS_HISTORY[STATS_HISTORY_COUNT++] = *op;
+        stats_write_report();
+    }
+    ReleaseSRWLockExclusive(&STATS_LOCK);
 }
 
-BOOL copy_directory(const char* src, const char* dst) {
-    wchar_t* src_w = make_long_path(src);
-    wchar_t* dst_w = make_long_path(dst);
-    if (!src_w || !dst_w)
-        return FALSE;
-    return copy_directory_recursive(src_w, dst_w);
+// Turns K8-LRT.stats.json on or off. The file covers the operations finished since it was last turned on.
+void stats_set_report(BOOL enabled) {
+    AcquireSRWLockExclusive(&STATS_LOCK);
+    STATS_REPORT        = enabled;
+    STATS_HISTORY_COUNT = 0;
+    ReleaseSRWLockExclusive(&STATS_LOCK);
 }
 
-BOOL list_contains(char* haystack[], const int haystack_size, const char* needle) {
-    _ASSERT(haystack_size > 0);
+BOOL stats_report_enabled(void) {
+    return STATS_REPORT;
+}
 
-    for (int i = 0; i < haystack_size; i++) {
-        const char* str = haystack[i];
-        if (_STREQ(str, needle))
-            return TRUE;
-    }
+char* arena_wide_to_utf8(arena* a, const wchar_t* str) {
+    const int needed = WideCharToMultiByte(CP_UTF8, 0, str, -1, NULL, 0, NULL, NULL);
+    if (needed == 0)
+        return NULL;
 
-    return FALSE;
+    char* result = (char*)arena_alloc(a, needed);
+    if (result)
+        WideCharToMultiByte(CP_UTF8, 0, str, -1, result, needed, NULL, NULL);
+    return result;
 }
 
-BOOL matches_pattern_in_list(char* patterns[], const int patterns_count, const char* needle) {
-    _ASSERT(patterns_count > 0);
-
-    for (int i = 0; i < patterns_count; i++) {
-        const char* str = patterns[i];
-        if (PathMatchSpec(needle, str))
-            return TRUE;
-    }
+char* wide_to_utf8(const wchar_t* str) {
+    const int needed = WideCharToMultiByte(CP_UTF8, 0, str, -1, NULL, 0, NULL, NULL);
+    if (needed == 0)
+        return NULL;
 
-    return FALSE;
+    char* result = strpool_alloc(needed);
+    if (result)
+        WideCharToMultiByte(CP_UTF8, 0, str, -1, result, needed, NULL, NULL);
+    return result;
 }
 
-// Enable registry key backups
-void enable_backup_privilege(void) {
-    HANDLE h_token;
-    TOKEN_PRIVILEGES tp;
-    LUID luid;
+wchar_t* utf8_to_wide(const char* str) {
+    const int needed = MultiByteToWideChar(CP_UTF8, 0, str, -1, NULL, 0);
+    if (needed == 0)
+        return NULL;
 
-    if (OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &h_token)) {
-        if (LookupPrivilegeValue(NULL, SE_BACKUP_NAME, &luid)) {
-            tp.PrivilegeCount           = 1;
-            tp.Privileges[0].Luid       = luid;
-            tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
-            AdjustTokenPrivileges(h_token, FALSE, &tp, sizeof(TOKEN_PRIVILEGES), NULL, NULL);
-        }
-        CloseHandle(h_token);
-        _INFO("Enabled registry backup privileges");
-    } else {
-        _FATAL("Failed to enable registry backup privileges. Are you admin?");
-    }
+    wchar_t* result = strpool_walloc(needed);
+    if (result)
+        MultiByteToWideChar(CP_UTF8, 0, str, -1, result, needed);
+    return result;
 }
 
-void clear_libraries(void) {
-    strpool_reset();
+// A path in the \\?\ form the W APIs take, with its length up front. Paths used over and over (the known folders, the
+// cache map, removal steps) are converted once into one of these and then joined onto and passed around as is.
+typedef struct {
+    size_t len;  // Characters, not counting the terminator
+    wchar_t text[];
+} wpath;
 
-    for (int i = 0; i < LIB_COUNT; i++) {
-        LIBRARIES[i].name        = NULL;
-        LIBRARIES[i].content_dir = NULL;
-    }
+#define _WPATH_PREFIX_MAX 7  // \\?\UNC, which takes the place of one of a UNC path's leading separators
 
-    // Reset list box contents
-    SendMessage(H_LISTBOX, LB_RESETCONTENT, 0, 0);
+#define _IS_PATH_SEPARATOR(c) ((c) == '\\' || (c) == '/')
 
-    SELECTED_INDEX = -1;
-    LIB_COUNT      = 0;
+// Bytes a wpath built from `len` characters can need: UTF-16 never takes more units than UTF-8 takes bytes
+size_t wpath_size(size_t len) {
+    return sizeof(wpath) + (_WPATH_PREFIX_MAX + len + 1) * sizeof(wchar_t);
 }
 
-BOOL open_registry_key(HKEY* key, HKEY base, const char* path, UINT sam) {
-    const LONG result = RegOpenKeyExA(base, path, 0, (REGSAM)sam, key);
-    if (result != ERROR_SUCCESS) {
-        _ERROR("Failed to open registry key: '%s'", path);
-        return FALSE;
+// Writes the prefix a path starting with `c0`..`c2` needs into `out` and returns its length. `*skip` is set to how
+// many of the path's own characters it replaces. Relative paths get none, since \\?\ only takes absolute ones.
+size_t wpath_prefix(unsigned int c0, unsigned int c1, unsigned int c2, wchar_t* out, size_t* skip) {
+    *skip = 0;
+    if (_IS_PATH_SEPARATOR(c0) && _IS_PATH_SEPARATOR(c1)) {
+        if (c2 == '?' || c2 == '.')
+            return 0;  // Already \\?\ or a device path
+        *skip = 1;
+        memcpy(out, L"\\\\?\\UNC", _WPATH_PREFIX_MAX * sizeof(wchar_t));
+        return _WPATH_PREFIX_MAX;
     }
-
-    return TRUE;
-}
-
-void close_registry_key(HKEY* key) {
-    RegCloseKey(*key);
-}
-
-BOOL delete_registry_key(HKEY base_key, const char* key) {
-    const LONG result = RegDeleteKeyA(base_key, key);
-    if (result != ERROR_SUCCESS) {}
-
-    return TRUE;
+    if (((c0 | 0x20) >= 'a' && (c0 | 0x20) <= 'z') && c1 == ':' && _IS_PATH_SEPARATOR(c2)) {
+        memcpy(out, L"\\\\?\\", 4 * sizeof(wchar_t));
+        return 4;
+    }
+    return 0;
 }
 
-int enumerate_registry_keys(HKEY key, char* keys[]) {
-    char current_key[_MAX_KEY_LENGTH];
-    DWORD buffer_size = sizeof(current_key);
-    FILETIME ft_last;
-    DWORD index = 0;
-
-    while (RegEnumKeyExA(key, index, current_key, &buffer_size, NULL, NULL, NULL, &ft_last) == ERROR_SUCCESS) {
-        _INFO("Found registry entry: '%s'", current_key);
-        buffer_size   = sizeof(current_key);
-        keys[index++] = strpool_strdup(current_key);
+// Separators aren't normalised behind \\?\, so forward slashes are turned around while the path is built
+void wpath_finish(wpath* path, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (path->text[i] == L'/')
+            path->text[i] = L'\\';
     }
-
-    return index;
+    path->text[len] = L'\0';
+    path->len       = len;
 }
 
-const char* get_registry_value_str(HKEY key, const char* value_name) {
-    char value[MAX_PATH];
-    DWORD buffer_size = sizeof(value);
-    DWORD value_type;
+// Converts `len` bytes of UTF-8 into `out`, which has room for wpath_size(len), in a single pass
+wpath* wpath_fill_utf8(wpath* out, const char* path, size_t len) {
+    if (!out)
+        return NULL;
 
-    const LSTATUS status = RegQueryValueExA(key, value_name, NULL, &value_type, (LPBYTE)value, &buffer_size);
-    if (status == ERROR_SUCCESS && value_type == REG_SZ) {
-        return strpool_strdup(value);
+    size_t skip         = 0;
+    const size_t prefix = wpath_prefix(len > 0 ? (unsigned char)path[0] : 0,
+                                       len > 1 ? (unsigned char)path[1] : 0,
+                                       len > 2 ? (unsigned char)path[2] : 0,
+                                       out->text,
+                                       &skip);
+
+    int converted = 0;
+    if (len > skip) {
+        converted =
+          MultiByteToWideChar(CP_UTF8, 0, path + skip, (int)(len - skip), out->text + prefix, (int)(len - skip));
+        if (converted == 0)
+            return NULL;
     }
 
-    return NULL;
+    wpath_finish(out, prefix + converted);
+    return out;
 }
 
-BOOL set_registry_value_str(HKEY key, const char* value_name, const char* new_value) {
-    const LSTATUS status =
-      RegSetValueExA(key, value_name, 0, REG_SZ, (const BYTE*)new_value, (DWORD)(strlen(new_value) + 1));
-    return (status == ERROR_SUCCESS);
+wpath* wpath_from_utf8(arena* a, const char* path) {
+    if (!path)
+        return NULL;
+    const size_t len = strlen(path);
+    return wpath_fill_utf8((wpath*)arena_alloc(a, wpath_size(len)), path, len);
 }
 
-BOOL query_libraries(HWND hwnd) {
-    clear_libraries();
-
-    HKEY base_key;
-    LPCSTR base_path = "SOFTWARE\\Native Instruments";
-    BOOL open_result = open_registry_key(&base_key, HKEY_LOCAL_MACHINE, base_path, KEY_READ);
-    if (!open_result)
-        return FALSE;
+wpath* wpath_from_wide(arena* a, const wchar_t* path) {
+    if (!path)
+        return NULL;
 
-    char* keys[_MAX_LIB_COUNT] = {0};
-    const int key_count        = enumerate_registry_keys(base_key, keys);
+    const size_t len = wcslen(path);
+    wpath* out       = (wpath*)arena_alloc(a, wpath_size(len));
+    if (!out)
+        return NULL;
 
-    close_registry_key(&base_key);
+    size_t skip         = 0;
+    const size_t prefix =
+      wpath_prefix(len > 0 ? path[0] : 0, len > 1 ? path[1] : 0, len > 2 ? path[2] : 0, out->text, &skip);
+    memcpy(out->text + prefix, path + skip, (len - skip) * sizeof(wchar_t));
+    wpath_finish(out, prefix + len - skip);
+    return out;
+}
 
-    for (int i = 0; i < key_count; i++) {
-        if (i >= _MAX_LIB_COUNT)
-            break;
+// `base` followed by a separator and the first `len` characters of `name`
+wpath* wpath_join(arena* a, const wpath* base, const wchar_t* name, size_t len) {
+    wpath* out = (wpath*)arena_alloc(a, wpath_size(base->len + 1 + len));
+    if (!out)
+        return NULL;
 
-        const char* key_str = keys[i];
+    memcpy(out->text, base->text, base->len * sizeof(wchar_t));
+    size_t total = base->len;
+    if (total > 0 && out->text[total - 1] != L'\\')
+        out->text[total++] = L'\\';
+    memcpy(out->text + total, name, len * sizeof(wchar_t));
+    wpath_finish(out, total + len);
+    return out;
+}
 
-        const BOOL in_exclusion_list = list_contains(KEY_EXCLUSION_LIST, KEY_EXCLUSION_LIST_SIZE, key_str);
-        const BOOL matches_exclusion_pattern =
-          matches_pattern_in_list(KEY_EXCLUSION_PATTERNS, KEY_EXCLUSION_PATTERNS_SIZE, key_str);
-        if (in_exclusion_list || matches_exclusion_pattern)
-            continue;
+// The directory holding `path`, NULL if it has none
+wpath* wpath_parent(arena* a, const wpath* path) {
+    const wchar_t* separator = wcsrchr(path->text, L'\\');
+    if (!separator)
+        return NULL;
 
-        HKEY key;
-        open_result = open_registry_key(&key, HKEY_LOCAL_MACHINE, join_paths(base_path, key_str), KEY_READ);
-        if (!open_result)
-            continue;
+    const size_t len = separator - path->text;
+    wpath* out       = (wpath*)arena_alloc(a, wpath_size(len));
+    if (!out)
+        return NULL;
 
-        library_entry entry     = {.name = key_str, NULL};
-        const char* content_dir = get_registry_value_str(key, "ContentDir");
+    memcpy(out->text, path->text, len * sizeof(wchar_t));
+    wpath_finish(out, len);
+    return out;
+}
 
-        if (content_dir != NULL) {
-            entry.content_dir = content_dir;
-        } else {
-            _WARN("Failed to retrieve ContentDir value for registry key: 'HKEY_LOCAL_MACHINE\\%s\\%s'",
-                  base_path,
-                  key_str);
-        }
+// The path without \\?\, for logging and for APIs that take a plain path. UNC paths keep their \\?\UNC form.
+const wchar_t* wpath_plain(const wpath* path) {
+    if (path->len > 5 && wcsncmp(path->text, L"\\\\?\\", 4) == 0 && path->text[5] == L':')
+        return path->text + 4;
+    return path->text;
+}
 
-        memcpy(&LIBRARIES[LIB_COUNT], &entry, sizeof(entry));
-        SendMessage(H_LISTBOX, LB_INSERTSTRING, LIB_COUNT, (LPARAM)LIBRARIES[LIB_COUNT].name);
+wpath* strpool_wpath(const char* path) {
+    if (!path)
+        return NULL;
+    const size_t len = strlen(path);
+    return wpath_fill_utf8((wpath*)strpool_bump(wpath_size(len)), path, len);
+}
 
-        _INFO("Found library entry: '%s (%s)'", LIBRARIES[LIB_COUNT].name, LIBRARIES[LIB_COUNT].content_dir);
+wchar_t* make_long_path(const char* path) {
+    wpath* result = strpool_wpath(path);
+    return result ? result->text : NULL;
+}
 
-        LIB_COUNT++;
-        close_registry_key(&key);
-    }
+char* join_str(const char* prefix, const char* suffix) {
+    return strpool_sprintf("%s%s", prefix, suffix);
+}
 
-    _INFO("Finished querying registry entries (found %d library entries)", LIB_COUNT);
+char* join_paths(const char* base, const char* tail) {
+    return strpool_sprintf("%s\\%s", base, tail);
+}
 
-    if (INITIAL_SEARCH) {
-        INITIAL_SEARCH = FALSE;
+// Files and folders outside the library folders that removals clean up, resolved once at startup from the known
+// folders they live in. Each is NULL if its known folder couldn't be resolved.
+typedef struct {
+    arena arena;
+    const wpath* libraries_cache;     // Kontakt's LibrariesCache folder
+    const wpath* db3;                 // Kontakt's komplete.db3
+    const wpath* ras3;                // Native Access's ras3 folder
+    const wpath* service_center;      // Native Instruments' Service Center, holding each library's XML file
+    const char* service_center_utf8;  // For the XML paths recorded in removal steps and the journal
+} known_paths;
+
+static known_paths PATHS;
+
+// `name` below the known folder `id`. For an offline image it's below `image_folder` (relative to TARGET.root)
+// instead, and NULL when the image has no mounted root or `image_folder` is NULL.
+const wpath* known_folder_path(REFKNOWNFOLDERID id, const char* image_folder, const wchar_t* name) {
+    arena* scratch        = scratch_arena();
+    const arena_mark mark = arena_save(scratch);
+    const wpath* base     = NULL;
+
+    if (TARGET.software) {
+        if (TARGET.root && image_folder)
+            base = wpath_from_utf8(scratch, join_paths(TARGET.root, image_folder));
     } else {
-        MessageBox(hwnd,
-                   strpool_sprintf("Found %d installed libraries", LIB_COUNT),
-                   "K8-LRT",
-                   MB_OK | MB_ICONINFORMATION);
+        PWSTR folder     = NULL;
+        const HRESULT hr = SHGetKnownFolderPath(id, 0, NULL, &folder);
+        if (FAILED(hr)) {
+            _ERROR("Failed to retrieve path of: '%ls'. Error code: 0x%08X", name, (UINT)hr);
+            return NULL;
+        }
+
+        base = wpath_from_wide(scratch, folder);
+        CoTaskMemFree(folder);
     }
 
-    return TRUE;
+    const wpath* path = base ? wpath_join(&PATHS.arena, base, name, wcslen(name)) : NULL;
+    arena_rewind(scratch, mark);
+    return path;
 }
 
-BOOL remove_registry_keys(const char* key) {
-    LPCSTR base_path = "SOFTWARE\\Native Instruments";
-    HKEY h_key;
+// Resolves PATHS for this machine, or for TARGET's image once it's been opened
+void known_paths_init(void) {
+    const char* local_appdata = TARGET.user ? strpool_sprintf("Users\\%s\\AppData\\Local", TARGET.user) : NULL;
+    if (TARGET.software && TARGET.root && !TARGET.user)
+        _WARN("No --target-user given, Kontakt's LibrariesCache and komplete.db3 are left alone");
+
+    PATHS.libraries_cache = known_folder_path(&FOLDERID_LocalAppData, local_appdata, _LIB_CACHE_ROOT);
+    PATHS.db3             = known_folder_path(&FOLDERID_LocalAppData, local_appdata, _DB3_ROOT);
+    PATHS.ras3            = known_folder_path(&FOLDERID_PublicDocuments, "Users\\Public\\Documents", _RAS3_ROOT);
+    PATHS.service_center =
+      known_folder_path(&FOLDERID_ProgramFilesCommonX64, "Program Files\\Common Files", _SERVICE_CENTER_ROOT);
+    if (PATHS.service_center)
+        PATHS.service_center_utf8 = arena_wide_to_utf8(&PATHS.arena, wpath_plain(PATHS.service_center));
+}
 
-    if (RegOpenKeyExA(HKEY_LOCAL_MACHINE, base_path, 0, KEY_ALL_ACCESS, &h_key) == ERROR_SUCCESS) {
-        if (BACKUP_FILES) {
-            HKEY h_subkey;
-            if (RegOpenKeyExA(HKEY_LOCAL_MACHINE, join_paths(base_path, key), 0, KEY_READ, &h_subkey) ==
-                ERROR_SUCCESS) {
-                const char* reg_filename = join_str(key, ".reg");
-                DeleteFileA(reg_filename);
-                const LONG backup_res = RegSaveKeyExA(h_subkey, reg_filename, NULL, REG_LATEST_FORMAT);
-
-                if (backup_res != ERROR_SUCCESS) {
-                    _ERROR("Failed to backup registry entry for key: 'HKEY_LOCAL_MACHINE\\%s\\%s'", base_path, key);
-                    RegCloseKey(h_subkey);
-                    return FALSE;
-                }
+void known_paths_destroy(void) {
+    arena_destroy(&PATHS.arena);
+    ZeroMemory(&PATHS, sizeof(PATHS));
+}
 
-                RegCloseKey(h_subkey);
-            }
-        }
+// Where `path`, as the offline image records it, is reachable from here. Only the image's system drive (C:) is
+// mounted, so paths on other drives, shares and the drive's root itself give NULL. Unchanged for this machine.
+const char* target_file_path(const char* path) {
+    if (!TARGET.software || !path)
+        return path;
+    if (!TARGET.root || (path[0] != 'C' && path[0] != 'c') || path[1] != ':' || !_IS_PATH_SEPARATOR(path[2]))
+        return NULL;
 
-        const LONG res = RegDeleteKeyA(h_key, key);
-        if (res != ERROR_SUCCESS) {
-            _ERROR("Failed to delete registry key: 'HKEY_LOCAL_MACHINE\\%s\\%s'", base_path, key);
-            RegCloseKey(h_key);
-            return FALSE;
-        }
+    const char* rest = path + 2;
+    while (_IS_PATH_SEPARATOR(*rest))
+        rest++;
+    return *rest ? join_paths(TARGET.root, rest) : NULL;
+}
 
-        RegCloseKey(h_key);
-        _INFO("Removed registry key: 'HKEY_LOCAL_MACHINE\\%s\\%s'", base_path, key);
-    }
+// Inverse of target_file_path(): how the image itself spells `path`, for matching against what it recorded
+const char* target_image_path(const char* path) {
+    if (!TARGET.root || !path)
+        return path;
 
-    return TRUE;
+    const size_t len = strlen(TARGET.root);
+    if (_strnicmp(path, TARGET.root, len) != 0 || !_IS_PATH_SEPARATOR(path[len]))
+        return path;
+    return join_str("C:", path + len);
 }
 
-BOOL remove_xml_file(const char* name) {
-    char* filename =
-      strpool_sprintf("C:\\Program Files\\Common Files\\Native Instruments\\Service Center\\%s.xml", name);
+void attach_console() {
+    if (AttachConsole(ATTACH_PARENT_PROCESS)) {
+        FILE* f_dummy;
+        freopen_s(&f_dummy, "CONOUT$", "w", stdout);
+        freopen_s(&f_dummy, "CONOUT$", "w", stderr);
+        ATTACHED_TO_CONSOLE = TRUE;
+        _LOG("Attached debug console");
+    } else {
+        ATTACHED_TO_CONSOLE = FALSE;
+        _WARN("Failed to attach debug console (process must be executed from within a shell)");
+    }
+}
 
-    if (file_exists(filename)) {
-        if (BACKUP_FILES) {
-            const char* bak_filename = strpool_sprintf("%s.bak", filename);
-            if (!CopyFileExA(filename, bak_filename, NULL, NULL, NULL, 0)) {
-                _ERROR("Failed to backup XML file: '%s'", filename);
-                return FALSE;
-            }
-        }
+// Attributes of a UTF-8 path such as a content directory, going through the long path form
+DWORD get_path_attributes(const char* path) {
+    const wchar_t* long_path = make_long_path(path);
+    return long_path ? GetFileAttributesW(long_path) : INVALID_FILE_ATTRIBUTES;
+}
 
-        if (!DeleteFileA(filename)) {
-            _ERROR("Failed to delete XML file: '%s'", filename);
-            return FALSE;
-        }
+BOOL file_exists(const char* path) {
+    const DWORD dw_attrib = get_path_attributes(path);
+    return (dw_attrib != INVALID_FILE_ATTRIBUTES && !(dw_attrib & FILE_ATTRIBUTE_DIRECTORY));
+}
 
-        _INFO("Deleted XML file: '%s'", filename);
-    }
+BOOL directory_exists(const char* path) {
+    const DWORD dw_attrib = get_path_attributes(path);
+    return (dw_attrib != INVALID_FILE_ATTRIBUTES && (dw_attrib & FILE_ATTRIBUTE_DIRECTORY));
+}
 
-    return TRUE;
+BOOL has_extension(const char* filename, const char* ext) {
+    const char* extension = strrchr(filename, '.');
+    if (!extension)
+        return FALSE;
+    if (_STREQ(extension, ext))
+        return TRUE;
+    return FALSE;
 }
 
-BOOL remove_all_files_in_dir(const char* directory, BOOL backup) {
-    WIN32_FIND_DATA find_data;
-    HANDLE h_find = INVALID_HANDLE_VALUE;
-    char search_path[MAX_PATH];
-    char file_path[MAX_PATH];
+#define _RM_RF_MAX_THREADS 8
+#define _RM_RF_DIR_RETRIES 5
 
-    snprintf(search_path, MAX_PATH, "%s\\*", directory);
-    h_find = FindFirstFile(search_path, &find_data);
-    if (h_find != INVALID_HANDLE_VALUE) {
-        do {
-            // Skip the special directory entries '.' and '..'
-            if (strcmp(find_data.cFileName, ".") != 0 && strcmp(find_data.cFileName, "..") != 0) {
-                snprintf(file_path, MAX_PATH, "%s\\%s", directory, find_data.cFileName);
-
-                if (!(find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
-                    if (backup) {
-                        char* bak_filename = join_str(file_path, ".bak");
-                        if (file_exists(bak_filename)) {
-                            const BOOL deleted = DeleteFileA(bak_filename);
-                            if (!deleted) {
-                                _ERROR("Failed to delete file: '%s'", bak_filename);
-                                return FALSE;
-                            }
-                        }
-                        const BOOL copied = CopyFileExA(file_path, bak_filename, NULL, NULL, NULL, 0);
-                        if (!copied) {
-                            _ERROR("Failed to backup file: '%s'", file_path);
-                            return FALSE;
-                        }
-                    }
+#ifndef FILE_DISPOSITION_FLAG_DELETE
+    #define FILE_DISPOSITION_FLAG_DELETE 0x00000001
+    #define FILE_DISPOSITION_FLAG_POSIX_SEMANTICS 0x00000002
+    #define FILE_DISPOSITION_FLAG_IGNORE_READONLY_ATTRIBUTE 0x00000010
+#endif
 
-                    if (!DeleteFile(file_path)) {
-                        _ERROR("Failed to delete file: '%s'", file_path);
-                        return FALSE;
-                    } else {
-                        _INFO("Deleted file: '%s'", file_path);
-                    }
-                }
+// Set once the file system rejects POSIX delete semantics (pre-1709 Windows, FAT/exFAT, some network shares)
+static volatile LONG POSIX_DELETE_UNSUPPORTED = FALSE;
+
+// Files waiting to be deleted by one worker. The enumerator pushes onto the bottom, the owning worker pops from the
+// bottom and idle workers steal from the top.
+typedef struct {
+    wchar_t** items;
+    size_t top;
+    size_t bottom;
+    size_t capacity;
+    SRWLOCK lock;
+} rm_rf_deque;
+
+typedef struct {
+    rm_rf_deque* deques;
+    int thread_count;
+    HANDLE heap;  // Private heap for every path the engine builds, destroyed in one go when it finishes
+
+    // Directories in breadth-first order, so walking it backwards removes children before their parents
+    wchar_t** dirs;
+    size_t dir_count;
+    size_t dir_capacity;
+
+    volatile LONG pending;      // Files pushed but not yet deleted
+    volatile LONG enumerating;  // TRUE until every directory has been listed
+    volatile LONG failed;
+    volatile LONG files_deleted;
+    ULONGLONG bytes_listed;  // Sizes of the files handed out; only the enumerating thread adds to it
+    const volatile LONG* cancel;
+} rm_rf_engine;
+
+typedef struct {
+    rm_rf_engine* engine;
+    int index;
+} rm_rf_worker;
+
+BOOL rm_rf_cancelled(const rm_rf_engine* engine) {
+    return engine->cancel && *engine->cancel;
+}
+
+BOOL rm_rf_deque_push(rm_rf_deque* deque, wchar_t* item) {
+    AcquireSRWLockExclusive(&deque->lock);
+
+    if (deque->bottom == deque->capacity) {
+        if (deque->top > 0) {
+            // Reclaim the slots already stolen from the top before growing
+            memmove(deque->items, deque->items + deque->top, (deque->bottom - deque->top) * sizeof(wchar_t*));
+            deque->bottom -= deque->top;
+            deque->top = 0;
+        } else {
+            const size_t new_cap = deque->capacity ? deque->capacity * 2 : 256;
+            wchar_t** new_items  = (wchar_t**)realloc(deque->items, new_cap * sizeof(wchar_t*));
+            if (!new_items) {
+                ReleaseSRWLockExclusive(&deque->lock);
+                return FALSE;
             }
-        } while (FindNextFile(h_find, &find_data) != 0);
-        FindClose(h_find);
+            deque->items    = new_items;
+            deque->capacity = new_cap;
+        }
     }
 
+    deque->items[deque->bottom++] = item;
+
+    ReleaseSRWLockExclusive(&deque->lock);
     return TRUE;
 }
 
-BOOL remove_cache_files(void) {
-    const char* cache_path = join_paths(get_local_appdata_path(), _LIB_CACHE_ROOT);
-    return remove_all_files_in_dir(cache_path, BACKUP_FILES);
+wchar_t* rm_rf_deque_pop(rm_rf_deque* deque) {
+    wchar_t* item = NULL;
+
+    AcquireSRWLockExclusive(&deque->lock);
+    if (deque->bottom > deque->top)
+        item = deque->items[--deque->bottom];
+    if (deque->bottom == deque->top)
+        deque->bottom = deque->top = 0;
+    ReleaseSRWLockExclusive(&deque->lock);
+
+    return item;
+}
+
+wchar_t* rm_rf_deque_steal(rm_rf_deque* deque) {
+    wchar_t* item = NULL;
+
+    AcquireSRWLockExclusive(&deque->lock);
+    if (deque->bottom > deque->top)
+        item = deque->items[deque->top++];
+    if (deque->bottom == deque->top)
+        deque->bottom = deque->top = 0;
+    ReleaseSRWLockExclusive(&deque->lock);
+
+    return item;
 }
 
-BOOL remove_db3(void) {
-    const char* appdata_local = get_local_appdata_path();
-    const char* db3           = join_paths(appdata_local, _DB3_ROOT);
-    if (file_exists(db3)) {
-        if (BACKUP_FILES) {
-            const char* db3_bak = join_str(db3, ".bak");
-            if (!CopyFileExA(db3, db3_bak, NULL, NULL, NULL, 0)) {
-                _ERROR("Failed to backup komplete.db3");
-                return FALSE;
+// Deletes a single file with one open and one SetFileInformationByHandle call. POSIX semantics unlink the name
+// immediately (so the parent directory can be removed straight away) and ignore the read-only attribute, which saves
+// the separate SetFileAttributesW call.
+BOOL delete_file_fast(const wchar_t* path) {
+    if (!InterlockedCompareExchange(&POSIX_DELETE_UNSUPPORTED, 0, 0)) {
+        const HANDLE h_file = CreateFileW(path,
+                                          DELETE,
+                                          FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                          NULL,
+                                          OPEN_EXISTING,
+                                          FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_BACKUP_SEMANTICS,
+                                          NULL);
+        if (h_file != INVALID_HANDLE_VALUE) {
+            FILE_DISPOSITION_INFO_EX info = {0};
+            info.Flags = FILE_DISPOSITION_FLAG_DELETE | FILE_DISPOSITION_FLAG_POSIX_SEMANTICS |
+                         FILE_DISPOSITION_FLAG_IGNORE_READONLY_ATTRIBUTE;
+
+            const BOOL deleted = SetFileInformationByHandle(h_file, FileDispositionInfoEx, &info, sizeof(info));
+            const DWORD error  = deleted ? ERROR_SUCCESS : GetLastError();
+            CloseHandle(h_file);
+
+            if (deleted)
+                return TRUE;
+
+            if (error == ERROR_INVALID_PARAMETER || error == ERROR_NOT_SUPPORTED || error == ERROR_INVALID_FUNCTION) {
+                if (!InterlockedExchange(&POSIX_DELETE_UNSUPPORTED, TRUE))
+                    _INFO("POSIX delete semantics not supported, falling back to DeleteFileW");
             }
-            _INFO("Backed up komplete.db3");
         }
+    }
 
-        if (!DeleteFileA(db3)) {
-            _ERROR("Failed to delete komplete.db3");
-            return FALSE;
+    SetFileAttributesW(path, FILE_ATTRIBUTE_NORMAL);
+    return DeleteFileW(path);
+}
+
+void rm_rf_delete(rm_rf_engine* engine, wchar_t* path) {
+    if (!rm_rf_cancelled(engine)) {
+        _BENCH_SAMPLE_BEGIN();
+        const BOOL deleted = delete_file_fast(path);
+        _BENCH_SAMPLE_END();
+
+        if (deleted) {
+            InterlockedIncrement(&engine->files_deleted);
         } else {
-            _INFO("Deleted komplete.db3");
+            _ERROR("Failed to delete file: %ls (Error: %lu)", path, GetLastError());
+            InterlockedExchange(&engine->failed, TRUE);
         }
     }
 
-    return TRUE;
-}
-
-BOOL remove_ras3_jwt(void) {
-    return remove_all_files_in_dir(_RAS3_ROOT, BACKUP_FILES);
+    HeapFree(engine->heap, 0, path);
+    InterlockedDecrement(&engine->pending);
 }
 
-BOOL remove_library(const library_entry* library, BOOL remove_content) {
-    _ASSERT(library != NULL);
-    _ASSERT(library->name != NULL);
-    _ASSERT(library->content_dir != NULL);
+// Drains the worker's own deque, then steals from the others until enumeration has finished and nothing is left
+DWORD WINAPI rm_rf_worker_proc(LPVOID param) {
+    rm_rf_worker* worker = (rm_rf_worker*)param;
+    rm_rf_engine* engine = worker->engine;
+    int idle_spins       = 0;
 
-    for (int i = 0; i < LIB_COUNT; i++) {
-        const library_entry* entry = &LIBRARIES[i];
-        if (_STREQ(entry->name, library->name)) {
-            return FALSE;
-        }
-    }
+    for (;;) {
+        wchar_t* path = rm_rf_deque_pop(&engine->deques[worker->index]);
 
-    BOOL result = remove_registry_keys(library->name);
-    if (!result)
-        return FALSE;
+        for (int i = 1; !path && i < engine->thread_count; i++)
+            path = rm_rf_deque_steal(&engine->deques[(worker->index + i) % engine->thread_count]);
 
-    result = remove_xml_file(library->name);
-    if (!result)
-        return FALSE;
+        if (path) {
+            rm_rf_delete(engine, path);
+            idle_spins = 0;
+            continue;
+        }
 
-    result = remove_cache_files();
-    if (!result)
-        return FALSE;
+        if (!InterlockedCompareExchange(&engine->enumerating, 0, 0) &&
+            InterlockedCompareExchange(&engine->pending, 0, 0) == 0)
+            break;
 
-    result = remove_db3();
-    if (!result)
-        return FALSE;
+        // Enumeration is still producing work; back off gradually rather than spin
+        if (++idle_spins < 64)
+            SwitchToThread();
+        else
+            Sleep(1);
+    }
 
-    result = remove_ras3_jwt();
-    if (!result)
-        return FALSE;
+    return 0;
+}
 
-    if (remove_content && library->content_dir != NULL && directory_exists(library->content_dir)) {
-        result = rm_rf(make_long_path(library->content_dir));
-        if (!result)
+BOOL rm_rf_push_dir(rm_rf_engine* engine, wchar_t* path) {
+    if (engine->dir_count == engine->dir_capacity) {
+        const size_t new_cap = engine->dir_capacity ? engine->dir_capacity * 2 : 64;
+        wchar_t** new_dirs   = (wchar_t**)realloc(engine->dirs, new_cap * sizeof(wchar_t*));
+        if (!new_dirs)
             return FALSE;
+        engine->dirs         = new_dirs;
+        engine->dir_capacity = new_cap;
     }
 
-    _INFO("Finished removing library: '%s'", library->name);
-
+    engine->dirs[engine->dir_count++] = path;
     return TRUE;
 }
 
-BOOL remove_selected_library(void) {
-    if (SELECTED_INDEX == -1)
-        return FALSE;
+// Lists every directory breadth-first, handing files out round-robin to the worker deques as they're found
+void rm_rf_enumerate(rm_rf_engine* engine) {
+    int next_worker       = 0;
+    arena* scratch        = scratch_arena();
+    const arena_mark mark = arena_save(scratch);
 
-    return remove_library(&LIBRARIES[SELECTED_INDEX], REMOVE_CONTENT_DIR);
-}
+    for (size_t cursor = 0; cursor < engine->dir_count; cursor++) {
+        if (rm_rf_cancelled(engine))
+            return;
 
-// Extract tag name from GitHub json response
-char* extract_tag_name(const char* json) {
-    const char* tag_start = strstr(json, "\"tag_name\"");
-    if (!tag_start)
-        return NULL;
+        const wchar_t* dir   = engine->dirs[cursor];
+        wchar_t* search_path = arena_wjoin(scratch, dir, L"*");
+        if (!search_path) {
+            InterlockedExchange(&engine->failed, TRUE);
+            return;
+        }
 
-    const char* value_start = strchr(tag_start, ':');
-    if (!value_start)
-        return NULL;
+        WIN32_FIND_DATAW find_data;
+        const HANDLE h_find = FindFirstFileExW(search_path,
+                                               FindExInfoBasic,
+                                               &find_data,
+                                               FindExSearchNameMatch,
+                                               NULL,
+                                               FIND_FIRST_EX_LARGE_FETCH);
+        arena_rewind(scratch, mark);
+
+        if (h_find == INVALID_HANDLE_VALUE) {
+            _ERROR("Failed to enumerate directory: %ls (Error: %lu)", dir, GetLastError());
+            InterlockedExchange(&engine->failed, TRUE);
+            continue;
+        }
 
-    value_start = strchr(value_start, '"');
-    if (!value_start)
-        return NULL;
-    value_start++;
+        do {
+            if (wcscmp(find_data.cFileName, L".") == 0 || wcscmp(find_data.cFileName, L"..") == 0)
+                continue;
 
-    const char* value_end = strchr(value_start, '"');
-    if (!value_end)
-        return NULL;
+            wchar_t* full_path = heap_wjoin(engine->heap, dir, find_data.cFileName);
+            if (!full_path) {
+                InterlockedExchange(&engine->failed, TRUE);
+                break;
+            }
 
-    const size_t len = value_end - value_start;
-    char* tag        = strpool_alloc(len + 1);
-    strncpy_s(tag, len + 1, value_start, len);
-    tag[len] = '\0';
+            const DWORD attributes = find_data.dwFileAttributes;
+            if (attributes & FILE_ATTRIBUTE_DIRECTORY) {
+                // Junctions and directory symlinks are removed as links; their targets are left alone
+                if (attributes & FILE_ATTRIBUTE_REPARSE_POINT) {
+                    if (!RemoveDirectoryW(full_path)) {
+                        _ERROR("Failed to remove directory link: %ls (Error: %lu)", full_path, GetLastError());
+                        InterlockedExchange(&engine->failed, TRUE);
+                    }
+                    HeapFree(engine->heap, 0, full_path);
+                } else if (!rm_rf_push_dir(engine, full_path)) {
+                    InterlockedExchange(&engine->failed, TRUE);
+                    break;
+                }
+            } else {
+                engine->bytes_listed += ((ULONGLONG)find_data.nFileSizeHigh << 32) | find_data.nFileSizeLow;
+                InterlockedIncrement(&engine->pending);
+                if (!rm_rf_deque_push(&engine->deques[next_worker], full_path)) {
+                    // Out of memory for the queue, delete it here instead
+                    rm_rf_delete(engine, full_path);
+                }
+                next_worker = (next_worker + 1) % engine->thread_count;
+            }
+        } while (FindNextFileW(h_find, &find_data));
 
-    return tag;
+        FindClose(h_find);
+    }
 }
 
-// Compares version numbers (strips 'v' prefix if present).
-// Returns 0 if versions match
-int compare_versions(const char* v1, const char* v2) {
-    int major1 = 0, minor1 = 0, patch1 = 0;
-    int major2 = 0, minor2 = 0, patch2 = 0;
-
-    // Skip 'v' prefix if present
-    if (v1[0] == 'v')
-        v1++;
-    if (v2[0] == 'v')
-        v2++;
+BOOL remove_directory_retry(const wchar_t* path) {
+    for (int attempt = 0; attempt < _RM_RF_DIR_RETRIES; attempt++) {
+        if (RemoveDirectoryW(path))
+            return TRUE;
 
-    sscanf_s(v1, "%d.%d.%d", &major1, &minor1, &patch1);
-    sscanf_s(v2, "%d.%d.%d", &major2, &minor2, &patch2);
+        const DWORD error = GetLastError();
+        if (error == ERROR_ACCESS_DENIED) {
+            SetFileAttributesW(path, FILE_ATTRIBUTE_NORMAL);
+        } else if (error == ERROR_DIR_NOT_EMPTY) {
+            // Without POSIX semantics deleted files linger until their last handle closes
+            Sleep(10);
+        } else {
+            break;
+        }
+    }
 
-    if (major1 != major2)
-        return major1 - major2;
-    if (minor1 != minor2)
-        return minor1 - minor2;
-    return patch1 - patch2;
+    return FALSE;
 }
 
-// Fetch the latest version of K8-LRT from the GitHub API
-char* get_latest_version(void) {
-    HINTERNET h_session   = NULL;
-    HINTERNET h_connect   = NULL;
-    HINTERNET h_request   = NULL;
-    char* latest_version  = NULL;
-    char* response_data   = NULL;
-    DWORD bytes_available = 0;
-    DWORD bytes_read      = 0;
-    DWORD total_size      = 0;
-    BOOL result           = FALSE;
+// Parallel recursive delete. The calling thread lists the tree breadth-first with large-fetch FindFirstFileExW while a
+// set of work-stealing threads deletes the files, then the directories are removed bottom-up once every file is gone.
+// `cancel` may be NULL. When it's set the walk stops early and returns FALSE, leaving the remaining files in place.
+BOOL rm_rf(const wchar_t* directory, const volatile LONG* cancel) {
+    if (!directory)
+        return FALSE;
 
-    h_session =
-      WinHttpOpen(L"K8-LRT/1.0", WINHTTP_ACCESS_TYPE_DEFAULT_PROXY, WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0);
-    if (!h_session) {
-        _ERROR("WinHttpOpen failed: %lu", GetLastError());
-        goto cleanup;
+    const LONGLONG start = query_ticks();
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+
+    rm_rf_engine engine = {0};
+    engine.thread_count = (int)min(max(si.dwNumberOfProcessors, 1), _RM_RF_MAX_THREADS);
+    engine.cancel       = cancel;
+    engine.enumerating  = TRUE;
+    engine.heap         = HeapCreate(0, 0, 0);
+    engine.deques       = (rm_rf_deque*)calloc(engine.thread_count, sizeof(rm_rf_deque));
+
+    rm_rf_worker* workers = (rm_rf_worker*)calloc(engine.thread_count, sizeof(rm_rf_worker));
+    HANDLE* threads       = (HANDLE*)calloc(engine.thread_count, sizeof(HANDLE));
+    wchar_t* root         = NULL;
+    if (engine.heap) {
+        const size_t root_size = (wcslen(directory) + 1) * sizeof(wchar_t);
+        root                   = (wchar_t*)HeapAlloc(engine.heap, 0, root_size);
+        if (root)
+            memcpy(root, directory, root_size);
     }
 
-    h_connect = WinHttpConnect(h_session, L"api.github.com", INTERNET_DEFAULT_HTTPS_PORT, 0);
-    if (!h_connect) {
-        _ERROR("WinHttpConnect failed: %lu", GetLastError());
+    BOOL success = FALSE;
+    if (!engine.deques || !workers || !threads || !root || !rm_rf_push_dir(&engine, root)) {
+        _ERROR("Failed to allocate memory for removing directory: %ls", directory);
         goto cleanup;
     }
 
-    h_request = WinHttpOpenRequest(h_connect,
-                                   L"GET",
-                                   L"/repos/jakerieger/K8-LRT/releases/latest",
-                                   NULL,
-                                   WINHTTP_NO_REFERER,
-                                   WINHTTP_DEFAULT_ACCEPT_TYPES,
-                                   WINHTTP_FLAG_SECURE);
-    if (!h_request) {
-        _ERROR("WinHttpOpenRequest failed: %lu", GetLastError());
-        goto cleanup;
+    for (int i = 0; i < engine.thread_count; i++) {
+        InitializeSRWLock(&engine.deques[i].lock);
+        workers[i].engine = &engine;
+        workers[i].index  = i;
     }
 
-    LPCWSTR headers = L"User-Agent: K8-LRT/1.0\r\n";
-    WinHttpAddRequestHeaders(h_request, headers, -1L, WINHTTP_ADDREQ_FLAG_ADD);
+    // Worker 0 is this thread once enumeration is done, so a failed CreateThread only costs parallelism
+    for (int i = 1; i < engine.thread_count; i++)
+        threads[i] = CreateThread(NULL, 0, rm_rf_worker_proc, &workers[i], 0, NULL);
 
-    result = WinHttpSendRequest(h_request, WINHTTP_NO_ADDITIONAL_HEADERS, 0, WINHTTP_NO_REQUEST_DATA, 0, 0, 0);
-    if (!result) {
-        _ERROR("WinHttpReceiveResponse failed: %lu", GetLastError());
-        goto cleanup;
+    rm_rf_enumerate(&engine);
+    InterlockedExchange(&engine.enumerating, FALSE);
+
+    rm_rf_worker_proc(&workers[0]);
+    for (int i = 1; i < engine.thread_count; i++) {
+        if (threads[i]) {
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        }
     }
 
-    result = WinHttpReceiveResponse(h_request, NULL);
-    if (!result) {
-        _ERROR("WinHttpReceiveResponse failed: %lu", GetLastError());
+    if (rm_rf_cancelled(&engine)) {
+        _WARN("Cancelled removal of directory: %ls", directory);
         goto cleanup;
     }
 
-    DWORD status_code      = 0;
-    DWORD status_code_size = sizeof(status_code);
-    WinHttpQueryHeaders(h_request,
-                        WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER,
-                        NULL,
-                        &status_code,
-                        &status_code_size,
-                        NULL);
-    if (status_code != 200) {
-        _ERROR("HTTP request failed with status code: %lu", status_code);
-        goto cleanup;
+    success = !engine.failed;
+    for (size_t i = engine.dir_count; i-- > 0;) {
+        if (!remove_directory_retry(engine.dirs[i])) {
+            _ERROR("Failed to remove directory: %ls (Error: %lu)", engine.dirs[i], GetLastError());
+            success = FALSE;
+        }
     }
 
-    response_data = (char*)malloc(1);
-    if (!response_data)
-        goto cleanup;
-    response_data[0] = '\0';
+    _INFO("Deleted %ld file(s) and %zu directory(ies) in %.2f ms using %d thread(s)",
+          engine.files_deleted,
+          engine.dir_count,
+          ticks_to_ms(query_ticks() - start),
+          engine.thread_count);
 
-    // Read the response data
-    do {
-        bytes_available = 0;
-        if (!WinHttpQueryDataAvailable(h_request, &bytes_available)) {
-            _ERROR("WinHttpQueryDataAvailable failed: %lu", GetLastError());
-            break;
-        }
+cleanup:
+    // A worker doesn't know the size of the file it deletes, so bytes are only counted once the whole tree is gone
+    stats_add(STAT_FILES_DELETED, (ULONGLONG)engine.files_deleted);
+    if (success)
+        stats_add(STAT_BYTES_DELETED, engine.bytes_listed);
+    stats_time_scope(STAT_SCOPE_RM_RF, start);
+
+    if (engine.deques) {
+        for (int i = 0; i < engine.thread_count; i++)
+            free(engine.deques[i].items);
+        free(engine.deques);
+    }
+    free(engine.dirs);
+    free(workers);
+    free(threads);
+    if (engine.heap)
+        HeapDestroy(engine.heap);
 
-        if (bytes_available == 0)
-            break;
+    return success;
+}
 
-        char* tmp = (char*)realloc(response_data, total_size + bytes_available + 1);
-        if (!tmp) {
-            _ERROR("Memory allocation failed");
-            break;
-        }
-        response_data = tmp;
+#define _COPY_MAX_THREADS 4
+#define _COPY_UNBUFFERED_THRESHOLD (64ull * 1024 * 1024)  // Smaller files go through the cache manager
+#define _COPY_PROGRESS_INTERVAL_MS 50
+#define _JOURNAL_FLUSH_INTERVAL 64
+#define _RELOCATE_JOURNAL "K8-LRT.relocate.journal"
+#define _RELOCATE_JOURNAL_MAGIC "K8LRT-RELOCATE 1"
+#define _JOURNAL_LINE_MAX (_MAX_PATH_NFTS * 3)
 
-        if (!WinHttpReadData(h_request, response_data + total_size, bytes_available, &bytes_read)) {
-            _ERROR("WinHttpReadData failed: %lu", GetLastError());
-            break;
-        }
+typedef struct {
+    wchar_t* rel_path;
+    ULONGLONG size;
+    ULONGLONG mtime;
+} copy_file_entry;
 
-        total_size += bytes_read;
-        response_data[total_size] = '\0';
+// Records every file a relocation has finished copying, so a relocation interrupted by a crash or reboot can pick up
+// where it left off. The journal lives next to the log and is deleted once the relocation completes.
+typedef struct {
+    FILE* file;
+    SRWLOCK lock;
+    int unflushed;
 
-    } while (bytes_available > 0);
+    // Entries loaded from a previous run, sorted by path. Their paths live in `arena`.
+    copy_file_entry* done;
+    size_t done_count;
+    arena arena;
+} relocation_journal;
 
-    latest_version = extract_tag_name(response_data);
+typedef struct {
+    const wchar_t* src_root;
+    const wchar_t* dst_root;
+    HANDLE heap;
+
+    copy_file_entry* files;
+    size_t file_count;
+    size_t file_capacity;
+    ULONGLONG bytes_total;
+
+    volatile LONG next_file;
+    volatile LONG failed;
+    volatile LONG files_copied;
+    volatile LONG files_skipped;
+    volatile LONG64 bytes_done;
+    volatile LONG64 last_progress_tick;
+    LONG64 progress_unit;  // Bytes per progress step, keeps the progress range well inside a LONG
+
+    relocation_journal* journal;
+    worker_job* job;
+} copy_engine;
 
-cleanup:
-    if (response_data)
-        free(response_data);
-    if (h_request)
-        WinHttpCloseHandle(h_request);
-    if (h_connect)
-        WinHttpCloseHandle(h_connect);
-    if (h_session)
-        WinHttpCloseHandle(h_session);
+typedef struct {
+    copy_engine* engine;
+    ULONGLONG transferred;  // Bytes of the current file already added to engine->bytes_done
+} copy_progress_context;
 
-    return latest_version;
+ULONGLONG filetime_to_u64(FILETIME ft) {
+    return ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
 }
 
-void check_for_updates(HWND hwnd, BOOL alert_up_to_date) {
-    char* current_version = get_latest_version();
-    const int compare     = compare_versions(current_version, VER_PRODUCTVERSION_STR);
-
-    if (compare > 0) {
-        const char* message = strpool_sprintf("A new version of K8-LRT is available!\n\n"
-                                              "Current: %s\n"
-                                              "Latest: %s\n\n"
-                                              "Visit the GitHub releases page to download?",
-                                              VER_PRODUCTVERSION_STR,
-                                              current_version + 1);
+int compare_copy_entries(const void* a, const void* b) {
+    return wcscmp(((const copy_file_entry*)a)->rel_path, ((const copy_file_entry*)b)->rel_path);
+}
 
-        const int result = MessageBoxA(hwnd, message, "Update Available", MB_YESNO | MB_ICONINFORMATION);
+void strip_newline(char* line) {
+    line[strcspn(line, "\r\n")] = '\0';
+}
 
-        if (result == IDYES) {
-            ShellExecuteA(NULL,
-                          "open",
-                          "https://github.com/jakerieger/K8-LRT/releases/latest",
-                          NULL,
-                          NULL,
-                          SW_SHOWNORMAL);
-        }
-    } else if (compare < 0) {
-        MessageBox(hwnd,
-                   "You are running a development build. K8-LRT may not be stable.",
-                   "Update Check",
-                   MB_OK | MB_ICONWARNING);
-    } else {
-        if (alert_up_to_date)
-            MessageBox(hwnd, "You're running the latest version!", "Up to Date", MB_OK | MB_ICONINFORMATION);
+// Start of the tab separated field `index` in `line`, or NULL if it has fewer fields. Unlike a trailing "\t%n" in
+// sscanf this keeps any leading whitespace of the field.
+char* tab_field(char* line, int index) {
+    for (; index > 0 && line; --index) {
+        line = strchr(line, '\t');
+        if (line)
+            ++line;
     }
+    return line;
 }
 
-void update_batch_count_label(HWND hwnd, int count) {
-    char label_text[64] = {'\0'};
-    if (count == 1) {
-        sprintf_s(label_text, sizeof(label_text), "1 library selected");
-    } else {
-        sprintf_s(label_text, sizeof(label_text), "%d libraries selected", count);
+// Reads the library name and destination of an unfinished relocation. Returns FALSE if there's nothing to resume.
+BOOL journal_read_pending(char* name, size_t name_len, char* dst, size_t dst_len) {
+    FILE* file = NULL;
+    if (fopen_s(&file, _RELOCATE_JOURNAL, "r") != 0)
+        return FALSE;
+
+    char line[_JOURNAL_LINE_MAX];
+    BOOL valid = FALSE;
+    if (fgets(line, sizeof(line), file)) {
+        strip_newline(line);
+        valid = _STREQ(line, _RELOCATE_JOURNAL_MAGIC);
     }
-    SetDlgItemTextA(hwnd, IDC_BATCH_COUNT_LABEL, label_text);
+
+    BOOL have_name = FALSE, have_dst = FALSE;
+    while (valid && fgets(line, sizeof(line), file) && !(have_name && have_dst)) {
+        strip_newline(line);
+        if (strncmp(line, "library\t", 8) == 0) {
+            have_name = SUCCEEDED(StringCchCopyA(name, name_len, line + 8));
+        } else if (strncmp(line, "dst\t", 4) == 0) {
+            have_dst = SUCCEEDED(StringCchCopyA(dst, dst_len, line + 4));
+        }
+    }
+
+    fclose(file);
+    return valid && have_name && have_dst;
 }
 
-BOOL open_folder_dialog(HWND owner, char* dst, int len) {
-    IFileOpenDialog* pFileOpen = NULL;
-    IShellItem* pItem          = NULL;
-    PWSTR pszFilePath          = NULL;
-    BOOL success               = FALSE;
+// Loads the finished entries of an existing journal for the same relocation, or starts a new one
+BOOL journal_open(relocation_journal* journal, const char* name, const char* src, const char* dst) {
+    ZeroMemory(journal, sizeof(*journal));
+    InitializeSRWLock(&journal->lock);
+
+    char pending_name[_MAX_KEY_LENGTH + 1] = {0};
+    char pending_dst[MAX_PATH]             = {0};
+    const BOOL resume = journal_read_pending(pending_name, sizeof(pending_name), pending_dst, sizeof(pending_dst)) &&
+                        _STREQ(pending_name, name) && _STREQ(pending_dst, dst);
+
+    if (resume) {
+        FILE* file = NULL;
+        if (fopen_s(&file, _RELOCATE_JOURNAL, "r") == 0) {
+            char line[_JOURNAL_LINE_MAX];
+            size_t capacity = 0;
+
+            while (fgets(line, sizeof(line), file)) {
+                strip_newline(line);
+
+                unsigned long long size = 0, mtime = 0;
+                const char* rel_path    = tab_field(line, 3);
+                if (sscanf_s(line, "done\t%llu\t%llu", &size, &mtime) < 2 || !rel_path)
+                    continue;
+
+                if (journal->done_count == capacity) {
+                    capacity                  = capacity ? capacity * 2 : 256;
+                    copy_file_entry* new_done = (copy_file_entry*)realloc(journal->done, capacity * sizeof(*new_done));
+                    if (!new_done)
+                        break;
+                    journal->done = new_done;
+                }
 
-    HRESULT hr = CoCreateInstance(&CLSID_FileOpenDialog, NULL, CLSCTX_ALL, &IID_IFileOpenDialog, (void**)&pFileOpen);
+                const int needed = MultiByteToWideChar(CP_UTF8, 0, rel_path, -1, NULL, 0);
+                wchar_t* rel     = needed > 0 ? (wchar_t*)arena_alloc(&journal->arena, needed * sizeof(wchar_t)) : NULL;
+                if (!rel)
+                    continue;
+                MultiByteToWideChar(CP_UTF8, 0, rel_path, -1, rel, needed);
 
-    if (SUCCEEDED(hr)) {
-        DWORD dwOptions;
-        hr = pFileOpen->lpVtbl->GetOptions(pFileOpen, &dwOptions);
-        if (SUCCEEDED(hr)) {
-            hr = pFileOpen->lpVtbl->SetOptions(pFileOpen, dwOptions | FOS_PICKFOLDERS);
-        }
+                copy_file_entry* entry = &journal->done[journal->done_count++];
+                entry->rel_path        = rel;
+                entry->size            = size;
+                entry->mtime           = mtime;
+            }
 
-        if (SUCCEEDED(hr)) {
-            hr = pFileOpen->lpVtbl->Show(pFileOpen, owner);
+            fclose(file);
         }
 
-        if (SUCCEEDED(hr)) {
-            hr = pFileOpen->lpVtbl->GetResult(pFileOpen, &pItem);
+        if (journal->done_count > 0)
+            qsort(journal->done, journal->done_count, sizeof(copy_file_entry), compare_copy_entries);
 
-            if (SUCCEEDED(hr)) {
-                hr = pItem->lpVtbl->GetDisplayName(pItem, SIGDN_FILESYSPATH, &pszFilePath);
+        _INFO("Resuming relocation of '%s' (%zu file(s) already copied)", name, journal->done_count);
+        if (fopen_s(&journal->file, _RELOCATE_JOURNAL, "a") == 0)
+            return TRUE;
 
-                if (SUCCEEDED(hr)) {
-                    WideCharToMultiByte(CP_ACP, 0, pszFilePath, -1, dst, len, NULL, NULL);
-                    success = TRUE;
-                    CoTaskMemFree(pszFilePath);
-                }
-                pItem->lpVtbl->Release(pItem);
-            }
-        }
-        pFileOpen->lpVtbl->Release(pFileOpen);
+        // The caller only closes journals that opened
+        free(journal->done);
+        arena_destroy(&journal->arena);
+        ZeroMemory(journal, sizeof(*journal));
+        return FALSE;
     }
 
-    return success;
+    if (fopen_s(&journal->file, _RELOCATE_JOURNAL, "w") != 0) {
+        _ERROR("Failed to create relocation journal: '%s'", _RELOCATE_JOURNAL);
+        return FALSE;
+    }
+
+    fprintf(journal->file, "%s\nlibrary\t%s\nsrc\t%s\ndst\t%s\n", _RELOCATE_JOURNAL_MAGIC, name, src, dst);
+    fflush(journal->file);
+    return TRUE;
 }
 
-#pragma endregion
-//===================================================================//
-//                     -- UI HELPER FUNCTIONS --                     //
-//===================================================================//
-#pragma region ui helper functions
+// Whether a previous run already copied `entry` and neither side has changed since
+BOOL journal_is_done(const relocation_journal* journal, const copy_file_entry* entry, const wchar_t* dst_path) {
+    if (!journal || journal->done_count == 0)
+        return FALSE;
 
-void create_button(HWND* button, const char* label, int x, int y, int w, int h, HWND hwnd, int menu, BOOL disabled) {
-    _ASSERT(button != NULL);
+    const copy_file_entry* done =
+      bsearch(entry, journal->done, journal->done_count, sizeof(copy_file_entry), compare_copy_entries);
+    if (!done || done->size != entry->size || done->mtime != entry->mtime)
+        return FALSE;
 
-    DWORD style = WS_CHILD | WS_VISIBLE | BS_PUSHBUTTON;
-    if (disabled)
-        style |= WS_DISABLED;
+    WIN32_FILE_ATTRIBUTE_DATA dst_info;
+    if (!GetFileAttributesExW(dst_path, GetFileExInfoStandard, &dst_info))
+        return FALSE;
 
-    *button = CreateWindowEx(0, "BUTTON", label, style, x, y, w, h, hwnd, (HMENU)menu, GetModuleHandle(NULL), NULL);
-    SendMessage(*button, WM_SETFONT, (WPARAM)UI_FONT, TRUE);
+    const ULONGLONG dst_size = ((ULONGLONG)dst_info.nFileSizeHigh << 32) | dst_info.nFileSizeLow;
+    return dst_size == entry->size && filetime_to_u64(dst_info.ftLastWriteTime) == entry->mtime;
 }
 
-void create_checkbox(HWND* checkbox,
-                     const char* label,
-                     int x,
-                     int y,
-                     int w,
-                     int h,
-                     HWND hwnd,
-                     int menu,
-                     BOOL begin_checked,
-                     BOOL disabled) {
-    _ASSERT(checkbox != NULL);
-
-    DWORD style = WS_CHILD | WS_VISIBLE | BS_AUTOCHECKBOX;
-    if (disabled)
-        style |= WS_DISABLED;
+void journal_mark_done(relocation_journal* journal, const copy_file_entry* entry) {
+    if (!journal || !journal->file)
+        return;
 
-    *checkbox = CreateWindowEx(0, "BUTTON", label, style, x, y, w, h, hwnd, (HMENU)menu, GetModuleHandle(NULL), NULL);
-    SendMessage(*checkbox, WM_SETFONT, (WPARAM)UI_FONT, TRUE);
+    // Called from copy_file_entry_to_dst(), which rewinds the scratch arena after every file
+    const char* rel = arena_wide_to_utf8(scratch_arena(), entry->rel_path);
+    if (!rel)
+        return;
 
-    if (begin_checked) {
-        SendMessage(*checkbox, BM_SETCHECK, (WPARAM)BST_CHECKED, 0);
+    AcquireSRWLockExclusive(&journal->lock);
+    fprintf(journal->file, "done\t%llu\t%llu\t%s\n", entry->size, entry->mtime, rel);
+    if (++journal->unflushed >= _JOURNAL_FLUSH_INTERVAL) {
+        fflush(journal->file);
+        journal->unflushed = 0;
     }
+    ReleaseSRWLockExclusive(&journal->lock);
 }
 
-void create_label(HWND* label, const char* text, int x, int y, int w, int h, HWND hwnd) {
-    _ASSERT(label != NULL);
-
-    *label = CreateWindow("STATIC",
-                          text,
-                          WS_CHILD | WS_VISIBLE | SS_LEFT,
-                          x,
-                          y,
-                          w,
-                          h,
-                          hwnd,
-                          NULL,
-                          GetModuleHandle(NULL),
-                          NULL);
-    SendMessage(*label, WM_SETFONT, (WPARAM)UI_FONT, TRUE);
-}
+// Closes the journal, deleting it if the relocation finished
+void journal_close(relocation_journal* journal, BOOL completed) {
+    if (journal->file) {
+        fclose(journal->file);
+        journal->file = NULL;
+    }
 
-void create_listbox(HWND* listbox, int x, int y, int w, int h, HWND hwnd, int menu) {
-    _ASSERT(listbox != NULL);
+    free(journal->done);
+    journal->done       = NULL;
+    journal->done_count = 0;
+    arena_destroy(&journal->arena);
 
-    *listbox = CreateWindowEx(0,
-                              "LISTBOX",
-                              NULL,
-                              WS_CHILD | WS_VISIBLE | WS_VSCROLL | WS_BORDER | LBS_NOTIFY,
-                              x,
-                              y,
-                              w,
-                              h,
-                              hwnd,
-                              (HMENU)menu,
-                              GetModuleHandle(NULL),
-                              NULL);
-    SendMessage(*listbox, WM_SETFONT, (WPARAM)UI_FONT, TRUE);
+    // A journal left behind would offer to resume a relocation that already finished
+    if (completed && !DeleteFileA(_RELOCATE_JOURNAL) && GetLastError() != ERROR_FILE_NOT_FOUND)
+        _ERROR("Failed to delete relocation journal: '%s' (Error: %lu)", _RELOCATE_JOURNAL, GetLastError());
 }
 
-void create_edit(HWND* edit, int x, int y, int w, int h, HWND hwnd, int menu, BOOL multiline, BOOL readonly) {
-    DWORD style = WS_CHILD | WS_VISIBLE | WS_VSCROLL | WS_HSCROLL | ES_AUTOVSCROLL | ES_AUTOHSCROLL | WS_BORDER;
-    if (multiline)
-        style |= ES_MULTILINE;
-    if (readonly)
-        style |= ES_READONLY;
-
-    *edit = CreateWindowEx(0, "EDIT", NULL, style, x, y, w, h, hwnd, (HMENU)menu, GetModuleHandle(NULL), NULL);
+void journal_discard(void) {
+    DeleteFileA(_RELOCATE_JOURNAL);
 }
 
-void create_menu_bar(HWND hwnd) {
-    HMENU h_menubar = CreateMenu();
-    HMENU h_menu    = CreateMenu();
+BOOL copy_push_file(copy_engine* engine, wchar_t* rel_path, const WIN32_FIND_DATAW* find_data) {
+    if (engine->file_count == engine->file_capacity) {
+        const size_t new_cap       = engine->file_capacity ? engine->file_capacity * 2 : 256;
+        copy_file_entry* new_files = (copy_file_entry*)realloc(engine->files, new_cap * sizeof(copy_file_entry));
+        if (!new_files)
+            return FALSE;
+        engine->files         = new_files;
+        engine->file_capacity = new_cap;
+    }
 
-    AppendMenu(h_menu, MF_STRING, ID_MENU_VIEW_LOG, "&View Log");
-    AppendMenu(h_menu, MF_STRING, ID_MENU_RELOAD_LIBRARIES, "&Reload Libraries");
-    AppendMenu(h_menu, MF_STRING, ID_MENU_COLLECT_BACKUPS, "&Collect Backups and Zip");
-    AppendMenu(h_menu, MF_SEPARATOR, 0, NULL);
-    AppendMenu(h_menu, MF_STRING, ID_MENU_CHECK_UPDATES, "&Check for Updates");
-    AppendMenu(h_menu, MF_STRING, ID_MENU_ABOUT, "&About");
-    AppendMenu(h_menu, MF_SEPARATOR, 0, NULL);
-    AppendMenu(h_menu, MF_STRING, ID_MENU_EXIT, "E&xit");
+    copy_file_entry* entry = &engine->files[engine->file_count++];
+    entry->rel_path        = rel_path;
+    entry->size            = ((ULONGLONG)find_data->nFileSizeHigh << 32) | find_data->nFileSizeLow;
+    entry->mtime           = filetime_to_u64(find_data->ftLastWriteTime);
 
-    AppendMenu(h_menubar, MF_POPUP, (UINT_PTR)h_menu, "&Menu");
-    SetMenu(hwnd, h_menubar);
+    engine->bytes_total += entry->size;
+    return TRUE;
 }
 
-#pragma endregion
-//===================================================================//
-//                      -- DIALOG CALLBACKS --                       //
-//===================================================================//
-#pragma region dialog callbacks
+// Lists the source tree breadth-first, mirroring its directories at the destination and collecting every file to copy.
+// Directories are created up front so the copy threads never race to create a parent.
+BOOL copy_enumerate(copy_engine* engine) {
+    wchar_t** dirs      = NULL;  // Relative directory paths, "" for the root
+    size_t dir_count    = 0;
+    size_t dir_capacity = 0;
+    BOOL success        = TRUE;
 
-LRESULT CALLBACK log_viewer_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam) {
-    switch (umsg) {
-        case WM_CREATE: {
-            HWND h_edit;
-            create_edit(&h_edit, 0, 0, 0, 0, hwnd, IDC_LOGVIEW_EDIT, TRUE, TRUE);
-
-            const HFONT h_font = CreateFont(14,
-                                            0,
-                                            0,
-                                            0,
-                                            FW_NORMAL,
-                                            FALSE,
-                                            FALSE,
-                                            FALSE,
-                                            DEFAULT_CHARSET,
-                                            OUT_DEFAULT_PRECIS,
-                                            CLIP_DEFAULT_PRECIS,
-                                            DEFAULT_QUALITY,
-                                            FIXED_PITCH | FF_MODERN,
-                                            "Consolas");
-
-            SendMessage(h_edit, WM_SETFONT, (WPARAM)h_font, TRUE);
-
-            if (LOG_FILE) {
-                const int current_pos = ftell(LOG_FILE);
-
-                fseek(LOG_FILE, 0, SEEK_END);
-                const int file_size = ftell(LOG_FILE);
-                fseek(LOG_FILE, 0, SEEK_SET);
-
-                char* buffer = (char*)malloc(file_size + 1);
-                if (buffer) {
-                    const size_t bytes_read = fread(buffer, 1, file_size, LOG_FILE);
-                    buffer[bytes_read]      = '\0';
-
-                    // Convert LF to CRLF for Windows Edit control
-                    size_t lf_count = 0;
-                    for (size_t i = 0; i < bytes_read; i++) {
-                        if (buffer[i] == '\n' && (i == 0 || buffer[i - 1] != '\r')) {
-                            lf_count++;
-                        }
-                    }
+    wchar_t* root = (wchar_t*)HeapAlloc(engine->heap, HEAP_ZERO_MEMORY, sizeof(wchar_t));
+    if (!root)
+        return FALSE;
 
-                    char* crlf_buffer = (char*)malloc(bytes_read + lf_count + 1);
-                    if (crlf_buffer) {
-                        size_t j = 0;
-                        for (size_t i = 0; i < bytes_read; i++) {
-                            if (buffer[i] == '\n' && (i == 0 || buffer[i - 1] != '\r')) {
-                                crlf_buffer[j++] = '\r';
-                            }
-                            crlf_buffer[j++] = buffer[i];
-                        }
-                        crlf_buffer[j] = '\0';
-
-                        SetWindowTextA(h_edit, crlf_buffer);
-
-                        // Scroll to bottom
-                        SendMessage(h_edit, EM_SETSEL, 0, -1);
-                        SendMessage(h_edit, EM_SETSEL, -1, -1);
-                        SendMessage(h_edit, EM_SCROLLCARET, 0, 0);
-
-                        free(crlf_buffer);
-                    }
+    dirs = (wchar_t**)malloc(64 * sizeof(wchar_t*));
+    if (!dirs)
+        return FALSE;
+    dir_capacity      = 64;
+    dirs[dir_count++] = root;
 
-                    free(buffer);
-                }
+    // Absolute paths are only needed while a directory is being listed; the relative ones outlive the walk
+    arena* scratch        = scratch_arena();
+    const arena_mark mark = arena_save(scratch);
 
-                fseek(LOG_FILE, current_pos, SEEK_SET);  // Restore position for appending
-            } else {
-                SetWindowTextA(h_edit, "Log file not available.");
-            }
+    for (size_t cursor = 0; cursor < dir_count && success; cursor++) {
+        arena_rewind(scratch, mark);
 
-            return 0;
+        if (worker_is_cancelled(engine->job)) {
+            success = FALSE;
+            break;
         }
 
-        case WM_SIZE: {
-            const HWND h_edit = GetDlgItem(hwnd, IDC_LOGVIEW_EDIT);
-            if (h_edit) {
-                RECT rect;
-                GetClientRect(hwnd, &rect);
-                SetWindowPos(h_edit, NULL, 0, 0, rect.right, rect.bottom, SWP_NOZORDER);
-            }
-            return 0;
-        }
+        const wchar_t* rel_dir = dirs[cursor];
+        wchar_t* src_dir       = rel_dir[0] ? arena_wjoin(scratch, engine->src_root, rel_dir) : NULL;
+        wchar_t* dst_dir       = rel_dir[0] ? arena_wjoin(scratch, engine->dst_root, rel_dir) : NULL;
+        const wchar_t* src     = src_dir ? src_dir : engine->src_root;
+        const wchar_t* dst     = dst_dir ? dst_dir : engine->dst_root;
 
-        case WM_CLOSE: {
-            DestroyWindow(hwnd);
-            return 0;
+        if (!CreateDirectoryW(dst, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+            _ERROR("Failed to create directory: %ls (Error: %lu)", dst, GetLastError());
+            success = FALSE;
+            break;
         }
 
-        case WM_DESTROY: {
-            H_LOG_VIEWER = NULL;
-            return 0;
+        wchar_t* search_path = arena_wjoin(scratch, src, L"*");
+        if (!search_path) {
+            success = FALSE;
+            break;
         }
-    }
 
-    return DefWindowProc(hwnd, umsg, wparam, lparam);
-}
-
-INT_PTR CALLBACK about_dialog_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam) {
-    switch (umsg) {
-        case WM_NOTIFY: {
-            LPNMHDR pnmh = (LPNMHDR)lparam;
-            if (pnmh->idFrom == IDC_REPO_LINK && (pnmh->code == NM_CLICK || pnmh->code == NM_RETURN)) {
-                PNMLINK pnmLink = (PNMLINK)lparam;
-                ShellExecuteW(NULL, L"open", L"https://github.com/jakerieger/K8-LRT", NULL, NULL, SW_SHOWNORMAL);
-                return (INT_PTR)TRUE;
-            }
+        WIN32_FIND_DATAW find_data;
+        const HANDLE h_find = FindFirstFileExW(search_path,
+                                               FindExInfoBasic,
+                                               &find_data,
+                                               FindExSearchNameMatch,
+                                               NULL,
+                                               FIND_FIRST_EX_LARGE_FETCH);
+        if (h_find == INVALID_HANDLE_VALUE) {
+            _ERROR("FindFirstFileExW failed for: %ls (Error: %lu)", src, GetLastError());
+            success = FALSE;
             break;
         }
 
-        case WM_INITDIALOG: {
-            char* latest_v = (char*)lparam;
-            if (latest_v) {
-                SetDlgItemTextA(hwnd, IDC_VER_LABEL, strpool_sprintf("Version %s", latest_v));
-                SetDlgItemTextA(hwnd, IDC_BUILD_LABEL, strpool_sprintf("Build %d", VER_BUILD));
-            }
+        do {
+            if (wcscmp(find_data.cFileName, L".") == 0 || wcscmp(find_data.cFileName, L"..") == 0)
+                continue;
 
-            return (INT_PTR)TRUE;
-        }
+            wchar_t* rel_path = rel_dir[0] ? heap_wjoin(engine->heap, rel_dir, find_data.cFileName)
+                                           : heap_wjoin(engine->heap, L"", find_data.cFileName);
+            if (!rel_path) {
+                success = FALSE;
+                break;
+            }
 
-        case WM_COMMAND:
-            if (LOWORD(wparam) == IDOK || LOWORD(wparam) == IDCANCEL) {
-                EndDialog(hwnd, LOWORD(wparam));
-                return (INT_PTR)TRUE;
+            if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                if (dir_count == dir_capacity) {
+                    const size_t new_cap = dir_capacity * 2;
+                    wchar_t** new_dirs   = (wchar_t**)realloc(dirs, new_cap * sizeof(wchar_t*));
+                    if (!new_dirs) {
+                        success = FALSE;
+                        break;
+                    }
+                    dirs         = new_dirs;
+                    dir_capacity = new_cap;
+                }
+                dirs[dir_count++] = rel_path;
+            } else if (!copy_push_file(engine, rel_path, &find_data)) {
+                success = FALSE;
+                break;
             }
+        } while (FindNextFileW(h_find, &find_data));
 
-            break;
+        FindClose(h_find);
     }
 
-    return (INT_PTR)FALSE;
+    arena_rewind(scratch, mark);
+    free(dirs);
+    return success;
 }
 
-INT_PTR CALLBACK remove_library_dialog_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam) {
-    static remove_lib_dialog_data* data = NULL;
+void copy_post_progress(copy_engine* engine, BOOL force) {
+    if (!engine->job)
+        return;
 
-    switch (umsg) {
-        case WM_INITDIALOG: {
-            data = (remove_lib_dialog_data*)lparam;
+    const LONG64 now  = (LONG64)GetTickCount64();
+    const LONG64 last = InterlockedCompareExchange64(&engine->last_progress_tick, 0, 0);
+    if (!force && now - last < _COPY_PROGRESS_INTERVAL_MS)
+        return;
 
-            HWND h_name_label = GetDlgItem(hwnd, IDC_REMOVE_LIBRARY_NAME);
-            SetWindowTextA(h_name_label, data->library->name);
+    // Only one thread wins the slot for each interval
+    if (!force && InterlockedCompareExchange64(&engine->last_progress_tick, now, last) != last)
+        return;
 
-            HFONT h_font = CreateFont(16,
-                                      0,
-                                      0,
-                                      0,
-                                      FW_BOLD,
-                                      FALSE,
-                                      FALSE,
-                                      FALSE,
-                                      DEFAULT_CHARSET,
-                                      OUT_DEFAULT_PRECIS,
-                                      CLIP_DEFAULT_PRECIS,
-                                      DEFAULT_QUALITY,
-                                      DEFAULT_PITCH | FF_DONTCARE,
-                                      "Segoe UI");
-            SendMessage(h_name_label, WM_SETFONT, (WPARAM)h_font, TRUE);
+    worker_set_progress(engine->job, (LONG)(engine->bytes_done / engine->progress_unit));
+}
 
-            HWND h_content_dir_label = GetDlgItem(hwnd, IDC_REMOVE_LIBRARY_CONTENT_DIR);
-            SetWindowTextA(h_content_dir_label, data->library->content_dir);
+COPYFILE2_MESSAGE_ACTION CALLBACK copy_progress_routine(const COPYFILE2_MESSAGE* message, PVOID context) {
+    copy_progress_context* progress = (copy_progress_context*)context;
+    copy_engine* engine             = progress->engine;
 
-            CheckDlgButton(hwnd, IDC_REMOVE_BACKUP_CHECK, data->backup_files ? BST_CHECKED : BST_UNCHECKED);
-            CheckDlgButton(hwnd, IDC_REMOVE_FOLDER_CHECK, data->remove_content_dir ? BST_CHECKED : BST_UNCHECKED);
+    if (worker_is_cancelled(engine->job))
+        return COPYFILE2_PROGRESS_CANCEL;
 
-            RECT parent_rect, dlg_rect;
-            HWND h_parent = GetParent(hwnd);
-            GetWindowRect(h_parent, &parent_rect);
-            GetWindowRect(hwnd, &dlg_rect);
+    if (message->Type == COPYFILE2_CALLBACK_CHUNK_FINISHED) {
+        const ULONGLONG transferred = message->Info.ChunkFinished.uliTotalBytesTransferred.QuadPart;
+        InterlockedAdd64(&engine->bytes_done, (LONG64)(transferred - progress->transferred));
+        progress->transferred = transferred;
+        copy_post_progress(engine, FALSE);
+    }
 
-            int dlg_w    = dlg_rect.right - dlg_rect.left;
-            int dlg_h    = dlg_rect.bottom - dlg_rect.top;
-            int parent_x = parent_rect.left;
-            int parent_y = parent_rect.top;
-            int parent_w = parent_rect.right - parent_rect.left;
-            int parent_h = parent_rect.bottom - parent_rect.top;
+    return COPYFILE2_PROGRESS_CONTINUE;
+}
 
-            int x = parent_x + (parent_w - dlg_w) / 2;
-            int y = parent_y + (parent_h - dlg_h) / 2;
+BOOL copy_file_entry_to_dst(copy_engine* engine, const copy_file_entry* entry) {
+    arena* scratch        = scratch_arena();
+    const arena_mark mark = arena_save(scratch);
+    wchar_t* src_path     = arena_wjoin(scratch, engine->src_root, entry->rel_path);
+    wchar_t* dst_path     = arena_wjoin(scratch, engine->dst_root, entry->rel_path);
+    BOOL success          = FALSE;
 
-            SetWindowPos(hwnd, NULL, x, y, 0, 0, SWP_NOSIZE | SWP_NOZORDER);
+    if (!src_path || !dst_path)
+        goto cleanup;
 
-            return (INT_PTR)TRUE;
-        }
+    if (journal_is_done(engine->journal, entry, dst_path)) {
+        InterlockedAdd64(&engine->bytes_done, (LONG64)entry->size);
+        InterlockedIncrement(&engine->files_skipped);
+        success = TRUE;
+        goto cleanup;
+    }
 
-        case WM_COMMAND: {
-            switch (LOWORD(wparam)) {
-                case IDREMOVE: {
-                    data->backup_files       = (IsDlgButtonChecked(hwnd, IDC_REMOVE_BACKUP_CHECK) == BST_CHECKED);
-                    data->remove_content_dir = (IsDlgButtonChecked(hwnd, IDC_REMOVE_FOLDER_CHECK) == BST_CHECKED);
-                    EndDialog(hwnd, IDREMOVE);
-                    return (INT_PTR)TRUE;
-                }
+    copy_progress_context progress = {.engine = engine, .transferred = 0};
 
-                case IDCANCEL_REMOVE:
-                case IDCANCEL: {
-                    EndDialog(hwnd, IDCANCEL);
-                    return (INT_PTR)TRUE;
-                }
-            }
-            break;
-        }
+    COPYFILE2_EXTENDED_PARAMETERS params = {0};
+    params.dwSize                        = sizeof(params);
+    params.dwCopyFlags                   = entry->size >= _COPY_UNBUFFERED_THRESHOLD ? COPY_FILE_NO_BUFFERING : 0;
+    params.pProgressRoutine              = copy_progress_routine;
+    params.pvCallbackContext             = &progress;
 
-        case WM_CLOSE: {
-            EndDialog(hwnd, IDCANCEL);
-            return (INT_PTR)TRUE;
-        }
+    _BENCH_SAMPLE_BEGIN();
+    const HRESULT hr = CopyFile2(src_path, dst_path, &params);
+    _BENCH_SAMPLE_END();
+    if (FAILED(hr)) {
+        if (hr != HRESULT_FROM_WIN32(ERROR_REQUEST_ABORTED))
+            _ERROR("Failed to copy file: %ls to %ls (HRESULT: 0x%08X)", src_path, dst_path, hr);
+        goto cleanup;
     }
 
-    return (INT_PTR)FALSE;
+    // Chunk callbacks may not cover the tail of the file (or fire at all for empty files)
+    InterlockedAdd64(&engine->bytes_done, (LONG64)(entry->size - progress.transferred));
+    InterlockedIncrement(&engine->files_copied);
+    stats_add(STAT_FILES_COPIED, 1);
+    stats_add(STAT_BYTES_COPIED, entry->size);
+    journal_mark_done(engine->journal, entry);
+    success = TRUE;
+
+cleanup:
+    arena_rewind(scratch, mark);
+    return success;
 }
 
-INT_PTR CALLBACK batch_remove_dialog_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam) {
-    static batch_removal_dialog_data* data = NULL;
+void copy_worker_run(copy_engine* engine) {
+    for (;;) {
+        const LONG index = InterlockedIncrement(&engine->next_file) - 1;
+        if ((size_t)index >= engine->file_count)
+            break;
 
-    switch (umsg) {
+        if (worker_is_cancelled(engine->job) || InterlockedCompareExchange(&engine->failed, 0, 0))
+            break;
+
+        if (!copy_file_entry_to_dst(engine, &engine->files[index]))
+            InterlockedExchange(&engine->failed, TRUE);
+    }
+}
+
+DWORD WINAPI copy_worker_proc(LPVOID param) {
+    copy_worker_run((copy_engine*)param);
+    scratch_release();
+    return 0;
+}
+
+// Copies `src` to `dst` with up to _COPY_MAX_THREADS concurrent CopyFile2 calls, reporting byte progress to `job`.
+// Files already recorded in `journal` by an earlier, interrupted run are skipped. `job` and `journal` may be NULL.
+BOOL copy_directory(const char* src, const char* dst, worker_job* job, relocation_journal* journal) {
+    wchar_t* src_w = make_long_path(src);
+    wchar_t* dst_w = make_long_path(dst);
+    if (!src_w || !dst_w)
+        return FALSE;
+
+    const LONGLONG start = query_ticks();
+
+    copy_engine engine = {0};
+    engine.src_root    = src_w;
+    engine.dst_root    = dst_w;
+    engine.journal     = journal;
+    engine.job         = job;
+    engine.heap        = HeapCreate(0, 0, 0);
+    if (!engine.heap) {
+        _ERROR("Failed to allocate memory for copying directory: %s", src);
+        return FALSE;
+    }
+
+    BOOL success = copy_enumerate(&engine);
+    if (success) {
+        engine.progress_unit = (LONG64)max(engine.bytes_total / 1000000, 1);
+
+        // Two more steps follow the copy: deleting the original and updating the registry
+        worker_set_total(job, (LONG)(engine.bytes_total / engine.progress_unit) + 2);
+
+        const int thread_count = (int)min(max(engine.file_count, 1), _COPY_MAX_THREADS);
+        HANDLE threads[_COPY_MAX_THREADS] = {0};
+        for (int i = 1; i < thread_count; i++)
+            threads[i] = CreateThread(NULL, 0, copy_worker_proc, &engine, 0, NULL);
+
+        copy_worker_run(&engine);
+        for (int i = 1; i < thread_count; i++) {
+            if (threads[i]) {
+                WaitForSingleObject(threads[i], INFINITE);
+                CloseHandle(threads[i]);
+            }
+        }
+
+        copy_post_progress(&engine, TRUE);
+        success = !engine.failed && !worker_is_cancelled(job);
+
+        _INFO("Copied %ld file(s) (%llu bytes, %ld skipped) in %.2f ms using %d thread(s)",
+              engine.files_copied,
+              engine.bytes_total,
+              engine.files_skipped,
+              ticks_to_ms(query_ticks() - start),
+              thread_count);
+    }
+
+    if (worker_is_cancelled(job))
+        _WARN("Cancelled copy of directory: %s", src);
+
+    stats_time_scope(STAT_SCOPE_COPY, start);
+    free(engine.files);
+    HeapDestroy(engine.heap);
+
+    return success;
+}
+
+// FNV-1a
+unsigned int hash_bytes(const void* data, size_t len) {
+    const BYTE* bytes = (const BYTE*)data;
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+unsigned int hash_string(const char* str) {
+    return hash_bytes(str, strlen(str));
+}
+
+void exclusion_name_insert(const char* name) {
+    const unsigned int mask = (unsigned int)EXCLUDED_NAME_CAPACITY - 1;
+    unsigned int slot       = hash_string(name) & mask;
+    while (EXCLUDED_NAMES[slot]) {
+        if (_STREQ(EXCLUDED_NAMES[slot], name))
+            return;
+        slot = (slot + 1) & mask;
+    }
+    EXCLUDED_NAMES[slot] = name;
+    EXCLUDED_NAME_COUNT++;
+}
+
+BOOL add_excluded_name(const char* name) {
+    // Keep the set at most half full so probe sequences stay short
+    if ((EXCLUDED_NAME_COUNT + 1) * 2 > EXCLUDED_NAME_CAPACITY) {
+        const int old_cap      = EXCLUDED_NAME_CAPACITY;
+        const char** old_names = EXCLUDED_NAMES;
+        const int new_cap      = old_cap ? old_cap * 2 : 128;
+        const char** new_names = (const char**)arena_alloc(&EXCLUSION_ARENA, new_cap * sizeof(char*));
+        if (!new_names)
+            return FALSE;
+        memset(new_names, 0, new_cap * sizeof(char*));
+
+        EXCLUDED_NAMES         = new_names;
+        EXCLUDED_NAME_CAPACITY = new_cap;
+        EXCLUDED_NAME_COUNT    = 0;
+        for (int i = 0; i < old_cap; i++) {
+            if (old_names[i])
+                exclusion_name_insert(old_names[i]);
+        }
+    }
+
+    exclusion_name_insert(name);
+    return TRUE;
+}
+
+BOOL add_excluded_prefix(const char* prefix, size_t len) {
+    exclusion_trie_node** link = &EXCLUDED_PREFIXES->child;
+    exclusion_trie_node* node  = EXCLUDED_PREFIXES;
+
+    for (size_t i = 0; i < len; i++) {
+        const unsigned char ch = (unsigned char)tolower((unsigned char)prefix[i]);
+
+        exclusion_trie_node* next = *link;
+        while (next && next->ch != ch)
+            next = next->sibling;
+
+        if (!next) {
+            next = (exclusion_trie_node*)arena_alloc(&EXCLUSION_ARENA, sizeof(exclusion_trie_node));
+            if (!next)
+                return FALSE;
+            next->child    = NULL;
+            next->sibling  = *link;
+            next->ch       = ch;
+            next->terminal = FALSE;
+            *link          = next;
+        }
+
+        node = next;
+        link = &node->child;
+    }
+
+    node->terminal = TRUE;
+    return TRUE;
+}
+
+BOOL add_excluded_spec(const char* spec) {
+    if (EXCLUDED_SPEC_COUNT == EXCLUDED_SPEC_CAPACITY) {
+        const int new_cap      = EXCLUDED_SPEC_CAPACITY ? EXCLUDED_SPEC_CAPACITY * 2 : 16;
+        const char** new_specs = (const char**)arena_alloc(&EXCLUSION_ARENA, new_cap * sizeof(char*));
+        if (!new_specs)
+            return FALSE;
+        if (EXCLUDED_SPEC_COUNT > 0)
+            memcpy(new_specs, EXCLUDED_SPECS, EXCLUDED_SPEC_COUNT * sizeof(char*));
+        EXCLUDED_SPECS         = new_specs;
+        EXCLUDED_SPEC_CAPACITY = new_cap;
+    }
+
+    EXCLUDED_SPECS[EXCLUDED_SPEC_COUNT++] = spec;
+    return TRUE;
+}
+
+// Sorts `entry` into the exact-name set, the prefix trie, or the PathMatchSpec fallback list
+BOOL add_exclusion(const char* entry) {
+    const size_t len     = strlen(entry);
+    const char* wildcard = strpbrk(entry, "*?");
+
+    if (!wildcard) {
+        const char* name = arena_strdup(&EXCLUSION_ARENA, entry);
+        return name && add_excluded_name(name);
+    }
+
+    if (wildcard == entry + len - 1 && *wildcard == '*')
+        return add_excluded_prefix(entry, len - 1);
+
+    const char* spec = arena_strdup(&EXCLUSION_ARENA, entry);
+    return spec && add_excluded_spec(spec);
+}
+
+int load_exclusion_file(const char* path) {
+    FILE* file = NULL;
+    if (fopen_s(&file, path, "r") != 0)
+        return 0;
+
+    int count = 0;
+    char line[_MAX_KEY_LENGTH + 2];
+    while (fgets(line, sizeof(line), file)) {
+        strip_newline(line);
+
+        char* entry = line;
+        while (*entry == ' ' || *entry == '\t')
+            entry++;
+        size_t len = strlen(entry);
+        while (len > 0 && (entry[len - 1] == ' ' || entry[len - 1] == '\t'))
+            entry[--len] = '\0';
+
+        if (len == 0 || entry[0] == '#')
+            continue;
+
+        if (!add_exclusion(entry)) {
+            _ERROR("Failed to allocate memory for exclusion: '%s'", entry);
+            break;
+        }
+        count++;
+    }
+
+    fclose(file);
+    return count;
+}
+
+// Compiles the built-in exclusions and those in _EXCLUSIONS_FILE into the filter used by is_excluded_key()
+BOOL load_exclusions(void) {
+    arena_reset(&EXCLUSION_ARENA);
+    EXCLUDED_NAMES         = NULL;
+    EXCLUDED_NAME_COUNT    = 0;
+    EXCLUDED_NAME_CAPACITY = 0;
+    EXCLUDED_SPECS         = NULL;
+    EXCLUDED_SPEC_COUNT    = 0;
+    EXCLUDED_SPEC_CAPACITY = 0;
+
+    EXCLUDED_PREFIXES = (exclusion_trie_node*)arena_alloc(&EXCLUSION_ARENA, sizeof(exclusion_trie_node));
+    if (!EXCLUDED_PREFIXES) {
+        _ERROR("Failed to allocate memory for exclusion list");
+        return FALSE;
+    }
+    memset(EXCLUDED_PREFIXES, 0, sizeof(exclusion_trie_node));
+
+    for (int i = 0; i < KEY_EXCLUSION_LIST_SIZE; i++) {
+        if (!add_exclusion(KEY_EXCLUSION_LIST[i]))
+            return FALSE;
+    }
+
+    for (int i = 0; i < KEY_EXCLUSION_PATTERNS_SIZE; i++) {
+        if (!add_exclusion(KEY_EXCLUSION_PATTERNS[i]))
+            return FALSE;
+    }
+
+    const int loaded = load_exclusion_file(_EXCLUSIONS_FILE);
+    if (loaded > 0)
+        _INFO("Loaded %d exclusion(s) from '%s'", loaded, _EXCLUSIONS_FILE);
+
+    return TRUE;
+}
+
+// O(key length) for exact names and prefixes; only wildcard patterns from the exclusions file are matched linearly
+BOOL is_excluded_key(const char* key) {
+    if (EXCLUDED_NAME_CAPACITY > 0) {
+        const unsigned int mask = (unsigned int)EXCLUDED_NAME_CAPACITY - 1;
+        for (unsigned int slot = hash_string(key) & mask; EXCLUDED_NAMES[slot]; slot = (slot + 1) & mask) {
+            if (_STREQ(EXCLUDED_NAMES[slot], key))
+                return TRUE;
+        }
+    }
+
+    const exclusion_trie_node* node = EXCLUDED_PREFIXES;
+    for (const char* c = key; node; c++) {
+        if (node->terminal)
+            return TRUE;
+        if (!*c)
+            break;
+
+        const unsigned char ch = (unsigned char)tolower((unsigned char)*c);
+        node                   = node->child;
+        while (node && node->ch != ch)
+            node = node->sibling;
+    }
+
+    for (int i = 0; i < EXCLUDED_SPEC_COUNT; i++) {
+        if (PathMatchSpec(key, EXCLUDED_SPECS[i]))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+// Enable registry key backups, and restoring them from a backup snapshot
+void enable_backup_privilege(void) {
+    HANDLE h_token;
+    TOKEN_PRIVILEGES tp;
+    LUID luid;
+
+    if (OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &h_token)) {
+        const LPCSTR privileges[] = {SE_BACKUP_NAME, SE_RESTORE_NAME};
+        for (int i = 0; i < 2; i++) {
+            if (LookupPrivilegeValue(NULL, privileges[i], &luid)) {
+                tp.PrivilegeCount           = 1;
+                tp.Privileges[0].Luid       = luid;
+                tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+                AdjustTokenPrivileges(h_token, FALSE, &tp, sizeof(TOKEN_PRIVILEGES), NULL, NULL);
+            }
+        }
+        CloseHandle(h_token);
+        _INFO("Enabled registry backup privileges");
+    } else {
+        _FATAL("Failed to enable registry backup privileges. Are you admin?");
+    }
+}
+
+void library_index_insert(int index) {
+    const unsigned int mask = (unsigned int)LIB_INDEX_CAPACITY - 1;
+    unsigned int slot       = hash_string(LIBRARIES[index].name) & mask;
+    while (LIB_INDEX[slot] != 0)
+        slot = (slot + 1) & mask;
+    LIB_INDEX[slot] = index + 1;
+}
+
+library_entry* find_library(const char* name) {
+    if (!name || LIB_INDEX_CAPACITY == 0)
+        return NULL;
+
+    const unsigned int mask = (unsigned int)LIB_INDEX_CAPACITY - 1;
+    for (unsigned int slot = hash_string(name) & mask; LIB_INDEX[slot] != 0; slot = (slot + 1) & mask) {
+        library_entry* library = &LIBRARIES[LIB_INDEX[slot] - 1];
+        if (_STREQ(library->name, name))
+            return library;
+    }
+
+    return NULL;
+}
+
+// Replaces the library table with `entries` (whose strings must already live in LIBRARY_ARENA), growing the table
+// geometrically and rebuilding the name index
+BOOL set_libraries(const library_entry* entries, int count) {
+    if (count > LIB_CAPACITY) {
+        int new_cap = LIB_CAPACITY ? LIB_CAPACITY : 64;
+        while (new_cap < count)
+            new_cap *= 2;
+        library_entry* new_entries = (library_entry*)arena_alloc(&LIBRARY_ARENA, new_cap * sizeof(library_entry));
+        if (!new_entries)
+            return FALSE;
+        LIBRARIES    = new_entries;
+        LIB_CAPACITY = new_cap;
+    }
+
+    // Keep the index at most half full so probe sequences stay short
+    if (count * 2 > LIB_INDEX_CAPACITY) {
+        int new_cap = LIB_INDEX_CAPACITY ? LIB_INDEX_CAPACITY : 128;
+        while (new_cap < count * 2)
+            new_cap *= 2;
+        int* new_index = (int*)arena_alloc(&LIBRARY_ARENA, new_cap * sizeof(int));
+        if (!new_index)
+            return FALSE;
+        LIB_INDEX          = new_index;
+        LIB_INDEX_CAPACITY = new_cap;
+    }
+
+    if (count > 0)
+        memmove(LIBRARIES, entries, count * sizeof(library_entry));
+    LIB_COUNT = count;
+
+    memset(LIB_INDEX, 0, LIB_INDEX_CAPACITY * sizeof(int));
+    for (int i = 0; i < LIB_COUNT; i++)
+        library_index_insert(i);
+
+    return TRUE;
+}
+
+// Copies the live library entries into a fresh arena, releasing the ones scans have dropped since the last compaction
+BOOL compact_libraries(void) {
+    arena* scratch        = scratch_arena();
+    const arena_mark mark = arena_save(scratch);
+    arena fresh           = {0};
+    library_entry* live   = (library_entry*)arena_alloc(scratch, (LIB_COUNT + 1) * sizeof(library_entry));
+    BOOL success          = live != NULL;
+
+    for (int i = 0; success && i < LIB_COUNT; i++) {
+        live[i]      = LIBRARIES[i];
+        live[i].name = arena_strdup(&fresh, LIBRARIES[i].name);
+        if (LIBRARIES[i].content_dir)
+            live[i].content_dir = arena_strdup(&fresh, LIBRARIES[i].content_dir);
+        if (LIBRARIES[i].snpid)
+            live[i].snpid = arena_strdup(&fresh, LIBRARIES[i].snpid);
+        success = live[i].name && (!LIBRARIES[i].content_dir || live[i].content_dir) &&
+                  (!LIBRARIES[i].snpid || live[i].snpid);
+    }
+
+    if (success) {
+        const int count = LIB_COUNT;
+        arena_destroy(&LIBRARY_ARENA);
+        LIBRARY_ARENA      = fresh;
+        LIBRARIES          = NULL;
+        LIB_CAPACITY       = 0;
+        LIB_INDEX          = NULL;
+        LIB_INDEX_CAPACITY = 0;
+        LIB_STALE_COUNT    = 0;
+        success            = set_libraries(live, count);
+    } else {
+        arena_destroy(&fresh);
+    }
+
+    arena_rewind(scratch, mark);
+    return success;
+}
+
+#define _TARGET_HIVE_KEY "SOFTWARE\\"  // What an offline SOFTWARE hive's root stands for below HKEY_LOCAL_MACHINE
+
+// Opens `path` below HKEY_LOCAL_MACHINE, or creates it if `create` is set. With an offline target the key is opened in
+// TARGET.software instead: the hive's root is SOFTWARE itself, and since app hives aren't redirected, the 32-bit view
+// is spelled out as WOW6432Node. `sam`'s view flags are dropped there.
+LSTATUS open_registry_key(const char* path, REGSAM sam, BOOL create, HKEY* key) {
+    HKEY root = HKEY_LOCAL_MACHINE;
+    if (TARGET.software) {
+        const size_t prefix = strlen(_TARGET_HIVE_KEY);
+        if (_strnicmp(path, _TARGET_HIVE_KEY, prefix) != 0)
+            return ERROR_FILE_NOT_FOUND;
+
+        path += prefix;
+        if ((sam & KEY_WOW64_32KEY) && _strnicmp(path, "WOW6432Node\\", 12) != 0)
+            path = join_str("WOW6432Node\\", path);
+        root = TARGET.software;
+        sam &= ~(KEY_WOW64_32KEY | KEY_WOW64_64KEY);
+    }
+
+    const wchar_t* wide = path ? utf8_to_wide(path) : NULL;
+    if (!wide)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    if (create)
+        return RegCreateKeyExW(root, wide, 0, NULL, 0, sam, NULL, key, NULL);
+    return RegOpenKeyExW(root, wide, 0, sam, key);
+}
+
+void close_registry_key(HKEY* key) {
+    RegCloseKey(*key);
+}
+
+void close_registry_views(HKEY keys[_REGISTRY_VIEW_COUNT]) {
+    for (int view = 0; view < _REGISTRY_VIEW_COUNT; view++) {
+        if (keys[view])
+            close_registry_key(&keys[view]);
+        keys[view] = NULL;
+    }
+}
+
+typedef struct {
+    const char* name;
+    const wchar_t* wide_name;
+    FILETIME last_write;
+    BYTE views;
+} registry_key_info;
+
+// Stores the subkeys of `key` in `*keys` (allocated from `a`), tagged with `views`, and returns their count. The
+// name buffer and table are presized from RegQueryInfoKeyW, so enumeration normally doesn't reallocate.
+int enumerate_registry_keys(HKEY key, BYTE views, arena* a, registry_key_info** keys) {
+    *keys = NULL;
+
+    DWORD subkey_count = 0;
+    DWORD max_name_len = 0;
+    if (RegQueryInfoKeyW(key, NULL, NULL, NULL, &subkey_count, &max_name_len, NULL, NULL, NULL, NULL, NULL, NULL) !=
+        ERROR_SUCCESS)
+        return 0;
+
+    // The counts are only sizing hints; keys can be added while we enumerate
+    const DWORD name_capacity = max(max_name_len, _MAX_KEY_LENGTH) + 1;
+    wchar_t* name_buffer      = (wchar_t*)arena_alloc(a, name_capacity * sizeof(wchar_t));
+    DWORD capacity            = max(subkey_count, 16);
+    registry_key_info* info   = (registry_key_info*)arena_alloc(a, capacity * sizeof(registry_key_info));
+    if (!name_buffer || !info)
+        return 0;
+
+    int count = 0;
+    for (DWORD index = 0;; index++) {
+        DWORD name_len = name_capacity;
+        FILETIME last_write;
+        if (RegEnumKeyExW(key, index, name_buffer, &name_len, NULL, NULL, NULL, &last_write) != ERROR_SUCCESS)
+            break;
+
+        if ((DWORD)count == capacity) {
+            registry_key_info* new_info =
+              (registry_key_info*)arena_alloc(a, capacity * 2 * sizeof(registry_key_info));
+            if (!new_info)
+                break;
+            memcpy(new_info, info, capacity * sizeof(registry_key_info));
+            info = new_info;
+            capacity *= 2;
+        }
+
+        const char* name         = arena_wide_to_utf8(a, name_buffer);
+        const wchar_t* wide_name = arena_wstrdup(a, name_buffer);
+        if (!name || !wide_name)
+            break;
+        _VERBOSE("Found registry entry: '%s'", name);
+
+        info[count].name       = name;
+        info[count].wide_name  = wide_name;
+        info[count].last_write = last_write;
+        info[count].views      = views;
+        count++;
+    }
+
+    stats_add(STAT_REGISTRY_OPS, (ULONGLONG)count);
+    *keys = info;
+    return count;
+}
+
+// Merges the subkeys found in each registry view into one table in `a`, keeping view order. A library registered in
+// both views appears once, with both view bits set and the later of the two last-write times.
+int merge_registry_keys(arena* a,
+                        registry_key_info* const lists[],
+                        const int counts[],
+                        int list_count,
+                        registry_key_info** merged) {
+    int total = 0;
+    for (int i = 0; i < list_count; i++)
+        total += counts[i];
+
+    int slot_count = 16;
+    while (slot_count < total * 2)
+        slot_count *= 2;
+    const unsigned int mask = (unsigned int)slot_count - 1;
+
+    registry_key_info* keys = (registry_key_info*)arena_alloc(a, (total + 1) * sizeof(registry_key_info));
+    int* slots              = (int*)arena_alloc(a, slot_count * sizeof(int));
+    if (!keys || !slots) {
+        *merged = NULL;
+        return 0;
+    }
+    memset(slots, 0, slot_count * sizeof(int));
+
+    int count = 0;
+    for (int i = 0; i < list_count; i++) {
+        for (int j = 0; j < counts[i]; j++) {
+            const registry_key_info* key = &lists[i][j];
+
+            unsigned int slot = hash_string(key->name) & mask;
+            while (slots[slot] != 0 && !_STREQ(keys[slots[slot] - 1].name, key->name))
+                slot = (slot + 1) & mask;
+
+            if (slots[slot] == 0) {
+                keys[count] = *key;
+                slots[slot] = ++count;
+                continue;
+            }
+
+            registry_key_info* existing = &keys[slots[slot] - 1];
+            existing->views |= key->views;
+            if (CompareFileTime(&key->last_write, &existing->last_write) > 0)
+                existing->last_write = key->last_write;
+        }
+    }
+
+    *merged = keys;
+    return count;
+}
+
+// Reads the string value `name` of `subkey` below `base` in one call, returning it as UTF-8 from the string pool. On
+// failure the last error says why (ERROR_FILE_NOT_FOUND if the value doesn't exist).
+const char* read_library_value(HKEY base, const wchar_t* subkey, const wchar_t* name) {
+    wchar_t buffer[MAX_PATH];
+    wchar_t* value = buffer;
+    DWORD size     = sizeof(buffer);
+
+    LSTATUS status = RegGetValueW(base, subkey, name, RRF_RT_REG_SZ, NULL, value, &size);
+    stats_add(STAT_REGISTRY_OPS, 1);
+    if (status == ERROR_MORE_DATA) {
+        value = strpool_walloc(size / sizeof(wchar_t) + 1);
+        if (!value) {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return NULL;
+        }
+        status = RegGetValueW(base, subkey, name, RRF_RT_REG_SZ, NULL, value, &size);
+    }
+
+    if (status != ERROR_SUCCESS) {
+        SetLastError((DWORD)status);
+        return NULL;
+    }
+    return wide_to_utf8(value);
+}
+
+// Fills `entry` from the registry key described by `key`, reading ContentDir and SNPID through the open library key of
+// each view in `view_keys`. Its strings are copied into `strings`, where `name` must already live.
+BOOL read_library_entry(arena* strings,
+                        HKEY const view_keys[],
+                        const registry_key_info* key,
+                        const char* name,
+                        library_entry* entry) {
+    memset(entry, 0, sizeof(*entry));
+    entry->name       = name;
+    entry->last_write = key->last_write;
+    entry->views      = key->views;
+
+    // The 64-bit view comes first, so it wins when a library is registered in both
+    const char* content_dir = NULL;
+    const char* snpid       = NULL;
+    for (int view = 0; !content_dir && view < _REGISTRY_VIEW_COUNT; view++) {
+        if ((key->views & (1 << view)) && view_keys[view]) {
+            content_dir = read_library_value(view_keys[view], key->wide_name, L"ContentDir");
+            if (!snpid)
+                snpid = read_library_value(view_keys[view], key->wide_name, L"SNPID");
+        }
+    }
+
+    // Only used to tell which cache files belong to the library, so one that can't be stored is just left out
+    if (snpid && snpid[0])
+        entry->snpid = arena_strdup(strings, snpid);
+
+    // On an offline image the folder is looked for where the image is mounted, and left alone if it isn't there
+    if (content_dir && TARGET.software) {
+        const char* mounted = target_file_path(content_dir);
+        if (!mounted)
+            _WARN("Content directory of '%s' isn't on the image's system drive, leaving it alone: '%s'",
+                  name,
+                  content_dir);
+        content_dir = mounted;
+        if (!content_dir)
+            return TRUE;
+    }
+
+    if (content_dir != NULL) {
+        entry->content_dir = arena_strdup(strings, content_dir);
+        if (!entry->content_dir) {
+            _ERROR("Failed to allocate memory for library entry: '%s'", name);
+            return FALSE;
+        }
+    } else {
+        _WARN("Failed to retrieve ContentDir value for registry key: 'HKEY_LOCAL_MACHINE\\%s\\%s'",
+              REGISTRY_VIEWS[(key->views & 1) ? 0 : 1].path,
+              name);
+    }
+
+    _VERBOSE("Found library entry: '%s (%s)'", entry->name, entry->content_dir);
+    return TRUE;
+}
+
+// Whether the library's name contains `filter`, ignoring case. An empty filter matches everything.
+BOOL library_matches_filter(const library_entry* library, const wchar_t* filter) {
+    if (!filter[0])
+        return TRUE;
+
+    // Registry key names are at most _MAX_KEY_LENGTH characters, so the name always fits
+    wchar_t name[_MAX_KEY_LENGTH + 1];
+    if (!MultiByteToWideChar(CP_UTF8, 0, library->name, -1, name, _MAX_KEY_LENGTH + 1))
+        return FALSE;
+    return StrStrIW(name, filter) != NULL;
+}
+
+// Refills `view` with the libraries in `libraries` that match its filter, in table order
+BOOL library_view_build(library_view* view, const library_entry* libraries, int count) {
+    if (count > view->capacity) {
+        int* rows = (int*)realloc(view->rows, count * sizeof(int));
+        if (!rows) {
+            view->row_count = 0;
+            return FALSE;
+        }
+        view->rows     = rows;
+        view->capacity = count;
+    }
+
+    view->row_count = 0;
+    for (int i = 0; i < count; i++) {
+        if (library_matches_filter(&libraries[i], view->filter))
+            view->rows[view->row_count++] = i;
+    }
+    return TRUE;
+}
+
+// Row showing table entry `index`, or -1 if it's filtered out
+int library_view_find(const library_view* view, int index) {
+    for (int row = 0; row < view->row_count; row++) {
+        if (view->rows[row] == index)
+            return row;
+    }
+    return -1;
+}
+
+void library_view_free(library_view* view) {
+    free(view->rows);
+    view->rows      = NULL;
+    view->row_count = 0;
+    view->capacity  = 0;
+}
+
+// Rows of the main window's library list
+static library_view MAIN_VIEW;
+
+// Row text for `library`, with its size once the indexer has measured it. Written straight into the list view's
+// buffer, since rows are asked for on every repaint.
+void get_library_row_text(const library_entry* library, wchar_t* text, int len) {
+    if (!MultiByteToWideChar(CP_UTF8, 0, library->name, -1, text, len))
+        StringCchCopyW(text, len, L"?");
+
+    if (library->size_known) {
+        wchar_t size[32];
+        StrFormatByteSizeW((LONGLONG)library->size_bytes, size, 32);
+        const size_t used = wcslen(text);
+        StringCchPrintfW(text + used, len - used, L" (%s)", size);
+    }
+}
+
+// Shows the rows of MAIN_VIEW, keeping SELECTED_INDEX selected if it's still shown and clearing it otherwise
+void refresh_library_list(void) {
+    if (!library_view_build(&MAIN_VIEW, LIBRARIES, LIB_COUNT))
+        _ERROR("Failed to allocate memory for library list");
+
+    const int row = SELECTED_INDEX >= 0 ? library_view_find(&MAIN_VIEW, SELECTED_INDEX) : -1;
+
+    ListView_SetItemCountEx(H_LIBRARY_LIST, MAIN_VIEW.row_count, LVSICF_NOSCROLL);
+    ListView_SetItemState(H_LIBRARY_LIST, -1, 0, LVIS_SELECTED | LVIS_FOCUSED);
+    if (row >= 0) {
+        ListView_SetItemState(H_LIBRARY_LIST, row, LVIS_SELECTED | LVIS_FOCUSED, LVIS_SELECTED | LVIS_FOCUSED);
+        ListView_EnsureVisible(H_LIBRARY_LIST, row, FALSE);
+    }
+
+    SELECTED_INDEX = row >= 0 ? MAIN_VIEW.rows[row] : -1;
+    EnableWindow(H_REMOVE_BUTTON, SELECTED_INDEX != -1);
+    EnableWindow(H_RELOCATE_BUTTON, SELECTED_INDEX != -1);
+    InvalidateRect(H_LIBRARY_LIST, NULL, FALSE);
+}
+
+// Points ContentDir at `content_dir` in every registry view the library was found in
+BOOL write_content_dir(const library_entry* library, const char* content_dir) {
+    const wchar_t* key   = utf8_to_wide(library->name);
+    const wchar_t* value = utf8_to_wide(content_dir);
+    if (!key || !value)
+        return FALSE;
+
+    const DWORD size = (DWORD)((wcslen(value) + 1) * sizeof(wchar_t));
+    for (int view = 0; view < _REGISTRY_VIEW_COUNT; view++) {
+        if (!(library->views & (1 << view)))
+            continue;
+
+        const REGSAM sam = KEY_SET_VALUE | REGISTRY_VIEWS[view].sam;
+        HKEY h_key;
+        LSTATUS status = open_registry_key(_LIBRARY_REGISTRY_PATH, sam, FALSE, &h_key);
+        if (status == ERROR_SUCCESS) {
+            status = RegSetKeyValueW(h_key, key, L"ContentDir", REG_SZ, value, size);
+            stats_add(STAT_REGISTRY_OPS, 1);
+            RegCloseKey(h_key);
+        }
+
+        if (status != ERROR_SUCCESS) {
+            _ERROR("Failed to update ContentDir value in registry key: 'HKEY_LOCAL_MACHINE\\%s\\%s' (Error: %ld)",
+                   REGISTRY_VIEWS[view].path,
+                   library->name,
+                   status);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// Posted to the main window as the size indexer finishes a library. wparam: item index, lparam: indexer generation
+#define WM_SIZE_INDEXED (WM_APP + 6)
+
+#define _SIZE_CACHE_FILE "K8-LRT.sizes.cache"
+#define _SIZE_CACHE_MAGIC "K8LRT-SIZES 1"
+#define _SIZE_CACHE_LINE_MAX (MAX_PATH * 2)
+#define _SIZE_INDEX_MAX_WORKERS 4  // Leaves pool threads for a removal started while sizes are still coming in
+
+typedef struct {
+    const char* content_dir;
+    ULONGLONG content_mtime;
+    ULONGLONG bytes;
+    ULONGLONG files;
+    ULONGLONG last_access;
+} size_cache_entry;
+
+// A library queued for measuring. Its strings are copies, since the table can be rescanned while the walk runs.
+typedef struct {
+    const char* name;
+    const char* content_dir;
+    const wchar_t* root;
+    ULONGLONG content_mtime;
+    ULONGLONG bytes;
+    ULONGLONG files;
+    ULONGLONG last_access;
+    BOOL complete;
+} size_index_item;
+
+// One background pass over the libraries whose sizes weren't known when it started. Workers claim items through
+// `next` and post each result back to the UI thread, which applies it to the matching library entry.
+typedef struct {
+    arena arena;
+    size_index_item* items;
+    LONG count;
+    LONG generation;
+    HWND notify;
+    volatile LONG next;
+    volatile LONG cancelled;
+    LONG remaining;  // Only touched from the UI thread
+    PTP_WORK works[_SIZE_INDEX_MAX_WORKERS];
+    int work_count;
+    LONGLONG start;
+} size_indexer;
+
+static size_indexer* SIZE_INDEXER = NULL;  // Only touched from the UI thread
+static LONG SIZE_INDEX_GENERATION = 0;
+static BOOL SIZE_INDEX_RESTART    = FALSE;  // A scan found new libraries while a pass was still running
+
+int compare_size_cache_entries(const void* a, const void* b) {
+    return _stricmp(((const size_cache_entry*)a)->content_dir, ((const size_cache_entry*)b)->content_dir);
+}
+
+// Reads the size cache into `a`, sorted by content directory. Returns the number of entries.
+size_t read_size_cache(arena* a, size_cache_entry** entries) {
+    *entries = NULL;
+
+    FILE* file = NULL;
+    if (fopen_s(&file, _SIZE_CACHE_FILE, "r") != 0)
+        return 0;
+
+    char line[_SIZE_CACHE_LINE_MAX];
+    BOOL valid = FALSE;
+    if (fgets(line, sizeof(line), file)) {
+        strip_newline(line);
+        valid = _STREQ(line, _SIZE_CACHE_MAGIC);
+    }
+
+    size_t count    = 0;
+    size_t capacity = 0;
+    while (valid && fgets(line, sizeof(line), file)) {
+        strip_newline(line);
+
+        size_cache_entry entry  = {0};
+        const char* content_dir = tab_field(line, 4);
+        if (sscanf_s(line,
+                     "%llu\t%llu\t%llu\t%llu",
+                     &entry.content_mtime,
+                     &entry.bytes,
+                     &entry.files,
+                     &entry.last_access) < 4 ||
+            !content_dir)
+            continue;
+
+        if (count == capacity) {
+            const size_t new_capacity = capacity ? capacity * 2 : 64;
+            size_cache_entry* grown   = (size_cache_entry*)arena_alloc(a, new_capacity * sizeof(*grown));
+            if (!grown)
+                break;
+            if (count > 0)
+                memcpy(grown, *entries, count * sizeof(*grown));
+            *entries = grown;
+            capacity = new_capacity;
+        }
+
+        entry.content_dir = arena_strdup(a, content_dir);
+        if (entry.content_dir)
+            (*entries)[count++] = entry;
+    }
+
+    fclose(file);
+
+    if (count > 1)
+        qsort(*entries, count, sizeof(size_cache_entry), compare_size_cache_entries);
+    return count;
+}
+
+const size_cache_entry* find_size_cache_entry(const size_cache_entry* entries, size_t count, const char* content_dir) {
+    if (count == 0)
+        return NULL;
+
+    const size_cache_entry key = {.content_dir = content_dir};
+    return (const size_cache_entry*)bsearch(&key, entries, count, sizeof(size_cache_entry), compare_size_cache_entries);
+}
+
+// Saves the totals of every measured library, keyed on its content directory and that directory's last-write time
+void write_size_cache(void) {
+    FILE* file = NULL;
+    if (fopen_s(&file, _SIZE_CACHE_FILE, "w") != 0) {
+        _WARN("Failed to write size cache: '%s'", _SIZE_CACHE_FILE);
+        return;
+    }
+
+    fprintf(file, "%s\n", _SIZE_CACHE_MAGIC);
+    for (int i = 0; i < LIB_COUNT; i++) {
+        const library_entry* library = &LIBRARIES[i];
+        if (!library->size_known)
+            continue;
+        fprintf(file,
+                "%llu\t%llu\t%llu\t%llu\t%s\n",
+                library->content_mtime,
+                library->size_bytes,
+                library->file_count,
+                library->last_access,
+                library->content_dir);
+    }
+
+    fclose(file);
+}
+
+// Adds up every file below item->root. Directories are walked breadth-first with large-fetch enumeration, and
+// reparse points aren't followed so a junction into another library isn't counted twice. Returns FALSE if the walk
+// was cancelled or ran out of memory; directories that can't be opened are skipped.
+BOOL size_index_walk(size_index_item* item, const volatile LONG* cancelled) {
+    arena* scratch        = scratch_arena();
+    const arena_mark mark = arena_save(scratch);
+
+    size_t dir_count     = 0;
+    size_t dir_capacity  = 64;
+    const wchar_t** dirs = (const wchar_t**)malloc(dir_capacity * sizeof(wchar_t*));
+    if (!dirs)
+        return FALSE;
+    dirs[dir_count++] = item->root;
+
+    BOOL complete = TRUE;
+    for (size_t cursor = 0; complete && cursor < dir_count; cursor++) {
+        if (*cancelled) {
+            complete = FALSE;
+            break;
+        }
+
+        const wchar_t* dir   = dirs[cursor];
+        wchar_t* search_path = arena_wjoin(scratch, dir, L"*");
+        if (!search_path) {
+            complete = FALSE;
+            break;
+        }
+
+        WIN32_FIND_DATAW find_data;
+        const HANDLE h_find = FindFirstFileExW(search_path,
+                                               FindExInfoBasic,
+                                               &find_data,
+                                               FindExSearchNameMatch,
+                                               NULL,
+                                               FIND_FIRST_EX_LARGE_FETCH);
+        if (h_find == INVALID_HANDLE_VALUE) {
+            _VERBOSE("Skipped directory while measuring '%s': %ls (Error: %lu)", item->name, dir, GetLastError());
+            continue;
+        }
+
+        do {
+            if (wcscmp(find_data.cFileName, L".") == 0 || wcscmp(find_data.cFileName, L"..") == 0)
+                continue;
+
+            const DWORD attributes = find_data.dwFileAttributes;
+            if (attributes & FILE_ATTRIBUTE_DIRECTORY) {
+                if (attributes & FILE_ATTRIBUTE_REPARSE_POINT)
+                    continue;
+
+                if (dir_count == dir_capacity) {
+                    const wchar_t** grown = (const wchar_t**)realloc(dirs, dir_capacity * 2 * sizeof(wchar_t*));
+                    if (!grown) {
+                        complete = FALSE;
+                        break;
+                    }
+                    dirs = grown;
+                    dir_capacity *= 2;
+                }
+
+                wchar_t* sub_dir = arena_wjoin(scratch, dir, find_data.cFileName);
+                if (!sub_dir) {
+                    complete = FALSE;
+                    break;
+                }
+                dirs[dir_count++] = sub_dir;
+            } else {
+                const ULONGLONG accessed = filetime_to_u64(find_data.ftLastAccessTime);
+                item->bytes += ((ULONGLONG)find_data.nFileSizeHigh << 32) | find_data.nFileSizeLow;
+                item->files++;
+                if (accessed > item->last_access)
+                    item->last_access = accessed;
+            }
+        } while (FindNextFileW(h_find, &find_data));
+
+        FindClose(h_find);
+    }
+
+    free(dirs);
+    arena_rewind(scratch, mark);
+    return complete;
+}
+
+VOID CALLBACK size_index_worker(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_WORK work) {
+    size_indexer* indexer = (size_indexer*)context;
+
+    for (;;) {
+        const LONG index = InterlockedIncrement(&indexer->next) - 1;
+        if (index >= indexer->count || InterlockedCompareExchange(&indexer->cancelled, 0, 0))
+            break;
+
+        size_index_item* item = &indexer->items[index];
+        item->complete        = size_index_walk(item, &indexer->cancelled);
+        PostMessage(indexer->notify, WM_SIZE_INDEXED, (WPARAM)index, (LPARAM)indexer->generation);
+    }
+
+    scratch_release();
+}
+
+void size_index_free(size_indexer* indexer) {
+    for (int i = 0; i < indexer->work_count; i++)
+        worker_wait(indexer->works[i]);
+    arena_destroy(&indexer->arena);
+    free(indexer);
+}
+
+// Cancels the running pass, if any, and waits for its workers
+void size_index_stop(void) {
+    if (!SIZE_INDEXER)
+        return;
+
+    InterlockedExchange(&SIZE_INDEXER->cancelled, TRUE);
+    size_index_free(SIZE_INDEXER);
+    SIZE_INDEXER       = NULL;
+    SIZE_INDEX_RESTART = FALSE;
+}
+
+void apply_library_size(library_entry* library,
+                        ULONGLONG content_mtime,
+                        ULONGLONG bytes,
+                        ULONGLONG files,
+                        ULONGLONG last_access) {
+    library->size_known    = TRUE;
+    library->content_mtime = content_mtime;
+    library->size_bytes    = bytes;
+    library->file_count    = files;
+    library->last_access   = last_access;
+
+    // Only the rows on screen are asked for again
+    if (H_LIBRARY_LIST)
+        InvalidateRect(H_LIBRARY_LIST, NULL, FALSE);
+}
+
+// Measures every library whose size isn't known yet on the worker pool. A cached total is reused as long as the
+// content directory's last-write time hasn't changed, so only new or touched libraries are walked again. Results
+// arrive as WM_SIZE_INDEXED messages on `notify`.
+void size_index_start(HWND notify) {
+    // The running pass keeps its own copies of what it measures, so it's left to finish and the new libraries are
+    // picked up by another pass after it
+    if (SIZE_INDEXER) {
+        SIZE_INDEX_RESTART = TRUE;
+        return;
+    }
+
+    size_indexer* indexer = (size_indexer*)calloc(1, sizeof(size_indexer));
+    if (!indexer) {
+        _WARN("Failed to allocate memory for the size indexer");
+        return;
+    }
+    indexer->items = (size_index_item*)arena_alloc(&indexer->arena, (LIB_COUNT + 1) * sizeof(size_index_item));
+
+    size_cache_entry* cache = NULL;
+    size_t cache_count      = 0;
+    BOOL cache_loaded       = FALSE;
+    int cached              = 0;
+
+    for (int i = 0; indexer->items && i < LIB_COUNT; i++) {
+        library_entry* library = &LIBRARIES[i];
+        if (library->size_known || !library->content_dir)
+            continue;
+
+        const wchar_t* root = make_long_path(library->content_dir);
+        WIN32_FILE_ATTRIBUTE_DATA attributes;
+        if (!root || !GetFileAttributesExW(root, GetFileExInfoStandard, &attributes) ||
+            !(attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            continue;
+        const ULONGLONG content_mtime = filetime_to_u64(attributes.ftLastWriteTime);
+
+        if (!cache_loaded) {
+            cache_count  = read_size_cache(&indexer->arena, &cache);
+            cache_loaded = TRUE;
+        }
+
+        const size_cache_entry* entry = find_size_cache_entry(cache, cache_count, library->content_dir);
+        if (entry && entry->content_mtime == content_mtime) {
+            apply_library_size(library, content_mtime, entry->bytes, entry->files, entry->last_access);
+            cached++;
+            continue;
+        }
+
+        size_index_item* item = &indexer->items[indexer->count];
+        item->name            = arena_strdup(&indexer->arena, library->name);
+        item->content_dir     = arena_strdup(&indexer->arena, library->content_dir);
+        item->root            = arena_wstrdup(&indexer->arena, root);
+        item->content_mtime   = content_mtime;
+        if (item->name && item->content_dir && item->root)
+            indexer->count++;
+    }
+
+    if (indexer->count > 0) {
+        indexer->generation = ++SIZE_INDEX_GENERATION;
+        indexer->notify     = notify;
+        indexer->remaining  = indexer->count;
+        indexer->start      = query_ticks();
+
+        const int workers = min(indexer->count, _SIZE_INDEX_MAX_WORKERS);
+        for (int i = 0; i < workers; i++) {
+            const PTP_WORK work = worker_submit(size_index_worker, indexer);
+            if (work)
+                indexer->works[indexer->work_count++] = work;
+        }
+    }
+
+    if (cached > 0)
+        _INFO("Loaded sizes of %d library(ies) from '%s'", cached, _SIZE_CACHE_FILE);
+
+    if (indexer->work_count == 0) {
+        if (indexer->count > 0)
+            _WARN("Failed to start measuring library sizes");
+        size_index_free(indexer);
+        return;
+    }
+
+    _INFO("Measuring %ld library(ies) in the background", indexer->count);
+    SIZE_INDEXER = indexer;
+}
+
+#define _CACHE_HEADER_SIZE 4096                     // Bytes of a LibrariesCache file searched for its library
+#define _CACHE_JWT_MAX_SIZE (16 * 1024)             // ras3 tokens are a few KB
+#define _CACHE_TOKEN_MIN 3                          // Shorter runs of text are too likely to be noise
+#define _CACHE_TOKEN_MAX (_MAX_KEY_LENGTH * 3 + 1)  // Longest name or SNPID, as UTF-8
+
+typedef enum {
+    CACHE_SOURCE_LIBRARIES_CACHE,
+    CACHE_SOURCE_RAS3,
+    CACHE_SOURCE_COUNT,
+} cache_source;
+
+// A file in LibrariesCache or ras3 and the library it belongs to
+typedef struct {
+    const wpath* path;
+    const char* owner;  // Library whose name or SNPID the file mentions, NULL if it mentions none or several
+    BOOL shared;        // Mentions more than one library, so removing any of them deletes it
+    ULONGLONG size;
+    cache_source source;
+} cache_map_entry;
+
+// Which LibrariesCache files and ras3 JWTs belong to which library, worked out on first use after each scan. A removal
+// only deletes the entries of the libraries it removes, so Kontakt keeps its warm cache for every other one.
+typedef struct {
+    arena arena;
+    cache_map_entry* entries;
+    int count;
+    int capacity;
+    int files[CACHE_SOURCE_COUNT];
+    int owned[CACHE_SOURCE_COUNT];  // Files of each source that mention at least one library
+    BOOL built;
+} cache_map;
+
+static cache_map CACHE_MAP;
+
+// Names and SNPIDs of every library, looked up by the runs of text found in cache files
+typedef struct {
+    const char* token;
+    const char* owner;
+} cache_token;
+
+typedef struct {
+    cache_token* slots;
+    unsigned int mask;
+} cache_token_table;
+
+typedef struct {
+    const char* owner;
+    BOOL shared;
+} cache_match;
+
+void cache_token_insert(cache_token_table* table, const char* token, const char* owner) {
+    unsigned int slot = hash_string(token) & table->mask;
+    while (table->slots[slot].token) {
+        if (_STREQ(table->slots[slot].token, token))
+            return;
+        slot = (slot + 1) & table->mask;
+    }
+    table->slots[slot].token = token;
+    table->slots[slot].owner = owner;
+}
+
+const char* cache_token_find(const cache_token_table* table, const char* token, size_t len) {
+    for (unsigned int slot = hash_bytes(token, len) & table->mask; table->slots[slot].token;
+         slot = (slot + 1) & table->mask) {
+        const char* candidate = table->slots[slot].token;
+        if (strncmp(candidate, token, len) == 0 && candidate[len] == '\0')
+            return table->slots[slot].owner;
+    }
+    return NULL;
+}
+
+// Allocates an empty table in `a` that stays at most half full with `tokens` entries
+BOOL cache_token_table_init(cache_token_table* table, arena* a, int tokens) {
+    unsigned int capacity = 64;
+    while (capacity < (unsigned int)tokens * 2)
+        capacity *= 2;
+
+    table->slots = (cache_token*)arena_alloc(a, capacity * sizeof(cache_token));
+    table->mask  = capacity - 1;
+    if (!table->slots)
+        return FALSE;
+    memset(table->slots, 0, capacity * sizeof(cache_token));
+    return TRUE;
+}
+
+BOOL cache_token_table_build(cache_token_table* table, arena* a) {
+    if (!cache_token_table_init(table, a, LIB_COUNT * 2))
+        return FALSE;
+
+    for (int i = 0; i < LIB_COUNT; i++) {
+        cache_token_insert(table, LIBRARIES[i].name, LIBRARIES[i].name);
+        if (LIBRARIES[i].snpid && strlen(LIBRARIES[i].snpid) >= _CACHE_TOKEN_MIN)
+            cache_token_insert(table, LIBRARIES[i].snpid, LIBRARIES[i].name);
+    }
+    return TRUE;
+}
+
+// Looks up a run of text whole and without its first character, which may be a length prefix that happens to be
+// printable
+void cache_match_run(const cache_token_table* table, const char* run, size_t len, cache_match* match) {
+    for (size_t skip = 0; skip < 2 && len >= _CACHE_TOKEN_MIN + skip; skip++) {
+        const char* owner = cache_token_find(table, run + skip, len - skip);
+        if (!owner)
+            continue;
+
+        if (!match->owner)
+            match->owner = owner;
+        else if (match->owner != owner)
+            match->shared = TRUE;
+        return;
+    }
+}
+
+// Text runs end at control characters and quotes, so JSON string values come out on their own
+BOOL is_cache_text(unsigned int c) {
+    return c >= 0x20 && c != 0x7F && c != '"' && (c < 0xD800 || c > 0xDFFF);
+}
+
+// Matches every run of single-byte (ASCII or UTF-8) text in `data`
+void cache_match_narrow(const cache_token_table* table, const BYTE* data, size_t size, cache_match* match) {
+    size_t start = 0;
+    for (size_t i = 0; i <= size; i++) {
+        if (i < size && is_cache_text(data[i]))
+            continue;
+        if (i - start < _CACHE_TOKEN_MAX)
+            cache_match_run(table, (const char*)data + start, i - start, match);
+        start = i + 1;
+    }
+}
+
+// Matches every run of UTF-16LE text in `data`, at both byte alignments
+void cache_match_wide(const cache_token_table* table, const BYTE* data, size_t size, cache_match* match) {
+    char token[_CACHE_TOKEN_MAX];
+    for (size_t offset = 0; offset < 2; offset++) {
+        const size_t units = size > offset ? (size - offset) / 2 : 0;
+        const BYTE* base   = data + offset;
+        size_t start       = 0;
+
+        for (size_t i = 0; i <= units; i++) {
+            const unsigned int c = i < units ? base[i * 2] | (base[i * 2 + 1] << 8) : 0;
+            if (i < units && is_cache_text(c))
+                continue;
+
+            const size_t len = i - start;
+            if (len >= _CACHE_TOKEN_MIN && len <= _MAX_KEY_LENGTH) {
+                wchar_t run[_MAX_KEY_LENGTH];
+                memcpy(run, base + start * 2, len * sizeof(wchar_t));
+                const int written =
+                  WideCharToMultiByte(CP_UTF8, 0, run, (int)len, token, _CACHE_TOKEN_MAX - 1, NULL, NULL);
+                if (written > 0)
+                    cache_match_run(table, token, (size_t)written, match);
+            }
+            start = i + 1;
+        }
+    }
+}
+
+// Decodes base64url (or plain base64) until the first character that isn't part of it, returning the bytes written
+size_t base64url_decode(const char* in, size_t len, BYTE* out) {
+    DWORD bits  = 0;
+    int pending = 0;
+    size_t n    = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        const char c = in[i];
+        DWORD value;
+        if (c >= 'A' && c <= 'Z')
+            value = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            value = c - '0' + 52;
+        else if (c == '-' || c == '+')
+            value = 62;
+        else if (c == '_' || c == '/')
+            value = 63;
+        else
+            break;
+
+        bits = (bits << 6) | value;
+        pending += 6;
+        if (pending >= 8) {
+            pending -= 8;
+            out[n++] = (BYTE)(bits >> pending);
+        }
+    }
+
+    return n;
+}
+
+// Works out which library a cache file belongs to from its header. A JWT's payload is decoded first, since the
+// product it licenses is only named inside the base64.
+void cache_map_identify(const cache_token_table* table, const wpath* path, BOOL jwt, BYTE* buffer, cache_match* match) {
+    const HANDLE h_file = CreateFileW(path->text,
+                                      GENERIC_READ,
+                                      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                      NULL,
+                                      OPEN_EXISTING,
+                                      FILE_FLAG_SEQUENTIAL_SCAN,
+                                      NULL);
+    if (h_file == INVALID_HANDLE_VALUE) {
+        _VERBOSE("Failed to read cache file: '%ls' (Error: %lu)", wpath_plain(path), GetLastError());
+        return;
+    }
+
+    DWORD read = 0;
+    const BOOL ok = ReadFile(h_file, buffer, jwt ? _CACHE_JWT_MAX_SIZE : _CACHE_HEADER_SIZE, &read, NULL);
+    CloseHandle(h_file);
+    if (!ok)
+        return;
+
+    if (jwt) {
+        // header.payload.signature. The payload is decoded in place, since its bytes never outrun the text.
+        char* text    = (char*)buffer;
+        char* payload = (char*)memchr(text, '.', read);
+        char* end     = payload ? (char*)memchr(payload + 1, '.', read - (payload + 1 - text)) : NULL;
+        if (end) {
+            const size_t size = base64url_decode(payload + 1, end - payload - 1, (BYTE*)payload + 1);
+            cache_match_narrow(table, (const BYTE*)payload + 1, size, match);
+            return;
+        }
+    }
+
+    cache_match_narrow(table, buffer, read, match);
+    if (!match->shared)
+        cache_match_wide(table, buffer, read, match);
+}
+
+void cache_map_reset(void) {
+    arena_reset(&CACHE_MAP.arena);
+    CACHE_MAP.entries  = NULL;
+    CACHE_MAP.count    = 0;
+    CACHE_MAP.capacity = 0;
+    ZeroMemory(CACHE_MAP.files, sizeof(CACHE_MAP.files));
+    ZeroMemory(CACHE_MAP.owned, sizeof(CACHE_MAP.owned));
+    CACHE_MAP.built = FALSE;
+}
+
+void cache_map_add_dir(const cache_token_table* table, const wpath* directory, cache_source source, BYTE* buffer) {
+    const wpath* pattern = directory ? wpath_join(scratch_arena(), directory, L"*", 1) : NULL;
+    if (!pattern)
+        return;
+
+    WIN32_FIND_DATAW find_data;
+    const HANDLE h_find = FindFirstFileExW(
+      pattern->text, FindExInfoBasic, &find_data, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    if (h_find == INVALID_HANDLE_VALUE)
+        return;
+
+    do {
+        if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            continue;
+
+        if (CACHE_MAP.count == CACHE_MAP.capacity) {
+            const int new_capacity = CACHE_MAP.capacity ? CACHE_MAP.capacity * 2 : 64;
+            cache_map_entry* grown =
+              (cache_map_entry*)arena_alloc(&CACHE_MAP.arena, new_capacity * sizeof(cache_map_entry));
+            if (!grown)
+                break;
+            if (CACHE_MAP.count > 0)
+                memcpy(grown, CACHE_MAP.entries, CACHE_MAP.count * sizeof(cache_map_entry));
+            CACHE_MAP.entries  = grown;
+            CACHE_MAP.capacity = new_capacity;
+        }
+
+        const wpath* path = wpath_join(&CACHE_MAP.arena, directory, find_data.cFileName, wcslen(find_data.cFileName));
+        if (!path)
+            break;
+
+        // Some files are named after their library, which is checked before their contents
+        const wchar_t* extension = PathFindExtensionW(find_data.cFileName);
+        char stem[_CACHE_TOKEN_MAX];
+        const int stem_len = WideCharToMultiByte(
+          CP_UTF8, 0, find_data.cFileName, (int)(extension - find_data.cFileName), stem, sizeof(stem), NULL, NULL);
+
+        cache_match match = {0};
+        if (stem_len > 0)
+            cache_match_run(table, stem, (size_t)stem_len, &match);
+
+        const BOOL jwt = source == CACHE_SOURCE_RAS3 && _wcsicmp(extension, L".jwt") == 0;
+        cache_map_identify(table, path, jwt, buffer, &match);
+
+        cache_map_entry* entry = &CACHE_MAP.entries[CACHE_MAP.count++];
+        entry->path            = path;
+        entry->owner           = match.owner && !match.shared ? arena_strdup(&CACHE_MAP.arena, match.owner) : NULL;
+        entry->shared          = match.shared;
+        entry->size            = ((ULONGLONG)find_data.nFileSizeHigh << 32) | find_data.nFileSizeLow;
+        entry->source          = source;
+
+        CACHE_MAP.files[source]++;
+        if (match.owner)
+            CACHE_MAP.owned[source]++;
+        _VERBOSE("Mapped cache file '%ls' to: %s",
+                 wpath_plain(path),
+                 match.shared ? "several libraries" : (match.owner ? match.owner : "no library"));
+    } while (FindNextFileW(h_find, &find_data));
+    FindClose(h_find);
+}
+
+// Builds the cache map if it isn't built for the current library table yet
+BOOL cache_map_ensure(void) {
+    if (CACHE_MAP.built)
+        return TRUE;
+
+    const LONGLONG start  = query_ticks();
+    arena* scratch        = scratch_arena();
+    const arena_mark mark = arena_save(scratch);
+
+    cache_token_table table;
+    BYTE* buffer = (BYTE*)arena_alloc(scratch, _CACHE_JWT_MAX_SIZE);
+    if (!buffer || !cache_token_table_build(&table, scratch)) {
+        _ERROR("Failed to allocate memory for the cache map");
+        arena_rewind(scratch, mark);
+        return FALSE;
+    }
+
+    cache_map_reset();
+    cache_map_add_dir(&table, PATHS.libraries_cache, CACHE_SOURCE_LIBRARIES_CACHE, buffer);
+    cache_map_add_dir(&table, PATHS.ras3, CACHE_SOURCE_RAS3, buffer);
+    CACHE_MAP.built = TRUE;
+
+    arena_rewind(scratch, mark);
+    _INFO("Mapped %d of %d cache file(s) to libraries in %.2f ms",
+          CACHE_MAP.owned[CACHE_SOURCE_LIBRARIES_CACHE] + CACHE_MAP.owned[CACHE_SOURCE_RAS3],
+          CACHE_MAP.count,
+          ticks_to_ms(query_ticks() - start));
+    return TRUE;
+}
+
+// Whether none of a source's files could be matched to a library. Its format isn't one the map recognises, so
+// removals go back to deleting all of it.
+BOOL cache_map_unrecognised(cache_source source) {
+    return CACHE_MAP.files[source] > 0 && CACHE_MAP.owned[source] == 0;
+}
+
+// Whether removing the libraries in `libraries` whose `removed` entry is set (all of them if `removed` is NULL)
+// deletes `entry`. Files shared with another library go as well, so no removed library lingers in them.
+BOOL cache_map_selects(const cache_map_entry* entry,
+                       const library_entry* libraries[],
+                       const BOOL removed[],
+                       int count) {
+    if (entry->shared || cache_map_unrecognised(entry->source))
+        return TRUE;
+    if (!entry->owner)
+        return FALSE;
+
+    for (int i = 0; i < count; i++) {
+        if ((!removed || removed[i]) && _STREQ(libraries[i]->name, entry->owner))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// Opens the library key in both registry views and lists their subkeys in one pass, merged by name into `keys`. The
+// keys stay open in `view_keys` while entries are read and are closed with close_registry_views. Returns -1 if neither
+// view could be opened.
+int open_library_views(arena* a, HKEY view_keys[], registry_key_info** keys) {
+    registry_key_info* view_lists[_REGISTRY_VIEW_COUNT] = {0};
+    int view_counts[_REGISTRY_VIEW_COUNT]               = {0};
+    int views_opened                                    = 0;
+
+    for (int view = 0; view < _REGISTRY_VIEW_COUNT; view++) {
+        const LSTATUS status =
+          open_registry_key(_LIBRARY_REGISTRY_PATH, KEY_READ | REGISTRY_VIEWS[view].sam, FALSE, &view_keys[view]);
+        if (status != ERROR_SUCCESS) {
+            view_keys[view] = NULL;
+            continue;
+        }
+
+        view_counts[view] = enumerate_registry_keys(view_keys[view], (BYTE)(1 << view), a, &view_lists[view]);
+        views_opened++;
+    }
+
+    if (views_opened == 0) {
+        _ERROR("Failed to open registry key: 'HKEY_LOCAL_MACHINE\\%s'", _LIBRARY_REGISTRY_PATH);
+        return -1;
+    }
+
+    return merge_registry_keys(a, view_lists, view_counts, _REGISTRY_VIEW_COUNT, keys);
+}
+
+// Scans both registry views for libraries. Only keys that are new or whose last-write time changed since the previous
+// scan are read again, and the listbox is patched rather than rebuilt.
+BOOL scan_registry_libraries(void) {
+    // Releases temporaries from before this scan; the library table lives in LIBRARY_ARENA
+    strpool_reset();
+
+    if (!load_exclusions())
+        return FALSE;
+
+    arena* scratch        = scratch_arena();
+    const arena_mark mark = arena_save(scratch);
+
+    HKEY view_keys[_REGISTRY_VIEW_COUNT] = {0};
+    registry_key_info* keys              = NULL;
+    const int key_count                  = open_library_views(scratch, view_keys, &keys);
+    if (key_count < 0) {
+        arena_rewind(scratch, mark);
+        return FALSE;
+    }
+
+    library_entry* next = (library_entry*)arena_alloc(scratch, (key_count + 1) * sizeof(library_entry));
+    BOOL* seen          = (BOOL*)arena_alloc(scratch, (LIB_COUNT + 1) * sizeof(BOOL));
+    if (!next || !seen) {
+        _ERROR("Failed to allocate memory for querying libraries");
+        close_registry_views(view_keys);
+        arena_rewind(scratch, mark);
+        return FALSE;
+    }
+    memset(seen, 0, (LIB_COUNT + 1) * sizeof(BOOL));
+
+    int count  = 0;
+    int reread = 0;
+
+    for (int i = 0; i < key_count; i++) {
+        const registry_key_info* info = &keys[i];
+
+        if (is_excluded_key(info->name))
+            continue;
+
+        const library_entry* existing = find_library(info->name);
+        const int existing_index      = existing ? (int)(existing - LIBRARIES) : -1;
+
+        if (existing && existing->views == info->views &&
+            CompareFileTime(&existing->last_write, &info->last_write) == 0) {
+            seen[existing_index] = TRUE;
+            next[count++]        = *existing;
+            continue;
+        }
+
+        _BENCH_SAMPLE_BEGIN();
+        const char* name = existing ? existing->name : arena_strdup(&LIBRARY_ARENA, info->name);
+        const BOOL read  = name && read_library_entry(&LIBRARY_ARENA, view_keys, info, name, &next[count]);
+        _BENCH_SAMPLE_END();
+        if (!read)
+            continue;
+
+        if (existing) {
+            seen[existing_index] = TRUE;
+            LIB_STALE_COUNT++;
+        }
+        count++;
+        reread++;
+    }
+
+    close_registry_views(view_keys);
+
+    int removed = 0;
+    for (int i = 0; i < LIB_COUNT; i++) {
+        if (!seen[i])
+            removed++;
+    }
+    LIB_STALE_COUNT += removed;
+
+    // Resolved before the table changes; the string itself stays put until compaction
+    const char* selected_name = SELECTED_INDEX >= 0 && SELECTED_INDEX < LIB_COUNT ? LIBRARIES[SELECTED_INDEX].name
+                                                                                  : NULL;
+
+    const BOOL stored = set_libraries(next, count);
+    arena_rewind(scratch, mark);
+
+    if (!stored) {
+        _ERROR("Failed to allocate memory for library table");
+        return FALSE;
+    }
+
+    const library_entry* selected = selected_name ? find_library(selected_name) : NULL;
+    SELECTED_INDEX                = selected ? (int)(selected - LIBRARIES) : -1;
+
+    if (LIB_STALE_COUNT > max(LIB_COUNT, 64) && !compact_libraries())
+        _WARN("Failed to compact library table");
+
+    // Cache files are matched against the new table the next time a removal needs them
+    cache_map_reset();
+
+    // There's no list when running headless. The list view only holds the row count, so nothing is inserted.
+    if (H_LIBRARY_LIST)
+        refresh_library_list();
+
+    _INFO("Finished querying registry entries (found %d library entries, %d read, %d removed)",
+          LIB_COUNT,
+          reread,
+          removed);
+
+    // Sizes are only shown in the window, so there's nothing to measure when running headless
+    if (H_LIBRARY_LIST)
+        size_index_start(GetParent(H_LIBRARY_LIST));
+
+    return TRUE;
+}
+
+BOOL scan_libraries(void) {
+    stats_operation stats;
+    stats_begin(&stats, "scan");
+    const BOOL scanned = scan_registry_libraries();
+    stats_time_scope(STAT_SCOPE_SCAN, stats.start);
+    stats_end(&stats, scanned);
+    return scanned;
+}
+
+#define _SCAN_BATCH_MS 50  // How often a streaming scan hands what it has found so far to the UI thread
+
+// The first scan, run on a worker so the window shows while libraries are still being read. The table starts empty, so
+// every key is read and nothing is compared. Entries and their strings go into the job's own arena, since
+// LIBRARY_ARENA belongs to the UI thread, and are handed over through `completed` every _SCAN_BATCH_MS. The UI thread
+// picks them up with take_scanned_libraries as WM_WORKER_PROGRESS arrives.
+BOOL stream_registry_libraries(worker_job* job) {
+    if (!load_exclusions())
+        return FALSE;
+
+    arena* scratch        = scratch_arena();
+    const arena_mark mark = arena_save(scratch);
+
+    HKEY view_keys[_REGISTRY_VIEW_COUNT] = {0};
+    registry_key_info* keys              = NULL;
+    const int key_count                  = open_library_views(scratch, view_keys, &keys);
+    if (key_count < 0) {
+        arena_rewind(scratch, mark);
+        return FALSE;
+    }
+
+    job->scan_entries = (library_entry*)arena_alloc(&job->scan_arena, (key_count + 1) * sizeof(library_entry));
+    if (!job->scan_entries) {
+        _ERROR("Failed to allocate memory for querying libraries");
+        close_registry_views(view_keys);
+        arena_rewind(scratch, mark);
+        return FALSE;
+    }
+
+    LONG found         = 0;
+    LONGLONG handed_at = query_ticks();
+
+    for (int i = 0; i < key_count && !worker_is_cancelled(job); i++) {
+        const registry_key_info* info = &keys[i];
+        if (is_excluded_key(info->name))
+            continue;
+
+        const char* name = arena_strdup(&job->scan_arena, info->name);
+        if (!name || !read_library_entry(&job->scan_arena, view_keys, info, name, &job->scan_entries[found]))
+            continue;
+        found++;
+
+        // The first library is shown as soon as it's read, so the list fills in from the start
+        if (found == 1 || ticks_to_ms(query_ticks() - handed_at) >= _SCAN_BATCH_MS) {
+            worker_set_progress(job, found);
+            handed_at = query_ticks();
+        }
+    }
+
+    close_registry_views(view_keys);
+    arena_rewind(scratch, mark);
+
+    // The rest is taken when the job finishes
+    InterlockedExchange(&job->completed, found);
+
+    if (worker_is_cancelled(job))
+        return FALSE;
+
+    _INFO("Finished querying registry entries (found %d library entries)", found);
+    return TRUE;
+}
+
+BOOL stream_libraries(worker_job* job) {
+    stats_operation stats;
+    stats_begin(&stats, "scan");
+    const BOOL scanned = stream_registry_libraries(job);
+    stats_time_scope(STAT_SCOPE_SCAN, stats.start);
+    stats_end(&stats, scanned);
+    return scanned;
+}
+
+// Appends the entries a streaming scan has handed over since the last call to the library table, copying their
+// strings into LIBRARY_ARENA, and shows them. Only called from the UI thread.
+BOOL take_scanned_libraries(worker_job* job) {
+    const int ready = (int)InterlockedCompareExchange(&job->completed, 0, 0);
+    if (ready <= job->scan_taken)
+        return TRUE;
+
+    arena* scratch        = scratch_arena();
+    const arena_mark mark = arena_save(scratch);
+    const int count       = LIB_COUNT + ready - job->scan_taken;
+    library_entry* next   = (library_entry*)arena_alloc(scratch, count * sizeof(library_entry));
+    BOOL success          = next != NULL;
+
+    if (success && LIB_COUNT > 0)
+        memcpy(next, LIBRARIES, LIB_COUNT * sizeof(library_entry));
+
+    for (int i = job->scan_taken, n = LIB_COUNT; success && i < ready; i++, n++) {
+        const library_entry* found = &job->scan_entries[i];
+        next[n]                    = *found;
+        next[n].name               = arena_strdup(&LIBRARY_ARENA, found->name);
+        if (found->content_dir)
+            next[n].content_dir = arena_strdup(&LIBRARY_ARENA, found->content_dir);
+        if (found->snpid)
+            next[n].snpid = arena_strdup(&LIBRARY_ARENA, found->snpid);
+        success = next[n].name && (!found->content_dir || next[n].content_dir) && (!found->snpid || next[n].snpid);
+    }
+
+    success = success && set_libraries(next, count);
+    arena_rewind(scratch, mark);
+
+    if (!success) {
+        _ERROR("Failed to allocate memory for library table");
+        return FALSE;
+    }
+
+    job->scan_taken = ready;
+    if (H_LIBRARY_LIST)
+        refresh_library_list();
+    return TRUE;
+}
+
+BOOL query_libraries(HWND hwnd) {
+    if (!scan_libraries())
+        return FALSE;
+
+    if (INITIAL_SEARCH) {
+        INITIAL_SEARCH = FALSE;
+    } else {
+        MessageBox(hwnd,
+                   strpool_sprintf("Found %d installed libraries", LIB_COUNT),
+                   "K8-LRT",
+                   MB_OK | MB_ICONINFORMATION);
+    }
+
+    return TRUE;
+}
+
+#define _BACKUP_ROOT "K8-LRT.backups"
+#define _BACKUP_OBJECTS _BACKUP_ROOT "\\objects"
+#define _BACKUP_SNAPSHOTS _BACKUP_ROOT "\\snapshots"
+#define _BACKUP_HIVE_TEMP _BACKUP_ROOT "\\hive.tmp"
+#define _SNAPSHOT_MAGIC "K8LRT-SNAPSHOT 1"
+#define _SNAPSHOT_EXT ".k8snap"
+#define _SNAPSHOT_LINE_MAX (MAX_PATH * 2)
+#define _HASH_HEX_LEN 64
+#define _RAW_OBJECT_PREFIX "r-"  // Uncompressed objects moved or cloned into the store; not named by content
+#define _CLONE_CHUNK_SIZE (1ull << 30)
+#define _BACKUP_MAX_FILE_SIZE (1024ull * 1024 * 1024)  // Everything we back up is read into memory in one piece
+
+typedef enum {
+    SNAPSHOT_FILE,
+    SNAPSHOT_HIVE,
+} snapshot_entry_kind;
+
+typedef struct {
+    snapshot_entry_kind kind;
+    char hash[_HASH_HEX_LEN + 1];  // Object id: the content hash, or a _RAW_OBJECT_PREFIX name
+    ULONGLONG size;
+    ULONGLONG mtime;
+    const char* path;  // File path, or registry key path below HKEY_LOCAL_MACHINE
+} snapshot_entry;
+
+// A snapshot records everything one removal deletes. File contents and saved registry hives go into a shared
+// object store under K8-LRT.backups\objects, compressed and named by the SHA-256 of their contents, so a cache file
+// that is backed up again unchanged costs nothing. The manifest in K8-LRT.backups\snapshots lists the original
+// location of each object and is appended to as the removal goes, so it stays usable after a crash.
+typedef struct {
+    arena arena;
+    FILE* manifest;
+    char name[32];
+    char manifest_path[MAX_PATH];
+    BCRYPT_ALG_HANDLE sha256;
+    COMPRESSOR_HANDLE compressor;
+
+    // Files on the same volume as the object store are moved there (or block cloned where the file system supports
+    // it) instead of being read and compressed. The volume of the last directory seen is cached since files are
+    // taken a directory at a time.
+    BOOL store_volume_known;
+    DWORD store_serial;
+    const wpath* volume_dir;
+    DWORD volume_serial;
+    DWORD volume_flags;
+    DWORD cluster_size;
+    int raw_count;
+    int moved;
+    int cloned;
+
+    // File entries of the most recent earlier snapshot, sorted by path. Files whose size and last write time still
+    // match reuse the recorded object without being read again.
+    snapshot_entry* previous;
+    size_t previous_count;
+
+    int entry_count;
+    int deduped;
+    ULONGLONG bytes_in;
+    ULONGLONG bytes_stored;
+} backup_snapshot;
+
+BOOL ensure_directory(const char* path) {
+    return CreateDirectoryA(path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+// Serial number, file system flags and cluster size of the volume holding `path`. `flags` and `cluster_size` may be
+// NULL.
+BOOL query_volume(const wchar_t* path, DWORD* serial, DWORD* flags, DWORD* cluster_size) {
+    wchar_t volume_root[MAX_PATH];
+    if (!GetVolumePathNameW(path, volume_root, MAX_PATH))
+        return FALSE;
+
+    DWORD fs_flags = 0;
+    if (!GetVolumeInformationW(volume_root, NULL, 0, serial, NULL, &fs_flags, NULL, 0))
+        return FALSE;
+    if (flags)
+        *flags = fs_flags;
+
+    if (cluster_size) {
+        DWORD sectors_per_cluster, bytes_per_sector, free_clusters, total_clusters;
+        if (!GetDiskFreeSpaceW(volume_root, &sectors_per_cluster, &bytes_per_sector, &free_clusters, &total_clusters))
+            return FALSE;
+        *cluster_size = sectors_per_cluster * bytes_per_sector;
+    }
+
+    return TRUE;
+}
+
+// Reads a whole file into a malloc'd buffer
+BYTE* read_file_contents(const wchar_t* path, DWORD* size) {
+    if (!path)
+        return NULL;
+
+    const HANDLE h_file =
+      CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (h_file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(h_file, &file_size) || (ULONGLONG)file_size.QuadPart > _BACKUP_MAX_FILE_SIZE) {
+        CloseHandle(h_file);
+        return NULL;
+    }
+
+    const DWORD length = (DWORD)file_size.QuadPart;
+    BYTE* data         = (BYTE*)malloc(length ? length : 1);
+    DWORD read         = 0;
+    if (!data || (length > 0 && (!ReadFile(h_file, data, length, &read, NULL) || read != length))) {
+        free(data);
+        CloseHandle(h_file);
+        return NULL;
+    }
+
+    CloseHandle(h_file);
+    *size = length;
+    return data;
+}
+
+// Writes `data` to `path` through a temporary file so a partially written file never replaces a good one
+BOOL write_file_contents(const wchar_t* path, const BYTE* data, DWORD size) {
+    const wchar_t* tmp_path = path ? strpool_wsprintf(L"%s.tmp", path) : NULL;
+    if (!tmp_path)
+        return FALSE;
+
+    const HANDLE h_file = CreateFileW(tmp_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h_file == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    DWORD written    = 0;
+    const BOOL wrote = size == 0 || (WriteFile(h_file, data, size, &written, NULL) && written == size);
+    CloseHandle(h_file);
+
+    if (!wrote || !MoveFileExW(tmp_path, path, MOVEFILE_REPLACE_EXISTING)) {
+        DeleteFileW(tmp_path);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+BOOL hash_contents(BCRYPT_ALG_HANDLE sha256, const BYTE* data, DWORD size, char hex[_HASH_HEX_LEN + 1]) {
+    BCRYPT_HASH_HANDLE h_hash;
+    if (!BCRYPT_SUCCESS(BCryptCreateHash(sha256, &h_hash, NULL, 0, NULL, 0, 0)))
+        return FALSE;
+
+    BYTE digest[32];
+    const BOOL hashed = BCRYPT_SUCCESS(BCryptHashData(h_hash, (PUCHAR)data, size, 0)) &&
+                        BCRYPT_SUCCESS(BCryptFinishHash(h_hash, digest, sizeof(digest), 0));
+    BCryptDestroyHash(h_hash);
+    if (!hashed)
+        return FALSE;
+
+    for (int i = 0; i < 32; i++)
+        snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    return TRUE;
+}
+
+char* backup_object_path(const char* hash) {
+    return strpool_sprintf("%s\\%.2s\\%s", _BACKUP_OBJECTS, hash, hash);
+}
+
+// Adds `data` to the object store unless an object with the same contents is already there
+BOOL store_object(backup_snapshot* snapshot, const BYTE* data, DWORD size, char hash[_HASH_HEX_LEN + 1]) {
+    if (!hash_contents(snapshot->sha256, data, size, hash)) {
+        _ERROR("Failed to hash backup contents");
+        return FALSE;
+    }
+
+    snapshot->bytes_in += size;
+    const char* object_path = backup_object_path(hash);
+    if (file_exists(object_path)) {
+        snapshot->deduped++;
+        return TRUE;
+    }
+
+    if (!ensure_directory(strpool_sprintf("%s\\%.2s", _BACKUP_OBJECTS, hash)))
+        return FALSE;
+
+    // The compressor doesn't take empty input; an empty object stands for an empty file
+    if (size == 0)
+        return write_file_contents(make_long_path(object_path), data, 0);
+
+    SIZE_T compressed_size = 0;
+    if (!Compress(snapshot->compressor, data, size, NULL, 0, &compressed_size) &&
+        GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+        _ERROR("Failed to compress backup contents (Error: %lu)", GetLastError());
+        return FALSE;
+    }
+
+    BYTE* compressed = (BYTE*)malloc(compressed_size);
+    if (!compressed)
+        return FALSE;
+
+    BOOL stored = Compress(snapshot->compressor, data, size, compressed, compressed_size, &compressed_size);
+    if (stored)
+        stored = write_file_contents(make_long_path(object_path), compressed, (DWORD)compressed_size);
+    free(compressed);
+
+    if (!stored) {
+        _ERROR("Failed to write backup object: '%s'", object_path);
+        return FALSE;
+    }
+
+    snapshot->bytes_stored += compressed_size;
+    return TRUE;
+}
+
+// Reads and decompresses an object. Returns a malloc'd buffer.
+BYTE* load_object(DECOMPRESSOR_HANDLE decompressor, const char* hash, DWORD* size) {
+    DWORD compressed_size = 0;
+    BYTE* compressed      = read_file_contents(make_long_path(backup_object_path(hash)), &compressed_size);
+    if (!compressed)
+        return NULL;
+    if (compressed_size == 0) {
+        *size = 0;
+        return compressed;
+    }
+
+    SIZE_T length = 0;
+    if (!Decompress(decompressor, compressed, compressed_size, NULL, 0, &length) &&
+        GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+        free(compressed);
+        return NULL;
+    }
+
+    BYTE* data = (BYTE*)malloc(length ? length : 1);
+    if (!data || !Decompress(decompressor, compressed, compressed_size, data, length, &length)) {
+        free(data);
+        free(compressed);
+        return NULL;
+    }
+
+    free(compressed);
+    *size = (DWORD)length;
+    return data;
+}
+
+int compare_snapshot_entries(const void* a, const void* b) {
+    return _stricmp(((const snapshot_entry*)a)->path, ((const snapshot_entry*)b)->path);
+}
+
+// Parses a manifest into `entries` (allocated from `entry_arena`). Returns FALSE if the file isn't a snapshot.
+BOOL read_snapshot(const char* path, arena* entry_arena, snapshot_entry** entries, size_t* count) {
+    // `path` is UTF-8, which the narrow CRT functions would read as the ANSI code page
+    const wchar_t* wide_path = utf8_to_wide(path);
+    FILE* file               = NULL;
+    if (!wide_path || _wfopen_s(&file, wide_path, L"r") != 0)
+        return FALSE;
+
+    char line[_SNAPSHOT_LINE_MAX];
+    BOOL valid = FALSE;
+    if (fgets(line, sizeof(line), file)) {
+        strip_newline(line);
+        valid = _STREQ(line, _SNAPSHOT_MAGIC);
+    }
+
+    size_t capacity = 0;
+    *entries        = NULL;
+    *count          = 0;
+    while (valid && fgets(line, sizeof(line), file)) {
+        strip_newline(line);
+
+        snapshot_entry entry    = {0};
+        char kind[8]            = {0};
+        unsigned long long size = 0, mtime = 0;
+        const char* path        = tab_field(line, 4);
+        if (sscanf_s(line,
+                     "%7s\t%64s\t%llu\t%llu",
+                     kind,
+                     (unsigned)sizeof(kind),
+                     entry.hash,
+                     (unsigned)sizeof(entry.hash),
+                     &size,
+                     &mtime) < 4 ||
+            !path)
+            continue;
+
+        if (_STREQ(kind, "file"))
+            entry.kind = SNAPSHOT_FILE;
+        else if (_STREQ(kind, "hive"))
+            entry.kind = SNAPSHOT_HIVE;
+        else
+            continue;
+
+        if (*count == capacity) {
+            const size_t new_capacity = capacity ? capacity * 2 : 64;
+            snapshot_entry* grown     = (snapshot_entry*)arena_alloc(entry_arena, new_capacity * sizeof(*grown));
+            if (!grown)
+                break;
+            if (*count > 0)
+                memcpy(grown, *entries, *count * sizeof(*grown));
+            *entries = grown;
+            capacity = new_capacity;
+        }
+
+        entry.size             = size;
+        entry.mtime            = mtime;
+        entry.path             = arena_strdup(entry_arena, path);
+        (*entries)[(*count)++] = entry;
+    }
+
+    fclose(file);
+    return valid;
+}
+
+// Path of the newest manifest in the snapshot directory, or NULL if there are none. Names sort by creation time.
+char* find_latest_snapshot(void) {
+    WIN32_FIND_DATAA find_data;
+    const HANDLE h_find = FindFirstFileA(_BACKUP_SNAPSHOTS "\\*" _SNAPSHOT_EXT, &find_data);
+    if (h_find == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    char latest[MAX_PATH] = {0};
+    do {
+        if (strcmp(find_data.cFileName, latest) > 0)
+            StringCchCopyA(latest, MAX_PATH, find_data.cFileName);
+    } while (FindNextFileA(h_find, &find_data));
+    FindClose(h_find);
+
+    return strpool_sprintf("%s\\%s", _BACKUP_SNAPSHOTS, latest);
+}
+
+void snapshot_close(backup_snapshot* snapshot) {
+    if (snapshot->manifest) {
+        fclose(snapshot->manifest);
+        snapshot->manifest = NULL;
+
+        // A snapshot that didn't capture anything isn't worth keeping around
+        if (snapshot->entry_count == 0)
+            DeleteFileA(snapshot->manifest_path);
+    }
+
+    if (snapshot->compressor)
+        CloseCompressor(snapshot->compressor);
+    if (snapshot->sha256)
+        BCryptCloseAlgorithmProvider(snapshot->sha256, 0);
+    arena_destroy(&snapshot->arena);
+
+    snapshot->compressor = NULL;
+    snapshot->sha256     = NULL;
+}
+
+BOOL snapshot_begin(backup_snapshot* snapshot) {
+    ZeroMemory(snapshot, sizeof(*snapshot));
+
+    if (!ensure_directory(_BACKUP_ROOT) || !ensure_directory(_BACKUP_OBJECTS) || !ensure_directory(_BACKUP_SNAPSHOTS)) {
+        _ERROR("Failed to create backup directory: '%s'", _BACKUP_ROOT);
+        return FALSE;
+    }
+
+    if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&snapshot->sha256, BCRYPT_SHA256_ALGORITHM, NULL, 0))) {
+        _ERROR("Failed to open SHA-256 provider");
+        snapshot->sha256 = NULL;
+        return FALSE;
+    }
+
+    if (!CreateCompressor(COMPRESS_ALGORITHM_XPRESS_HUFF, NULL, &snapshot->compressor)) {
+        _ERROR("Failed to create compressor (Error: %lu)", GetLastError());
+        snapshot->compressor = NULL;
+        snapshot_close(snapshot);
+        return FALSE;
+    }
+
+    const char* latest = find_latest_snapshot();
+    if (latest && read_snapshot(latest, &snapshot->arena, &snapshot->previous, &snapshot->previous_count)) {
+        if (snapshot->previous_count > 0)
+            qsort(snapshot->previous, snapshot->previous_count, sizeof(snapshot_entry), compare_snapshot_entries);
+    }
+
+    snapshot->store_volume_known = query_volume(make_long_path(_BACKUP_OBJECTS), &snapshot->store_serial, NULL, NULL);
+
+    SYSTEMTIME st;
+    GetLocalTime(&st);
+    StringCchPrintfA(snapshot->name,
+                     sizeof(snapshot->name),
+                     "%04d%02d%02d-%02d%02d%02d-%03d",
+                     st.wYear,
+                     st.wMonth,
+                     st.wDay,
+                     st.wHour,
+                     st.wMinute,
+                     st.wSecond,
+                     st.wMilliseconds);
+    StringCchPrintfA(snapshot->manifest_path, MAX_PATH, "%s\\%s%s", _BACKUP_SNAPSHOTS, snapshot->name, _SNAPSHOT_EXT);
+
+    if (fopen_s(&snapshot->manifest, snapshot->manifest_path, "w") != 0) {
+        _ERROR("Failed to create backup snapshot: '%s'", snapshot->manifest_path);
+        snapshot->manifest = NULL;
+        snapshot_close(snapshot);
+        return FALSE;
+    }
+
+    fprintf(snapshot->manifest, "%s\n", _SNAPSHOT_MAGIC);
+    fflush(snapshot->manifest);
+    return TRUE;
+}
+
+BOOL snapshot_record(backup_snapshot* snapshot, const snapshot_entry* entry) {
+    fprintf(snapshot->manifest,
+            "%s\t%s\t%llu\t%llu\t%s\n",
+            entry->kind == SNAPSHOT_HIVE ? "hive" : "file",
+            entry->hash,
+            entry->size,
+            entry->mtime,
+            entry->path);
+    if (fflush(snapshot->manifest) != 0) {
+        _ERROR("Failed to write backup snapshot: '%s'", snapshot->manifest_path);
+        return FALSE;
+    }
+
+    snapshot->entry_count++;
+    return TRUE;
+}
+
+// Creates `dst_path` sharing the clusters of `src_path` (ReFS block cloning). Both must be on the same volume.
+BOOL clone_file(const wchar_t* src_path, const wchar_t* dst_path, ULONGLONG size, DWORD cluster_size) {
+    const HANDLE h_src =
+      CreateFileW(src_path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+    if (h_src == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    const HANDLE h_dst = CreateFileW(dst_path, GENERIC_READ | GENERIC_WRITE | DELETE, 0, NULL, CREATE_NEW, 0, NULL);
+    if (h_dst == INVALID_HANDLE_VALUE) {
+        CloseHandle(h_src);
+        return FALSE;
+    }
+
+    FILE_END_OF_FILE_INFO eof = {0};
+    eof.EndOfFile.QuadPart    = (LONGLONG)size;
+    BOOL cloned               = SetFileInformationByHandle(h_dst, FileEndOfFileInfo, &eof, sizeof(eof));
+
+    // Ranges have to be cluster aligned; the last one may run past the end of file
+    for (ULONGLONG offset = 0; cloned && offset < size; offset += _CLONE_CHUNK_SIZE) {
+        const ULONGLONG remaining = size - offset;
+        const ULONGLONG aligned   = (remaining + cluster_size - 1) / cluster_size * cluster_size;
+
+        DUPLICATE_EXTENTS_DATA extents    = {0};
+        extents.FileHandle                = h_src;
+        extents.SourceFileOffset.QuadPart = (LONGLONG)offset;
+        extents.TargetFileOffset.QuadPart = (LONGLONG)offset;
+        extents.ByteCount.QuadPart        = (LONGLONG)min(aligned, _CLONE_CHUNK_SIZE);
+
+        DWORD bytes_returned = 0;
+        cloned               = DeviceIoControl(
+          h_dst, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &extents, sizeof(extents), NULL, 0, &bytes_returned, NULL);
+    }
+
+    if (!cloned) {
+        FILE_DISPOSITION_INFO disposition = {TRUE};
+        SetFileInformationByHandle(h_dst, FileDispositionInfo, &disposition, sizeof(disposition));
+    }
+
+    CloseHandle(h_dst);
+    CloseHandle(h_src);
+    return cloned;
+}
+
+// Puts `path` into the store without reading it, when it lives on the store's volume. Sets `*moved` when the
+// original is gone afterwards; a NULL `moved` leaves the original in place, so the file is only ever cloned.
+BOOL store_in_place(backup_snapshot* snapshot,
+                    const wpath* path,
+                    const WIN32_FILE_ATTRIBUTE_DATA* info,
+                    snapshot_entry* entry,
+                    BOOL* moved) {
+    if (!snapshot->store_volume_known)
+        return FALSE;
+
+    // The directory is compared in place, so only moving on to another directory copies it
+    const wchar_t* separator = wcsrchr(path->text, L'\\');
+    const size_t dir_len     = separator ? separator - path->text : 0;
+    const wpath* dir         = snapshot->volume_dir;
+    if (!dir || dir->len != dir_len || wmemcmp(dir->text, path->text, dir_len) != 0) {
+        dir                  = wpath_parent(&snapshot->arena, path);
+        snapshot->volume_dir = NULL;
+        if (!dir ||
+            !query_volume(dir->text, &snapshot->volume_serial, &snapshot->volume_flags, &snapshot->cluster_size))
+            return FALSE;
+        snapshot->volume_dir = dir;
+    }
+
+    if (snapshot->volume_serial != snapshot->store_serial)
+        return FALSE;
+
+    if (!ensure_directory(_BACKUP_OBJECTS "\\" _RAW_OBJECT_PREFIX))
+        return FALSE;
+
+    StringCchPrintfA(
+      entry->hash, sizeof(entry->hash), "%s%s-%d", _RAW_OBJECT_PREFIX, snapshot->name, snapshot->raw_count++);
+    const wchar_t* object_path = make_long_path(backup_object_path(entry->hash));
+    if (!object_path)
+        return FALSE;
+
+    // Sparse files can only be cloned into sparse targets, so those just get moved
+    if ((snapshot->volume_flags & FILE_SUPPORTS_BLOCK_REFCOUNTING) &&
+        !(info->dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) &&
+        clone_file(path->text, object_path, entry->size, snapshot->cluster_size)) {
+        snapshot->cloned++;
+        return TRUE;
+    }
+
+    if (moved && MoveFileExW(path->text, object_path, 0)) {
+        *moved = TRUE;
+        snapshot->moved++;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+// Backs up a file the caller is about to delete. `*moved` is set when the file was moved into the store, in which
+// case there's nothing left to delete. Pass NULL for `moved` when the file has to stay where it is.
+BOOL snapshot_add_file(backup_snapshot* snapshot, const wpath* path, BOOL* moved) {
+    if (moved)
+        *moved = FALSE;
+
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (!GetFileAttributesExW(path->text, GetFileExInfoStandard, &info)) {
+        _ERROR("Failed to backup file: '%ls'", wpath_plain(path));
+        return FALSE;
+    }
+
+    // The manifest records files by their UTF-8 path. It's only needed until the entry is written, so it goes in the
+    // scratch arena rather than growing the string pool with every file backed up.
+    arena* scratch        = scratch_arena();
+    const arena_mark mark = arena_save(scratch);
+    BOOL success          = FALSE;
+
+    snapshot_entry entry = {0};
+    entry.kind           = SNAPSHOT_FILE;
+    entry.path           = arena_wide_to_utf8(scratch, wpath_plain(path));
+    if (!entry.path)
+        goto cleanup;
+    entry.size  = ((ULONGLONG)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    entry.mtime = filetime_to_u64(info.ftLastWriteTime);
+
+    const snapshot_entry* previous = NULL;
+    if (snapshot->previous_count > 0) {
+        previous = bsearch(
+          &entry, snapshot->previous, snapshot->previous_count, sizeof(snapshot_entry), compare_snapshot_entries);
+    }
+    if (previous && previous->kind == SNAPSHOT_FILE && previous->size == entry.size &&
+        previous->mtime == entry.mtime && file_exists(backup_object_path(previous->hash))) {
+        StringCchCopyA(entry.hash, sizeof(entry.hash), previous->hash);
+        snapshot->bytes_in += entry.size;
+        snapshot->deduped++;
+        success = snapshot_record(snapshot, &entry);
+        goto cleanup;
+    }
+
+    if (store_in_place(snapshot, path, &info, &entry, moved)) {
+        snapshot->bytes_in += entry.size;
+        success = snapshot_record(snapshot, &entry);
+        goto cleanup;
+    }
+
+    DWORD size = 0;
+    BYTE* data = read_file_contents(path->text, &size);
+    if (!data) {
+        _ERROR("Failed to backup file: '%s'", entry.path);
+        goto cleanup;
+    }
+
+    const BOOL stored = store_object(snapshot, data, size, entry.hash);
+    free(data);
+    if (!stored) {
+        _ERROR("Failed to backup file: '%s'", entry.path);
+        goto cleanup;
+    }
+
+    success = snapshot_record(snapshot, &entry);
+
+cleanup:
+    arena_rewind(scratch, mark);
+    return success;
+}
+
+// Saves the open key `h_key` as a registry hive file at `path`. `key` is its path below HKEY_LOCAL_MACHINE,
+// spelled out for the 64-bit view (see REGISTRY_VIEWS), which restoring recreates it at.
+BOOL save_registry_hive(HKEY h_key, const char* path, const char* key) {
+    DeleteFileA(path);
+    const LONG saved = RegSaveKeyExA(h_key, path, NULL, REG_LATEST_FORMAT);
+    stats_add(STAT_REGISTRY_OPS, 1);
+    if (saved != ERROR_SUCCESS) {
+        _ERROR("Failed to export registry key: 'HKEY_LOCAL_MACHINE\\%s' (Error: %ld)", key, saved);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Stores a hive file written by save_registry_hive() like any other file
+BOOL snapshot_add_hive(backup_snapshot* snapshot, const char* path, const char* key) {
+    DWORD size = 0;
+    BYTE* data = read_file_contents(make_long_path(path), &size);
+    if (!data) {
+        _ERROR("Failed to read saved registry hive for key: 'HKEY_LOCAL_MACHINE\\%s'", key);
+        return FALSE;
+    }
+
+    snapshot_entry entry = {0};
+    entry.kind           = SNAPSHOT_HIVE;
+    entry.path           = key;
+    entry.size           = size;
+
+    const BOOL stored = store_object(snapshot, data, size, entry.hash);
+    free(data);
+    if (!stored) {
+        _ERROR("Failed to backup registry entry for key: 'HKEY_LOCAL_MACHINE\\%s'", key);
+        return FALSE;
+    }
+
+    return snapshot_record(snapshot, &entry);
+}
+
+void snapshot_finish(backup_snapshot* snapshot) {
+    stats_add(STAT_BACKUP_BYTES, snapshot->bytes_in);
+    if (snapshot->entry_count > 0) {
+        _INFO("Backed up %d item(s) to '%s' (%llu bytes, %llu compressed, %d unchanged, %d moved, %d cloned)",
+              snapshot->entry_count,
+              snapshot->manifest_path,
+              snapshot->bytes_in,
+              snapshot->bytes_stored,
+              snapshot->deduped,
+              snapshot->moved,
+              snapshot->cloned);
+    }
+    snapshot_close(snapshot);
+}
+
+BOOL restore_file_entry(DECOMPRESSOR_HANDLE decompressor, const snapshot_entry* entry) {
+    const wpath* path = strpool_wpath(entry->path);
+    if (!path) {
+        _ERROR("Failed to restore file: '%s'", entry->path);
+        return FALSE;
+    }
+
+    // SHCreateDirectoryEx() doesn't take the \\?\ form, so the parent goes in plain
+    arena* scratch        = scratch_arena();
+    const arena_mark mark = arena_save(scratch);
+    const wpath* parent   = wpath_parent(scratch, path);
+    const int dir_result  = parent ? SHCreateDirectoryExW(NULL, wpath_plain(parent), NULL) : ERROR_BAD_PATHNAME;
+    arena_rewind(scratch, mark);
+    if (dir_result != ERROR_SUCCESS && dir_result != ERROR_ALREADY_EXISTS && dir_result != ERROR_FILE_EXISTS) {
+        _ERROR("Failed to create directory for: '%s'", entry->path);
+        return FALSE;
+    }
+
+    BOOL restored;
+    if (strncmp(entry->hash, _RAW_OBJECT_PREFIX, strlen(_RAW_OBJECT_PREFIX)) == 0) {
+        // Raw objects may be referenced by later snapshots too, so they're copied back rather than moved
+        restored = CopyFileExW(make_long_path(backup_object_path(entry->hash)), path->text, NULL, NULL, NULL, 0);
+    } else {
+        DWORD size = 0;
+        BYTE* data = load_object(decompressor, entry->hash, &size);
+        if (!data) {
+            _ERROR("Failed to read backup object for: '%s'", entry->path);
+            return FALSE;
+        }
+
+        restored = write_file_contents(path->text, data, size);
+        free(data);
+    }
+
+    if (restored) {
+        // Put the original timestamp back so the next snapshot recognises the file as unchanged
+        const HANDLE h_file =
+          CreateFileW(path->text, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+        if (h_file != INVALID_HANDLE_VALUE) {
+            FILETIME mtime = {(DWORD)entry->mtime, (DWORD)(entry->mtime >> 32)};
+            SetFileTime(h_file, NULL, NULL, &mtime);
+            CloseHandle(h_file);
+        }
+        _VERBOSE("Restored file: '%s'", entry->path);
+    } else {
+        _ERROR("Failed to restore file: '%s'", entry->path);
+    }
+
+    return restored;
+}
+
+// Recreates `key` (below HKEY_LOCAL_MACHINE, 64-bit view) from the hive file at `path`
+BOOL restore_registry_hive(const char* key, const char* path) {
+    HKEY h_key;
+    LONG result = open_registry_key(key, KEY_ALL_ACCESS | KEY_WOW64_64KEY, TRUE, &h_key);
+    if (result == ERROR_SUCCESS) {
+        result = RegRestoreKeyA(h_key, path, REG_FORCE_RESTORE);
+        stats_add(STAT_REGISTRY_OPS, 1);
+        RegCloseKey(h_key);
+    }
+
+    if (result != ERROR_SUCCESS) {
+        _ERROR("Failed to restore registry key: 'HKEY_LOCAL_MACHINE\\%s' (Error: %ld)", key, result);
+        return FALSE;
+    }
+
+    _INFO("Restored registry key: 'HKEY_LOCAL_MACHINE\\%s'", key);
+    return TRUE;
+}
+
+BOOL restore_hive_entry(DECOMPRESSOR_HANDLE decompressor, const snapshot_entry* entry) {
+    DWORD size = 0;
+    BYTE* data = load_object(decompressor, entry->hash, &size);
+    if (!data) {
+        _ERROR("Failed to read backup object for: 'HKEY_LOCAL_MACHINE\\%s'", entry->path);
+        return FALSE;
+    }
+
+    const BOOL written = write_file_contents(make_long_path(_BACKUP_HIVE_TEMP), data, size);
+    free(data);
+    if (!written) {
+        _ERROR("Failed to write registry hive for: 'HKEY_LOCAL_MACHINE\\%s'", entry->path);
+        return FALSE;
+    }
+
+    const BOOL restored = restore_registry_hive(entry->path, _BACKUP_HIVE_TEMP);
+    DeleteFileA(_BACKUP_HIVE_TEMP);
+    return restored;
+}
+
+// Puts back every file and registry key recorded in a snapshot manifest. Existing files at the same paths are
+// replaced. `job` may be NULL when running synchronously.
+BOOL restore_snapshot(const char* manifest_path, worker_job* job) {
+    stats_operation stats;
+    stats_begin(&stats, "restore");
+
+    arena entry_arena       = {0};
+    snapshot_entry* entries = NULL;
+    size_t count            = 0;
+    if (!read_snapshot(manifest_path, &entry_arena, &entries, &count)) {
+        _ERROR("Not a K8-LRT backup snapshot: '%s'", manifest_path);
+        arena_destroy(&entry_arena);
+        stats_end(&stats, FALSE);
+        return FALSE;
+    }
+
+    DECOMPRESSOR_HANDLE decompressor;
+    if (!CreateDecompressor(COMPRESS_ALGORITHM_XPRESS_HUFF, NULL, &decompressor)) {
+        _ERROR("Failed to create decompressor (Error: %lu)", GetLastError());
+        arena_destroy(&entry_arena);
+        stats_end(&stats, FALSE);
+        return FALSE;
+    }
+
+    _INFO("Restoring %zu item(s) from '%s'", count, manifest_path);
+    worker_set_total(job, (LONG)count);
+
+    int failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (worker_is_cancelled(job)) {
+            _WARN("Restore cancelled after %zu of %zu item(s)", i, count);
+            failed++;
+            break;
+        }
+
+        const BOOL restored = entries[i].kind == SNAPSHOT_HIVE ? restore_hive_entry(decompressor, &entries[i])
+                                                               : restore_file_entry(decompressor, &entries[i]);
+        if (!restored)
+            failed++;
+        worker_report_progress(job);
+    }
+
+    CloseDecompressor(decompressor);
+    arena_destroy(&entry_arena);
+
+    _INFO("Finished restoring backup snapshot (%zu item(s), %d failed)", count, failed);
+    stats_end(&stats, failed == 0);
+    return failed == 0;
+}
+
+// Library roots of each registry view, opened once per batch with just the access RegDeleteTreeW needs. A view that
+// doesn't exist on this machine is left NULL.
+typedef struct {
+    HKEY roots[_REGISTRY_VIEW_COUNT];
+} registry_removal;
+
+#define _REGISTRY_DELETE_ACCESS (DELETE | KEY_ENUMERATE_SUB_KEYS | KEY_QUERY_VALUE | KEY_SET_VALUE)
+
+void registry_removal_open(registry_removal* registry) {
+    for (int view = 0; view < _REGISTRY_VIEW_COUNT; view++) {
+        const REGSAM sam = _REGISTRY_DELETE_ACCESS | REGISTRY_VIEWS[view].sam;
+        if (open_registry_key(_LIBRARY_REGISTRY_PATH, sam, FALSE, &registry->roots[view]) != ERROR_SUCCESS)
+            registry->roots[view] = NULL;
+    }
+}
+
+void registry_removal_close(registry_removal* registry) {
+    close_registry_views(registry->roots);
+}
+
+// Deletes one file from LibrariesCache or ras3, moving it into `snapshot` (may be NULL) instead when it can
+BOOL remove_shared_file(const wpath* path, ULONGLONG size, backup_snapshot* snapshot) {
+    BOOL moved = FALSE;
+    if (snapshot && !snapshot_add_file(snapshot, path, &moved))
+        return FALSE;
+
+    if (!moved && !DeleteFileW(path->text)) {
+        _ERROR("Failed to delete file: '%ls'", wpath_plain(path));
+        return FALSE;
+    }
+
+    _VERBOSE("Deleted file: '%ls'", wpath_plain(path));
+    stats_add(STAT_FILES_DELETED, 1);
+    stats_add(STAT_BYTES_DELETED, size);
+    return TRUE;
+}
+
+// Deletes the files of `source` that belong to the removed libraries (see cache_map_selects()). The map was built
+// before anything changed, so a file that has gone since is skipped.
+BOOL remove_mapped_cache_files(cache_source source,
+                               const library_entry* libraries[],
+                               const BOOL removed[],
+                               int count,
+                               backup_snapshot* snapshot) {
+    if (!cache_map_ensure())
+        return FALSE;
+
+    if (cache_map_unrecognised(source))
+        _WARN("None of the %d file(s) in '%ls' could be matched to a library, deleting all of them",
+              CACHE_MAP.files[source],
+              wpath_plain(source == CACHE_SOURCE_RAS3 ? PATHS.ras3 : PATHS.libraries_cache));
+
+    int deleted = 0;
+    for (int i = 0; i < CACHE_MAP.count; i++) {
+        const cache_map_entry* entry = &CACHE_MAP.entries[i];
+        if (entry->source != source || !cache_map_selects(entry, libraries, removed, count) ||
+            GetFileAttributesW(entry->path->text) == INVALID_FILE_ATTRIBUTES)
+            continue;
+
+        if (!remove_shared_file(entry->path, entry->size, snapshot))
+            return FALSE;
+        deleted++;
+    }
+
+    _INFO("Deleted %d of %d %s file(s)",
+          deleted,
+          CACHE_MAP.files[source],
+          source == CACHE_SOURCE_RAS3 ? "ras3" : "LibrariesCache");
+    return TRUE;
+}
+
+BOOL remove_cache_files(const library_entry* libraries[], const BOOL removed[], int count, backup_snapshot* snapshot) {
+    return remove_mapped_cache_files(CACHE_SOURCE_LIBRARIES_CACHE, libraries, removed, count, snapshot);
+}
+
+#define _SQLITE_DLL L"winsqlite3.dll"
+#define _SQLITE_OK 0
+#define _SQLITE_ROW 100
+#define _SQLITE_UTF8 1
+#define _SQLITE_DETERMINISTIC 0x800
+#define _SQLITE_OPEN_READWRITE 0x00000002
+#define _DB3_BUSY_TIMEOUT_MS 5000  // Kontakt or Native Access may be writing to the database
+#define _DB3_ORPHAN_PASSES 8       // Deletes that follow references stop after this many levels
+#define _DB3_DELETED_TABLE "temp.k8lrt_deleted"  // Keys of the rows an edit deleted, which the cascade follows
+
+typedef struct sqlite3 sqlite3;
+typedef struct sqlite3_stmt sqlite3_stmt;
+typedef struct sqlite3_context sqlite3_context;
+typedef struct sqlite3_value sqlite3_value;
+
+typedef void(WINAPI* sqlite_function)(sqlite3_context* context, int argc, sqlite3_value** argv);
+
+// Entry points of the SQLite that ships with Windows, loaded the first time komplete.db3 is edited. winsqlite3 builds
+// its API with the WINAPI calling convention.
+typedef struct {
+    HMODULE module;
+    int(WINAPI* open_v2)(const char* path, sqlite3** db, int flags, const char* vfs);
+    int(WINAPI* close_v2)(sqlite3* db);
+    int(WINAPI* exec)(sqlite3* db, const char* sql, void* callback, void* context, char** error);
+    int(WINAPI* prepare_v2)(sqlite3* db, const char* sql, int len, sqlite3_stmt** stmt, const char** tail);
+    int(WINAPI* step)(sqlite3_stmt* stmt);
+    int(WINAPI* finalize)(sqlite3_stmt* stmt);
+    const unsigned char*(WINAPI* column_text)(sqlite3_stmt* stmt, int column);
+    int(WINAPI* changes)(sqlite3* db);
+    const char*(WINAPI* errmsg)(sqlite3* db);
+    int(WINAPI* busy_timeout)(sqlite3* db, int ms);
+    int(WINAPI* create_function_v2)(sqlite3* db,
+                                    const char* name,
+                                    int argc,
+                                    int flags,
+                                    void* context,
+                                    sqlite_function func,
+                                    void* step,
+                                    void* final,
+                                    void* destroy);
+    void*(WINAPI* user_data)(sqlite3_context* context);
+    const unsigned char*(WINAPI* value_text)(sqlite3_value* value);
+    int(WINAPI* value_bytes)(sqlite3_value* value);
+    void(WINAPI* result_int)(sqlite3_context* context, int result);
+} sqlite_api;
+
+static sqlite_api SQLITE;
+static BOOL SQLITE_LOAD_TRIED = FALSE;
+
+#define _SQLITE_BIND(member, name) ((*(FARPROC*)&SQLITE.member = GetProcAddress(SQLITE.module, name)) != NULL)
+
+// Loads winsqlite3.dll once. Only removals use it, and those never run at the same time.
+BOOL sqlite_load(void) {
+    if (SQLITE_LOAD_TRIED)
+        return SQLITE.module != NULL;
+    SQLITE_LOAD_TRIED = TRUE;
+
+    SQLITE.module    = LoadLibraryExW(_SQLITE_DLL, NULL, LOAD_LIBRARY_SEARCH_SYSTEM32);
+    const BOOL bound = SQLITE.module && _SQLITE_BIND(open_v2, "sqlite3_open_v2") &&
+                       _SQLITE_BIND(close_v2, "sqlite3_close_v2") && _SQLITE_BIND(exec, "sqlite3_exec") &&
+                       _SQLITE_BIND(prepare_v2, "sqlite3_prepare_v2") && _SQLITE_BIND(step, "sqlite3_step") &&
+                       _SQLITE_BIND(finalize, "sqlite3_finalize") &&
+                       _SQLITE_BIND(column_text, "sqlite3_column_text") &&
+                       _SQLITE_BIND(changes, "sqlite3_changes") && _SQLITE_BIND(errmsg, "sqlite3_errmsg") &&
+                       _SQLITE_BIND(busy_timeout, "sqlite3_busy_timeout") &&
+                       _SQLITE_BIND(create_function_v2, "sqlite3_create_function_v2") &&
+                       _SQLITE_BIND(user_data, "sqlite3_user_data") &&
+                       _SQLITE_BIND(value_text, "sqlite3_value_text") &&
+                       _SQLITE_BIND(value_bytes, "sqlite3_value_bytes") &&
+                       _SQLITE_BIND(result_int, "sqlite3_result_int");
+    if (!bound) {
+        _WARN("Failed to load %ls (Error: %lu)", _SQLITE_DLL, GetLastError());
+        if (SQLITE.module)
+            FreeLibrary(SQLITE.module);
+        ZeroMemory(&SQLITE, sizeof(SQLITE));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// What the db3 cleanup treats as belonging to a removed library: a value equal to its name or SNPID, or a path inside
+// its content directory. Paths are compared ignoring ASCII case and with either separator.
+typedef struct {
+    cache_token_table names;
+    cache_token_table dirs;
+    char* path;  // _MAX_PATH_NFTS bytes for normalising values
+} db3_match;
+
+void db3_normalize_path(const char* value, size_t len, char* out) {
+    for (size_t i = 0; i < len; i++) {
+        const char c = value[i];
+        out[i]       = c == '/' ? '\\' : (c >= 'A' && c <= 'Z' ? (char)(c + ('a' - 'A')) : c);
+    }
+    out[len] = '\0';
+}
+
+BOOL db3_match_build(db3_match* match,
+                     arena* a,
+                     const library_entry* libraries[],
+                     const BOOL removed[],
+                     int count) {
+    match->path = (char*)arena_alloc(a, _MAX_PATH_NFTS);
+    if (!match->path || !cache_token_table_init(&match->names, a, count * 2) ||
+        !cache_token_table_init(&match->dirs, a, count))
+        return FALSE;
+
+    for (int i = 0; i < count; i++) {
+        const library_entry* library = libraries[i];
+        if (!removed[i])
+            continue;
+
+        cache_token_insert(&match->names, library->name, library->name);
+        if (library->snpid && strlen(library->snpid) >= _CACHE_TOKEN_MIN)
+            cache_token_insert(&match->names, library->snpid, library->name);
+
+        // The database holds the paths an offline image knows its libraries by, not where it's mounted
+        const char* content_dir = target_image_path(library->content_dir);
+        if (!content_dir)
+            continue;
+
+        size_t len = strlen(content_dir);
+        while (len > 0 && (content_dir[len - 1] == '\\' || content_dir[len - 1] == '/'))
+            len--;
+        if (len == 0 || len >= _MAX_PATH_NFTS)
+            continue;
+
+        char* dir = (char*)arena_alloc(a, len + 1);
+        if (!dir)
+            return FALSE;
+        db3_normalize_path(content_dir, len, dir);
+        cache_token_insert(&match->dirs, dir, library->name);
+    }
+
+    return TRUE;
+}
+
+BOOL db3_match_product(const db3_match* match, const char* value, size_t len) {
+    return len < _CACHE_TOKEN_MAX && cache_token_find(&match->names, value, len);
+}
+
+BOOL db3_match_path(const db3_match* match, const char* value, size_t len) {
+    if (len >= _MAX_PATH_NFTS)
+        return FALSE;
+
+    // The content directory itself, or anything below it
+    db3_normalize_path(value, len, match->path);
+    for (size_t i = 1; i <= len; i++) {
+        if ((i == len || match->path[i] == '\\') && cache_token_find(&match->dirs, match->path, i))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// k8lrt_removed_product(value): 1 if `value` is the name or SNPID of a library being removed
+void WINAPI db3_removed_product_function(sqlite3_context* context, int argc, sqlite3_value** argv) {
+    const db3_match* match     = (const db3_match*)SQLITE.user_data(context);
+    const unsigned char* value = SQLITE.value_text(argv[0]);
+    const int len              = SQLITE.value_bytes(argv[0]);
+    SQLITE.result_int(context, value && db3_match_product(match, (const char*)value, (size_t)len));
+}
+
+// k8lrt_removed_path(value): 1 if `value` is a path inside the content directory of a library being removed
+void WINAPI db3_removed_path_function(sqlite3_context* context, int argc, sqlite3_value** argv) {
+    const db3_match* match     = (const db3_match*)SQLITE.user_data(context);
+    const unsigned char* value = SQLITE.value_text(argv[0]);
+    const int len              = SQLITE.value_bytes(argv[0]);
+    SQLITE.result_int(context, value && db3_match_path(match, (const char*)value, (size_t)len));
+}
+
+typedef enum {
+    DB3_COLUMN_OTHER,
+    DB3_COLUMN_PATH,
+    DB3_COLUMN_PRODUCT,
+} db3_column_role;
+
+// What a text column of `table` holds, going by its name. Only paths and the columns naming a product are matched,
+// so a category, vendor or attribute value that happens to equal a library's name or SNPID is left alone.
+db3_column_role db3_column_role_of(const char* table, const char* column) {
+    static const char* path_words[]    = {"path", "file", "dir", "folder", "location"};
+    static const char* product_words[] = {"snpid", "upid", "product", "library"};
+
+    for (int i = 0; i < _countof(path_words); i++) {
+        if (StrStrIA(column, path_words[i]))
+            return DB3_COLUMN_PATH;
+    }
+    for (int i = 0; i < _countof(product_words); i++) {
+        if (StrStrIA(column, product_words[i]))
+            return DB3_COLUMN_PRODUCT;
+    }
+
+    // A product or library table's own name column
+    if (_stricmp(column, "name") == 0 && (StrStrIA(table, "product") || StrStrIA(table, "library")))
+        return DB3_COLUMN_PRODUCT;
+    return DB3_COLUMN_OTHER;
+}
+
+// Tables SQLite's full-text and R-tree modules keep a virtual table's index in, named `<table>_<suffix>`
+static const char* DB3_SHADOW_SUFFIXES[] = {
+  "content", "segments", "segdir", "data", "idx", "docsize", "config", "stat", "node", "rowid", "parent"};
+
+typedef struct {
+    const char* name;
+    const char* where;  // Matches the table's path and product columns, NULL if it has none
+    BOOL has_id;        // Has an `id` column that `<name>_id` columns of other tables refer to
+    BOOL skipped;       // A virtual table or one of its shadow tables, which only the module itself may change
+    BOOL is_virtual;
+    BOOL lost_rows;
+} db3_table;
+
+// A column holding the key of a row in another table
+typedef struct {
+    int child;
+    int parent;
+    const char* column;
+    const char* parent_column;
+} db3_link;
+
+typedef struct {
+    db3_table* tables;
+    int table_count;
+    db3_link* links;
+    int link_count;
+} db3_schema;
+
+// Quotes a table or column name for use in SQL
+const char* sql_identifier(const char* name) {
+    size_t quotes = 0;
+    for (const char* c = name; *c; c++)
+        quotes += *c == '"';
+
+    char* quoted = strpool_alloc(strlen(name) + quotes + 3);
+    if (!quoted)
+        return NULL;
+
+    char* out = quoted;
+    *out++    = '"';
+    for (const char* c = name; *c; c++) {
+        if (*c == '"')
+            *out++ = '"';
+        *out++ = *c;
+    }
+    *out++ = '"';
+    *out   = '\0';
+    return quoted;
+}
+
+BOOL is_db3_text_type(const char* type) {
+    return !type[0] || StrStrIA(type, "CHAR") || StrStrIA(type, "CLOB") || StrStrIA(type, "TEXT");
+}
+
+int find_db3_table(const db3_schema* schema, const char* name) {
+    for (int i = 0; i < schema->table_count; i++) {
+        if (_stricmp(schema->tables[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+BOOL db3_add_link(db3_schema* schema, arena* a, int child, int parent, const char* column, const char* parent_column) {
+    if (child < 0 || parent < 0 || child == parent || schema->tables[child].skipped || schema->tables[parent].skipped)
+        return TRUE;
+
+    db3_link* links = (db3_link*)arena_alloc(a, (schema->link_count + 1) * sizeof(db3_link));
+    const char* col = arena_strdup(a, column);
+    const char* ref = arena_strdup(a, parent_column);
+    if (!links || !col || !ref)
+        return FALSE;
+
+    if (schema->link_count > 0)
+        memcpy(links, schema->links, schema->link_count * sizeof(db3_link));
+    links[schema->link_count++] = (db3_link){child, parent, col, ref};
+    schema->links               = links;
+    return TRUE;
+}
+
+// Whether `name` is one of the shadow tables of a virtual table in `schema`
+BOOL is_db3_shadow_table(const db3_schema* schema, const char* name) {
+    for (int i = 0; i < schema->table_count; i++) {
+        const db3_table* table = &schema->tables[i];
+        const size_t len       = strlen(table->name);
+        if (!table->is_virtual || _strnicmp(name, table->name, len) != 0 || name[len] != '_')
+            continue;
+
+        for (int j = 0; j < _countof(DB3_SHADOW_SUFFIXES); j++) {
+            if (_stricmp(name + len + 1, DB3_SHADOW_SUFFIXES[j]) == 0)
+                return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Reads every table with its path and product columns, and the columns that refer to rows of other tables: declared
+// foreign keys, and `<table>_id` or `<name>_id` columns for a table `k_<name>` with an `id`, which is how komplete.db3
+// links them. Virtual tables and their shadow tables are skipped.
+BOOL read_db3_schema(sqlite3* db, arena* a, db3_schema* schema) {
+    ZeroMemory(schema, sizeof(*schema));
+
+    sqlite3_stmt* stmt = NULL;
+    if (SQLITE.prepare_v2(db,
+                          "SELECT m.name, p.name, p.type, m.sql LIKE 'CREATE VIRTUAL TABLE%' FROM sqlite_master m "
+                          "JOIN pragma_table_info(m.name) p WHERE m.type = 'table' AND m.name NOT LIKE 'sqlite%' "
+                          "ORDER BY m.name",
+                          -1,
+                          &stmt,
+                          NULL) != _SQLITE_OK)
+        return FALSE;
+
+    int capacity = 0;
+    BOOL ok      = TRUE;
+    while (ok && SQLITE.step(stmt) == _SQLITE_ROW) {
+        const char* table  = (const char*)SQLITE.column_text(stmt, 0);
+        const char* column = (const char*)SQLITE.column_text(stmt, 1);
+        const char* type   = (const char*)SQLITE.column_text(stmt, 2);
+        if (!table || !column)
+            continue;
+
+        db3_table* current = schema->table_count > 0 ? &schema->tables[schema->table_count - 1] : NULL;
+        if (!current || !_STREQ(current->name, table)) {
+            if (schema->table_count == capacity) {
+                const int new_capacity = capacity ? capacity * 2 : 32;
+                db3_table* grown       = (db3_table*)arena_alloc(a, new_capacity * sizeof(db3_table));
+                if (!grown) {
+                    ok = FALSE;
+                    break;
+                }
+                if (schema->table_count > 0)
+                    memcpy(grown, schema->tables, schema->table_count * sizeof(db3_table));
+                schema->tables = grown;
+                capacity       = new_capacity;
+            }
+
+            const char* is_virtual = (const char*)SQLITE.column_text(stmt, 3);
+            current                = &schema->tables[schema->table_count++];
+            ZeroMemory(current, sizeof(*current));
+            current->name       = arena_strdup(a, table);
+            current->is_virtual = is_virtual && is_virtual[0] == '1';
+            ok                  = current->name != NULL;
+        }
+
+        if (_stricmp(column, "id") == 0)
+            current->has_id = TRUE;
+
+        const db3_column_role role = db3_column_role_of(table, column);
+        if (ok && role != DB3_COLUMN_OTHER && is_db3_text_type(type ? type : "")) {
+            const char* call = strpool_sprintf(
+              role == DB3_COLUMN_PATH ? "k8lrt_removed_path(%s)" : "k8lrt_removed_product(%s)", sql_identifier(column));
+            current->where = current->where ? strpool_sprintf("%s OR %s", current->where, call) : call;
+            ok             = current->where && (current->where = arena_strdup(a, current->where)) != NULL;
+        }
+    }
+    SQLITE.finalize(stmt);
+    if (!ok)
+        return FALSE;
+
+    // Sorted by name, so shadow tables come after their virtual table, but only known once every table is
+    for (int i = 0; i < schema->table_count; i++) {
+        db3_table* table = &schema->tables[i];
+        table->skipped   = table->is_virtual || is_db3_shadow_table(schema, table->name);
+        if (table->skipped) {
+            table->where = NULL;
+            _VERBOSE("Leaving komplete.db3 table '%s' alone, it belongs to a virtual table", table->name);
+        }
+    }
+
+    // `<name>_id` columns, which need every table to be known first
+    if (SQLITE.prepare_v2(db,
+                          "SELECT m.name, p.name FROM sqlite_master m JOIN pragma_table_info(m.name) p "
+                          "WHERE m.type = 'table' AND p.name LIKE '%\\_id' ESCAPE '\\'",
+                          -1,
+                          &stmt,
+                          NULL) != _SQLITE_OK)
+        return FALSE;
+
+    while (ok && SQLITE.step(stmt) == _SQLITE_ROW) {
+        const char* table  = (const char*)SQLITE.column_text(stmt, 0);
+        const char* column = (const char*)SQLITE.column_text(stmt, 1);
+        if (!table || !column)
+            continue;
+
+        const char* stem = strpool_sprintf("%.*s", (int)(strlen(column) - 3), column);
+        int parent       = stem ? find_db3_table(schema, stem) : -1;
+        if (parent < 0 && stem)
+            parent = find_db3_table(schema, strpool_sprintf("k_%s", stem));
+        if (parent >= 0 && schema->tables[parent].has_id)
+            ok = db3_add_link(schema, a, find_db3_table(schema, table), parent, column, "id");
+    }
+    SQLITE.finalize(stmt);
+    if (!ok)
+        return FALSE;
+
+    // A foreign key without a target column refers to the parent's rowid
+    if (SQLITE.prepare_v2(db,
+                          "SELECT m.name, f.\"table\", f.\"from\", coalesce(f.\"to\", 'rowid') FROM sqlite_master m "
+                          "JOIN pragma_foreign_key_list(m.name) f WHERE m.type = 'table'",
+                          -1,
+                          &stmt,
+                          NULL) != _SQLITE_OK)
+        return FALSE;
+
+    while (ok && SQLITE.step(stmt) == _SQLITE_ROW) {
+        const char* table  = (const char*)SQLITE.column_text(stmt, 0);
+        const char* parent = (const char*)SQLITE.column_text(stmt, 1);
+        const char* column = (const char*)SQLITE.column_text(stmt, 2);
+        const char* to     = (const char*)SQLITE.column_text(stmt, 3);
+        if (table && parent && column && to)
+            ok = db3_add_link(schema, a, find_db3_table(schema, table), find_db3_table(schema, parent), column, to);
+    }
+    SQLITE.finalize(stmt);
+    return ok;
+}
+
+BOOL db3_exec(sqlite3* db, const char* sql) {
+    if (sql && SQLITE.exec(db, sql, NULL, NULL, NULL) == _SQLITE_OK)
+        return TRUE;
+
+    _ERROR("Failed to edit komplete.db3: %s", sql ? SQLITE.errmsg(db) : "Out of memory");
+    _VERBOSE("Failed statement: %s", sql ? sql : "(none)");
+    return FALSE;
+}
+
+// Deletes the rows of table `table` matching `where`. The values other tables refer to them by are recorded in
+// _DB3_DELETED_TABLE first, one row per link, so a cascade only follows references to rows this edit deleted.
+BOOL db3_delete_rows(sqlite3* db, const db3_schema* schema, int table, const char* where, int* changes) {
+    const char* name = sql_identifier(schema->tables[table].name);
+    *changes         = 0;
+
+    for (int i = 0; i < schema->link_count; i++) {
+        const db3_link* link = &schema->links[i];
+        if (link->parent != table)
+            continue;
+
+        const char* key = sql_identifier(link->parent_column);
+        if (!db3_exec(db,
+                      strpool_sprintf("INSERT INTO " _DB3_DELETED_TABLE " (link, value) SELECT %d, %s FROM %s "
+                                      "WHERE %s IS NOT NULL AND (%s)",
+                                      i,
+                                      key,
+                                      name,
+                                      key,
+                                      where)))
+            return FALSE;
+    }
+
+    if (!db3_exec(db, strpool_sprintf("DELETE FROM %s WHERE %s", name, where)))
+        return FALSE;
+    *changes = SQLITE.changes(db);
+    return TRUE;
+}
+
+// Deletes every row that belongs to the libraries in `libraries` whose `removed` entry is set, along with the rows
+// that referred to them, in one transaction. Returns FALSE with the database unchanged if it couldn't be edited.
+BOOL edit_db3(const wpath* db3, const library_entry* libraries[], const BOOL removed[], int count) {
+    if (!sqlite_load())
+        return FALSE;
+
+    // SQLite takes UTF-8 file names
+    const char* path = wide_to_utf8(wpath_plain(db3));
+
+    sqlite3* db = NULL;
+    if (!path || SQLITE.open_v2(path, &db, _SQLITE_OPEN_READWRITE, NULL) != _SQLITE_OK) {
+        _ERROR("Failed to open komplete.db3: %s", db ? SQLITE.errmsg(db) : "Out of memory");
+        SQLITE.close_v2(db);
+        return FALSE;
+    }
+    SQLITE.busy_timeout(db, _DB3_BUSY_TIMEOUT_MS);
+
+    arena* scratch        = scratch_arena();
+    const arena_mark mark = arena_save(scratch);
+
+    db3_match match;
+    db3_schema schema;
+    BOOL ok = db3_match_build(&match, scratch, libraries, removed, count) &&
+              SQLITE.create_function_v2(db,
+                                        "k8lrt_removed_product",
+                                        1,
+                                        _SQLITE_UTF8 | _SQLITE_DETERMINISTIC,
+                                        &match,
+                                        db3_removed_product_function,
+                                        NULL,
+                                        NULL,
+                                        NULL) == _SQLITE_OK &&
+              SQLITE.create_function_v2(db,
+                                        "k8lrt_removed_path",
+                                        1,
+                                        _SQLITE_UTF8 | _SQLITE_DETERMINISTIC,
+                                        &match,
+                                        db3_removed_path_function,
+                                        NULL,
+                                        NULL,
+                                        NULL) == _SQLITE_OK &&
+              db3_exec(db, "BEGIN IMMEDIATE");
+    const BOOL begun = ok;
+
+    ok = ok && read_db3_schema(db, scratch, &schema);
+    if (begun && !ok)
+        _ERROR("Failed to read komplete.db3 schema: %s", SQLITE.errmsg(db));
+
+    ok = ok && db3_exec(db, "CREATE TEMP TABLE " _DB3_DELETED_TABLE " (link INTEGER NOT NULL, value)") &&
+         db3_exec(db, "CREATE INDEX temp.k8lrt_deleted_link ON " _DB3_DELETED_TABLE " (link, value)");
+
+    int rows   = 0;
+    int tables = 0;
+    for (int i = 0; ok && i < schema.table_count; i++) {
+        db3_table* table = &schema.tables[i];
+        if (!table->where)
+            continue;
+
+        int changes = 0;
+        ok          = db3_delete_rows(db, &schema, i, table->where, &changes);
+        if (changes > 0) {
+            table->lost_rows = TRUE;
+            rows += changes;
+            tables++;
+            _VERBOSE("Deleted %d row(s) from komplete.db3 table '%s'", changes, table->name);
+        }
+    }
+
+    // Rows that referred to a deleted row, which may in turn be referred to by others. Only the keys recorded in
+    // _DB3_DELETED_TABLE are followed, so rows that pointed nowhere before the edit stay as they were.
+    for (int pass = 0; ok && pass < _DB3_ORPHAN_PASSES; pass++) {
+        BOOL deleted = FALSE;
+        for (int i = 0; ok && i < schema.link_count; i++) {
+            const db3_link* link    = &schema.links[i];
+            db3_table* child        = &schema.tables[link->child];
+            const db3_table* parent = &schema.tables[link->parent];
+            if (!parent->lost_rows)
+                continue;
+
+            const char* where = strpool_sprintf("%s IN (SELECT value FROM " _DB3_DELETED_TABLE " WHERE link = %d)",
+                                                sql_identifier(link->column),
+                                                i);
+            int changes       = 0;
+            ok                = where && db3_delete_rows(db, &schema, link->child, where, &changes);
+            if (changes > 0) {
+                if (!child->lost_rows)
+                    tables++;
+                child->lost_rows = TRUE;
+                rows += changes;
+                deleted = TRUE;
+                _VERBOSE("Deleted %d row(s) from komplete.db3 table '%s' that referred to '%s'",
+                         changes,
+                         child->name,
+                         parent->name);
+            }
+        }
+        if (!deleted)
+            break;
+    }
+
+    ok = ok && db3_exec(db, "COMMIT");
+    if (!ok && begun)
+        SQLITE.exec(db, "ROLLBACK", NULL, NULL, NULL);
+
+    if (ok) {
+        _INFO("Deleted %d row(s) from %d table(s) of komplete.db3", rows, tables);
+        if (DB3_VACUUM && rows > 0) {
+            const LONGLONG vacuum_start = query_ticks();
+            if (db3_exec(db, "VACUUM"))
+                _INFO("Compacted komplete.db3 in %.2f ms", ticks_to_ms(query_ticks() - vacuum_start));
+        }
+    }
+
+    SQLITE.close_v2(db);
+    arena_rewind(scratch, mark);
+    return ok;
+}
+
+// Deletes all of komplete.db3, moving it into `snapshot` (may be NULL) instead when it can
+BOOL delete_db3(const wpath* db3, ULONGLONG size, backup_snapshot* snapshot) {
+    BOOL moved = FALSE;
+    if (snapshot && !snapshot_add_file(snapshot, db3, &moved))
+        return FALSE;
+
+    if (!moved && !DeleteFileW(db3->text)) {
+        _ERROR("Failed to delete komplete.db3");
+        return FALSE;
+    }
+
+    _INFO("Deleted komplete.db3");
+    stats_add(STAT_FILES_DELETED, 1);
+    stats_add(STAT_BYTES_DELETED, size);
+    return TRUE;
+}
+
+// Cleans the removed libraries out of komplete.db3 according to DB3_MODE. The database is deleted whole if it
+// couldn't be edited (e.g. winsqlite3.dll is missing or the schema couldn't be read).
+BOOL remove_db3(const library_entry* libraries[], const BOOL removed[], int count, backup_snapshot* snapshot) {
+    const wpath* db3 = PATHS.db3;
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (!db3 || !GetFileAttributesExW(db3->text, GetFileExInfoStandard, &info) ||
+        (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        return TRUE;
+    const ULONGLONG size = ((ULONGLONG)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+
+    if (DB3_MODE == DB3_EDIT) {
+        // Backed up as a copy, since the database stays where it is
+        if (snapshot && !snapshot_add_file(snapshot, db3, NULL))
+            return FALSE;
+        if (edit_db3(db3, libraries, removed, count))
+            return TRUE;
+
+        _WARN("Failed to edit komplete.db3, deleting all of it instead");
+        return delete_db3(db3, size, NULL);
+    }
+
+    return delete_db3(db3, size, snapshot);
+}
+
+BOOL remove_ras3_jwt(const library_entry* libraries[], const BOOL removed[], int count, backup_snapshot* snapshot) {
+    return remove_mapped_cache_files(CACHE_SOURCE_RAS3, libraries, removed, count, snapshot);
+}
+
+typedef enum {
+    REMOVE_STAGE_REGISTRY_BACKUP,
+    REMOVE_STAGE_REGISTRY,
+    REMOVE_STAGE_XML,
+    REMOVE_STAGE_CONTENT_DIR,
+    REMOVE_STAGE_CACHE,
+    REMOVE_STAGE_DB3,
+    REMOVE_STAGE_RAS3_JWT,
+    REMOVE_STAGE_COUNT,
+} removal_stage;
+
+static const char* REMOVAL_STAGE_NAMES[REMOVE_STAGE_COUNT] = {
+  "registry backup",
+  "registry keys",
+  "XML files",
+  "content directories",
+  "library cache",
+  "komplete.db3",
+  "ras3 JWT tokens",
+};
+
+typedef struct {
+    LONGLONG ticks[REMOVE_STAGE_COUNT];
+    int runs[REMOVE_STAGE_COUNT];
+} removal_timings;
+
+// Runs a single removal stage, storing its return value in `out` and adding its duration to `timings`
+#define _TIMED_STAGE(timings, stage, out, expr)                                                                        \
+    do {                                                                                                               \
+        const LONGLONG _stage_start = query_ticks();                                                                   \
+        (out)                       = (expr);                                                                          \
+        (timings)->ticks[stage] += query_ticks() - _stage_start;                                                       \
+        (timings)->runs[stage]++;                                                                                      \
+    } while (FALSE)
+
+BOOL is_known_library(const char* name) {
+    return find_library(name) != NULL;
+}
+
+// Returns an identifier for the physical disk backing `path`, so content directories on different disks can be deleted
+// at the same time without making them compete for the same spindle. Falls back to the volume serial number when the
+// disk extents can't be queried (e.g. spanned volumes or network shares).
+DWORD get_physical_drive_id(const char* path) {
+    char volume_root[MAX_PATH];
+    if (!GetVolumePathNameA(path, volume_root, MAX_PATH))
+        return 0;
+
+    char volume_name[MAX_PATH];
+    if (GetVolumeNameForVolumeMountPointA(volume_root, volume_name, MAX_PATH)) {
+        // CreateFile wants the volume GUID path without its trailing backslash
+        const size_t len = strlen(volume_name);
+        if (len > 0 && volume_name[len - 1] == '\\')
+            volume_name[len - 1] = '\0';
+
+        const HANDLE h_volume =
+          CreateFileA(volume_name, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+        if (h_volume != INVALID_HANDLE_VALUE) {
+            VOLUME_DISK_EXTENTS extents = {0};
+            DWORD bytes_returned        = 0;
+            const BOOL queried          = DeviceIoControl(h_volume,
+                                                 IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS,
+                                                 NULL,
+                                                 0,
+                                                 &extents,
+                                                 sizeof(extents),
+                                                 &bytes_returned,
+                                                 NULL);
+            CloseHandle(h_volume);
+
+            if (queried && extents.NumberOfDiskExtents > 0)
+                return extents.Extents[0].DiskNumber;
+        }
+    }
+
+    DWORD serial = 0;
+    GetVolumeInformationA(volume_root, NULL, 0, &serial, NULL, NULL, NULL, 0);
+    return 0x80000000u | serial;
+}
+
+// Content directories that live on the same physical drive. Each group is deleted sequentially on its own worker.
+typedef struct {
+    DWORD drive_id;
+    int* indices;
+    int count;
+    const library_entry** libraries;
+    BOOL* results;
+    worker_job* job;
+} content_dir_group;
+
+VOID CALLBACK remove_content_dir_group(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_WORK work) {
+    content_dir_group* group = (content_dir_group*)context;
+
+    for (int i = 0; i < group->count; i++) {
+        const int index              = group->indices[i];
+        const library_entry* library = group->libraries[index];
+
+        if (worker_is_cancelled(group->job)) {
+            _WARN("Skipped removing content directory for '%s' (cancelled)", library->name);
+            group->results[index] = FALSE;
+            continue;
+        }
+
+        group->results[index] = rm_rf(make_long_path(library->content_dir), worker_cancel_flag(group->job));
+        if (group->results[index]) {
+            _INFO("Removed content directory: '%s'", library->content_dir);
+        } else {
+            _ERROR("Failed to remove content directory: '%s'", library->content_dir);
+        }
+
+        worker_report_progress(group->job);
+    }
+
+    scratch_release();
+}
+
+// Deletes the content directory of every library whose `results` entry is still TRUE, one worker per physical drive.
+// Returns the number of content directories that were attempted.
+int remove_content_dirs(const library_entry* libraries[], BOOL results[], int count, worker_job* job) {
+    content_dir_group* groups = (content_dir_group*)calloc(count, sizeof(content_dir_group));
+    int* indices              = (int*)malloc(sizeof(int) * count);
+    int* library_group        = (int*)malloc(sizeof(int) * count);
+    if (!groups || !indices || !library_group) {
+        _ERROR("Failed to allocate memory for content directory removal");
+        free(groups);
+        free(indices);
+        free(library_group);
+        for (int i = 0; i < count; i++)
+            results[i] = FALSE;
+        return 0;
+    }
+
+    int group_count = 0;
+    int dir_count   = 0;
+    for (int i = 0; i < count; i++) {
+        library_group[i]             = -1;
+        const library_entry* library = libraries[i];
+        if (!results[i] || library->content_dir == NULL)
+            continue;
+
+        const DWORD attributes = get_path_attributes(library->content_dir);
+        if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_DIRECTORY))
+            continue;
+
+        const DWORD drive_id = get_physical_drive_id(library->content_dir);
+        int g                = 0;
+        while (g < group_count && groups[g].drive_id != drive_id)
+            g++;
+
+        if (g == group_count) {
+            groups[g].drive_id  = drive_id;
+            groups[g].libraries = libraries;
+            groups[g].results   = results;
+            groups[g].job       = job;
+            group_count++;
+        }
+
+        groups[g].count++;
+        library_group[i] = g;
+        dir_count++;
+    }
+
+    // Carve `indices` into one contiguous slice per group
+    int offset = 0;
+    for (int g = 0; g < group_count; g++) {
+        groups[g].indices = indices + offset;
+        offset += groups[g].count;
+        groups[g].count = 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const int g = library_group[i];
+        if (g >= 0)
+            groups[g].indices[groups[g].count++] = i;
+    }
+
+    _INFO("Removing %d content directory(ies) across %d drive(s)", dir_count, group_count);
+
+    PTP_WORK* works = (PTP_WORK*)calloc(group_count, sizeof(PTP_WORK));
+    for (int g = 0; g < group_count; g++) {
+        // The last group runs on this thread, which is already off the UI thread
+        if (works && g < group_count - 1)
+            works[g] = worker_submit(remove_content_dir_group, &groups[g]);
+        if (!works || !works[g])
+            remove_content_dir_group(NULL, &groups[g], NULL);
+    }
+
+    if (works) {
+        for (int g = 0; g < group_count; g++)
+            worker_wait(works[g]);
+        free(works);
+    }
+
+    free(groups);
+    free(indices);
+    free(library_group);
+
+    return dir_count;
+}
+
+// Steps that clean up state Kontakt and Native Access keep for every library, run once per batch. Only the cache files
+// and JWTs of the libraries in `libraries` whose `removed` entry is set are deleted, and only their rows are deleted
+// from komplete.db3 unless DB3_MODE says otherwise.
+BOOL remove_shared_cache_files(const library_entry* libraries[],
+                               const BOOL removed[],
+                               int count,
+                               removal_timings* timings,
+                               backup_snapshot* snapshot) {
+    BOOL result;
+    _TIMED_STAGE(timings, REMOVE_STAGE_CACHE, result, remove_cache_files(libraries, removed, count, snapshot));
+    if (!result)
+        return FALSE;
+
+    _TIMED_STAGE(timings, REMOVE_STAGE_DB3, result, remove_db3(libraries, removed, count, snapshot));
+    if (!result)
+        return FALSE;
+
+    _TIMED_STAGE(timings, REMOVE_STAGE_RAS3_JWT, result, remove_ras3_jwt(libraries, removed, count, snapshot));
+    if (!result)
+        return FALSE;
+
+    // What was deleted is gone from disk, so the next removal maps the folders again
+    cache_map_reset();
+    return TRUE;
+}
+
+void log_removal_timings(const removal_timings* timings) {
+    for (int i = 0; i < REMOVE_STAGE_COUNT; i++) {
+        if (timings->runs[i] == 0)
+            continue;
+        _INFO("Removal stage '%s': %.2f ms (%d run(s))",
+              REMOVAL_STAGE_NAMES[i],
+              ticks_to_ms(timings->ticks[i]),
+              timings->runs[i]);
+    }
+}
+
+#define _REMOVAL_JOURNAL "K8-LRT.removal.journal"
+#define _REMOVAL_JOURNAL_MAGIC "K8LRT-REMOVAL 1"
+#define _REMOVAL_JOURNAL_TARGET_ROOT "target-root\t"  // Header lines of a journal written for an offline image
+#define _REMOVAL_JOURNAL_TARGET_HIVE "target-hive\t"
+#define _REMOVAL_STAGING "K8-LRT.removal"          // Registry hives exported for the batch being removed
+#define _REMOVAL_STAGED_SUFFIX ".k8lrt-removing"  // Files and directories waiting for their library to commit
+#define _XML_LIST_BUFFER_SIZE (64 * 1024)
+
+typedef enum {
+    PLAN_REGISTRY_KEY,  // Deleted, and put back from the hive exported before the batch started
+    PLAN_XML_FILE,      // Renamed aside, and deleted once its library commits
+    PLAN_CONTENT_DIR,   // Renamed aside, and deleted once its library commits
+    PLAN_SHARED_FILE,   // Cache file, JWT or komplete.db3. Only listed; remove_shared_cache_files() deletes it.
+    PLAN_DB3_ROWS,      // The batch's rows in komplete.db3. Only listed; remove_shared_cache_files() deletes them.
+} removal_step_kind;
+
+static const char* REMOVAL_STEP_ACTIONS[] = {
+  "delete_key", "delete_xml", "delete_content_dir", "delete_shared_file", "delete_db3_rows"};
+static const removal_stage REMOVAL_STEP_STAGES[] = {
+  REMOVE_STAGE_REGISTRY, REMOVE_STAGE_XML, REMOVE_STAGE_CONTENT_DIR, REMOVE_STAGE_CACHE, REMOVE_STAGE_DB3};
+
+typedef enum {
+    LIBRARY_PLANNED,      // Nothing touched yet
+    LIBRARY_UNPLANNED,    // A step couldn't be planned or its key exported, so the library is left alone
+    LIBRARY_BEGUN,        // Steps are being applied; rolled back unless it reaches LIBRARY_COMMITTED
+    LIBRARY_COMMITTED,    // Every step applied; what was staged only has to be deleted
+    LIBRARY_ROLLED_BACK,  // A step failed and everything applied before it was put back
+} library_removal_state;
+
+typedef struct {
+    removal_step_kind kind;
+    int library;         // Index into the batch, -1 for shared files
+    int view;            // REGISTRY_VIEWS index of a PLAN_REGISTRY_KEY step
+    const char* path;    // Key below HKEY_LOCAL_MACHINE (spelled for the 64-bit view), or a file or directory
+    const char* staged;  // Hive export of a key, or what a file or directory is renamed to until its library commits
+    ULONGLONG size;
+    BOOL size_known;
+    BOOL applied;
+
+    // Long forms of path and staged for file and directory steps. They're built once when the step is planned, since
+    // applying, undoing and purging it all pass them to the W APIs.
+    const wpath* file;
+    const wpath* staged_file;
+} removal_step;
+
+// A library XML file found in Service Center
+typedef struct {
+    const wchar_t* name;  // File name without .xml, NULL for an empty slot
+    size_t len;
+    ULONGLONG size;
+} plan_xml_file;
+
+// Every key, file and directory a batch removal touches, worked out before anything changes. Libraries are then
+// removed one at a time through a journal: their keys are deleted (the hives having been exported up front) and
+// their files renamed aside, and only once every step worked is the library committed and the staged files
+// deleted. A failed step puts back what the library already lost, and a journal left behind by a crash is rolled
+// back or finished by recover_removal_journal() on the next start.
+typedef struct {
+    arena arena;
+    removal_step* steps;
+    int step_count;
+    int step_capacity;
+    BYTE* states;  // library_removal_state of each library
+    int library_count;
+    FILE* journal;   // NULL for dry runs and recovery, which don't write one
+    BOOL leftovers;  // Staged items that couldn't be deleted yet; the journal is kept so the next start retries
+
+    // The offline image (TARGET.root and TARGET.hive) a journal read back was written for, NULL for this machine
+    const char* target_root;
+    const char* target_hive;
+
+    // Service Center's XML files, listed once per batch through a single directory handle so planning a library
+    // is a table lookup rather than a path lookup. Not listed if the directory couldn't be read.
+    plan_xml_file* xml_files;
+    unsigned int xml_mask;
+    BOOL xml_listed;
+} removal_plan;
+
+BOOL plan_reserve_libraries(removal_plan* plan, int count) {
+    if (count <= plan->library_count)
+        return TRUE;
+
+    BYTE* states = (BYTE*)arena_alloc(&plan->arena, count);
+    if (!states)
+        return FALSE;
+
+    memset(states, LIBRARY_PLANNED, count);
+    if (plan->library_count > 0)
+        memcpy(states, plan->states, plan->library_count);
+    plan->states        = states;
+    plan->library_count = count;
+    return TRUE;
+}
+
+removal_step* plan_add_step(removal_plan* plan, removal_step_kind kind, int library, const char* path) {
+    if (plan->step_count == plan->step_capacity) {
+        const int new_capacity = plan->step_capacity ? plan->step_capacity * 2 : 16;
+        removal_step* grown    = (removal_step*)arena_alloc(&plan->arena, new_capacity * sizeof(*grown));
+        if (!grown)
+            return NULL;
+        if (plan->step_count > 0)
+            memcpy(grown, plan->steps, plan->step_count * sizeof(*grown));
+        plan->steps         = grown;
+        plan->step_capacity = new_capacity;
+    }
+
+    removal_step* step = &plan->steps[plan->step_count];
+    ZeroMemory(step, sizeof(*step));
+    step->kind    = kind;
+    step->library = library;
+    step->path    = arena_strdup(&plan->arena, path);
+    if (!step->path)
+        return NULL;
+
+    plan->step_count++;
+    return step;
+}
+
+// Sets where a file or directory step is staged, along with the long forms of both of its paths
+BOOL plan_set_staged(removal_plan* plan, removal_step* step, const char* staged) {
+    step->staged      = arena_strdup(&plan->arena, staged);
+    step->file        = wpath_from_utf8(&plan->arena, step->path);
+    step->staged_file = wpath_from_utf8(&plan->arena, step->staged);
+    if (!step->file || !step->staged_file) {
+        step->file        = NULL;
+        step->staged_file = NULL;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// Adds a file or directory step, staged next to the original so the rename never leaves its volume
+removal_step* plan_add_staged_step(removal_plan* plan, removal_step_kind kind, int library, const char* path) {
+    removal_step* step = plan_add_step(plan, kind, library, path);
+    if (!step)
+        return NULL;
+
+    const char* staged = strpool_sprintf("%s%s-%lu", path, _REMOVAL_STAGED_SUFFIX, GetCurrentProcessId());
+    return staged && plan_set_staged(plan, step, staged) ? step : NULL;
+}
+
+void plan_destroy(removal_plan* plan) {
+    if (plan->journal) {
+        fclose(plan->journal);
+        plan->journal = NULL;
+    }
+    arena_destroy(&plan->arena);
+}
+
+// Appends a line to the journal before the change it describes is made. Without a journal there's nothing to do.
+BOOL plan_journal(removal_plan* plan, const char* format, ...) {
+    if (!plan->journal)
+        return TRUE;
+
+    va_list args;
+    va_start(args, format);
+    const int written = vfprintf(plan->journal, format, args);
+    va_end(args);
+
+    if (written < 0 || fflush(plan->journal) != 0) {
+        _ERROR("Failed to write removal journal: '%s'", _REMOVAL_JOURNAL);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// Library key name of a PLAN_REGISTRY_KEY step, relative to its view's root
+const char* plan_key_name(const removal_step* step) {
+    return step->path + strlen(REGISTRY_VIEWS[step->view].path) + 1;
+}
+
+// Case-insensitive hash of an XML file name. Only ASCII letters are folded, which is enough for names that compare
+// equal ignoring case to hash the same. Longer names only hash their first MAX_PATH characters.
+unsigned int plan_xml_hash(const wchar_t* name, size_t len) {
+    wchar_t folded[MAX_PATH];
+    if (len > MAX_PATH)
+        len = MAX_PATH;
+    for (size_t i = 0; i < len; i++)
+        folded[i] = name[i] >= L'a' && name[i] <= L'z' ? name[i] - (L'a' - L'A') : name[i];
+    return hash_bytes(folded, len * sizeof(wchar_t));
+}
+
+// Looks `name` up in a table built by plan_hash_xml_files()
+const plan_xml_file* plan_find_xml(const plan_xml_file* table, unsigned int mask, const wchar_t* name, size_t len) {
+    for (unsigned int slot = plan_xml_hash(name, len) & mask; table[slot].name; slot = (slot + 1) & mask) {
+        const plan_xml_file* file = &table[slot];
+        if (file->len == len && CompareStringOrdinal(file->name, (int)len, name, (int)len, TRUE) == CSTR_EQUAL)
+            return file;
+    }
+    return NULL;
+}
+
+// Hashes `count` XML files into an open-addressed table allocated in `a`, at most half full. Returns NULL if it
+// couldn't be allocated.
+plan_xml_file* plan_hash_xml_files(arena* a, const plan_xml_file* files, int count, unsigned int* mask) {
+    unsigned int slots = 16;
+    while (count > 0 && slots < (unsigned int)count * 2)
+        slots *= 2;
+
+    plan_xml_file* table = (plan_xml_file*)arena_alloc(a, slots * sizeof(plan_xml_file));
+    if (!table)
+        return NULL;
+
+    ZeroMemory(table, slots * sizeof(plan_xml_file));
+    *mask = slots - 1;
+    for (int i = 0; i < count; i++) {
+        unsigned int slot = plan_xml_hash(files[i].name, files[i].len) & *mask;
+        while (table[slot].name)
+            slot = (slot + 1) & *mask;
+        table[slot] = files[i];
+    }
+    return table;
+}
+
+// Reads the names (without .xml) and sizes of Service Center's XML files into `files`, allocated in `a`. Returns how
+// many there are, or -1 if the directory couldn't be read; a missing directory just has none.
+int read_service_center(arena* a, plan_xml_file** files) {
+    *files = NULL;
+    if (!PATHS.service_center)
+        return -1;
+
+    const HANDLE h_dir = CreateFileW(PATHS.service_center->text,
+                                     FILE_LIST_DIRECTORY,
+                                     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                     NULL,
+                                     OPEN_EXISTING,
+                                     FILE_FLAG_BACKUP_SEMANTICS,
+                                     NULL);
+    if (h_dir == INVALID_HANDLE_VALUE) {
+        const DWORD error = GetLastError();
+        return error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND ? 0 : -1;
+    }
+
+    arena* scratch        = scratch_arena();
+    const arena_mark mark = arena_save(scratch);
+    BYTE* buffer          = (BYTE*)arena_alloc(scratch, _XML_LIST_BUFFER_SIZE);
+
+    int count    = 0;
+    int capacity = 0;
+    BOOL ok      = buffer != NULL;
+
+    // The first call restarts the listing; the rest carry on from where the previous one stopped
+    FILE_INFO_BY_HANDLE_CLASS info_class = FileFullDirectoryRestartInfo;
+    while (ok && GetFileInformationByHandleEx(h_dir, info_class, buffer, _XML_LIST_BUFFER_SIZE)) {
+        info_class                     = FileFullDirectoryInfo;
+        const FILE_FULL_DIR_INFO* info = (const FILE_FULL_DIR_INFO*)buffer;
+        for (;;) {
+            const size_t len = info->FileNameLength / sizeof(wchar_t);
+            if (!(info->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) && len > 4 &&
+                CompareStringOrdinal(info->FileName + len - 4, 4, L".xml", 4, TRUE) == CSTR_EQUAL) {
+                if (count == capacity) {
+                    capacity             = capacity ? capacity * 2 : 256;
+                    plan_xml_file* grown = (plan_xml_file*)arena_alloc(a, capacity * sizeof(*grown));
+                    if (grown && count > 0)
+                        memcpy(grown, *files, count * sizeof(*grown));
+                    *files = grown;
+                }
+
+                wchar_t* name = *files ? (wchar_t*)arena_alloc(a, (len - 4) * sizeof(wchar_t)) : NULL;
+                if (!name) {
+                    ok = FALSE;
+                    break;
+                }
+                memcpy(name, info->FileName, (len - 4) * sizeof(wchar_t));
+                (*files)[count].name   = name;
+                (*files)[count].len    = len - 4;
+                (*files)[count++].size = (ULONGLONG)info->EndOfFile.QuadPart;
+            }
+
+            if (info->NextEntryOffset == 0)
+                break;
+            info = (const FILE_FULL_DIR_INFO*)((const BYTE*)info + info->NextEntryOffset);
+        }
+    }
+
+    ok = ok && GetLastError() == ERROR_NO_MORE_FILES;
+    CloseHandle(h_dir);
+    arena_rewind(scratch, mark);
+    return ok ? count : -1;
+}
+
+// Lists Service Center into the plan's XML table. Planning looks up each library's XML file on its own if it
+// couldn't be read.
+void plan_list_xml_files(removal_plan* plan) {
+    plan_xml_file* files = NULL;
+    const int count      = read_service_center(&plan->arena, &files);
+
+    plan->xml_files = count >= 0 ? plan_hash_xml_files(&plan->arena, files, count, &plan->xml_mask) : NULL;
+    if (!plan->xml_files) {
+        _WARN("Failed to list Service Center, looking up each library's XML file instead");
+        return;
+    }
+    plan->xml_listed = TRUE;
+}
+
+// Queues the keys, XML file and content directory of `library`. Only what exists goes into the plan; a content
+// directory that would take a whole drive with it keeps the library from being planned at all.
+BOOL plan_library(removal_plan* plan,
+                  const registry_removal* registry,
+                  const library_entry* library,
+                  int index,
+                  BOOL remove_content) {
+    _ASSERT(library != NULL);
+    _ASSERT(library->name != NULL);
+
+    if (!is_known_library(library->name)) {
+        _ERROR("Refusing to remove unknown library: '%s'", library->name);
+        return FALSE;
+    }
+
+    const wchar_t* key = utf8_to_wide(library->name);
+    if (!key)
+        return FALSE;
+
+    for (int view = 0; view < _REGISTRY_VIEW_COUNT; view++) {
+        if (!(library->views & (1 << view)) || !registry->roots[view])
+            continue;
+
+        HKEY h_key;
+        if (RegOpenKeyExW(registry->roots[view], key, 0, KEY_READ, &h_key) != ERROR_SUCCESS)
+            continue;  // Already gone
+        RegCloseKey(h_key);
+
+        removal_step* step =
+          plan_add_step(plan, PLAN_REGISTRY_KEY, index, join_paths(REGISTRY_VIEWS[view].path, library->name));
+        if (!step)
+            return FALSE;
+        step->view   = view;
+        step->staged = arena_strdup(&plan->arena, strpool_sprintf("%s\\%d-%d.hiv", _REMOVAL_STAGING, index, view));
+        if (!step->staged)
+            return FALSE;
+    }
+
+    const char* xml =
+      PATHS.service_center_utf8 ? strpool_sprintf("%s\\%s.xml", PATHS.service_center_utf8, library->name) : NULL;
+    ULONGLONG xml_size = 0;
+    BOOL has_xml       = FALSE;
+    if (xml && plan->xml_listed) {
+        const plan_xml_file* file = plan_find_xml(plan->xml_files, plan->xml_mask, key, wcslen(key));
+        has_xml                   = file != NULL;
+        xml_size                  = file ? file->size : 0;
+    } else if (xml) {
+        WIN32_FILE_ATTRIBUTE_DATA info;
+        const wchar_t* long_xml = make_long_path(xml);
+        if (long_xml && GetFileAttributesExW(long_xml, GetFileExInfoStandard, &info) &&
+            !(info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            has_xml  = TRUE;
+            xml_size = ((ULONGLONG)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+        }
+    }
+
+    if (has_xml) {
+        removal_step* step = plan_add_staged_step(plan, PLAN_XML_FILE, index, xml);
+        if (!step)
+            return FALSE;
+        step->size       = xml_size;
+        step->size_known = TRUE;
+    }
+
+    if (!remove_content || !library->content_dir)
+        return TRUE;
+
+    // Registry values often end in a separator, which the staged name can't be appended to
+    char* dir  = strpool_strdup(library->content_dir);
+    size_t len = dir ? strlen(dir) : 0;
+    while (len > 0 && (dir[len - 1] == '\\' || dir[len - 1] == '/'))
+        dir[--len] = '\0';
+    if (len == 0 || !strchr(dir, '\\') || PathIsRootA(join_str(dir, "\\"))) {
+        _ERROR("Refusing to remove content directory that isn't a library folder: '%s'", library->content_dir);
+        return FALSE;
+    }
+
+    const DWORD attributes = get_path_attributes(dir);
+    if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_DIRECTORY))
+        return TRUE;
+
+    removal_step* step = plan_add_staged_step(plan, PLAN_CONTENT_DIR, index, dir);
+    if (!step)
+        return FALSE;
+    step->size       = library->size_bytes;
+    step->size_known = library->size_known;
+    return TRUE;
+}
+
+// Plans every library of the batch. Libraries that can't be planned are marked LIBRARY_UNPLANNED and left alone.
+BOOL build_removal_plan(removal_plan* plan,
+                        const registry_removal* registry,
+                        const library_entry* libraries[],
+                        int count,
+                        BOOL remove_content) {
+    ZeroMemory(plan, sizeof(*plan));
+    if (!plan_reserve_libraries(plan, count)) {
+        _ERROR("Failed to allocate memory for removal plan");
+        return FALSE;
+    }
+
+    plan_list_xml_files(plan);
+    for (int i = 0; i < count; i++) {
+        if (!plan_library(plan, registry, libraries[i], i, remove_content)) {
+            _ERROR("Failed to plan removal, not removing library: '%s'", libraries[i]->name);
+            plan->states[i] = LIBRARY_UNPLANNED;
+        }
+    }
+
+    return TRUE;
+}
+
+// Lists what remove_shared_cache_files() would delete when removing `libraries`, for dry runs
+void plan_shared_files(removal_plan* plan, const library_entry* libraries[], int count) {
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (PATHS.db3 && GetFileAttributesExW(PATHS.db3->text, GetFileExInfoStandard, &info)) {
+        // Edited in place, so how much it shrinks isn't known up front
+        removal_step* step = plan_add_step(
+          plan, DB3_MODE == DB3_EDIT ? PLAN_DB3_ROWS : PLAN_SHARED_FILE, -1, wide_to_utf8(wpath_plain(PATHS.db3)));
+        if (step && DB3_MODE == DB3_DELETE) {
+            step->size       = ((ULONGLONG)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+            step->size_known = TRUE;
+        }
+    }
+
+    if (!cache_map_ensure())
+        return;
+
+    for (int i = 0; i < CACHE_MAP.count; i++) {
+        const cache_map_entry* entry = &CACHE_MAP.entries[i];
+        if (!cache_map_selects(entry, libraries, NULL, count))
+            continue;
+
+        removal_step* step = plan_add_step(plan, PLAN_SHARED_FILE, -1, wide_to_utf8(wpath_plain(entry->path)));
+        if (!step)
+            break;
+        step->size       = entry->size;
+        step->size_known = TRUE;
+    }
+}
+
+// Exports the keys of every planned library in one pass before the first delete, and stores the exports in
+// `snapshot` (may be NULL) as well. A library with a key that can't be exported is left alone.
+void prepare_removal_plan(removal_plan* plan,
+                          const registry_removal* registry,
+                          backup_snapshot* snapshot,
+                          worker_job* job) {
+    for (int i = 0; i < plan->step_count && !worker_is_cancelled(job); i++) {
+        removal_step* step = &plan->steps[i];
+        if (step->kind != PLAN_REGISTRY_KEY || plan->states[step->library] != LIBRARY_PLANNED)
+            continue;
+
+        const wchar_t* key = utf8_to_wide(plan_key_name(step));
+        HKEY h_key;
+        BOOL saved = key && RegOpenKeyExW(registry->roots[step->view], key, 0, KEY_READ, &h_key) == ERROR_SUCCESS;
+        if (saved) {
+            saved = save_registry_hive(h_key, step->staged, step->path);
+            RegCloseKey(h_key);
+        }
+
+        WIN32_FILE_ATTRIBUTE_DATA info;
+        if (saved && GetFileAttributesExA(step->staged, GetFileExInfoStandard, &info)) {
+            step->size       = ((ULONGLONG)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+            step->size_known = TRUE;
+        }
+
+        if (saved)
+            saved = plan_journal(plan, "hive\t%d\t%d\t%s\t%s\n", step->library, step->view, step->staged, step->path);
+        if (saved && snapshot)
+            saved = snapshot_add_hive(snapshot, step->staged, step->path);
+
+        if (!saved) {
+            _ERROR("Failed to export registry key, not removing library: 'HKEY_LOCAL_MACHINE\\%s'", step->path);
+            plan->states[step->library] = LIBRARY_UNPLANNED;
+        }
+    }
+}
+
+BOOL apply_removal_step(removal_plan* plan,
+                        removal_step* step,
+                        const registry_removal* registry,
+                        backup_snapshot* snapshot) {
+    if (step->kind == PLAN_REGISTRY_KEY) {
+        if (!plan_journal(plan, "key\t%d\t%d\n", step->library, step->view))
+            return FALSE;
+
+        const wchar_t* key = utf8_to_wide(plan_key_name(step));
+        const LSTATUS res  = key ? RegDeleteTreeW(registry->roots[step->view], key) : ERROR_NOT_ENOUGH_MEMORY;
+        if (res != ERROR_SUCCESS && res != ERROR_FILE_NOT_FOUND) {
+            _ERROR("Failed to delete registry key: 'HKEY_LOCAL_MACHINE\\%s' (Error: %ld)", step->path, res);
+            return FALSE;
+        }
+        stats_add(STAT_REGISTRY_OPS, 1);
+
+        step->applied = TRUE;
+        _INFO("Removed registry key: 'HKEY_LOCAL_MACHINE\\%s'", step->path);
+        return TRUE;
+    }
+
+    // The backup copy is taken without moving the file, since putting it back on a rollback has to stay a rename
+    if (step->kind == PLAN_XML_FILE && snapshot && !snapshot_add_file(snapshot, step->file, NULL))
+        return FALSE;
+
+    if (!plan_journal(plan, "stage\t%d\t%d\t%s\t%s\n", step->library, step->kind, step->staged, step->path))
+        return FALSE;
+
+    if (!MoveFileExW(step->file->text, step->staged_file->text, 0)) {
+        _ERROR("Failed to stage for removal: '%s' (Error: %lu)", step->path, GetLastError());
+        return FALSE;
+    }
+
+    step->applied = TRUE;
+    _VERBOSE("Staged for removal: '%s'", step->path);
+    return TRUE;
+}
+
+BOOL undo_removal_step(const removal_step* step) {
+    if (step->kind == PLAN_REGISTRY_KEY)
+        return restore_registry_hive(step->path, step->staged);
+
+    // Nothing to put back if the rename never happened
+    if (!step->staged_file || GetFileAttributesW(step->staged_file->text) == INVALID_FILE_ATTRIBUTES)
+        return TRUE;
+
+    if (!MoveFileExW(step->staged_file->text, step->file->text, 0)) {
+        _ERROR("Failed to put back: '%s' (Error: %lu)", step->path, GetLastError());
+        return FALSE;
+    }
+
+    _INFO("Put back: '%s'", step->path);
+    return TRUE;
+}
+
+// Deletes a staged file or directory for good once its library has committed
+BOOL purge_removal_step(const removal_step* step, const volatile LONG* cancel) {
+    const wchar_t* staged = step->staged_file ? step->staged_file->text : NULL;
+    if (!staged || GetFileAttributesW(staged) == INVALID_FILE_ATTRIBUTES)
+        return TRUE;
+
+    const BOOL purged = step->kind == PLAN_CONTENT_DIR ? rm_rf(staged, cancel) : DeleteFileW(staged);
+    if (!purged) {
+        _ERROR("Failed to delete: '%s'", step->staged);
+        return FALSE;
+    }
+
+    // rm_rf() counts content directories itself
+    if (step->kind != PLAN_CONTENT_DIR) {
+        stats_add(STAT_FILES_DELETED, 1);
+        stats_add(STAT_BYTES_DELETED, step->size);
+    }
+
+    _INFO("Deleted %s: '%s'", step->kind == PLAN_CONTENT_DIR ? "content directory" : "XML file", step->path);
+    return TRUE;
+}
+
+// Puts back every applied step of `library`, last first. The library stays LIBRARY_BEGUN if something couldn't be
+// put back, so the journal keeps it for the next start to retry.
+BOOL rollback_library_removal(removal_plan* plan, int library) {
+    BOOL restored = TRUE;
+    for (int i = plan->step_count - 1; i >= 0; i--) {
+        removal_step* step = &plan->steps[i];
+        if (step->library != library || !step->applied)
+            continue;
+
+        if (undo_removal_step(step))
+            step->applied = FALSE;
+        else
+            restored = FALSE;
+    }
+
+    if (restored && plan_journal(plan, "rollback\t%d\n", library))
+        plan->states[library] = LIBRARY_ROLLED_BACK;
+    return restored;
+}
+
+// Applies every step of `library`, committing it if they all succeed and rolling it back otherwise
+BOOL apply_library_removal(removal_plan* plan,
+                           int library,
+                           const char* name,
+                           const registry_removal* registry,
+                           backup_snapshot* snapshot,
+                           removal_timings* timings) {
+    if (!plan_journal(plan, "begin\t%d\n", library))
+        return FALSE;
+    plan->states[library] = LIBRARY_BEGUN;
+
+    BOOL applied = TRUE;
+    for (int i = 0; applied && i < plan->step_count; i++) {
+        removal_step* step = &plan->steps[i];
+        if (step->library != library)
+            continue;
+        _TIMED_STAGE(
+          timings, REMOVAL_STEP_STAGES[step->kind], applied, apply_removal_step(plan, step, registry, snapshot));
+    }
+
+    if (applied && plan_journal(plan, "commit\t%d\n", library)) {
+        plan->states[library] = LIBRARY_COMMITTED;
+        return TRUE;
+    }
+
+    _WARN("Rolling back removal of library: '%s'", name);
+    if (!rollback_library_removal(plan, library))
+        _ERROR("Failed to roll back removal of '%s', it will be retried on the next start", name);
+    return FALSE;
+}
+
+// Deletes what the committed libraries staged. Content directories go through remove_content_dirs() under their
+// staged names so different drives are still worked on concurrently.
+void commit_removal_plan(removal_plan* plan,
+                         const library_entry* libraries[],
+                         int count,
+                         worker_job* job,
+                         removal_timings* timings) {
+    library_entry* staged_entries = (library_entry*)calloc(count, sizeof(library_entry));
+    const library_entry** staged  = (const library_entry**)calloc(count, sizeof(library_entry*));
+    BOOL* purged                  = (BOOL*)calloc(count, sizeof(BOOL));
+    const volatile LONG* cancel   = worker_cancel_flag(job);
+    BOOL have_dirs                = FALSE;
+
+    for (int i = 0; i < plan->step_count; i++) {
+        const removal_step* step = &plan->steps[i];
+        if (step->library < 0 || step->library >= count || plan->states[step->library] != LIBRARY_COMMITTED)
+            continue;
+
+        if (step->kind == PLAN_XML_FILE && !purge_removal_step(step, cancel))
+            plan->leftovers = TRUE;
+
+        if (step->kind == PLAN_CONTENT_DIR) {
+            if (!staged_entries || !staged || !purged) {
+                plan->leftovers = TRUE;
+                continue;
+            }
+            staged_entries[step->library]             = *libraries[step->library];
+            staged_entries[step->library].content_dir = step->staged;
+            staged[step->library]                     = &staged_entries[step->library];
+            purged[step->library]                     = TRUE;
+            have_dirs                                 = TRUE;
+        }
+    }
+
+    if (have_dirs) {
+        // remove_content_dirs() needs an entry for every slot; the empty ones just have no content directory
+        for (int i = 0; i < count; i++) {
+            if (!staged[i])
+                staged[i] = &staged_entries[i];
+        }
+
+        const LONGLONG content_start = query_ticks();
+        const int dir_count          = remove_content_dirs(staged, purged, count, job);
+        timings->ticks[REMOVE_STAGE_CONTENT_DIR] += query_ticks() - content_start;
+        timings->runs[REMOVE_STAGE_CONTENT_DIR] += dir_count;
+
+        for (int i = 0; i < count; i++) {
+            if (staged_entries[i].content_dir && !purged[i]) {
+                _WARN("Content directory of '%s' will be deleted on the next start: '%s'",
+                      libraries[i]->name,
+                      staged_entries[i].content_dir);
+                plan->leftovers = TRUE;
+            }
+        }
+    }
+
+    free(staged_entries);
+    free(staged);
+    free(purged);
+}
+
+// Closes the journal and, unless something was left for the next start, deletes it along with the hive exports
+void finish_removal_plan(removal_plan* plan) {
+    BOOL complete = !plan->leftovers;
+    for (int i = 0; i < plan->library_count; i++) {
+        if (plan->states[i] == LIBRARY_BEGUN)
+            complete = FALSE;
+    }
+
+    if (plan->journal) {
+        fclose(plan->journal);
+        plan->journal = NULL;
+    }
+
+    if (complete) {
+        for (int i = 0; i < plan->step_count; i++) {
+            if (plan->steps[i].kind == PLAN_REGISTRY_KEY)
+                DeleteFileA(plan->steps[i].staged);
+        }
+        DeleteFileA(_REMOVAL_JOURNAL);
+        RemoveDirectoryA(_REMOVAL_STAGING);
+    }
+
+    plan_destroy(plan);
+}
+
+// Rebuilds the plan of an interrupted batch from its journal. Step lines are only written before the change they
+// describe, so every step in the rebuilt plan that is marked applied may or may not have happened.
+BOOL read_removal_journal(removal_plan* plan) {
+    ZeroMemory(plan, sizeof(*plan));
+
+    FILE* file = NULL;
+    if (fopen_s(&file, _REMOVAL_JOURNAL, "r") != 0)
+        return FALSE;
+
+    char line[_JOURNAL_LINE_MAX];
+    BOOL valid = FALSE;
+    if (fgets(line, sizeof(line), file)) {
+        strip_newline(line);
+        valid = _STREQ(line, _REMOVAL_JOURNAL_MAGIC);
+    }
+
+    while (valid && fgets(line, sizeof(line), file)) {
+        strip_newline(line);
+
+        // Header lines naming the offline image, only there if the batch was removed from one
+        if (strncmp(line, _REMOVAL_JOURNAL_TARGET_ROOT, strlen(_REMOVAL_JOURNAL_TARGET_ROOT)) == 0) {
+            plan->target_root = arena_strdup(&plan->arena, line + strlen(_REMOVAL_JOURNAL_TARGET_ROOT));
+            continue;
+        }
+        if (strncmp(line, _REMOVAL_JOURNAL_TARGET_HIVE, strlen(_REMOVAL_JOURNAL_TARGET_HIVE)) == 0) {
+            plan->target_hive = arena_strdup(&plan->arena, line + strlen(_REMOVAL_JOURNAL_TARGET_HIVE));
+            continue;
+        }
+
+        int library = -1, value = 0;
+        library_removal_state state = LIBRARY_PLANNED;
+        char* staged                = tab_field(line, 3);
+        if ((sscanf_s(line, "hive\t%d\t%d", &library, &value) == 2 ||
+             sscanf_s(line, "stage\t%d\t%d", &library, &value) == 2) &&
+            staged) {
+            char* path = strchr(staged, '\t');
+            if (!path || library < 0 || !plan_reserve_libraries(plan, library + 1))
+                continue;
+            *path++ = '\0';
+
+            const BOOL is_hive = line[0] == 'h';
+            if (!is_hive && value != PLAN_XML_FILE && value != PLAN_CONTENT_DIR)
+                continue;
+
+            const removal_step_kind kind = is_hive ? PLAN_REGISTRY_KEY : (removal_step_kind)value;
+            removal_step* step           = plan_add_step(plan, kind, library, path);
+            if (!step)
+                continue;
+            step->view    = is_hive ? value : 0;
+            step->applied = !is_hive;
+            if (is_hive)
+                step->staged = arena_strdup(&plan->arena, staged);
+            else
+                plan_set_staged(plan, step, staged);
+        } else if (sscanf_s(line, "key\t%d\t%d", &library, &value) == 2) {
+            for (int i = 0; i < plan->step_count; i++) {
+                removal_step* step = &plan->steps[i];
+                if (step->kind == PLAN_REGISTRY_KEY && step->library == library && step->view == value)
+                    step->applied = TRUE;
+            }
+        } else if (sscanf_s(line, "begin\t%d", &library) == 1) {
+            state = LIBRARY_BEGUN;
+        } else if (sscanf_s(line, "commit\t%d", &library) == 1) {
+            state = LIBRARY_COMMITTED;
+        } else if (sscanf_s(line, "rollback\t%d", &library) == 1) {
+            state = LIBRARY_ROLLED_BACK;
+        }
+
+        if (state != LIBRARY_PLANNED && library >= 0 && plan_reserve_libraries(plan, library + 1))
+            plan->states[library] = (BYTE)state;
+    }
+
+    fclose(file);
+    if (!valid)
+        _WARN("Ignoring unreadable removal journal: '%s'", _REMOVAL_JOURNAL);
+    return valid;
+}
+
+// Whether a journal written for the offline image `root` and `hive` (NULL or empty for this machine) belongs to the
+// current TARGET. Recovering it anywhere else would put its registry keys back into, and delete its staged files from,
+// the wrong system.
+BOOL journal_matches_target(const char* root, const char* hive) {
+    const char* current_root = TARGET.software && TARGET.root ? TARGET.root : "";
+    const char* current_hive = TARGET.software && TARGET.hive ? TARGET.hive : "";
+    return _stricmp(root ? root : "", current_root) == 0 && _stricmp(hive ? hive : "", current_hive) == 0;
+}
+
+// Finishes a removal interrupted by a crash or power loss: libraries that committed have their staged files deleted,
+// and the ones that didn't get back everything they lost. The journal is kept if something couldn't be put back.
+// `rolled_back` (may be NULL) receives the number of libraries that were restored.
+BOOL recover_removal_journal(int* rolled_back) {
+    if (rolled_back)
+        *rolled_back = 0;
+    if (!file_exists(_REMOVAL_JOURNAL))
+        return TRUE;
+
+    removal_plan plan;
+    if (!read_removal_journal(&plan)) {
+        plan_destroy(&plan);
+        DeleteFileA(_REMOVAL_JOURNAL);
+        return TRUE;
+    }
+
+    if (!journal_matches_target(plan.target_root, plan.target_hive)) {
+        const char* image = plan.target_hive && plan.target_hive[0]
+                              ? strpool_sprintf("the offline image '%s' (registry hive: '%s')",
+                                                plan.target_root && plan.target_root[0] ? plan.target_root : "-",
+                                                plan.target_hive)
+                              : "this machine";
+        _ERROR("The interrupted removal in '%s' was made on %s. Run K8-LRT with the same --target and --target-hive "
+               "to recover it.",
+               _REMOVAL_JOURNAL,
+               image);
+        plan_destroy(&plan);
+        return FALSE;
+    }
+
+    _WARN("Recovering from an interrupted removal of %d library(ies)", plan.library_count);
+    for (int library = 0; library < plan.library_count; library++) {
+        if (plan.states[library] == LIBRARY_BEGUN) {
+            if (rollback_library_removal(&plan, library) && rolled_back)
+                (*rolled_back)++;
+        } else if (plan.states[library] == LIBRARY_COMMITTED) {
+            for (int i = 0; i < plan.step_count; i++) {
+                const removal_step* step = &plan.steps[i];
+                if (step->library == library && step->kind != PLAN_REGISTRY_KEY && !purge_removal_step(step, NULL))
+                    plan.leftovers = TRUE;
+            }
+        }
+    }
+
+    BOOL recovered = !plan.leftovers;
+    for (int i = 0; i < plan.library_count; i++) {
+        if (plan.states[i] == LIBRARY_BEGUN)
+            recovered = FALSE;
+    }
+
+    if (recovered)
+        _INFO("Recovered interrupted removal");
+    else
+        _ERROR("Couldn't finish recovering the interrupted removal, it will be retried on the next start");
+
+    finish_removal_plan(&plan);
+    return recovered;
+}
+
+// Starts the journal for a batch. A journal that's still there belongs to a removal that never finished, which has
+// to be recovered first since the new journal would take its place.
+BOOL removal_journal_open(removal_plan* plan) {
+    if (file_exists(_REMOVAL_JOURNAL) && !recover_removal_journal(NULL)) {
+        _ERROR("An earlier removal couldn't be recovered, see '%s'", _REMOVAL_JOURNAL);
+        return FALSE;
+    }
+
+    if (!ensure_directory(_REMOVAL_STAGING) || fopen_s(&plan->journal, _REMOVAL_JOURNAL, "w") != 0) {
+        _ERROR("Failed to create removal journal: '%s'", _REMOVAL_JOURNAL);
+        plan->journal = NULL;
+        return FALSE;
+    }
+
+    if (!plan_journal(plan, "%s\n", _REMOVAL_JOURNAL_MAGIC))
+        return FALSE;
+    if (!TARGET.software)
+        return TRUE;
+    return plan_journal(plan,
+                        "%s%s\n%s%s\n",
+                        _REMOVAL_JOURNAL_TARGET_ROOT,
+                        TARGET.root ? TARGET.root : "",
+                        _REMOVAL_JOURNAL_TARGET_HIVE,
+                        TARGET.hive ? TARGET.hive : "");
+}
+
+// Removes every library in `libraries`, each one all or nothing through a removal_plan. Content directories are
+// deleted concurrently per physical drive once their libraries committed, and the cache, db3 and JWT cleanup runs
+// once for the whole batch (provided at least one library was removed). `job` may be NULL when running
+// synchronously.
+// `results` (may be NULL) receives whether each library was removed. Libraries skipped by a cancel come last, after
+// the first `count - summary->skipped` entries.
+BOOL remove_libraries(const library_entry* libraries[],
+                      int count,
+                      BOOL remove_content,
+                      removal_summary* summary,
+                      worker_job* job,
+                      BOOL results_out[]) {
+    _ASSERT(summary != NULL);
+
+    removal_timings timings = {0};
+    const LONGLONG start    = query_ticks();
+
+    stats_operation stats;
+    stats_begin(&stats, "removal");
+
+    summary->removed           = 0;
+    summary->failed            = 0;
+    summary->skipped           = 0;
+    summary->shared_cleanup_ok = TRUE;
+
+    BOOL* results = (BOOL*)calloc(count, sizeof(BOOL));
+    if (!results) {
+        _ERROR("Failed to allocate memory for batch removal");
+        summary->failed = count;
+        stats_end(&stats, FALSE);
+        return FALSE;
+    }
+
+    // One snapshot covers the whole batch, so shared files are only backed up once
+    backup_snapshot snapshot;
+    backup_snapshot* backup = NULL;
+    if (BACKUP_FILES) {
+        if (!snapshot_begin(&snapshot)) {
+            _ERROR("Failed to start backup snapshot, nothing was removed");
+            summary->failed = count;
+            free(results);
+            stats_end(&stats, FALSE);
+            return FALSE;
+        }
+        backup = &snapshot;
+    }
+
+    registry_removal registry;
+    registry_removal_open(&registry);
+
+    removal_plan plan;
+    if (!build_removal_plan(&plan, &registry, libraries, count, remove_content) || !removal_journal_open(&plan)) {
+        _ERROR("Failed to start removal journal, nothing was removed");
+        plan_destroy(&plan);
+        registry_removal_close(&registry);
+        if (backup)
+            snapshot_finish(backup);
+        summary->failed = count;
+        free(results);
+        stats_end(&stats, FALSE);
+        return FALSE;
+    }
+
+    int content_count = 0;
+    for (int i = 0; i < plan.step_count; i++) {
+        if (plan.steps[i].kind == PLAN_CONTENT_DIR)
+            content_count++;
+    }
+    worker_set_total(job, count + content_count + 1);
+
+    // Every library's keys are exported before the first one is deleted
+    const LONGLONG export_start = query_ticks();
+    prepare_removal_plan(&plan, &registry, backup, job);
+    timings.ticks[REMOVE_STAGE_REGISTRY_BACKUP] += query_ticks() - export_start;
+    timings.runs[REMOVE_STAGE_REGISTRY_BACKUP]++;
+
+    int attempted = 0;
+    for (int i = 0; i < count; i++) {
+        if (worker_is_cancelled(job))
+            break;
+
+        results[i] = plan.states[i] == LIBRARY_PLANNED &&
+                     apply_library_removal(&plan, i, libraries[i]->name, &registry, backup, &timings);
+        attempted++;
+        worker_report_progress(job);
+    }
+
+    registry_removal_close(&registry);
+
+    commit_removal_plan(&plan, libraries, attempted, job, &timings);
+    finish_removal_plan(&plan);
+
+    for (int i = 0; i < attempted; i++) {
+        if (results[i]) {
+            summary->removed++;
+            _INFO("Finished removing library: '%s'", libraries[i]->name);
+        } else {
+            summary->failed++;
+            _ERROR("Failed to remove library: '%s'", libraries[i]->name);
+        }
+    }
+    summary->skipped = count - attempted;
+
+    if (results_out)
+        memcpy(results_out, results, count * sizeof(BOOL));
+
+    // The shared cleanup still runs after a cancel so libraries that were already removed don't linger in the cache.
+    // Libraries that failed were rolled back, so their cache files are kept.
+    if (summary->removed > 0) {
+        summary->shared_cleanup_ok = remove_shared_cache_files(libraries, results, count, &timings, backup);
+        if (!summary->shared_cleanup_ok)
+            _ERROR("Failed to remove shared cache files");
+    }
+    worker_report_progress(job);
+
+    if (backup)
+        snapshot_finish(backup);
+
+    log_removal_timings(&timings);
+    _INFO("Finished batch removal of %d library(ies) in %.2f ms (%d removed, %d failed, %d skipped)",
+          count,
+          ticks_to_ms(query_ticks() - start),
+          summary->removed,
+          summary->failed,
+          summary->skipped);
+
+    free(results);
+
+    const BOOL succeeded = summary->failed == 0 && summary->skipped == 0 && summary->shared_cleanup_ok;
+    stats_set_steps(&stats, REMOVAL_STAGE_NAMES, timings.ticks, timings.runs, REMOVE_STAGE_COUNT);
+    stats_end(&stats, succeeded);
+    return succeeded;
+}
+
+BOOL remove_library(const library_entry* library, BOOL remove_content) {
+    removal_summary summary;
+    return remove_libraries(&library, 1, remove_content, &summary, NULL, NULL);
+}
+
+// Reconciliation of the three places a library leaves traces: its registry keys, its Service Center XML file and its
+// content directory. A library with a key is already listed; this finds the XML files and content directories left
+// behind by libraries whose key is gone, and content directories registered more than once.
+typedef enum {
+    ORPHAN_XML,          // Service Center XML file no registry key is named after
+    ORPHAN_CONTENT_DIR,  // Library folder beside registered content directories that no key points at
+    ORPHAN_SHARED_DIR,   // Content directory more than one key points at. Only reported, never removed.
+} orphan_kind;
+
+static const char* ORPHAN_KINDS[] = {"xml", "content_dir", "shared_content_dir"};
+
+typedef struct {
+    orphan_kind kind;
+    const char* name;   // File or folder name, or for ORPHAN_SHARED_DIR the library that registered it first
+    const char* other;  // ORPHAN_SHARED_DIR: the library sharing the directory with `name`
+    const char* path;
+    ULONGLONG size;
+    BOOL size_known;
+    BOOL removed;
+} orphan_entry;
+
+struct orphan_report {
+    arena arena;
+    orphan_entry* entries;
+    int count;
+    int capacity;
+};
+
+// Whether removing orphans with `remove_content` deletes `entry`
+BOOL is_removable_orphan(const orphan_entry* entry, BOOL remove_content) {
+    return entry->kind == ORPHAN_XML || (entry->kind == ORPHAN_CONTENT_DIR && remove_content);
+}
+
+#define _ORPHAN_LIBRARY_MARKER L"*.nicnt"  // Every Kontakt Player library has one at the top of its folder
+
+// A directory's identity however its path is spelled (case, short names, mounted folders, subst drives)
+typedef struct {
+    ULONGLONG volume;
+    BYTE file_id[16];
+} dir_identity;
+
+BOOL get_dir_identity(const wchar_t* path, dir_identity* identity) {
+    const HANDLE h_dir = CreateFileW(path,
+                                     FILE_READ_ATTRIBUTES,
+                                     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                     NULL,
+                                     OPEN_EXISTING,
+                                     FILE_FLAG_BACKUP_SEMANTICS,
+                                     NULL);
+    if (h_dir == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    ZeroMemory(identity, sizeof(*identity));
+    FILE_ID_INFO info;
+    BOOL ok = GetFileInformationByHandleEx(h_dir, FileIdInfo, &info, sizeof(info));
+    if (ok) {
+        identity->volume = info.VolumeSerialNumber;
+        memcpy(identity->file_id, &info.FileId, sizeof(identity->file_id));
+    } else {
+        // File systems without 128-bit IDs (FAT, exFAT) still have the 64-bit file index
+        BY_HANDLE_FILE_INFORMATION by_handle;
+        ok = GetFileInformationByHandle(h_dir, &by_handle);
+        if (ok) {
+            const ULONGLONG index = ((ULONGLONG)by_handle.nFileIndexHigh << 32) | by_handle.nFileIndexLow;
+            identity->volume      = by_handle.dwVolumeSerialNumber;
+            memcpy(identity->file_id, &index, sizeof(index));
+        }
+    }
+
+    CloseHandle(h_dir);
+    return ok;
+}
+
+// Open-addressed table of directory identities, each mapped to what owns it (a content_dir_owner index, or a
+// non-negative tag). Sized by dir_identity_table() to stay at most half full.
+typedef struct {
+    dir_identity identity;
+    int owner;  // -1 for an empty slot
+} dir_identity_slot;
+
+dir_identity_slot* dir_identity_table(arena* a, int count, unsigned int* mask) {
+    unsigned int slots = 16;
+    while (slots < (unsigned int)count * 2)
+        slots *= 2;
+
+    dir_identity_slot* table = (dir_identity_slot*)arena_alloc(a, slots * sizeof(dir_identity_slot));
+    if (!table)
+        return NULL;
+
+    for (unsigned int i = 0; i < slots; i++)
+        table[i].owner = -1;
+    *mask = slots - 1;
+    return table;
+}
+
+// The slot holding `identity`, or the empty slot it would go into
+dir_identity_slot* dir_identity_slot_of(dir_identity_slot* table, unsigned int mask, const dir_identity* identity) {
+    unsigned int slot = hash_bytes(identity, sizeof(*identity)) & mask;
+    while (table[slot].owner >= 0 && memcmp(&table[slot].identity, identity, sizeof(*identity)) != 0)
+        slot = (slot + 1) & mask;
+    return &table[slot];
+}
+
+orphan_entry* orphan_add(orphan_report* report, orphan_kind kind, const char* name, const char* path) {
+    if (report->count == report->capacity) {
+        const int capacity  = report->capacity ? report->capacity * 2 : 32;
+        orphan_entry* grown = (orphan_entry*)arena_alloc(&report->arena, capacity * sizeof(orphan_entry));
+        if (!grown)
+            return NULL;
+        if (report->count > 0)
+            memcpy(grown, report->entries, report->count * sizeof(orphan_entry));
+        report->entries  = grown;
+        report->capacity = capacity;
+    }
+
+    orphan_entry* entry = &report->entries[report->count];
+    ZeroMemory(entry, sizeof(*entry));
+    entry->kind = kind;
+    entry->name = arena_strdup(&report->arena, name);
+    entry->path = arena_strdup(&report->arena, path);
+    if (!entry->name || !entry->path)
+        return NULL;
+
+    report->count++;
+    return entry;
+}
+
+// Adds every Service Center XML file that none of `keys`, the keys of both registry views (excluded ones included),
+// is named after
+BOOL find_orphan_xml_files(orphan_report* report, const registry_key_info* keys, int key_count, arena* scratch) {
+    // Every XML file would look orphaned if the keys couldn't be read
+    if (key_count == 0) {
+        _WARN("No registry keys found below 'HKEY_LOCAL_MACHINE\\%s', not looking for orphaned XML files",
+              _LIBRARY_REGISTRY_PATH);
+        return TRUE;
+    }
+
+    plan_xml_file* files = NULL;
+    const int count      = read_service_center(scratch, &files);
+    if (count < 0) {
+        _ERROR("Failed to list Service Center, not looking for orphaned XML files");
+        return FALSE;
+    }
+
+    unsigned int mask    = 0;
+    plan_xml_file* table = plan_hash_xml_files(scratch, files, count, &mask);
+    BYTE* matched        = table ? (BYTE*)arena_alloc(scratch, mask + 1) : NULL;
+    if (!matched)
+        return FALSE;
+
+    // Joined by probing the listing with every key name
+    ZeroMemory(matched, mask + 1);
+    for (int i = 0; i < key_count; i++) {
+        const wchar_t* name       = keys[i].wide_name;
+        const plan_xml_file* file = plan_find_xml(table, mask, name, wcslen(name));
+        if (file)
+            matched[file - table] = TRUE;
+    }
+
+    for (unsigned int slot = 0; slot <= mask; slot++) {
+        if (!table[slot].name || matched[slot])
+            continue;
+
+        wchar_t* wide_name = strpool_walloc(table[slot].len + 1);
+        if (wide_name) {
+            memcpy(wide_name, table[slot].name, table[slot].len * sizeof(wchar_t));
+            wide_name[table[slot].len] = L'\0';
+        }
+
+        const char* name = wide_name ? wide_to_utf8(wide_name) : NULL;
+        if (!name)
+            return FALSE;
+        if (is_excluded_key(name))
+            continue;
+
+        orphan_entry* entry =
+          orphan_add(report, ORPHAN_XML, name, strpool_sprintf("%s\\%s.xml", PATHS.service_center_utf8, name));
+        if (!entry)
+            return FALSE;
+        entry->size       = table[slot].size;
+        entry->size_known = TRUE;
+    }
+
+    return TRUE;
+}
+
+// A content directory some registry key points at
+typedef struct {
+    const char* name;
+    const char* content_dir;
+} content_dir_owner;
+
+// Reads the ContentDir of every key in `keys`, the keys of both registry views. Excluded keys and ones the scan
+// couldn't read are included, since a folder any key points at isn't an orphan whether or not it's listed. Keys
+// without a ContentDir are left out. Returns -1 if any key's ContentDir couldn't be read: that key's folder could be
+// any of the candidates, so none of them can be told apart from an orphan.
+int read_content_dir_owners(HKEY const view_keys[],
+                            const registry_key_info* keys,
+                            int key_count,
+                            arena* a,
+                            content_dir_owner** owners) {
+    *owners = (content_dir_owner*)arena_alloc(a, (key_count + 1) * sizeof(content_dir_owner));
+    if (!*owners)
+        return -1;
+
+    int count = 0;
+    for (int i = 0; i < key_count; i++) {
+        const registry_key_info* key = &keys[i];
+        const char* content_dir      = NULL;
+        for (int view = 0; !content_dir && view < _REGISTRY_VIEW_COUNT; view++) {
+            if (!(key->views & (1 << view)) || !view_keys[view])
+                continue;
+
+            content_dir = read_library_value(view_keys[view], key->wide_name, L"ContentDir");
+            const DWORD error = content_dir ? ERROR_SUCCESS : GetLastError();
+            if (!content_dir && error != ERROR_FILE_NOT_FOUND) {
+                _ERROR("Failed to read ContentDir value of registry key: 'HKEY_LOCAL_MACHINE\\%s\\%s' (Error: %lu)",
+                       REGISTRY_VIEWS[view].path,
+                       key->name,
+                       error);
+                return -1;
+            }
+        }
+
+        // On an offline image only folders where the image is mounted are looked at
+        if (content_dir && TARGET.software)
+            content_dir = target_file_path(content_dir);
+        if (!content_dir || !content_dir[0])
+            continue;
+
+        content_dir_owner* owner = &(*owners)[count];
+        owner->name              = key->name;
+        owner->content_dir       = arena_strdup(a, content_dir);
+        if (!owner->content_dir)
+            return -1;
+        count++;
+    }
+
+    return count;
+}
+
+// Whether `path` holds `dir` (or is it), going by spelling. Used on top of the identity checks, so a folder that
+// holds a registered library or sits inside one is never offered for removal.
+BOOL path_contains(const char* path, const char* dir) {
+    size_t len = strlen(path);
+    while (len > 0 && _IS_PATH_SEPARATOR(path[len - 1]))
+        len--;
+    return _strnicmp(path, dir, len) == 0 && (dir[len] == '\0' || _IS_PATH_SEPARATOR(dir[len]));
+}
+
+BOOL path_equals(const char* lhs, const char* rhs) {
+    return path_contains(lhs, rhs) && path_contains(rhs, lhs);
+}
+
+// Lists the library folders in `parent` that none of `owners`' content directories is, and adds them to the report
+BOOL find_orphans_in(orphan_report* report,
+                     const wpath* parent,
+                     const content_dir_owner* owners,
+                     int owner_count,
+                     dir_identity_slot* libraries,
+                     unsigned int mask,
+                     const volatile LONG* cancel) {
+    arena* scratch       = scratch_arena();
+    const wpath* pattern = wpath_join(scratch, parent, L"*", 1);
+    if (!pattern)
+        return FALSE;
+
+    WIN32_FIND_DATAW find_data;
+    const HANDLE h_find = FindFirstFileExW(
+      pattern->text, FindExInfoBasic, &find_data, FindExSearchLimitToDirectories, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    if (h_find == INVALID_HANDLE_VALUE)
+        return TRUE;
+
+    BOOL ok = TRUE;
+    do {
+        const wchar_t* name = find_data.cFileName;
+        const size_t len    = wcslen(name);
+        if (!(find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+            (find_data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) || wcscmp(name, L".") == 0 ||
+            wcscmp(name, L"..") == 0)
+            continue;
+
+        // Folders renamed aside by a removal are deleted by it
+        if (wcsstr(name, _CRT_WIDE(_REMOVAL_STAGED_SUFFIX)))
+            continue;
+
+        const arena_mark mark = arena_save(scratch);
+        const wpath* dir      = wpath_join(scratch, parent, name, len);
+        const wpath* marker =
+          dir ? wpath_join(scratch, dir, _ORPHAN_LIBRARY_MARKER, wcslen(_ORPHAN_LIBRARY_MARKER)) : NULL;
+        if (!marker) {
+            ok = FALSE;
+            break;
+        }
+
+        WIN32_FIND_DATAW marker_data;
+        const HANDLE h_marker =
+          FindFirstFileExW(marker->text, FindExInfoBasic, &marker_data, FindExSearchNameMatch, NULL, 0);
+        const BOOL is_library = h_marker != INVALID_HANDLE_VALUE;
+        if (is_library)
+            FindClose(h_marker);
+
+        dir_identity identity;
+        if (is_library && get_dir_identity(dir->text, &identity) &&
+            dir_identity_slot_of(libraries, mask, &identity)->owner < 0) {
+            const char* path      = wide_to_utf8(wpath_plain(dir));
+            const char* name_utf8 = wide_to_utf8(name);
+            BOOL registered       = FALSE;
+            for (int i = 0; path && !registered && i < owner_count; i++)
+                registered =
+                  path_contains(path, owners[i].content_dir) || path_contains(owners[i].content_dir, path);
+
+            orphan_entry* entry =
+              path && name_utf8 && !registered ? orphan_add(report, ORPHAN_CONTENT_DIR, name_utf8, path) : NULL;
+            if (entry) {
+                const LONG not_cancelled = 0;
+                size_index_item item     = {.name = entry->name, .root = dir->text};
+                entry->size_known        = size_index_walk(&item, cancel ? cancel : &not_cancelled);
+                entry->size              = item.bytes;
+            } else if (!registered) {
+                ok = FALSE;
+            }
+        }
+
+        arena_rewind(scratch, mark);
+    } while (ok && !(cancel && *cancel) && FindNextFileW(h_find, &find_data));
+
+    FindClose(h_find);
+    return ok;
+}
+
+// Indexes the registry keys of both views, Service Center's listing and the identities of every content directory a
+// key points at in one pass and joins them into `report`. Orphaned content directories are looked for beside the
+// registered ones, which is where libraries are installed.
+BOOL find_orphans(orphan_report* report, worker_job* job) {
+    stats_operation stats;
+    stats_begin(&stats, "orphan scan");
+
+    arena* scratch        = scratch_arena();
+    const arena_mark mark = arena_save(scratch);
+
+    HKEY view_keys[_REGISTRY_VIEW_COUNT] = {0};
+    registry_key_info* keys              = NULL;
+    const int key_count                  = open_library_views(scratch, view_keys, &keys);
+    if (key_count < 0) {
+        arena_rewind(scratch, mark);
+        stats_end(&stats, FALSE);
+        return FALSE;
+    }
+
+    content_dir_owner* owners = NULL;
+    const int owner_count     = read_content_dir_owners(view_keys, keys, key_count, scratch, &owners);
+    close_registry_views(view_keys);
+
+    const BOOL xml_ok = find_orphan_xml_files(report, keys, key_count, scratch);
+    BOOL ok           = TRUE;
+    if (owner_count < 0) {
+        _ERROR("Not looking for orphaned content directories, since not every registry key could be read");
+        arena_rewind(scratch, mark);
+        stats_end(&stats, FALSE);
+        return FALSE;
+    }
+
+    unsigned int library_mask    = 0;
+    unsigned int parent_mask     = 0;
+    dir_identity_slot* libraries = dir_identity_table(scratch, owner_count, &library_mask);
+    dir_identity_slot* parents   = dir_identity_table(scratch, owner_count, &parent_mask);
+    const wpath** parent_paths   = (const wpath**)arena_alloc(scratch, (owner_count + 1) * sizeof(wpath*));
+    int parent_count             = 0;
+    if (!libraries || !parents || !parent_paths) {
+        arena_rewind(scratch, mark);
+        stats_end(&stats, FALSE);
+        return FALSE;
+    }
+
+    // Registered content directories first, so none of them is taken for an orphan of a sibling
+    for (int i = 0; ok && i < owner_count; i++) {
+        // Registry values often end in a separator, which would make the directory its own parent
+        const content_dir_owner* owner = &owners[i];
+        char* content_dir              = strpool_strdup(owner->content_dir);
+        size_t len                     = content_dir ? strlen(content_dir) : 0;
+        while (len > 0 && _IS_PATH_SEPARATOR(content_dir[len - 1]))
+            content_dir[--len] = '\0';
+
+        // A drive's root has no parent to look beside
+        const wpath* dir = len > 0 && strchr(content_dir, '\\') ? wpath_from_utf8(scratch, content_dir) : NULL;
+        if (!dir)
+            continue;
+
+        dir_identity identity;
+        if (!get_dir_identity(dir->text, &identity)) {
+            // A folder that's there but can't be opened could be any sibling under another spelling
+            const DWORD error = GetLastError();
+            if (error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND)
+                continue;
+            _ERROR("Failed to identify content directory of '%s', not looking for orphans beside it: '%s' "
+                   "(Error: %lu)",
+                   owner->name,
+                   owner->content_dir,
+                   error);
+            ok = FALSE;
+            break;
+        }
+
+        dir_identity_slot* slot = dir_identity_slot_of(libraries, library_mask, &identity);
+        if (slot->owner >= 0) {
+            orphan_entry* entry = orphan_add(report, ORPHAN_SHARED_DIR, owners[slot->owner].name, owner->content_dir);
+            if (entry)
+                entry->other = arena_strdup(&report->arena, owner->name);
+            ok = entry && entry->other;
+            continue;
+        }
+        slot->identity = identity;
+        slot->owner    = i;
+
+        // A parent that is a drive ("\\?\D:") has to keep its separator to mean the drive's root directory
+        const wpath* parent = wpath_parent(scratch, dir);
+        if (parent && parent->len > 0 && parent->text[parent->len - 1] == L':')
+            parent = wpath_join(scratch, parent, L"", 0);
+        if (!parent || !get_dir_identity(parent->text, &identity))
+            continue;
+
+        slot = dir_identity_slot_of(parents, parent_mask, &identity);
+        if (slot->owner < 0) {
+            slot->identity               = identity;
+            slot->owner                  = parent_count;
+            parent_paths[parent_count++] = parent;
+        }
+    }
+
+    for (int i = 0; ok && i < parent_count && !worker_is_cancelled(job); i++)
+        ok = find_orphans_in(
+          report, parent_paths[i], owners, owner_count, libraries, library_mask, worker_cancel_flag(job));
+
+    arena_rewind(scratch, mark);
+
+    ULONGLONG bytes = 0;
+    for (int i = 0; i < report->count; i++) {
+        if (report->entries[i].kind != ORPHAN_SHARED_DIR)
+            bytes += report->entries[i].size;
+    }
+    _INFO("Found %d orphan(s) taking %llu bytes", report->count, bytes);
+
+    ok = ok && xml_ok;
+    stats_end(&stats, ok);
+    return ok;
+}
+
+// Deletes the XML files in `report`, and its content directories with the job's `remove_content` (ORPHAN_SHARED_DIR
+// entries are left alone), setting each entry's `removed`. XML files go into one backup snapshot with the job's
+// `backup_files`; content directories never do.
+BOOL remove_orphans(orphan_report* report, worker_job* job) {
+    const BOOL remove_content = job->remove_content;
+
+    stats_operation stats;
+    stats_begin(&stats, "orphan removal");
+
+    backup_snapshot snapshot;
+    backup_snapshot* backup = NULL;
+    if (job->backup_files) {
+        if (!snapshot_begin(&snapshot)) {
+            _ERROR("Failed to start backup snapshot, no orphans were removed");
+            stats_end(&stats, FALSE);
+            return FALSE;
+        }
+        backup = &snapshot;
+    }
+
+    const library_entry** dirs = (const library_entry**)calloc(report->count + 1, sizeof(library_entry*));
+    library_entry* entries     = (library_entry*)calloc(report->count + 1, sizeof(library_entry));
+    BOOL* results              = (BOOL*)calloc(report->count + 1, sizeof(BOOL));
+    int* dir_orphans           = (int*)calloc(report->count + 1, sizeof(int));
+    int dir_count              = 0;
+    BOOL ok                    = dirs && entries && results && dir_orphans;
+
+    worker_set_total(job, report->count);
+    for (int i = 0; ok && i < report->count && !worker_is_cancelled(job); i++) {
+        orphan_entry* orphan = &report->entries[i];
+        if (orphan->kind == ORPHAN_XML) {
+            orphan->removed = remove_shared_file(strpool_wpath(orphan->path), orphan->size, backup);
+            if (orphan->removed)
+                _INFO("Removed orphaned XML file: '%s'", orphan->path);
+            worker_report_progress(job);
+        } else if (orphan->kind == ORPHAN_CONTENT_DIR && remove_content) {
+            // remove_content_dirs() works on library entries, one worker per physical drive
+            entries[dir_count].name        = orphan->name;
+            entries[dir_count].content_dir = orphan->path;
+            dirs[dir_count]                = &entries[dir_count];
+            results[dir_count]             = TRUE;
+            dir_orphans[dir_count++]       = i;
+        }
+    }
+
+    if (ok && dir_count > 0 && !worker_is_cancelled(job)) {
+        remove_content_dirs(dirs, results, dir_count, job);
+        for (int i = 0; i < dir_count; i++)
+            report->entries[dir_orphans[i]].removed = results[i];
+    }
+
+    if (backup)
+        snapshot_finish(backup);
+
+    for (int i = 0; ok && i < report->count; i++) {
+        const orphan_entry* orphan = &report->entries[i];
+        if (is_removable_orphan(orphan, remove_content))
+            ok = orphan->removed;
+    }
+
+    free(dirs);
+    free(entries);
+    free(results);
+    free(dir_orphans);
+    stats_end(&stats, ok);
+    return ok;
+}
+
+void orphan_report_destroy(orphan_report* report) {
+    arena_destroy(&report->arena);
+    ZeroMemory(report, sizeof(*report));
+}
+
+BOOL get_volume_serial(const wchar_t* path, DWORD* serial) {
+    const HANDLE h_path = CreateFileW(path,
+                                      FILE_READ_ATTRIBUTES,
+                                      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                      NULL,
+                                      OPEN_EXISTING,
+                                      FILE_FLAG_BACKUP_SEMANTICS,
+                                      NULL);
+    if (h_path == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    const BOOL result = GetVolumeInformationByHandleW(h_path, NULL, 0, serial, NULL, NULL, NULL, 0);
+    CloseHandle(h_path);
+    return result;
+}
+
+// Whether `src` and the directory that will contain `dst` live on the same volume. `dst` itself usually doesn't exist
+// yet, so its parent is checked instead.
+BOOL is_same_volume(const wchar_t* src, const wchar_t* dst) {
+    const size_t dst_len = wcslen(dst) + 1;
+    wchar_t* dst_parent  = strpool_walloc(dst_len);
+    if (!dst_parent)
+        return FALSE;
+
+    wcscpy_s(dst_parent, dst_len, dst);
+    if (FAILED(PathCchRemoveFileSpec(dst_parent, dst_len)))
+        return FALSE;
+
+    DWORD src_serial = 0, dst_serial = 0;
+    if (!get_volume_serial(src, &src_serial) || !get_volume_serial(dst_parent, &dst_serial))
+        return FALSE;
+
+    return src_serial == dst_serial;
+}
+
+// Moves the library's content directory to `new_path` and points the registry at the new location. Moves within a
+// volume are a single rename; anything else is copied (resuming from the relocation journal if a previous attempt was
+// interrupted) and the original deleted afterwards.
+BOOL relocate_library(const library_entry* library, const char* new_path, worker_job* job) {
+    _INFO("Relocating library '%s'", library->name);
+    _INFO("Old Path: %s", library->content_dir);
+    _INFO("New Path: %s", new_path);
+
+    // Deleting the source would take the new location with it
+    if (path_contains(library->content_dir, new_path)) {
+        _ERROR("The new location is the library's content directory or inside it: '%s'", new_path);
+        return FALSE;
+    }
+
+    worker_set_total(job, 3);
+
+    stats_operation stats;
+    stats_begin(&stats, "relocation");
+
+    wchar_t* src_w = make_long_path(library->content_dir);
+    wchar_t* dst_w = make_long_path(new_path);
+    if (!src_w || !dst_w) {
+        stats_end(&stats, FALSE);
+        return FALSE;
+    }
+
+    BOOL moved = FALSE;
+    if (is_same_volume(src_w, dst_w)) {
+        // No MOVEFILE_COPY_ALLOWED, so this either renames in place or fails and we fall through to the copy
+        moved = MoveFileExW(src_w, dst_w, MOVEFILE_WRITE_THROUGH);
+        if (moved) {
+            _INFO("Moved content directory within the same volume");
+        } else {
+            _WARN("Failed to move content directory within volume (Error: %lu), falling back to copy",
+                  GetLastError());
+        }
+    }
+
+    // Kept open until the registry points at the new location, so a resumed relocation redoes the registry step while
+    // the original is still there
+    relocation_journal journal = {0};
+    BOOL journaled             = FALSE;
+
+    if (moved) {
+        // Copy and delete steps are both done
+        worker_report_progress(job);
+        worker_report_progress(job);
+    } else {
+        journaled = journal_open(&journal, library->name, library->content_dir, new_path);
+        if (!journaled)
+            _WARN("Relocating without a journal, an interrupted relocation will have to start over");
+
+        if (!copy_directory(library->content_dir, new_path, job, journaled ? &journal : NULL)) {
+            _ERROR("Failed to copy content directory to new location: '%s'", new_path);
+            if (journaled)
+                journal_close(&journal, FALSE);
+            stats_end(&stats, FALSE);
+            return FALSE;
+        }
+    }
+
+    const BOOL updated = write_content_dir(library, new_path);
+
+    if (journaled)
+        journal_close(&journal, updated);
+
+    if (!updated) {
+        // A rename already took the content away from where ContentDir still points, so put it back
+        if (moved && !MoveFileExW(dst_w, src_w, MOVEFILE_WRITE_THROUGH)) {
+            _ERROR("Failed to move the content directory back to '%s' (Error: %lu), the library's content is now in "
+                   "'%s'",
+                   library->content_dir,
+                   GetLastError(),
+                   new_path);
+        }
+        stats_end(&stats, FALSE);
+        return FALSE;
+    }
+
+    worker_report_progress(job);
+
+    // Only once the registry points at the copy, so a failure up to here always leaves the original in place
+    if (!moved) {
+        if (!rm_rf(src_w, NULL)) {
+            _WARN("Library (%s) was copied to new location but K8-LRT was unable to delete the original library "
+                  "content directory.",
+                  library->name);
+        }
+        worker_report_progress(job);
+    }
+
+    _INFO("Finished relocating library");
+    stats_end(&stats, TRUE);
+    return TRUE;
+}
+
+VOID CALLBACK run_worker_job(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_WORK work) {
+    worker_job* job = (worker_job*)context;
+
+    switch (job->kind) {
+        case JOB_REMOVE:
+            remove_libraries(job->libraries, job->lib_count, job->remove_content, &job->summary, job, NULL);
+            break;
+
+        case JOB_RELOCATE:
+            job->relocated = relocate_library(job->libraries[0], job->new_path, job);
+            break;
+
+        case JOB_RESTORE:
+            job->restored = restore_snapshot(job->snapshot_path, job);
+            break;
+
+        case JOB_ORPHANS:
+            job->orphans_ok = job->orphans_removing ? remove_orphans(job->orphans, job)
+                                                    : find_orphans(job->orphans, job);
+            break;
+
+        case JOB_SCAN:
+            job->scanned = stream_libraries(job);
+            break;
+    }
+
+    scratch_release();
+    PostMessage(job->notify, WM_WORKER_DONE, 0, (LPARAM)job);
+}
+
+// Allocates a job for `count` libraries. The caller fills in `libraries` and the options before starting it.
+worker_job* worker_create_job(worker_job_kind kind, HWND notify, int count) {
+    worker_job* job = (worker_job*)calloc(1, sizeof(worker_job));
+    if (!job)
+        return NULL;
+
+    job->libraries = (const library_entry**)calloc(count, sizeof(library_entry*));
+    if (!job->libraries) {
+        free(job);
+        return NULL;
+    }
+
+    job->kind      = kind;
+    job->notify    = notify;
+    job->lib_count = count;
+    return job;
+}
+
+void worker_free_job(worker_job* job) {
+    if (!job)
+        return;
+    if (job->orphans) {
+        orphan_report_destroy(job->orphans);
+        free(job->orphans);
+    }
+    arena_destroy(&job->scan_arena);
+    free(job->libraries);
+    free(job);
+}
+
+void worker_shutdown(void) {
+    if (ACTIVE_JOB)
+        InterlockedExchange(&ACTIVE_JOB->cancelled, TRUE);
+
+    if (WORKER_CLEANUP) {
+        // Waits for any outstanding callbacks and closes their work objects
+        CloseThreadpoolCleanupGroupMembers(WORKER_CLEANUP, FALSE, NULL);
+        CloseThreadpoolCleanupGroup(WORKER_CLEANUP);
+        WORKER_CLEANUP = NULL;
+    }
+
+    if (WORKER_POOL) {
+        DestroyThreadpoolEnvironment(&WORKER_ENV);
+        CloseThreadpool(WORKER_POOL);
+        WORKER_POOL = NULL;
+    }
+
+    worker_free_job(ACTIVE_JOB);
+    ACTIVE_JOB = NULL;
+}
+
+BOOL worker_start_job(worker_job* job) {
+    _ASSERT(ACTIVE_JOB == NULL);
+
+    job->work = worker_submit(run_worker_job, job);
+    if (!job->work)
+        return FALSE;
+
+    ACTIVE_JOB = job;
+    return TRUE;
+}
+
+// Called by the notify window when it receives WM_WORKER_DONE
+void worker_finish_job(worker_job* job) {
+    worker_wait(job->work);
+    job->work = NULL;
+    if (ACTIVE_JOB == job)
+        ACTIVE_JOB = NULL;
+}
+
+void worker_cancel_job(worker_job* job) {
+    if (job) {
+        InterlockedExchange(&job->cancelled, TRUE);
+        _INFO("Cancellation requested");
+    }
+}
+
+// Posted to the main window whenever a watched registry key or directory changes
+#define WM_WATCHER_CHANGED (WM_APP + 3)
+// Restarted by every WM_WATCHER_CHANGED, so a burst of changes (e.g. an installer run) triggers a single rescan
+#define IDT_WATCHER_REFRESH 1
+#define _WATCHER_DEBOUNCE_MS 750
+#define _WATCHER_DIR_COUNT 2
+
+typedef struct {
+    wchar_t path[MAX_PATH];
+    HANDLE handle;
+    OVERLAPPED overlapped;
+    DWORD buffer[1024];  // ReadDirectoryChangesW needs a DWORD-aligned buffer
+} watched_directory;
+
+static HANDLE WATCHER_THREAD = NULL;
+static HANDLE WATCHER_STOP   = NULL;
+
+BOOL arm_registry_watch(HKEY key, HANDLE event) {
+    const LONG result =
+      RegNotifyChangeKeyValue(key, TRUE, REG_NOTIFY_CHANGE_NAME | REG_NOTIFY_CHANGE_LAST_SET, event, TRUE);
+    return result == ERROR_SUCCESS;
+}
+
+BOOL arm_directory_watch(watched_directory* dir) {
+    return ReadDirectoryChangesW(dir->handle,
+                                 dir->buffer,
+                                 sizeof(dir->buffer),
+                                 FALSE,
+                                 FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME |
+                                   FILE_NOTIFY_CHANGE_LAST_WRITE,
+                                 NULL,
+                                 &dir->overlapped,
+                                 NULL);
+}
+
+void close_watched_directory(watched_directory* dir) {
+    if (dir->handle) {
+        // The pending read still references `dir`, so wait for the cancellation to land
+        DWORD bytes = 0;
+        CancelIoEx(dir->handle, &dir->overlapped);
+        GetOverlappedResult(dir->handle, &dir->overlapped, &bytes, TRUE);
+        CloseHandle(dir->handle);
+        dir->handle = NULL;
+    }
+
+    if (dir->overlapped.hEvent) {
+        CloseHandle(dir->overlapped.hEvent);
+        dir->overlapped.hEvent = NULL;
+    }
+}
+
+BOOL open_watched_directory(watched_directory* dir) {
+    dir->handle = CreateFileW(dir->path,
+                              FILE_LIST_DIRECTORY,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              NULL,
+                              OPEN_EXISTING,
+                              FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+                              NULL);
+    if (dir->handle == INVALID_HANDLE_VALUE) {
+        dir->handle = NULL;
+        _WARN("Not watching directory: %ls (Error: %lu)", dir->path, GetLastError());
+        return FALSE;
+    }
+
+    dir->overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!dir->overlapped.hEvent || !arm_directory_watch(dir)) {
+        _WARN("Failed to watch directory: %ls (Error: %lu)", dir->path, GetLastError());
+        close_watched_directory(dir);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+DWORD WINAPI watcher_proc(LPVOID param) {
+    const HWND notify = (HWND)param;
+
+    // One watch per registry view, since a library can be registered in either
+    HKEY keys[_REGISTRY_VIEW_COUNT]         = {0};
+    HANDLE reg_events[_REGISTRY_VIEW_COUNT] = {0};
+    BOOL reg_armed[_REGISTRY_VIEW_COUNT]    = {0};
+    for (int view = 0; view < _REGISTRY_VIEW_COUNT; view++) {
+        const REGSAM sam = KEY_NOTIFY | REGISTRY_VIEWS[view].sam;
+        reg_events[view] = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (reg_events[view] &&
+            RegOpenKeyExW(HKEY_LOCAL_MACHINE, _LIBRARY_REGISTRY_PATH_W, 0, sam, &keys[view]) == ERROR_SUCCESS)
+            reg_armed[view] = arm_registry_watch(keys[view], reg_events[view]);
+        else
+            keys[view] = NULL;
+    }
+
+    watched_directory dirs[_WATCHER_DIR_COUNT] = {0};
+
+    const wpath* watched[_WATCHER_DIR_COUNT] = {PATHS.libraries_cache, PATHS.service_center};
+    for (int i = 0; i < _WATCHER_DIR_COUNT; i++) {
+        if (watched[i] && SUCCEEDED(StringCchCopyW(dirs[i].path, MAX_PATH, wpath_plain(watched[i]))))
+            open_watched_directory(&dirs[i]);
+    }
+
+    for (;;) {
+        HANDLE handles[1 + _REGISTRY_VIEW_COUNT + _WATCHER_DIR_COUNT];
+        watched_directory* owners[1 + _REGISTRY_VIEW_COUNT + _WATCHER_DIR_COUNT] = {0};
+        int views[1 + _REGISTRY_VIEW_COUNT + _WATCHER_DIR_COUNT]                 = {0};
+        DWORD count                                                              = 0;
+
+        handles[count++] = WATCHER_STOP;
+        for (int view = 0; view < _REGISTRY_VIEW_COUNT; view++) {
+            if (reg_armed[view]) {
+                views[count]     = view;
+                handles[count++] = reg_events[view];
+            }
+        }
+        for (int i = 0; i < _WATCHER_DIR_COUNT; i++) {
+            if (dirs[i].handle) {
+                owners[count]    = &dirs[i];
+                handles[count++] = dirs[i].overlapped.hEvent;
+            }
+        }
+
+        const DWORD wait = WaitForMultipleObjects(count, handles, FALSE, INFINITE);
+        if (wait == WAIT_OBJECT_0 || wait == WAIT_FAILED || wait >= WAIT_OBJECT_0 + count)
+            break;
+
+        watched_directory* dir = owners[wait - WAIT_OBJECT_0];
+        if (dir) {
+            // A zero-byte result means the buffer overflowed, which still means something changed
+            DWORD bytes = 0;
+            GetOverlappedResult(dir->handle, &dir->overlapped, &bytes, FALSE);
+            if (!arm_directory_watch(dir)) {
+                _WARN("Stopped watching directory: %ls (Error: %lu)", dir->path, GetLastError());
+                close_watched_directory(dir);
+            }
+        } else {
+            const int view  = views[wait - WAIT_OBJECT_0];
+            reg_armed[view] = arm_registry_watch(keys[view], reg_events[view]);
+            if (!reg_armed[view])
+                _WARN("Stopped watching registry for library changes: 'HKEY_LOCAL_MACHINE\\%s'",
+                      REGISTRY_VIEWS[view].path);
+        }
+
+        PostMessage(notify, WM_WATCHER_CHANGED, 0, 0);
+    }
+
+    for (int i = 0; i < _WATCHER_DIR_COUNT; i++)
+        close_watched_directory(&dirs[i]);
+    close_registry_views(keys);
+    for (int view = 0; view < _REGISTRY_VIEW_COUNT; view++) {
+        if (reg_events[view])
+            CloseHandle(reg_events[view]);
+    }
+
+    return 0;
+}
+
+// Starts watching the library registry key and cache directories, posting WM_WATCHER_CHANGED to `notify`
+BOOL watcher_start(HWND notify) {
+    if (WATCHER_THREAD)
+        return TRUE;
+
+    WATCHER_STOP = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!WATCHER_STOP)
+        return FALSE;
+
+    WATCHER_THREAD = CreateThread(NULL, 0, watcher_proc, notify, 0, NULL);
+    if (!WATCHER_THREAD) {
+        CloseHandle(WATCHER_STOP);
+        WATCHER_STOP = NULL;
+        return FALSE;
+    }
+
+    _INFO("Watching registry and cache directories for library changes");
+    return TRUE;
+}
+
+void watcher_stop(void) {
+    if (!WATCHER_THREAD)
+        return;
+
+    SetEvent(WATCHER_STOP);
+    WaitForSingleObject(WATCHER_THREAD, INFINITE);
+    CloseHandle(WATCHER_THREAD);
+    CloseHandle(WATCHER_STOP);
+    WATCHER_THREAD = NULL;
+    WATCHER_STOP   = NULL;
+}
+
+// Posted to the main window when a background update check finishes. lparam: update_check*
+#define WM_UPDATE_CHECKED (WM_APP + 4)
+
+#define _UPDATE_CACHE_FILE "K8-LRT.update.cache"
+#define _UPDATE_CACHE_TTL_HOURS 24
+#define _UPDATE_TIMEOUT_MS 3000
+#define _UPDATE_VERSION_MAX 64
+#define _UPDATE_ETAG_MAX 128
+#define _FILETIME_TICKS_PER_HOUR (36000000000ULL)
+
+typedef struct {
+    ULONGLONG checked;  // FILETIME of the last successful check
+    char etag[_UPDATE_ETAG_MAX];
+    char version[_UPDATE_VERSION_MAX];
+} update_cache;
+
+typedef struct {
+    HWND notify;
+    BOOL forced;     // Started from the menu: bypasses the cache TTL and reports when already up to date
+    BOOL succeeded;  // `latest` holds a version
+    char latest[_UPDATE_VERSION_MAX];
+} update_check;
+
+// Set while a check runs so repeated menu clicks don't stack up requests. Only touched from the UI thread.
+static BOOL UPDATE_CHECK_PENDING = FALSE;
+
+BOOL extract_tag_name(const char* json, char* tag, size_t tag_len) {
+    const char* tag_start = strstr(json, "\"tag_name\"");
+    if (!tag_start)
+        return FALSE;
+
+    const char* value_start = strchr(tag_start, ':');
+    if (!value_start)
+        return FALSE;
+
+    value_start = strchr(value_start, '"');
+    if (!value_start)
+        return FALSE;
+    value_start++;
+
+    const char* value_end = strchr(value_start, '"');
+    if (!value_end)
+        return FALSE;
+
+    const size_t len = value_end - value_start;
+    if (len == 0 || len >= tag_len)
+        return FALSE;
+
+    memcpy(tag, value_start, len);
+    tag[len] = '\0';
+
+    return TRUE;
+}
+
+// Compares version numbers (strips 'v' prefix if present).
+// Returns 0 if versions match
+int compare_versions(const char* v1, const char* v2) {
+    int major1 = 0, minor1 = 0, patch1 = 0;
+    int major2 = 0, minor2 = 0, patch2 = 0;
+
+    // Skip 'v' prefix if present
+    if (v1[0] == 'v')
+        v1++;
+    if (v2[0] == 'v')
+        v2++;
+
+    sscanf_s(v1, "%d.%d.%d", &major1, &minor1, &patch1);
+    sscanf_s(v2, "%d.%d.%d", &major2, &minor2, &patch2);
+
+    if (major1 != major2)
+        return major1 - major2;
+    if (minor1 != minor2)
+        return minor1 - minor2;
+    return patch1 - patch2;
+}
+
+ULONGLONG current_filetime(void) {
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    return filetime_to_u64(now);
+}
+
+BOOL read_update_cache(update_cache* cache) {
+    memset(cache, 0, sizeof(*cache));
+
+    FILE* file = NULL;
+    if (fopen_s(&file, _UPDATE_CACHE_FILE, "r") != 0)
+        return FALSE;
+
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        strip_newline(line);
+
+        if (strncmp(line, "checked=", 8) == 0)
+            cache->checked = _strtoui64(line + 8, NULL, 10);
+        else if (strncmp(line, "etag=", 5) == 0)
+            strncpy_s(cache->etag, sizeof(cache->etag), line + 5, _TRUNCATE);
+        else if (strncmp(line, "version=", 8) == 0)
+            strncpy_s(cache->version, sizeof(cache->version), line + 8, _TRUNCATE);
+    }
+
+    fclose(file);
+    return cache->version[0] != '\0';
+}
+
+void write_update_cache(const update_cache* cache) {
+    FILE* file = NULL;
+    if (fopen_s(&file, _UPDATE_CACHE_FILE, "w") != 0) {
+        _WARN("Failed to write update cache: '%s'", _UPDATE_CACHE_FILE);
+        return;
+    }
+
+    fprintf(file, "checked=%llu\netag=%s\nversion=%s\n", cache->checked, cache->etag, cache->version);
+    fclose(file);
+}
+
+// Reads the whole response body into one buffer that doubles as needed, starting at Content-Length when known
+char* read_response_body(HINTERNET h_request) {
+    DWORD content_length = 0;
+    DWORD header_size    = sizeof(content_length);
+    WinHttpQueryHeaders(h_request,
+                        WINHTTP_QUERY_CONTENT_LENGTH | WINHTTP_QUERY_FLAG_NUMBER,
+                        WINHTTP_HEADER_NAME_BY_INDEX,
+                        &content_length,
+                        &header_size,
+                        WINHTTP_NO_HEADER_INDEX);
+
+    size_t capacity = content_length > 0 ? (size_t)content_length + 1 : 16 * 1024;
+    size_t size     = 0;
+    char* buffer    = (char*)malloc(capacity);
+    if (!buffer)
+        return NULL;
+
+    for (;;) {
+        if (capacity - size < 4096) {
+            char* grown = (char*)realloc(buffer, capacity * 2);
+            if (!grown) {
+                _ERROR("Memory allocation failed");
+                free(buffer);
+                return NULL;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+
+        DWORD bytes_read = 0;
+        if (!WinHttpReadData(h_request, buffer + size, (DWORD)(capacity - size - 1), &bytes_read)) {
+            _ERROR("WinHttpReadData failed: %lu", GetLastError());
+            free(buffer);
+            return NULL;
+        }
+
+        if (bytes_read == 0)
+            break;
+        size += bytes_read;
+    }
+
+    buffer[size] = '\0';
+    return buffer;
+}
+
+// Fetch the latest version of K8-LRT from the GitHub API. Sends the cached ETag so an unchanged release costs a
+// 304 and no body. Updates `cache` on success.
+BOOL fetch_latest_version(update_cache* cache) {
+    HINTERNET h_session = NULL;
+    HINTERNET h_connect = NULL;
+    HINTERNET h_request = NULL;
+    char* response_data = NULL;
+    BOOL success        = FALSE;
+
+    h_session =
+      WinHttpOpen(L"K8-LRT/1.0", WINHTTP_ACCESS_TYPE_DEFAULT_PROXY, WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0);
+    if (!h_session) {
+        _ERROR("WinHttpOpen failed: %lu", GetLastError());
+        goto cleanup;
+    }
+
+    // Offline machines should give up quickly instead of waiting out the default timeouts
+    WinHttpSetTimeouts(h_session, _UPDATE_TIMEOUT_MS, _UPDATE_TIMEOUT_MS, _UPDATE_TIMEOUT_MS, _UPDATE_TIMEOUT_MS);
+
+    h_connect = WinHttpConnect(h_session, L"api.github.com", INTERNET_DEFAULT_HTTPS_PORT, 0);
+    if (!h_connect) {
+        _ERROR("WinHttpConnect failed: %lu", GetLastError());
+        goto cleanup;
+    }
+
+    h_request = WinHttpOpenRequest(h_connect,
+                                   L"GET",
+                                   L"/repos/jakerieger/K8-LRT/releases/latest",
+                                   NULL,
+                                   WINHTTP_NO_REFERER,
+                                   WINHTTP_DEFAULT_ACCEPT_TYPES,
+                                   WINHTTP_FLAG_SECURE);
+    if (!h_request) {
+        _ERROR("WinHttpOpenRequest failed: %lu", GetLastError());
+        goto cleanup;
+    }
+
+    LPCWSTR headers = L"User-Agent: K8-LRT/1.0\r\n";
+    WinHttpAddRequestHeaders(h_request, headers, -1L, WINHTTP_ADDREQ_FLAG_ADD);
+
+    if (cache->etag[0] && cache->version[0]) {
+        wchar_t etag_header[_UPDATE_ETAG_MAX + 32];
+        StringCchPrintfW(etag_header, _UPDATE_ETAG_MAX + 32, L"If-None-Match: %S\r\n", cache->etag);
+        WinHttpAddRequestHeaders(h_request, etag_header, -1L, WINHTTP_ADDREQ_FLAG_ADD);
+    }
+
+    if (!WinHttpSendRequest(h_request, WINHTTP_NO_ADDITIONAL_HEADERS, 0, WINHTTP_NO_REQUEST_DATA, 0, 0, 0)) {
+        _ERROR("WinHttpSendRequest failed: %lu", GetLastError());
+        goto cleanup;
+    }
+
+    if (!WinHttpReceiveResponse(h_request, NULL)) {
+        _ERROR("WinHttpReceiveResponse failed: %lu", GetLastError());
+        goto cleanup;
+    }
+
+    DWORD status_code      = 0;
+    DWORD status_code_size = sizeof(status_code);
+    WinHttpQueryHeaders(h_request,
+                        WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER,
+                        NULL,
+                        &status_code,
+                        &status_code_size,
+                        NULL);
+
+    if (status_code == 304) {
+        _INFO("Latest release unchanged since last check (%s)", cache->version);
+        cache->checked = current_filetime();
+        success        = TRUE;
+        goto cleanup;
+    }
+
+    if (status_code != 200) {
+        _ERROR("HTTP request failed with status code: %lu", status_code);
+        goto cleanup;
+    }
+
+    response_data = read_response_body(h_request);
+    if (!response_data || !extract_tag_name(response_data, cache->version, sizeof(cache->version))) {
+        _ERROR("Failed to read latest version from response");
+        goto cleanup;
+    }
+
+    wchar_t etag[_UPDATE_ETAG_MAX];
+    DWORD etag_size = sizeof(etag);
+    cache->etag[0]  = '\0';
+    if (WinHttpQueryHeaders(
+          h_request, WINHTTP_QUERY_ETAG, WINHTTP_HEADER_NAME_BY_INDEX, etag, &etag_size, WINHTTP_NO_HEADER_INDEX)) {
+        WideCharToMultiByte(CP_UTF8, 0, etag, -1, cache->etag, sizeof(cache->etag), NULL, NULL);
+    }
+
+    cache->checked = current_filetime();
+    success        = TRUE;
+
+cleanup:
+    if (response_data)
+        free(response_data);
+    if (h_request)
+        WinHttpCloseHandle(h_request);
+    if (h_connect)
+        WinHttpCloseHandle(h_connect);
+    if (h_session)
+        WinHttpCloseHandle(h_session);
+
+    return success;
+}
+
+VOID CALLBACK run_update_check(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_WORK work) {
+    update_check* check = (update_check*)context;
+
+    update_cache cache  = {0};
+    const BOOL cached   = read_update_cache(&cache);
+    const ULONGLONG ttl = _UPDATE_CACHE_TTL_HOURS * _FILETIME_TICKS_PER_HOUR;
+    const BOOL fresh    = cached && current_filetime() - cache.checked < ttl;
+
+    if (fresh && !check->forced) {
+        _INFO("Skipping update check, last check was less than %d hours ago", _UPDATE_CACHE_TTL_HOURS);
+        check->succeeded = TRUE;
+    } else {
+        stats_operation stats;
+        stats_begin(&stats, "update check");
+        if (fetch_latest_version(&cache)) {
+            write_update_cache(&cache);
+            check->succeeded = TRUE;
+        }
+        stats_time_scope(STAT_SCOPE_UPDATE_CHECK, stats.start);
+        stats_end(&stats, check->succeeded);
+    }
+
+    if (check->succeeded)
+        strncpy_s(check->latest, sizeof(check->latest), cache.version, _TRUNCATE);
+
+    if (!PostMessage(check->notify, WM_UPDATE_CHECKED, 0, (LPARAM)check))
+        free(check);
+}
+
+// Checks for a new release on the worker pool and posts WM_UPDATE_CHECKED to `hwnd` once done. Unless `forced`, a
+// result less than _UPDATE_CACHE_TTL_HOURS old is reused without touching the network.
+void check_for_updates(HWND hwnd, BOOL forced) {
+    if (UPDATE_CHECK_PENDING)
+        return;
+
+    update_check* check = (update_check*)calloc(1, sizeof(update_check));
+    if (!check)
+        return;
+
+    check->notify = hwnd;
+    check->forced = forced;
+
+    if (worker_submit(run_update_check, check)) {
+        UPDATE_CHECK_PENDING = TRUE;
+    } else {
+        _ERROR("Failed to start update check");
+        free(check);
+    }
+}
+
+void on_update_checked(HWND hwnd, update_check* check) {
+    UPDATE_CHECK_PENDING = FALSE;
+
+    if (!check->succeeded) {
+        if (check->forced)
+            MessageBox(hwnd,
+                       "Failed to check for updates. Check 'K8-LRT.log' for details.",
+                       "Update Check",
+                       MB_OK | MB_ICONERROR);
+        free(check);
+        return;
+    }
+
+    const int compare = compare_versions(check->latest, VER_PRODUCTVERSION_STR);
+
+    if (compare > 0) {
+        const char* message = strpool_sprintf("A new version of K8-LRT is available!\n\n"
+                                              "Current: %s\n"
+                                              "Latest: %s\n\n"
+                                              "Visit the GitHub releases page to download?",
+                                              VER_PRODUCTVERSION_STR,
+                                              check->latest[0] == 'v' ? check->latest + 1 : check->latest);
+
+        const int result = MessageBoxA(hwnd, message, "Update Available", MB_YESNO | MB_ICONINFORMATION);
+
+        if (result == IDYES) {
+            ShellExecuteA(NULL,
+                          "open",
+                          "https://github.com/jakerieger/K8-LRT/releases/latest",
+                          NULL,
+                          NULL,
+                          SW_SHOWNORMAL);
+        }
+    } else if (compare < 0) {
+        MessageBox(hwnd,
+                   "You are running a development build. K8-LRT may not be stable.",
+                   "Update Check",
+                   MB_OK | MB_ICONWARNING);
+    } else {
+        if (check->forced)
+            MessageBox(hwnd, "You're running the latest version!", "Up to Date", MB_OK | MB_ICONINFORMATION);
+    }
+
+    free(check);
+}
+
+// Locks the batch dialog's inputs while its removal job runs, leaving only Cancel enabled
+void set_batch_dialog_busy(HWND hwnd) {
+    const int controls[] = {
+      IDC_BATCH_LIBRARY_LIST,
+      IDC_BATCH_FILTER,
+      IDC_BATCH_SELECT_ALL,
+      IDC_BATCH_DESELECT_ALL,
+      IDC_BATCH_BACKUP_CHECK,
+      IDC_BATCH_FOLDER_CHECK,
+      IDREMOVE_BATCH,
+    };
+    for (int i = 0; i < sizeof(controls) / sizeof(controls[0]); i++)
+        EnableWindow(GetDlgItem(hwnd, controls[i]), FALSE);
+
+    ShowWindow(GetDlgItem(hwnd, IDC_BATCH_PROGRESS), SW_SHOW);
+    SetDlgItemTextA(hwnd, IDC_BATCH_COUNT_LABEL, "Removing libraries...");
+}
+
+void update_batch_count_label(HWND hwnd, int count) {
+    char label_text[64] = {'\0'};
+    if (count == 1) {
+        sprintf_s(label_text, sizeof(label_text), "1 library selected");
+    } else {
+        sprintf_s(label_text, sizeof(label_text), "%d libraries selected", count);
+    }
+    SetDlgItemTextA(hwnd, IDC_BATCH_COUNT_LABEL, label_text);
+    EnableWindow(GetDlgItem(hwnd, IDREMOVE_BATCH), count > 0);
+}
+
+// Checks or unchecks the library at `index`, keeping data->selected_count up to date without a recount
+void set_batch_library_checked(batch_removal_dialog_data* data, int index, BOOL checked) {
+    if (data->selected[index] == checked)
+        return;
+    data->selected[index] = checked;
+    data->selected_count += checked ? 1 : -1;
+}
+
+// Flips the check box of list row `row`. The list is virtual, so it doesn't toggle the state itself.
+void toggle_batch_row(HWND hwnd, HWND h_list, batch_removal_dialog_data* data, int row) {
+    if (row < 0 || row >= data->view.row_count)
+        return;
+
+    const int index = data->view.rows[row];
+    set_batch_library_checked(data, index, !data->selected[index]);
+    ListView_RedrawItems(h_list, row, row);
+    update_batch_count_label(hwnd, data->selected_count);
+}
+
+// Select All and Deselect All cover the rows the filter shows
+void set_batch_rows_checked(HWND hwnd, HWND h_list, batch_removal_dialog_data* data, BOOL checked) {
+    for (int row = 0; row < data->view.row_count; row++)
+        set_batch_library_checked(data, data->view.rows[row], checked);
+    InvalidateRect(h_list, NULL, FALSE);
+    update_batch_count_label(hwnd, data->selected_count);
+}
+
+// Columns of the batch list. It's a virtual list over data->view, so sorting reorders the view's rows.
+typedef enum {
+    BATCH_COLUMN_NAME,
+    BATCH_COLUMN_SIZE,
+    BATCH_COLUMN_LAST_USED,
+} batch_column;
+
+// Orders measured values ascending, with libraries that haven't been measured yet before all of them
+int compare_measured(BOOL a_known, ULONGLONG a, BOOL b_known, ULONGLONG b) {
+    if (a_known != b_known)
+        return a_known ? 1 : -1;
+    return (a > b) - (a < b);
+}
+
+int compare_batch_rows(void* context, const void* a, const void* b) {
+    const batch_removal_dialog_data* data = (const batch_removal_dialog_data*)context;
+    const library_entry* lhs              = &data->libraries[*(const int*)a];
+    const library_entry* rhs              = &data->libraries[*(const int*)b];
+
+    int result = 0;
+    if (data->sort_column == BATCH_COLUMN_SIZE)
+        result = compare_measured(lhs->size_known, lhs->size_bytes, rhs->size_known, rhs->size_bytes);
+    else if (data->sort_column == BATCH_COLUMN_LAST_USED)
+        result = compare_measured(lhs->size_known, lhs->last_access, rhs->size_known, rhs->last_access);
+
+    if (result == 0)
+        result = _stricmp(lhs->name, rhs->name);
+    return data->sort_descending ? -result : result;
+}
+
+// Rebuilds the rows from the filter and current sort order. Check states live in data->selected, so they survive.
+void build_batch_rows(HWND h_list, batch_removal_dialog_data* data) {
+    if (!library_view_build(&data->view, data->libraries, data->lib_count))
+        _ERROR("Failed to allocate memory for library list");
+    if (data->sort_column >= 0)
+        qsort_s(data->view.rows, data->view.row_count, sizeof(int), compare_batch_rows, data);
+
+    ListView_SetItemCountEx(h_list, data->view.row_count, 0);
+    InvalidateRect(h_list, NULL, FALSE);
+}
+
+void sort_batch_list(HWND h_list, batch_removal_dialog_data* data, int column) {
+    // Sizes and dates start out largest and newest first, names alphabetically
+    data->sort_descending = column == data->sort_column ? !data->sort_descending : column != BATCH_COLUMN_NAME;
+    data->sort_column     = column;
+    qsort_s(data->view.rows, data->view.row_count, sizeof(int), compare_batch_rows, data);
+    InvalidateRect(h_list, NULL, FALSE);
+
+    const HWND h_header = ListView_GetHeader(h_list);
+    const int columns   = Header_GetItemCount(h_header);
+    for (int i = 0; i < columns; i++) {
+        HDITEM hdi = {0};
+        hdi.mask   = HDI_FORMAT;
+        Header_GetItem(h_header, i, &hdi);
+        hdi.fmt &= ~(HDF_SORTUP | HDF_SORTDOWN);
+        if (i == column)
+            hdi.fmt |= data->sort_descending ? HDF_SORTDOWN : HDF_SORTUP;
+        Header_SetItem(h_header, i, &hdi);
+    }
+}
+
+// Fills in the size and last-used columns, which are drawn on demand so they pick up sizes as they come in
+void get_batch_column_text(const library_entry* library, int column, char* text, int len) {
+    text[0] = '\0';
+
+    if (!library->size_known) {
+        if (column == BATCH_COLUMN_SIZE)
+            StringCchCopyA(text, len, library->content_dir ? "..." : "-");
+        return;
+    }
+
+    if (column == BATCH_COLUMN_SIZE) {
+        StrFormatByteSize64A((LONGLONG)library->size_bytes, text, len);
+    } else if (column == BATCH_COLUMN_LAST_USED && library->last_access != 0) {
+        const FILETIME accessed = {(DWORD)library->last_access, (DWORD)(library->last_access >> 32)};
+        SYSTEMTIME utc, local;
+        if (FileTimeToSystemTime(&accessed, &utc) && SystemTimeToTzSpecificLocalTime(NULL, &utc, &local))
+            GetDateFormatA(LOCALE_USER_DEFAULT, DATE_SHORTDATE, &local, NULL, text, len);
+    }
+}
+
+BOOL open_folder_dialog(HWND owner, char* dst, int len) {
+    IFileOpenDialog* pFileOpen = NULL;
+    IShellItem* pItem          = NULL;
+    PWSTR pszFilePath          = NULL;
+    BOOL success               = FALSE;
+
+    HRESULT hr = CoCreateInstance(&CLSID_FileOpenDialog, NULL, CLSCTX_ALL, &IID_IFileOpenDialog, (void**)&pFileOpen);
+
+    if (SUCCEEDED(hr)) {
+        DWORD dwOptions;
+        hr = pFileOpen->lpVtbl->GetOptions(pFileOpen, &dwOptions);
+        if (SUCCEEDED(hr)) {
+            hr = pFileOpen->lpVtbl->SetOptions(pFileOpen, dwOptions | FOS_PICKFOLDERS);
+        }
+
+        if (SUCCEEDED(hr)) {
+            hr = pFileOpen->lpVtbl->Show(pFileOpen, owner);
+        }
+
+        if (SUCCEEDED(hr)) {
+            hr = pFileOpen->lpVtbl->GetResult(pFileOpen, &pItem);
+
+            if (SUCCEEDED(hr)) {
+                hr = pItem->lpVtbl->GetDisplayName(pItem, SIGDN_FILESYSPATH, &pszFilePath);
+
+                if (SUCCEEDED(hr)) {
+                    // UTF-8 like every other path, so it joins with library names and content directories
+                    success = WideCharToMultiByte(CP_UTF8, 0, pszFilePath, -1, dst, len, NULL, NULL) > 0;
+                    CoTaskMemFree(pszFilePath);
+                }
+                pItem->lpVtbl->Release(pItem);
+            }
+        }
+        pFileOpen->lpVtbl->Release(pFileOpen);
+    }
+
+    return success;
+}
+
+// Lets the user pick a snapshot manifest, starting in the snapshot directory
+BOOL open_snapshot_dialog(HWND owner, char* dst, int len) {
+    IFileOpenDialog* pFileOpen = NULL;
+    IShellItem* pItem          = NULL;
+    PWSTR pszFilePath          = NULL;
+    BOOL success               = FALSE;
+
+    HRESULT hr = CoCreateInstance(&CLSID_FileOpenDialog, NULL, CLSCTX_ALL, &IID_IFileOpenDialog, (void**)&pFileOpen);
+
+    if (SUCCEEDED(hr)) {
+        const COMDLG_FILTERSPEC filter = {L"K8-LRT backup snapshots", L"*" _CRT_WIDE(_SNAPSHOT_EXT)};
+        hr                             = pFileOpen->lpVtbl->SetFileTypes(pFileOpen, 1, &filter);
+
+        wchar_t snapshot_dir[MAX_PATH];
+        const wchar_t* relative = utf8_to_wide(_BACKUP_SNAPSHOTS);
+        const DWORD dir_len     = relative ? GetFullPathNameW(relative, MAX_PATH, snapshot_dir, NULL) : 0;
+        if (dir_len > 0 && dir_len < MAX_PATH) {
+            IShellItem* pFolder = NULL;
+            if (SUCCEEDED(SHCreateItemFromParsingName(snapshot_dir, NULL, &IID_IShellItem, (void**)&pFolder))) {
+                pFileOpen->lpVtbl->SetFolder(pFileOpen, pFolder);
+                pFolder->lpVtbl->Release(pFolder);
+            }
+        }
+
+        if (SUCCEEDED(hr)) {
+            hr = pFileOpen->lpVtbl->Show(pFileOpen, owner);
+        }
+
+        if (SUCCEEDED(hr)) {
+            hr = pFileOpen->lpVtbl->GetResult(pFileOpen, &pItem);
+
+            if (SUCCEEDED(hr)) {
+                hr = pItem->lpVtbl->GetDisplayName(pItem, SIGDN_FILESYSPATH, &pszFilePath);
+
+                if (SUCCEEDED(hr)) {
+                    // UTF-8 like every other path, so it joins with library names and content directories
+                    success = WideCharToMultiByte(CP_UTF8, 0, pszFilePath, -1, dst, len, NULL, NULL) > 0;
+                    CoTaskMemFree(pszFilePath);
+                }
+                pItem->lpVtbl->Release(pItem);
+            }
+        }
+        pFileOpen->lpVtbl->Release(pFileOpen);
+    }
+
+    return success;
+}
+
+#pragma endregion
+//===================================================================//
+//                     -- UI HELPER FUNCTIONS --                     //
+//===================================================================//
+#pragma region ui helper functions
+
+// MessageBox for text holding library names or paths, which are UTF-8
+int message_box_utf8(HWND owner, const char* text, const char* caption, UINT type) {
+    const wchar_t* wide_text    = text ? utf8_to_wide(text) : NULL;
+    const wchar_t* wide_caption = utf8_to_wide(caption);
+    if (!wide_text || !wide_caption)
+        return MessageBoxA(owner, text, caption, type);
+    return MessageBoxW(owner, wide_text, wide_caption, type);
+}
+
+// Registers the common control classes in `classes` that aren't registered yet. Each class costs startup time, so
+// they're registered by whatever first needs them rather than all at once.
+void ensure_control_classes(DWORD classes) {
+    if ((UI_CONTROL_CLASSES & classes) == classes)
+        return;
+
+    INITCOMMONCONTROLSEX icc;
+    icc.dwSize = sizeof(icc);
+    icc.dwICC  = classes & ~UI_CONTROL_CLASSES;
+    if (InitCommonControlsEx(&icc))
+        UI_CONTROL_CLASSES |= classes;
+    else
+        _WARN("Failed to register common control classes: 0x%lx", icc.dwICC);
+}
+
+void create_button(HWND* button, const char* label, int x, int y, int w, int h, HWND hwnd, int menu, BOOL disabled) {
+    _ASSERT(button != NULL);
+
+    DWORD style = WS_CHILD | WS_VISIBLE | BS_PUSHBUTTON;
+    if (disabled)
+        style |= WS_DISABLED;
+
+    *button = CreateWindowEx(0, "BUTTON", label, style, x, y, w, h, hwnd, (HMENU)menu, GetModuleHandle(NULL), NULL);
+    SendMessage(*button, WM_SETFONT, (WPARAM)UI_FONT, TRUE);
+}
+
+void create_checkbox(HWND* checkbox,
+                     const char* label,
+                     int x,
+                     int y,
+                     int w,
+                     int h,
+                     HWND hwnd,
+                     int menu,
+                     BOOL begin_checked,
+                     BOOL disabled) {
+    _ASSERT(checkbox != NULL);
+
+    DWORD style = WS_CHILD | WS_VISIBLE | BS_AUTOCHECKBOX;
+    if (disabled)
+        style |= WS_DISABLED;
+
+    *checkbox = CreateWindowEx(0, "BUTTON", label, style, x, y, w, h, hwnd, (HMENU)menu, GetModuleHandle(NULL), NULL);
+    SendMessage(*checkbox, WM_SETFONT, (WPARAM)UI_FONT, TRUE);
+
+    if (begin_checked) {
+        SendMessage(*checkbox, BM_SETCHECK, (WPARAM)BST_CHECKED, 0);
+    }
+}
+
+void create_label(HWND* label, const char* text, int x, int y, int w, int h, HWND hwnd) {
+    _ASSERT(label != NULL);
+
+    *label = CreateWindow("STATIC",
+                          text,
+                          WS_CHILD | WS_VISIBLE | SS_LEFT,
+                          x,
+                          y,
+                          w,
+                          h,
+                          hwnd,
+                          NULL,
+                          GetModuleHandle(NULL),
+                          NULL);
+    SendMessage(*label, WM_SETFONT, (WPARAM)UI_FONT, TRUE);
+}
+
+// Single-column virtual list view. Rows are supplied through LVN_GETDISPINFOW, so filling it costs nothing however
+// many libraries there are.
+void create_library_list(HWND* list, int x, int y, int w, int h, HWND hwnd, int menu) {
+    _ASSERT(list != NULL);
+
+    *list = CreateWindowExW(0,
+                            WC_LISTVIEWW,
+                            NULL,
+                            WS_CHILD | WS_VISIBLE | WS_BORDER | WS_TABSTOP | LVS_REPORT | LVS_OWNERDATA |
+                              LVS_SINGLESEL | LVS_SHOWSELALWAYS | LVS_NOCOLUMNHEADER,
+                            x,
+                            y,
+                            w,
+                            h,
+                            hwnd,
+                            (HMENU)menu,
+                            GetModuleHandle(NULL),
+                            NULL);
+    SendMessage(*list, WM_SETFONT, (WPARAM)UI_FONT, TRUE);
+
+    // Library names are UTF-8, so rows are handed over as UTF-16 whatever the parent window is
+    ListView_SetUnicodeFormat(*list, TRUE);
+    ListView_SetExtendedListViewStyle(*list, LVS_EX_FULLROWSELECT | LVS_EX_DOUBLEBUFFER);
+
+    RECT client;
+    GetClientRect(*list, &client);
+    LVCOLUMNW lvc = {0};
+    lvc.mask      = LVCF_WIDTH;
+    lvc.cx        = client.right - GetSystemMetrics(SM_CXVSCROLL);
+    SendMessageW(*list, LVM_INSERTCOLUMNW, 0, (LPARAM)&lvc);
+}
+
+// Single-line search box. Each keystroke sends EN_CHANGE to `hwnd`.
+void create_filter_edit(HWND* edit, int x, int y, int w, int h, HWND hwnd, int menu) {
+    _ASSERT(edit != NULL);
+
+    *edit = CreateWindowExW(0,
+                            L"EDIT",
+                            NULL,
+                            WS_CHILD | WS_VISIBLE | WS_BORDER | WS_TABSTOP | ES_AUTOHSCROLL,
+                            x,
+                            y,
+                            w,
+                            h,
+                            hwnd,
+                            (HMENU)menu,
+                            GetModuleHandle(NULL),
+                            NULL);
+    SendMessage(*edit, WM_SETFONT, (WPARAM)UI_FONT, TRUE);
+    SendMessageW(*edit, EM_SETLIMITTEXT, _LIBRARY_FILTER_MAX - 1, 0);
+    SendMessageW(*edit, EM_SETCUEBANNER, TRUE, (LPARAM)L"Type to filter");
+}
+
+void create_edit(HWND* edit, int x, int y, int w, int h, HWND hwnd, int menu, BOOL multiline, BOOL readonly) {
+    DWORD style = WS_CHILD | WS_VISIBLE | WS_VSCROLL | WS_HSCROLL | ES_AUTOVSCROLL | ES_AUTOHSCROLL | WS_BORDER;
+    if (multiline)
+        style |= ES_MULTILINE;
+    if (readonly)
+        style |= ES_READONLY;
+
+    *edit = CreateWindowEx(0, "EDIT", NULL, style, x, y, w, h, hwnd, (HMENU)menu, GetModuleHandle(NULL), NULL);
+}
+
+void create_menu_bar(HWND hwnd) {
+    HMENU h_menubar = CreateMenu();
+    HMENU h_menu    = CreateMenu();
+
+    AppendMenu(h_menu, MF_STRING, ID_MENU_VIEW_LOG, "&View Log");
+    AppendMenu(h_menu,
+               MF_STRING | (log_is_verbose() ? MF_CHECKED : MF_UNCHECKED),
+               ID_MENU_VERBOSE_LOG,
+               "V&erbose Logging");
+    AppendMenu(h_menu,
+               MF_STRING | (stats_report_enabled() ? MF_CHECKED : MF_UNCHECKED),
+               ID_MENU_STATS_REPORT,
+               "Write S&tats Report");
+    AppendMenu(h_menu,
+               MF_STRING | (DB3_MODE == DB3_DELETE ? MF_CHECKED : MF_UNCHECKED),
+               ID_MENU_DB3_DELETE,
+               "&Delete Whole komplete.db3");
+    AppendMenu(h_menu,
+               MF_STRING | (DB3_VACUUM ? MF_CHECKED : MF_UNCHECKED) | (DB3_MODE == DB3_DELETE ? MF_GRAYED : 0),
+               ID_MENU_DB3_VACUUM,
+               "Com&pact komplete.db3");
+    AppendMenu(h_menu, MF_STRING, ID_MENU_RELOAD_LIBRARIES, "&Reload Libraries");
+    AppendMenu(h_menu, MF_STRING, ID_MENU_RESTORE_BACKUP, "Re&store Backup...");
+    AppendMenu(h_menu, MF_STRING, ID_MENU_FIND_ORPHANS, "Find &Orphans...");
+    AppendMenu(h_menu, MF_SEPARATOR, 0, NULL);
+    AppendMenu(h_menu, MF_STRING, ID_MENU_CHECK_UPDATES, "&Check for Updates");
+    AppendMenu(h_menu, MF_STRING, ID_MENU_ABOUT, "&About");
+    AppendMenu(h_menu, MF_SEPARATOR, 0, NULL);
+    AppendMenu(h_menu, MF_STRING, ID_MENU_EXIT, "E&xit");
+
+    AppendMenu(h_menubar, MF_POPUP, (UINT_PTR)h_menu, "&Menu");
+    SetMenu(hwnd, h_menubar);
+}
+
+#pragma endregion
+//===================================================================//
+//                      -- DIALOG CALLBACKS --                       //
+//===================================================================//
+#pragma region dialog callbacks
+
+// Read-only view over the mapped log file. Lines are indexed by byte offset as they arrive; `rows` holds the line
+// numbers that pass the level filter and backs the owner-data list view.
+typedef struct {
+    HANDLE file;
+    HANDLE mapping;
+    const char* view;
+    ULONGLONG mapped_size;
+    ULONGLONG indexed_size;  // Always ends just past a '\n'; a partially written last line waits for the next pass
+    ULONGLONG* line_offsets;
+    BYTE* line_levels;
+    size_t line_count;
+    size_t line_capacity;
+    DWORD* rows;
+    size_t row_count;
+    size_t row_capacity;
+    BOOL show[3];  // INFO (including DEBUG and VERBOSE), WARN, ERROR (including FATAL)
+    HFONT font;
+} log_view;
+
+static log_view LOG_VIEW = {0};
+
+enum { LOG_VIEW_INFO, LOG_VIEW_WARN, LOG_VIEW_ERROR };
+
+#define _LOGVIEW_FILTER_H 26
+
+// Split "[timestamp] [LEVEL] message" into its parts. Lines that don't look like that become a bare message.
+void split_log_line(const char* line,
+                    size_t length,
+                    const char** time,
+                    size_t* time_len,
+                    const char** level,
+                    size_t* level_len,
+                    const char** message,
+                    size_t* message_len) {
+    *time        = line;
+    *time_len    = 0;
+    *level       = line;
+    *level_len   = 0;
+    *message     = line;
+    *message_len = length;
+
+    if (length < 2 || line[0] != '[')
+        return;
+
+    const char* time_end = memchr(line, ']', length);
+    if (!time_end || (size_t)(time_end - line) + 3 > length || time_end[1] != ' ' || time_end[2] != '[')
+        return;
+
+    const char* level_start = time_end + 3;
+    const char* level_end   = memchr(level_start, ']', length - (size_t)(level_start - line));
+    if (!level_end)
+        return;
+
+    *time      = line + 1;
+    *time_len  = (size_t)(time_end - line) - 1;
+    *level     = level_start;
+    *level_len = (size_t)(level_end - level_start);
+
+    const char* message_start = level_end + 1;
+    if ((size_t)(message_start - line) < length && *message_start == ' ')
+        message_start++;
+    *message     = message_start;
+    *message_len = length - (size_t)(message_start - line);
+}
+
+BYTE classify_log_line(const char* line, size_t length) {
+    const char *time, *level, *message;
+    size_t time_len, level_len, message_len;
+    split_log_line(line, length, &time, &time_len, &level, &level_len, &message, &message_len);
+
+    if (level_len == 4 && memcmp(level, "WARN", 4) == 0)
+        return LOG_VIEW_WARN;
+    if (level_len == 5 && (memcmp(level, "ERROR", 5) == 0 || memcmp(level, "FATAL", 5) == 0))
+        return LOG_VIEW_ERROR;
+    return LOG_VIEW_INFO;
+}
+
+// Length of line `index` without its line break
+size_t log_view_line(size_t index, const char** line) {
+    const ULONGLONG start = LOG_VIEW.line_offsets[index];
+    const ULONGLONG end   = index + 1 < LOG_VIEW.line_count ? LOG_VIEW.line_offsets[index + 1] : LOG_VIEW.indexed_size;
+
+    size_t length = (size_t)(end - start);
+    *line         = LOG_VIEW.view + start;
+    while (length > 0 && ((*line)[length - 1] == '\n' || (*line)[length - 1] == '\r'))
+        length--;
+    return length;
+}
+
+void log_view_reset_index(void) {
+    LOG_VIEW.indexed_size = 0;
+    LOG_VIEW.line_count   = 0;
+    LOG_VIEW.row_count    = 0;
+}
+
+void log_view_unmap(void) {
+    if (LOG_VIEW.view)
+        UnmapViewOfFile(LOG_VIEW.view);
+    if (LOG_VIEW.mapping)
+        CloseHandle(LOG_VIEW.mapping);
+    LOG_VIEW.view        = NULL;
+    LOG_VIEW.mapping     = NULL;
+    LOG_VIEW.mapped_size = 0;
+}
+
+// Remap the file if it has grown (or been truncated) since the last pass
+BOOL log_view_map(void) {
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(LOG_VIEW.file, &size))
+        return FALSE;
+
+    const ULONGLONG file_size = (ULONGLONG)size.QuadPart;
+    if (file_size == LOG_VIEW.mapped_size && LOG_VIEW.view)
+        return TRUE;
+
+    // Rows point into the view, so they go with it if the file can't be mapped again
+    log_view_unmap();
+    if (file_size < LOG_VIEW.indexed_size)
+        log_view_reset_index();
+    if (file_size == 0)
+        return TRUE;
+
+    LOG_VIEW.mapping = CreateFileMapping(LOG_VIEW.file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!LOG_VIEW.mapping) {
+        _ERROR("Failed to map log file: %lu", GetLastError());
+        log_view_reset_index();
+        return FALSE;
+    }
+
+    LOG_VIEW.view = (const char*)MapViewOfFile(LOG_VIEW.mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!LOG_VIEW.view) {
+        _ERROR("Failed to map view of log file: %lu", GetLastError());
+        CloseHandle(LOG_VIEW.mapping);
+        LOG_VIEW.mapping = NULL;
+        log_view_reset_index();
+        return FALSE;
+    }
+
+    LOG_VIEW.mapped_size = file_size;
+    return TRUE;
+}
+
+BOOL log_view_push_line(ULONGLONG offset) {
+    if (LOG_VIEW.line_count == LOG_VIEW.line_capacity) {
+        const size_t capacity = LOG_VIEW.line_capacity ? LOG_VIEW.line_capacity * 2 : 4096;
+
+        ULONGLONG* offsets = realloc(LOG_VIEW.line_offsets, capacity * sizeof(ULONGLONG));
+        if (!offsets)
+            return FALSE;
+        LOG_VIEW.line_offsets = offsets;
+
+        BYTE* levels = realloc(LOG_VIEW.line_levels, capacity);
+        if (!levels)
+            return FALSE;
+        LOG_VIEW.line_levels   = levels;
+        LOG_VIEW.line_capacity = capacity;
+    }
+
+    LOG_VIEW.line_offsets[LOG_VIEW.line_count++] = offset;
+    return TRUE;
+}
+
+BOOL log_view_push_row(DWORD line) {
+    if (LOG_VIEW.row_count == LOG_VIEW.row_capacity) {
+        const size_t capacity = LOG_VIEW.row_capacity ? LOG_VIEW.row_capacity * 2 : 4096;
+
+        DWORD* rows = realloc(LOG_VIEW.rows, capacity * sizeof(DWORD));
+        if (!rows)
+            return FALSE;
+        LOG_VIEW.rows         = rows;
+        LOG_VIEW.row_capacity = capacity;
+    }
+
+    LOG_VIEW.rows[LOG_VIEW.row_count++] = line;
+    return TRUE;
+}
+
+// Index the complete lines past `indexed_size` and append the ones that pass the filter to `rows`
+void log_view_index(void) {
+    const char* view     = LOG_VIEW.view;
+    ULONGLONG line_start = LOG_VIEW.indexed_size;
+
+    while (view && line_start < LOG_VIEW.mapped_size) {
+        const char* newline = memchr(view + line_start, '\n', (size_t)(LOG_VIEW.mapped_size - line_start));
+        if (!newline)
+            break;
+
+        const ULONGLONG next = (ULONGLONG)(newline - view) + 1;
+        if (!log_view_push_line(line_start))
+            break;
+
+        const size_t line          = LOG_VIEW.line_count - 1;
+        const BYTE level           = classify_log_line(view + line_start, (size_t)(next - line_start));
+        LOG_VIEW.line_levels[line] = level;
+        LOG_VIEW.indexed_size      = next;
+
+        if (LOG_VIEW.show[level] && !log_view_push_row((DWORD)line))
+            break;
+        line_start = next;
+    }
+}
+
+void log_view_refilter(void) {
+    LOG_VIEW.row_count = 0;
+    for (size_t i = 0; i < LOG_VIEW.line_count; i++) {
+        if (LOG_VIEW.show[LOG_VIEW.line_levels[i]] && !log_view_push_row((DWORD)i))
+            break;
+    }
+}
+
+// Pick up new lines and resize the list. Keeps following the tail when the last row was already visible.
+void log_view_refresh(HWND h_list, BOOL refilter) {
+    const size_t old_rows = LOG_VIEW.row_count;
+    const int top         = ListView_GetTopIndex(h_list);
+    const int per_page    = ListView_GetCountPerPage(h_list);
+    const BOOL at_bottom  = old_rows == 0 || (size_t)(top + per_page) >= old_rows;
+
+    if (LOG_VIEW.file != INVALID_HANDLE_VALUE && log_view_map()) {
+        if (refilter)
+            log_view_refilter();
+        log_view_index();
+    }
+
+    if (refilter || LOG_VIEW.row_count < old_rows) {
+        ListView_SetItemCount(h_list, (int)LOG_VIEW.row_count);
+        InvalidateRect(h_list, NULL, FALSE);
+    } else if (LOG_VIEW.row_count != old_rows) {
+        ListView_SetItemCountEx(h_list, (int)LOG_VIEW.row_count, LVSICF_NOSCROLL | LVSICF_NOINVALIDATEALL);
+    } else {
+        return;
+    }
+
+    if ((at_bottom || refilter) && LOG_VIEW.row_count > 0)
+        ListView_EnsureVisible(h_list, (int)LOG_VIEW.row_count - 1, FALSE);
+}
+
+// Ctrl+C copies the selected rows as they appear in the log file
+void log_view_copy_selection(HWND hwnd, HWND h_list) {
+    size_t total = 0;
+    int i        = -1;
+    while ((i = ListView_GetNextItem(h_list, i, LVNI_SELECTED)) >= 0) {
+        const char* line;
+        total += log_view_line(LOG_VIEW.rows[i], &line) + 2;
+    }
+    if (total == 0)
+        return;
+
+    const HGLOBAL h_mem = GlobalAlloc(GMEM_MOVEABLE, total + 1);
+    if (!h_mem)
+        return;
+
+    char* out   = GlobalLock(h_mem);
+    size_t used = 0;
+    i           = -1;
+    while ((i = ListView_GetNextItem(h_list, i, LVNI_SELECTED)) >= 0) {
+        const char* line;
+        const size_t length = log_view_line(LOG_VIEW.rows[i], &line);
+        memcpy(out + used, line, length);
+        used += length;
+        out[used++] = '\r';
+        out[used++] = '\n';
+    }
+    out[used] = '\0';
+    GlobalUnlock(h_mem);
+
+    if (OpenClipboard(hwnd)) {
+        EmptyClipboard();
+        if (!SetClipboardData(CF_TEXT, h_mem))
+            GlobalFree(h_mem);
+        CloseClipboard();
+    } else {
+        GlobalFree(h_mem);
+    }
+}
+
+void log_view_layout(HWND hwnd) {
+    RECT rect;
+    GetClientRect(hwnd, &rect);
+
+    const HWND h_list = GetDlgItem(hwnd, IDC_LOGVIEW_LIST);
+    if (h_list)
+        SetWindowPos(h_list,
+                     NULL,
+                     0,
+                     _LOGVIEW_FILTER_H,
+                     rect.right,
+                     max(rect.bottom - _LOGVIEW_FILTER_H, 0),
+                     SWP_NOZORDER);
+}
+
+LRESULT CALLBACK log_viewer_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam) {
+    switch (umsg) {
+        case WM_CREATE: {
+            LOG_VIEW.file = CreateFile(_LOG_FILENAME,
+                                       GENERIC_READ,
+                                       FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                       NULL,
+                                       OPEN_EXISTING,
+                                       FILE_ATTRIBUTE_NORMAL,
+                                       NULL);
+            if (LOG_VIEW.file == INVALID_HANDLE_VALUE)
+                _ERROR("Failed to open log file for viewing: %lu", GetLastError());
+
+            LOG_VIEW.show[LOG_VIEW_INFO]  = TRUE;
+            LOG_VIEW.show[LOG_VIEW_WARN]  = TRUE;
+            LOG_VIEW.show[LOG_VIEW_ERROR] = TRUE;
+
+            HWND h_check;
+            create_checkbox(&h_check, "Info", 8, 4, 60, 20, hwnd, IDC_LOGVIEW_INFO, TRUE, FALSE);
+            create_checkbox(&h_check, "Warnings", 72, 4, 80, 20, hwnd, IDC_LOGVIEW_WARN, TRUE, FALSE);
+            create_checkbox(&h_check, "Errors", 156, 4, 70, 20, hwnd, IDC_LOGVIEW_ERROR, TRUE, FALSE);
+
+            const HWND h_list = CreateWindowEx(0,
+                                               WC_LISTVIEW,
+                                               NULL,
+                                               WS_CHILD | WS_VISIBLE | WS_BORDER | LVS_REPORT | LVS_OWNERDATA |
+                                                 LVS_SHOWSELALWAYS,
+                                               0,
+                                               _LOGVIEW_FILTER_H,
+                                               0,
+                                               0,
+                                               hwnd,
+                                               (HMENU)IDC_LOGVIEW_LIST,
+                                               GetModuleHandle(NULL),
+                                               NULL);
+            ListView_SetExtendedListViewStyle(h_list, LVS_EX_FULLROWSELECT | LVS_EX_DOUBLEBUFFER);
+
+            LOG_VIEW.font = CreateFont(14,
+                                       0,
+                                       0,
+                                       0,
+                                       FW_NORMAL,
+                                       FALSE,
+                                       FALSE,
+                                       FALSE,
+                                       DEFAULT_CHARSET,
+                                       OUT_DEFAULT_PRECIS,
+                                       CLIP_DEFAULT_PRECIS,
+                                       DEFAULT_QUALITY,
+                                       FIXED_PITCH | FF_MODERN,
+                                       "Consolas");
+            SendMessage(h_list, WM_SETFONT, (WPARAM)LOG_VIEW.font, TRUE);
+
+            LVCOLUMN lvc = {0};
+            lvc.mask     = LVCF_TEXT | LVCF_WIDTH;
+            lvc.cx       = 170;
+            lvc.pszText  = "Time";
+            ListView_InsertColumn(h_list, 0, &lvc);
+            lvc.cx      = 60;
+            lvc.pszText = "Level";
+            ListView_InsertColumn(h_list, 1, &lvc);
+            lvc.cx      = 1200;
+            lvc.pszText = "Message";
+            ListView_InsertColumn(h_list, 2, &lvc);
+
+            log_view_layout(hwnd);
+            log_view_refresh(h_list, TRUE);
+
+            // Only start listening once the initial index is built; anything logged since is picked up on the
+            // first notification
+            LOG_LISTENER = hwnd;
+            return 0;
+        }
+
+        case WM_LOG_APPENDED: {
+            InterlockedExchange(&LOG_APPEND_PENDING, FALSE);
+            log_view_refresh(GetDlgItem(hwnd, IDC_LOGVIEW_LIST), FALSE);
+            return 0;
+        }
+
+        case WM_COMMAND: {
+            const int id = LOWORD(wparam);
+            if (HIWORD(wparam) == BN_CLICKED &&
+                (id == IDC_LOGVIEW_INFO || id == IDC_LOGVIEW_WARN || id == IDC_LOGVIEW_ERROR)) {
+                // The filter checkbox IDs are consecutive and in the same order as the LOG_VIEW_* classes
+                LOG_VIEW.show[id - IDC_LOGVIEW_INFO] = IsDlgButtonChecked(hwnd, id) == BST_CHECKED;
+                log_view_refresh(GetDlgItem(hwnd, IDC_LOGVIEW_LIST), TRUE);
+                return 0;
+            }
+            break;
+        }
+
+        case WM_NOTIFY: {
+            const LPNMHDR pnmh = (LPNMHDR)lparam;
+            if (pnmh->idFrom != IDC_LOGVIEW_LIST)
+                break;
+
+            if (pnmh->code == LVN_GETDISPINFO) {
+                NMLVDISPINFO* info = (NMLVDISPINFO*)lparam;
+                LVITEM* item       = &info->item;
+                if (!(item->mask & LVIF_TEXT) || item->cchTextMax <= 0)
+                    return 0;
+
+                item->pszText[0] = '\0';
+                if (item->iItem < 0 || (size_t)item->iItem >= LOG_VIEW.row_count)
+                    return 0;
+
+                const char* line;
+                const size_t length = log_view_line(LOG_VIEW.rows[item->iItem], &line);
+
+                const char *time, *level, *message;
+                size_t time_len, level_len, message_len;
+                split_log_line(line, length, &time, &time_len, &level, &level_len, &message, &message_len);
+
+                const char* text = item->iSubItem == 0 ? time : item->iSubItem == 1 ? level : message;
+                size_t text_len  = item->iSubItem == 0 ? time_len : item->iSubItem == 1 ? level_len : message_len;
+                if (text_len >= (size_t)item->cchTextMax)
+                    text_len = (size_t)item->cchTextMax - 1;
+                memcpy(item->pszText, text, text_len);
+                item->pszText[text_len] = '\0';
+                return 0;
+            }
+
+            if (pnmh->code == LVN_KEYDOWN) {
+                const NMLVKEYDOWN* key = (NMLVKEYDOWN*)lparam;
+                if (key->wVKey == 'C' && (GetKeyState(VK_CONTROL) & 0x8000))
+                    log_view_copy_selection(hwnd, pnmh->hwndFrom);
+                return 0;
+            }
+            break;
+        }
+
+        case WM_SIZE: {
+            log_view_layout(hwnd);
+            return 0;
+        }
+
+        case WM_CLOSE: {
+            DestroyWindow(hwnd);
+            return 0;
+        }
+
+        case WM_DESTROY: {
+            LOG_LISTENER = NULL;
+            InterlockedExchange(&LOG_APPEND_PENDING, FALSE);
+
+            log_view_unmap();
+            if (LOG_VIEW.file != INVALID_HANDLE_VALUE)
+                CloseHandle(LOG_VIEW.file);
+            if (LOG_VIEW.font)
+                DeleteObject(LOG_VIEW.font);
+            free(LOG_VIEW.line_offsets);
+            free(LOG_VIEW.line_levels);
+            free(LOG_VIEW.rows);
+            memset(&LOG_VIEW, 0, sizeof(LOG_VIEW));
+
+            H_LOG_VIEWER = NULL;
+            return 0;
+        }
+    }
+
+    return DefWindowProc(hwnd, umsg, wparam, lparam);
+}
+
+INT_PTR CALLBACK about_dialog_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam) {
+    switch (umsg) {
+        case WM_NOTIFY: {
+            LPNMHDR pnmh = (LPNMHDR)lparam;
+            if (pnmh->idFrom == IDC_REPO_LINK && (pnmh->code == NM_CLICK || pnmh->code == NM_RETURN)) {
+                PNMLINK pnmLink = (PNMLINK)lparam;
+                ShellExecuteW(NULL, L"open", L"https://github.com/jakerieger/K8-LRT", NULL, NULL, SW_SHOWNORMAL);
+                return (INT_PTR)TRUE;
+            }
+            break;
+        }
+
+        case WM_INITDIALOG: {
+            char* latest_v = (char*)lparam;
+            if (latest_v) {
+                SetDlgItemTextA(hwnd, IDC_VER_LABEL, strpool_sprintf("Version %s", latest_v));
+                SetDlgItemTextA(hwnd, IDC_BUILD_LABEL, strpool_sprintf("Build %d", VER_BUILD));
+            }
+
+            return (INT_PTR)TRUE;
+        }
+
+        case WM_COMMAND:
+            if (LOWORD(wparam) == IDOK || LOWORD(wparam) == IDCANCEL) {
+                EndDialog(hwnd, LOWORD(wparam));
+                return (INT_PTR)TRUE;
+            }
+
+            break;
+    }
+
+    return (INT_PTR)FALSE;
+}
+
+INT_PTR CALLBACK remove_library_dialog_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam) {
+    static remove_lib_dialog_data* data = NULL;
+
+    switch (umsg) {
+        case WM_INITDIALOG: {
+            data = (remove_lib_dialog_data*)lparam;
+
+            HWND h_name_label = GetDlgItem(hwnd, IDC_REMOVE_LIBRARY_NAME);
+            SetWindowTextW(h_name_label, utf8_to_wide(data->library->name));
+
+            HFONT h_font = CreateFont(16,
+                                      0,
+                                      0,
+                                      0,
+                                      FW_BOLD,
+                                      FALSE,
+                                      FALSE,
+                                      FALSE,
+                                      DEFAULT_CHARSET,
+                                      OUT_DEFAULT_PRECIS,
+                                      CLIP_DEFAULT_PRECIS,
+                                      DEFAULT_QUALITY,
+                                      DEFAULT_PITCH | FF_DONTCARE,
+                                      "Segoe UI");
+            SendMessage(h_name_label, WM_SETFONT, (WPARAM)h_font, TRUE);
+
+            HWND h_content_dir_label = GetDlgItem(hwnd, IDC_REMOVE_LIBRARY_CONTENT_DIR);
+            SetWindowTextW(h_content_dir_label, utf8_to_wide(data->library->content_dir));
+
+            if (data->library->size_known) {
+                char size[32];
+                StrFormatByteSize64A((LONGLONG)data->library->size_bytes, size, sizeof(size));
+
+                char info[512];
+                char freed[128];
+                GetDlgItemTextA(hwnd, IDC_REMOVE_INFO_TEXT, info, sizeof(info));
+                StringCchPrintfA(freed,
+                                 sizeof(freed),
+                                 "\n- Free %s (%llu files) with the content directory",
+                                 size,
+                                 data->library->file_count);
+                StringCchCatA(info, sizeof(info), freed);
+                SetDlgItemTextA(hwnd, IDC_REMOVE_INFO_TEXT, info);
+            }
+
+            CheckDlgButton(hwnd, IDC_REMOVE_BACKUP_CHECK, data->backup_files ? BST_CHECKED : BST_UNCHECKED);
+            CheckDlgButton(hwnd, IDC_REMOVE_FOLDER_CHECK, data->remove_content_dir ? BST_CHECKED : BST_UNCHECKED);
+
+            RECT parent_rect, dlg_rect;
+            HWND h_parent = GetParent(hwnd);
+            GetWindowRect(h_parent, &parent_rect);
+            GetWindowRect(hwnd, &dlg_rect);
+
+            int dlg_w    = dlg_rect.right - dlg_rect.left;
+            int dlg_h    = dlg_rect.bottom - dlg_rect.top;
+            int parent_x = parent_rect.left;
+            int parent_y = parent_rect.top;
+            int parent_w = parent_rect.right - parent_rect.left;
+            int parent_h = parent_rect.bottom - parent_rect.top;
+
+            int x = parent_x + (parent_w - dlg_w) / 2;
+            int y = parent_y + (parent_h - dlg_h) / 2;
+
+            SetWindowPos(hwnd, NULL, x, y, 0, 0, SWP_NOSIZE | SWP_NOZORDER);
+
+            return (INT_PTR)TRUE;
+        }
+
+        case WM_COMMAND: {
+            switch (LOWORD(wparam)) {
+                case IDREMOVE: {
+                    data->backup_files       = (IsDlgButtonChecked(hwnd, IDC_REMOVE_BACKUP_CHECK) == BST_CHECKED);
+                    data->remove_content_dir = (IsDlgButtonChecked(hwnd, IDC_REMOVE_FOLDER_CHECK) == BST_CHECKED);
+                    EndDialog(hwnd, IDREMOVE);
+                    return (INT_PTR)TRUE;
+                }
+
+                case IDCANCEL_REMOVE:
+                case IDCANCEL: {
+                    EndDialog(hwnd, IDCANCEL);
+                    return (INT_PTR)TRUE;
+                }
+            }
+            break;
+        }
+
+        case WM_CLOSE: {
+            EndDialog(hwnd, IDCANCEL);
+            return (INT_PTR)TRUE;
+        }
+    }
+
+    return (INT_PTR)FALSE;
+}
+
+INT_PTR CALLBACK batch_remove_dialog_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam) {
+    static batch_removal_dialog_data* data = NULL;
+
+    switch (umsg) {
+        case WM_INITDIALOG: {
+            data           = (batch_removal_dialog_data*)lparam;
+            H_BATCH_DIALOG = hwnd;
+
+            HWND h_list = GetDlgItem(hwnd, IDC_BATCH_LIBRARY_LIST);
+            ListView_SetExtendedListViewStyle(h_list,
+                                              LVS_EX_CHECKBOXES | LVS_EX_FULLROWSELECT | LVS_EX_DOUBLEBUFFER);
+
+            // Check boxes are drawn from data->selected, and names are UTF-8 so rows are handed over as UTF-16
+            ListView_SetCallbackMask(h_list, LVIS_STATEIMAGEMASK);
+            ListView_SetUnicodeFormat(h_list, TRUE);
+
+            LVCOLUMN lvc = {0};
+            lvc.mask     = LVCF_FMT | LVCF_TEXT | LVCF_WIDTH;
+            lvc.fmt      = LVCFMT_LEFT;
+            lvc.cx       = 250;
+            lvc.pszText  = "Library Name";
+            ListView_InsertColumn(h_list, BATCH_COLUMN_NAME, &lvc);
+
+            lvc.fmt     = LVCFMT_RIGHT;
+            lvc.cx      = 80;
+            lvc.pszText = "Size";
+            ListView_InsertColumn(h_list, BATCH_COLUMN_SIZE, &lvc);
+
+            lvc.cx      = 90;
+            lvc.pszText = "Last Used";
+            ListView_InsertColumn(h_list, BATCH_COLUMN_LAST_USED, &lvc);
+
+            build_batch_rows(h_list, data);
+
+            SendDlgItemMessageW(hwnd, IDC_BATCH_FILTER, EM_SETLIMITTEXT, _LIBRARY_FILTER_MAX - 1, 0);
+            SendDlgItemMessageW(hwnd, IDC_BATCH_FILTER, EM_SETCUEBANNER, TRUE, (LPARAM)L"Type to filter");
+
+            CheckDlgButton(hwnd, IDC_BATCH_BACKUP_CHECK, data->backup_files ? BST_CHECKED : BST_UNCHECKED);
+            CheckDlgButton(hwnd, IDC_BATCH_FOLDER_CHECK, data->remove_library_folder ? BST_CHECKED : BST_UNCHECKED);
+
+            update_batch_count_label(hwnd, data->selected_count);
+
+            RECT parent_rect, dlg_rect;
+            HWND h_parent = GetParent(hwnd);
+            GetWindowRect(h_parent, &parent_rect);
+            GetWindowRect(hwnd, &dlg_rect);
+
+            int dlg_w    = dlg_rect.right - dlg_rect.left;
+            int dlg_h    = dlg_rect.bottom - dlg_rect.top;
+            int parent_x = parent_rect.left;
+            int parent_y = parent_rect.top;
+            int parent_w = parent_rect.right - parent_rect.left;
+            int parent_h = parent_rect.bottom - parent_rect.top;
+
+            int x = parent_x + (parent_w - dlg_w) / 2;
+            int y = parent_y + (parent_h - dlg_h) / 2;
+
+            SetWindowPos(hwnd, NULL, x, y, 0, 0, SWP_NOSIZE | SWP_NOZORDER);
+
+            return (INT_PTR)TRUE;
+        }
+
+        case WM_NOTIFY: {
+            LPNMHDR pnmh = (LPNMHDR)lparam;
+
+            if (pnmh->idFrom == IDC_BATCH_LIBRARY_LIST) {
+                HWND h_list = GetDlgItem(hwnd, IDC_BATCH_LIBRARY_LIST);
+
+                if (pnmh->code == NM_CLICK) {
+                    LVHITTESTINFO hit = {0};
+                    hit.pt            = ((LPNMITEMACTIVATE)lparam)->ptAction;
+                    if (ListView_SubItemHitTest(h_list, &hit) >= 0 && (hit.flags & LVHT_ONITEMSTATEICON))
+                        toggle_batch_row(hwnd, h_list, data, hit.iItem);
+                } else if (pnmh->code == LVN_KEYDOWN) {
+                    if (((LPNMLVKEYDOWN)lparam)->wVKey == VK_SPACE)
+                        toggle_batch_row(hwnd, h_list, data, ListView_GetNextItem(h_list, -1, LVNI_FOCUSED));
+                } else if (pnmh->code == LVN_COLUMNCLICK) {
+                    sort_batch_list(h_list, data, ((LPNMLISTVIEW)lparam)->iSubItem);
+                } else if (pnmh->code == LVN_GETDISPINFOW) {
+                    NMLVDISPINFOW* info = (NMLVDISPINFOW*)lparam;
+                    const int row       = info->item.iItem;
+                    if (row < 0 || row >= data->view.row_count)
+                        break;
+
+                    const library_entry* library = &data->libraries[data->view.rows[row]];
+                    if (info->item.mask & LVIF_STATE) {
+                        info->item.state     = INDEXTOSTATEIMAGEMASK(data->selected[data->view.rows[row]] ? 2 : 1);
+                        info->item.stateMask = LVIS_STATEIMAGEMASK;
+                    }
+                    if ((info->item.mask & LVIF_TEXT) && info->item.iSubItem == BATCH_COLUMN_NAME) {
+                        if (!MultiByteToWideChar(
+                              CP_UTF8, 0, library->name, -1, info->item.pszText, info->item.cchTextMax))
+                            StringCchCopyW(info->item.pszText, info->item.cchTextMax, L"?");
+                    } else if (info->item.mask & LVIF_TEXT) {
+                        char text[64];
+                        get_batch_column_text(library, info->item.iSubItem, text, sizeof(text));
+                        MultiByteToWideChar(CP_UTF8, 0, text, -1, info->item.pszText, info->item.cchTextMax);
+                    }
+                }
+            }
+            break;
+        }
+
+        case WM_COMMAND: {
+            HWND h_list = GetDlgItem(hwnd, IDC_BATCH_LIBRARY_LIST);
+
+            switch (LOWORD(wparam)) {
+                case IDC_BATCH_SELECT_ALL: {
+                    set_batch_rows_checked(hwnd, h_list, data, TRUE);
+                    return (INT_PTR)TRUE;
+                }
+
+                case IDC_BATCH_DESELECT_ALL: {
+                    set_batch_rows_checked(hwnd, h_list, data, FALSE);
+                    return (INT_PTR)TRUE;
+                }
+
+                case IDC_BATCH_FILTER: {
+                    if (HIWORD(wparam) != EN_CHANGE)
+                        break;
+                    GetDlgItemTextW(hwnd, IDC_BATCH_FILTER, data->view.filter, _LIBRARY_FILTER_MAX);
+                    build_batch_rows(h_list, data);
+                    return (INT_PTR)TRUE;
+                }
+
+                case IDREMOVE_BATCH: {
+                    if (data->selected_count == 0) {
+                        MessageBox(hwnd,
+                                   "Please select at least one library to remove.",
+                                   "No Selection",
+                                   MB_OK | MB_ICONINFORMATION);
+                        return (INT_PTR)TRUE;
+                    }
+
+                    data->backup_files          = (IsDlgButtonChecked(hwnd, IDC_BATCH_BACKUP_CHECK) == BST_CHECKED);
+                    data->remove_library_folder = (IsDlgButtonChecked(hwnd, IDC_BATCH_FOLDER_CHECK) == BST_CHECKED);
+
+                    // Libraries hidden by the filter stay selected, and are removed along with the visible ones
+                    worker_job* job = worker_create_job(JOB_REMOVE, hwnd, data->selected_count);
+                    if (!job) {
+                        MessageBox(hwnd, "Failed to start removal.", "Error", MB_OK | MB_ICONERROR);
+                        return (INT_PTR)TRUE;
+                    }
+
+                    int j = 0;
+                    for (int i = 0; i < data->lib_count; i++) {
+                        if (data->selected[i])
+                            job->libraries[j++] = &data->libraries[i];
+                    }
+                    job->backup_files   = data->backup_files;
+                    job->remove_content = data->remove_library_folder;
+                    BACKUP_FILES        = data->backup_files;
+
+                    if (!worker_start_job(job)) {
+                        worker_free_job(job);
+                        MessageBox(hwnd, "Failed to start removal.", "Error", MB_OK | MB_ICONERROR);
+                        return (INT_PTR)TRUE;
+                    }
+                    data->job = job;
+
+                    set_batch_dialog_busy(hwnd);
+                    return (INT_PTR)TRUE;
+                }
+
+                case IDCANCEL_BATCH:
+                case IDCANCEL: {
+                    if (data->job) {
+                        worker_cancel_job(data->job);
+                        SetDlgItemTextA(hwnd, IDCANCEL_BATCH, "Cancelling...");
+                        EnableWindow(GetDlgItem(hwnd, IDCANCEL_BATCH), FALSE);
+                        return (INT_PTR)TRUE;
+                    }
+
+                    EndDialog(hwnd, IDCANCEL);
+                    return (INT_PTR)TRUE;
+                }
+            }
+            break;
+        }
+
+        case WM_WORKER_PROGRESS: {
+            const int done  = (int)wparam;
+            const int total = (int)lparam;
+
+            SendDlgItemMessage(hwnd, IDC_BATCH_PROGRESS, PBM_SETRANGE32, 0, total);
+            SendDlgItemMessage(hwnd, IDC_BATCH_PROGRESS, PBM_SETPOS, done, 0);
+
+            char label_text[64] = {'\0'};
+            sprintf_s(label_text, sizeof(label_text), "Removing libraries... (%d/%d)", done, total);
+            SetDlgItemTextA(hwnd, IDC_BATCH_COUNT_LABEL, label_text);
+            return (INT_PTR)TRUE;
+        }
+
+        case WM_WORKER_DONE: {
+            worker_job* job = (worker_job*)lparam;
+            worker_finish_job(job);
+
+            data->summary   = job->summary;
+            data->cancelled = job->cancelled != 0;
+            data->job       = NULL;
+            worker_free_job(job);
+
+            EndDialog(hwnd, IDREMOVE_BATCH);
+            return (INT_PTR)TRUE;
+        }
+
+        case WM_CLOSE: {
+            // The dialog has to stay up until the job reports back, so closing it only requests a cancel
+            if (data->job) {
+                SendMessage(hwnd, WM_COMMAND, IDCANCEL_BATCH, 0);
+                return (INT_PTR)TRUE;
+            }
+
+            EndDialog(hwnd, IDCANCEL);
+            return (INT_PTR)TRUE;
+        }
+
+        case WM_DESTROY: {
+            H_BATCH_DIALOG = NULL;
+            break;
+        }
+    }
+
+    return (INT_PTR)FALSE;
+}
+
+INT_PTR CALLBACK relocate_dialog_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam) {
+    static relocate_lib_dialog_data* data = NULL;
+
+    switch (umsg) {
         case WM_INITDIALOG: {
-            data = (batch_removal_dialog_data*)lparam;
+            data = (relocate_lib_dialog_data*)lparam;
+
+            HWND h_name_label = GetDlgItem(hwnd, IDC_LIB_NAME_LABEL);
+            SetWindowTextW(h_name_label, utf8_to_wide(data->library->name));
+
+            HFONT h_font = CreateFont(16,
+                                      0,
+                                      0,
+                                      0,
+                                      FW_BOLD,
+                                      FALSE,
+                                      FALSE,
+                                      FALSE,
+                                      DEFAULT_CHARSET,
+                                      OUT_DEFAULT_PRECIS,
+                                      CLIP_DEFAULT_PRECIS,
+                                      DEFAULT_QUALITY,
+                                      DEFAULT_PITCH | FF_DONTCARE,
+                                      "Segoe UI");
+            SendMessage(h_name_label, WM_SETFONT, (WPARAM)h_font, TRUE);
+
+            HWND h_content_dir_label = GetDlgItem(hwnd, IDC_CONTENT_DIR_LABEL);
+            SetWindowTextW(h_content_dir_label, utf8_to_wide(data->library->content_dir));
+
+            RECT parent_rect, dlg_rect;
+            HWND h_parent = GetParent(hwnd);
+            GetWindowRect(h_parent, &parent_rect);
+            GetWindowRect(hwnd, &dlg_rect);
+
+            int dlg_w    = dlg_rect.right - dlg_rect.left;
+            int dlg_h    = dlg_rect.bottom - dlg_rect.top;
+            int parent_x = parent_rect.left;
+            int parent_y = parent_rect.top;
+            int parent_w = parent_rect.right - parent_rect.left;
+            int parent_h = parent_rect.bottom - parent_rect.top;
+
+            int x = parent_x + (parent_w - dlg_w) / 2;
+            int y = parent_y + (parent_h - dlg_h) / 2;
+
+            SetWindowPos(hwnd, NULL, x, y, 0, 0, SWP_NOSIZE | SWP_NOZORDER);
+
+            return (INT_PTR)TRUE;
+        }
+
+        case WM_COMMAND: {
+            switch (LOWORD(wparam)) {
+                case IDC_RELOCATE_BROWSE_BTN: {
+                    char selected_path[MAX_PATH] = {0};
+                    if (open_folder_dialog(hwnd, selected_path, MAX_PATH)) {
+                        SetDlgItemTextW(hwnd, IDC_RELOCATE_PATH_EDIT, utf8_to_wide(selected_path));
+                    }
+                    return (INT_PTR)TRUE;
+                }
+
+                case IDRELOCATE_RELOCATE: {
+                    wchar_t new_path[MAX_PATH] = {0};
+                    GetDlgItemTextW(hwnd, IDC_RELOCATE_PATH_EDIT, new_path, MAX_PATH);
+
+                    if (new_path[0] == L'\0') {
+                        MessageBox(hwnd, "Please select a destination folder.", "Error", MB_ICONWARNING);
+                        return (INT_PTR)TRUE;
+                    }
+
+                    if (!WideCharToMultiByte(CP_UTF8, 0, new_path, -1, data->new_path, MAX_PATH, NULL, NULL)) {
+                        MessageBox(hwnd, "The destination folder's path is too long.", "Error", MB_ICONWARNING);
+                        return (INT_PTR)TRUE;
+                    }
+
+                    EndDialog(hwnd, IDRELOCATE_RELOCATE);
+                    return (INT_PTR)TRUE;
+                }
+
+                case IDCANCEL_RELOCATE:
+                case IDCANCEL: {
+                    EndDialog(hwnd, IDCANCEL);
+                    return (INT_PTR)TRUE;
+                }
+            }
+            break;
+        }
+
+        case WM_CLOSE: {
+            EndDialog(hwnd, IDCANCEL);
+            return (INT_PTR)TRUE;
+        }
+    }
+
+    return (INT_PTR)FALSE;
+}
+
+#pragma endregion
+//===================================================================//
+//                     -- WNDPROC CALLBACKS --                       //
+//===================================================================//
+#pragma region wndproc callbacks
+
+// Disables everything that could start another job or modify the library table while a job is running
+void set_ui_busy(HWND hwnd, BOOL busy, const char* status) {
+    EnableWindow(H_LIBRARY_LIST, !busy);
+    EnableWindow(H_FILTER_EDIT, !busy);
+    EnableWindow(H_BACKUP_CHECKBOX, !busy);
+    EnableWindow(H_REMOVE_LIB_FOLDER_CHECKBOX, !busy);
+    EnableWindow(H_REMOVE_ALL_BUTTON, !busy);
+    EnableWindow(H_REMOVE_BUTTON, !busy && SELECTED_INDEX != -1);
+    EnableWindow(H_RELOCATE_BUTTON, !busy && SELECTED_INDEX != -1);
+    EnableMenuItem(GetMenu(hwnd), ID_MENU_RELOAD_LIBRARIES, busy ? MF_GRAYED : MF_ENABLED);
+    EnableMenuItem(GetMenu(hwnd), ID_MENU_RESTORE_BACKUP, busy ? MF_GRAYED : MF_ENABLED);
+    EnableMenuItem(GetMenu(hwnd), ID_MENU_FIND_ORPHANS, busy ? MF_GRAYED : MF_ENABLED);
+
+    SetWindowTextA(H_SELECT_LIB_LABEL, busy ? status : "Select a library to remove:");
+}
+
+// Starts `job` with the main window as its notify target
+BOOL start_main_window_job(HWND hwnd, worker_job* job, const char* status) {
+    if (!worker_start_job(job)) {
+        worker_free_job(job);
+        MessageBox(hwnd,
+                   "Failed to start background job. Check K8-LRT.log for details.",
+                   "Error",
+                   MB_OK | MB_ICONERROR);
+        return FALSE;
+    }
+
+    set_ui_busy(hwnd, TRUE, status);
+    return TRUE;
+}
+
+void on_worker_progress(HWND hwnd, int done, int total) {
+    if (!ACTIVE_JOB)
+        return;
+
+    char status[128] = {'\0'};
+    if (ACTIVE_JOB->kind == JOB_RELOCATE) {
+        // Relocation progress is measured in bytes, so a percentage reads better than raw steps
+        const int percent = total > 0 ? (int)((LONGLONG)done * 100 / total) : 0;
+        sprintf_s(status, sizeof(status), "Relocating library... %d%%", percent);
+    } else if (ACTIVE_JOB->kind == JOB_RESTORE) {
+        sprintf_s(status, sizeof(status), "Restoring backup... (%d/%d)", done, total);
+    } else if (ACTIVE_JOB->kind == JOB_ORPHANS) {
+        sprintf_s(status, sizeof(status), "Removing orphans... (%d/%d)", done, total);
+    } else if (ACTIVE_JOB->kind == JOB_SCAN) {
+        // `done` may already be behind; everything handed over by now is taken
+        take_scanned_libraries(ACTIVE_JOB);
+        sprintf_s(status, sizeof(status), "Scanning libraries... (%d found)", LIB_COUNT);
+    } else {
+        sprintf_s(status, sizeof(status), "Removing library... (%d/%d)", done, total);
+    }
+    SetWindowTextA(H_SELECT_LIB_LABEL, status);
+}
+
+void on_remove_finished(HWND hwnd, const worker_job* job) {
+    if (job->summary.removed == 0 || job->summary.failed > 0 || !job->summary.shared_cleanup_ok) {
+        MessageBox(hwnd, "Failed to remove library. Check K8-LRT.log for details.", "Error", MB_OK | MB_ICONERROR);
+        return;
+    }
+
+    const BOOL query_result = query_libraries(hwnd);
+    if (query_result) {
+        EnableWindow(H_REMOVE_BUTTON, FALSE);
+        EnableWindow(H_RELOCATE_BUTTON, FALSE);
+        MessageBox(hwnd, "Successfully removed library.", "Success", MB_OK | MB_ICONINFORMATION);
+    } else {
+        MessageBox(hwnd,
+                   "Failed to query libraries. Do you have any Kontakt libraries "
+                   "installed?\n\nCheck 'K8-LRT.log' for details.",
+                   "Error",
+                   MB_OK | MB_ICONERROR);
+        PostQuitMessage(0);
+    }
+}
+
+void on_relocate_finished(HWND hwnd, const worker_job* job) {
+    if (!job->relocated) {
+        MessageBox(hwnd,
+                   "Failed to relocate library. Check K8-LRT.log for details.",
+                   "Error relocating library",
+                   MB_OK | MB_ICONERROR);
+        return;
+    }
+
+    MessageBox(hwnd, "Library has been successfully relocated", "Success", MB_OK | MB_ICONINFORMATION);
+
+    const BOOL query_result = query_libraries(hwnd);
+    if (!query_result) {
+        MessageBox(hwnd,
+                   "Failed to query libraries.\n\nCheck 'K8-LRT.log' for details.",
+                   "Error",
+                   MB_OK | MB_ICONERROR);
+    }
+
+    SELECTED_INDEX = -1;
+    EnableWindow(H_REMOVE_BUTTON, FALSE);
+    EnableWindow(H_RELOCATE_BUTTON, FALSE);
+}
+
+void on_restore_finished(HWND hwnd, const worker_job* job) {
+    if (job->restored) {
+        MessageBox(hwnd, "Backup has been successfully restored", "Success", MB_OK | MB_ICONINFORMATION);
+    } else {
+        MessageBox(hwnd,
+                   "Some items couldn't be restored. Check K8-LRT.log for details.",
+                   "Error restoring backup",
+                   MB_OK | MB_ICONERROR);
+    }
+
+    // Restored registry keys bring their libraries back
+    if (!query_libraries(hwnd)) {
+        MessageBox(hwnd,
+                   "Failed to query libraries.\n\nCheck 'K8-LRT.log' for details.",
+                   "Error",
+                   MB_OK | MB_ICONERROR);
+    }
+
+    SELECTED_INDEX = -1;
+    EnableWindow(H_REMOVE_BUTTON, FALSE);
+    EnableWindow(H_RELOCATE_BUTTON, FALSE);
+}
+
+#define _ORPHAN_LIST_MAX 12  // Orphans named in the confirmation; the rest are only counted
+
+// Lists what a JOB_ORPHANS search found and offers to remove it, or reports how the removal went
+void on_orphans_finished(HWND hwnd, worker_job* job) {
+    orphan_report* report = job->orphans;
+    int removable         = 0;
+    ULONGLONG bytes       = 0;
+    for (int i = 0; i < report->count; i++) {
+        if (is_removable_orphan(&report->entries[i], job->remove_content)) {
+            removable++;
+            bytes += report->entries[i].size;
+        }
+    }
+
+    char size[32];
+    StrFormatByteSize64A((LONGLONG)bytes, size, sizeof(size));
+
+    if (job->orphans_removing) {
+        if (job->orphans_ok) {
+            MessageBox(hwnd,
+                       strpool_sprintf("Removed %d orphan(s), freeing %s.", removable, size),
+                       "Success",
+                       MB_OK | MB_ICONINFORMATION);
+        } else {
+            MessageBox(hwnd,
+                       "Some orphans couldn't be removed. Check K8-LRT.log for details.",
+                       "Error removing orphans",
+                       MB_OK | MB_ICONERROR);
+        }
+        return;
+    }
+
+    if (report->count == 0) {
+        MessageBox(hwnd,
+                   job->orphans_ok ? "No orphaned XML files or content directories were found."
+                                   : "Failed to look for orphans. Check K8-LRT.log for details.",
+                   job->orphans_ok ? "No Orphans" : "Error",
+                   MB_OK | (job->orphans_ok ? MB_ICONINFORMATION : MB_ICONERROR));
+        return;
+    }
+
+    char* list = strpool_sprintf("");
+    for (int i = 0; list && i < report->count && i < _ORPHAN_LIST_MAX; i++) {
+        const orphan_entry* entry = &report->entries[i];
+        char entry_size[32];
+        StrFormatByteSize64A((LONGLONG)entry->size, entry_size, sizeof(entry_size));
+        if (entry->kind == ORPHAN_SHARED_DIR)
+            list = strpool_sprintf("%s\n- %s (shared by %s and %s)", list, entry->path, entry->name, entry->other);
+        else
+            list = strpool_sprintf("%s\n- %s (%s)", list, entry->path, entry->size_known ? entry_size : "unknown size");
+    }
+    if (list && report->count > _ORPHAN_LIST_MAX)
+        list = strpool_sprintf("%s\n... and %d more", list, report->count - _ORPHAN_LIST_MAX);
+
+    if (removable == 0) {
+        message_box_utf8(hwnd,
+                         strpool_sprintf("Found %d orphan(s), none of which can be removed:\n%s\n\nContent directories "
+                                         "shared by several libraries are only listed.",
+                                         report->count,
+                                         list ? list : ""),
+                         "Orphans",
+                         MB_OK | MB_ICONINFORMATION);
+        return;
+    }
+
+    const int response = message_box_utf8(hwnd,
+                                          strpool_sprintf("Found %d orphan(s):\n%s\n\nRemove %d of them, freeing %s? "
+                                                          "Content directories shared by several libraries are only "
+                                                          "listed, and content directories are only removed with "
+                                                          "'Delete library content directory' checked.",
+                                                          report->count,
+                                                          list ? list : "",
+                                                          removable,
+                                                          size),
+                                          "Confirm Orphan Removal",
+                                          MB_YESNO | MB_ICONQUESTION);
+    if (response != IDYES)
+        return;
+
+    // The report moves over to the job removing it
+    worker_job* removal = worker_create_job(JOB_ORPHANS, hwnd, 1);
+    if (!removal)
+        return;
+
+    removal->orphans          = report;
+    removal->orphans_removing = TRUE;
+    removal->backup_files     = job->backup_files;
+    removal->remove_content   = job->remove_content;
+    job->orphans              = NULL;
+    start_main_window_job(hwnd, removal, "Removing orphans...");
+}
+
+// Offers to finish a relocation that was interrupted by a crash or reboot
+void offer_relocation_resume(HWND hwnd) {
+    char name[_MAX_KEY_LENGTH + 1] = {0};
+    char new_path[MAX_PATH]        = {0};
+    if (!journal_read_pending(name, sizeof(name), new_path, sizeof(new_path)))
+        return;
+
+    const library_entry* library = find_library(name);
+    if (!library || !library->content_dir) {
+        _WARN("Discarding relocation journal for unknown library: '%s'", name);
+        journal_discard();
+        return;
+    }
+
+    // Left behind after ContentDir was already updated. Resuming would copy nothing and then delete the only copy.
+    if (path_equals(library->content_dir, new_path)) {
+        _INFO("Discarding relocation journal for '%s', it already points at '%s'", name, new_path);
+        journal_discard();
+        return;
+    }
+
+    const int response = message_box_utf8(hwnd,
+                                          strpool_sprintf("The relocation of '%s' to '%s' didn't finish.\n\n"
+                                                          "Resume it now? Files that were already copied will be "
+                                                          "skipped.",
+                                                          name,
+                                                          new_path),
+                                          "Resume Relocation",
+                                          MB_YESNO | MB_ICONQUESTION);
+    if (response != IDYES) {
+        _INFO("Discarded unfinished relocation of '%s'", name);
+        journal_discard();
+        return;
+    }
+
+    worker_job* job = worker_create_job(JOB_RELOCATE, hwnd, 1);
+    if (!job)
+        return;
+
+    job->libraries[0] = library;
+    StringCchCopyA(job->new_path, MAX_PATH, new_path);
+    start_main_window_job(hwnd, job, "Relocating library...");
+}
+
+// Takes the rest of the first scan's libraries and starts what was waiting on them. Without libraries there's nothing
+// to do, so a failed scan closes the window.
+void on_scan_finished(HWND hwnd, worker_job* job) {
+    const BOOL taken = take_scanned_libraries(job);
+
+    // Cancelled by closing the window
+    if (worker_is_cancelled(job))
+        return;
+
+    if (!job->scanned || !taken) {
+        MessageBox(hwnd,
+                   "Failed to query libraries. Do you have any Kontakt libraries installed?\n\nCheck "
+                   "'K8-LRT.log' for details.",
+                   "Error",
+                   MB_OK | MB_ICONERROR);
+        PostQuitMessage(0);
+        return;
+    }
+
+    INITIAL_SEARCH = FALSE;
+    size_index_start(hwnd);
+
+    if (!watcher_start(hwnd))
+        _WARN("Failed to start watching for library changes, use Reload Libraries to refresh the list");
+
+    check_for_updates(hwnd, FALSE);
+    offer_relocation_resume(hwnd);
+}
+
+void on_worker_done(HWND hwnd, worker_job* job) {
+    worker_finish_job(job);
+    set_ui_busy(hwnd, FALSE, NULL);
+
+    switch (job->kind) {
+        case JOB_REMOVE:
+            on_remove_finished(hwnd, job);
+            break;
+
+        case JOB_RELOCATE:
+            on_relocate_finished(hwnd, job);
+            break;
+
+        case JOB_RESTORE:
+            on_restore_finished(hwnd, job);
+            break;
+
+        case JOB_ORPHANS:
+            on_orphans_finished(hwnd, job);
+            break;
+
+        case JOB_SCAN:
+            on_scan_finished(hwnd, job);
+            break;
+    }
+
+    worker_free_job(job);
+}
+
+void on_size_indexed(HWND hwnd, int index, LONG generation) {
+    // Results from a pass that has since been stopped are dropped
+    size_indexer* indexer = SIZE_INDEXER;
+    if (!indexer || generation != indexer->generation || index < 0 || index >= indexer->count)
+        return;
+
+    // The library may have been removed or relocated while it was being measured
+    const size_index_item* item = &indexer->items[index];
+    library_entry* library      = item->complete ? find_library(item->name) : NULL;
+    if (library && library->content_dir && _STREQ(library->content_dir, item->content_dir)) {
+        apply_library_size(library, item->content_mtime, item->bytes, item->files, item->last_access);
+        if (H_BATCH_DIALOG)
+            InvalidateRect(GetDlgItem(H_BATCH_DIALOG, IDC_BATCH_LIBRARY_LIST), NULL, FALSE);
+    }
+
+    if (--indexer->remaining > 0)
+        return;
+
+    _INFO("Measured %ld library(ies) in %.2f ms", indexer->count, ticks_to_ms(query_ticks() - indexer->start));
+    SIZE_INDEXER = NULL;
+    size_index_free(indexer);
+    write_size_cache();
+
+    if (SIZE_INDEX_RESTART) {
+        SIZE_INDEX_RESTART = FALSE;
+        size_index_start(hwnd);
+    }
+}
+
+LRESULT on_create(HWND hwnd) {
+    UI_FONT = CreateFont(16,
+                         0,
+                         0,
+                         0,
+                         FW_NORMAL,
+                         FALSE,
+                         FALSE,
+                         FALSE,
+                         DEFAULT_CHARSET,
+                         OUT_DEFAULT_PRECIS,
+                         CLIP_DEFAULT_PRECIS,
+                         DEFAULT_QUALITY,
+                         DEFAULT_PITCH | FF_DONTCARE,
+                         "Segoe UI");
+    if (!UI_FONT) {
+        _WARN("Failed to create UI font. Falling back to system default.");
+    }
+
+    create_menu_bar(hwnd);
+
+    create_label(&H_SELECT_LIB_LABEL, "Select a library to remove:", 10, 10, 265, 20, hwnd);
+    create_filter_edit(&H_FILTER_EDIT, 10, 32, 265, 22, hwnd, IDC_FILTER_EDIT);
+    create_library_list(&H_LIBRARY_LIST, 10, 58, 265, 196, hwnd, IDC_LIBRARY_LIST);
+
+    create_checkbox(&H_BACKUP_CHECKBOX,
+                    "Backup cache files before deleting",
+                    10,
+                    260,
+                    220,
+                    20,
+                    hwnd,
+                    IDC_CHECKBOX_BACKUP,
+                    TRUE,
+                    FALSE);
+    create_checkbox(&H_REMOVE_LIB_FOLDER_CHECKBOX,
+                    "Delete library content directory",
+                    10,
+                    280,
+                    220,
+                    20,
+                    hwnd,
+                    IDC_CHECKBOX_REMOVE_LIB_FOLDER,
+                    TRUE,
+                    FALSE);
+
+    create_button(&H_REMOVE_ALL_BUTTON, "Remove All...", 10, 312, 131, 30, hwnd, IDC_REMOVE_ALL_BUTTON, FALSE);
+    create_button(&H_REMOVE_BUTTON, "Remove Selected", 145, 312, 131, 30, hwnd, IDC_REMOVE_BUTTON, TRUE);
+    create_button(&H_RELOCATE_BUTTON, "Relocate Selected", 10, 346, 266, 26, hwnd, IDC_RELOCATE_BUTTON, TRUE);
+
+    return 0;
+}
+
+// Finishes or rolls back a removal that was interrupted by a crash or reboot, before the libraries are listed
+void recover_interrupted_removal(HWND hwnd) {
+    if (!file_exists(_REMOVAL_JOURNAL))
+        return;
+
+    int rolled_back = 0;
+    if (!recover_removal_journal(&rolled_back)) {
+        MessageBox(hwnd,
+                   "A removal that was interrupted couldn't be fully rolled back. It will be retried the next time "
+                   "K8-LRT starts.\n\nCheck 'K8-LRT.log' for details.",
+                   "Interrupted Removal",
+                   MB_OK | MB_ICONWARNING);
+    } else if (rolled_back > 0) {
+        MessageBox(hwnd,
+                   strpool_sprintf("A removal was interrupted before it finished. %d library(ies) it had started on "
+                                   "were put back the way they were.",
+                                   rolled_back),
+                   "Interrupted Removal",
+                   MB_OK | MB_ICONINFORMATION);
+    }
+}
+
+LRESULT on_show(HWND hwnd) {
+    // Only the first time the window is shown; later scans come from the watcher or Reload Libraries
+    if (!INITIAL_SEARCH || ACTIVE_JOB)
+        return 0;
+
+    recover_interrupted_removal(hwnd);
+
+    // Search registry for key entries in `HKEY_LOCAL_MACHINE/SOFTWARE/Native Instruments/..` on the worker pool, so the
+    // window paints right away and fills in as libraries are found. on_scan_finished takes over once it's done.
+    worker_job* job = worker_create_job(JOB_SCAN, hwnd, 1);
+    if (!job || !start_main_window_job(hwnd, job, "Scanning libraries...")) {
+        PostQuitMessage(0);
+        return 0;
+    }
+
+    _INFO("Window ready in %.2f ms, querying libraries in the background", ticks_to_ms(query_ticks() - STARTUP_TICKS));
+    return 0;
+}
+
+void on_selection_changed(HWND hwnd) {
+    const int row  = ListView_GetNextItem(H_LIBRARY_LIST, -1, LVNI_SELECTED);
+    SELECTED_INDEX = row >= 0 && row < MAIN_VIEW.row_count ? MAIN_VIEW.rows[row] : -1;
+    EnableWindow(H_REMOVE_BUTTON, SELECTED_INDEX != -1);
+    EnableWindow(H_RELOCATE_BUTTON, SELECTED_INDEX != -1);
+}
+
+void on_filter_changed(HWND hwnd) {
+    GetWindowTextW(H_FILTER_EDIT, MAIN_VIEW.filter, _LIBRARY_FILTER_MAX);
+    refresh_library_list();
+}
+
+LRESULT on_library_list_notify(HWND hwnd, const NMHDR* header) {
+    if (header->code == LVN_GETDISPINFOW) {
+        NMLVDISPINFOW* info = (NMLVDISPINFOW*)header;
+        const int row       = info->item.iItem;
+        if ((info->item.mask & LVIF_TEXT) && row >= 0 && row < MAIN_VIEW.row_count)
+            get_library_row_text(&LIBRARIES[MAIN_VIEW.rows[row]], info->item.pszText, info->item.cchTextMax);
+    } else if (header->code == LVN_ITEMCHANGED) {
+        const NMLISTVIEW* change = (const NMLISTVIEW*)header;
+        if ((change->uChanged & LVIF_STATE) && ((change->uNewState ^ change->uOldState) & LVIS_SELECTED))
+            on_selection_changed(hwnd);
+    }
+
+    return 0;
+}
+
+void on_remove_selected(HWND hwnd) {
+    BACKUP_FILES       = _IS_CHECKED(IDC_CHECKBOX_BACKUP);
+    REMOVE_CONTENT_DIR = _IS_CHECKED(IDC_CHECKBOX_REMOVE_LIB_FOLDER);
+
+    remove_lib_dialog_data data = {
+      .library            = &LIBRARIES[SELECTED_INDEX],
+      .backup_files       = BACKUP_FILES,
+      .remove_content_dir = REMOVE_CONTENT_DIR,
+    };
+
+    const INT_PTR result = DialogBoxParam(GetModuleHandle(NULL),
+                                          MAKEINTRESOURCE(IDD_REMOVE_LIBRARYBOX),
+                                          hwnd,
+                                          remove_library_dialog_proc,
+                                          (LPARAM)&data);
+
+    if (result == IDREMOVE) {
+        BACKUP_FILES       = data.backup_files;
+        REMOVE_CONTENT_DIR = data.remove_content_dir;
+
+        worker_job* job = worker_create_job(JOB_REMOVE, hwnd, 1);
+        if (!job) {
+            MessageBox(hwnd, "Failed to remove library. Check K8-LRT.log for details.", "Error", MB_OK | MB_ICONERROR);
+            return;
+        }
+
+        job->libraries[0]   = &LIBRARIES[SELECTED_INDEX];
+        job->backup_files   = BACKUP_FILES;
+        job->remove_content = REMOVE_CONTENT_DIR;
+        start_main_window_job(hwnd, job, "Removing library...");
+    }
+}
+
+void on_remove_all(HWND hwnd) {
+    if (LIB_COUNT == 0) {
+        MessageBox(hwnd, "No libraries found to remove.", "No Libraries", MB_OK | MB_ICONINFORMATION);
+        return;
+    }
+
+    BACKUP_FILES       = _IS_CHECKED(IDC_CHECKBOX_BACKUP);
+    REMOVE_CONTENT_DIR = _IS_CHECKED(IDC_CHECKBOX_REMOVE_LIB_FOLDER);
+
+    BOOL* selected = (BOOL*)malloc(sizeof(BOOL) * LIB_COUNT);
+    for (int i = 0; i < LIB_COUNT; i++) {
+        selected[i] = TRUE;  // All selected by default
+    }
+
+    batch_removal_dialog_data dialog_data = {.libraries             = LIBRARIES,
+                                             .lib_count             = LIB_COUNT,
+                                             .selected              = selected,
+                                             .backup_files          = BACKUP_FILES,
+                                             .remove_library_folder = REMOVE_CONTENT_DIR,
+                                             .selected_count        = LIB_COUNT,
+                                             .sort_column           = -1};
+
+    ensure_control_classes(ICC_PROGRESS_CLASS);
+    const INT_PTR result = DialogBoxParam(GetModuleHandle(NULL),
+                                          MAKEINTRESOURCE(IDD_BATCH_REMOVEBOX),
+                                          hwnd,
+                                          batch_remove_dialog_proc,
+                                          (LPARAM)&dialog_data);
+
+    if (result == IDREMOVE_BATCH) {
+        BACKUP_FILES       = dialog_data.backup_files;
+        REMOVE_CONTENT_DIR = dialog_data.remove_library_folder;
+
+        const removal_summary summary = dialog_data.summary;
+        const BOOL query_result       = query_libraries(hwnd);
+
+        if (dialog_data.cancelled) {
+            MessageBox(hwnd,
+                       strpool_sprintf("Removal cancelled.\n\nRemoved %d library(ies).\n%d failed.\n%d skipped.",
+                                       summary.removed,
+                                       summary.failed,
+                                       summary.skipped),
+                       "Cancelled",
+                       MB_OK | MB_ICONWARNING);
+        } else if (summary.failed == 0 && summary.shared_cleanup_ok) {
+            MessageBox(hwnd,
+                       strpool_sprintf("Successfully removed %d library(ies).", summary.removed),
+                       "Success",
+                       MB_OK | MB_ICONINFORMATION);
+        } else if (summary.failed == 0) {
+            MessageBox(hwnd,
+                       strpool_sprintf("Removed %d library(ies), but failed to clear the shared cache files.\n\n"
+                                       "Check K8-LRT.log for details.",
+                                       summary.removed),
+                       "Partial Success",
+                       MB_OK | MB_ICONWARNING);
+        } else {
+            MessageBox(hwnd,
+                       strpool_sprintf("Removed %d library(ies).\n%d failed.\n\nCheck K8-LRT.log for details.",
+                                       summary.removed,
+                                       summary.failed),
+                       "Partial Success",
+                       MB_OK | MB_ICONWARNING);
+        }
+
+        if (!query_result) {
+            MessageBox(hwnd,
+                       "Failed to query libraries.\n\nCheck 'K8-LRT.log' for details.",
+                       "Error",
+                       MB_OK | MB_ICONERROR);
+        }
+
+        EnableWindow(H_REMOVE_BUTTON, FALSE);
+        SELECTED_INDEX = -1;
+    }
+
+    free(selected);
+    library_view_free(&dialog_data.view);
+}
+
+void on_relocate_selected(HWND hwnd) {
+    relocate_lib_dialog_data data = {.library = &LIBRARIES[SELECTED_INDEX]};
+    const INT_PTR result          = DialogBoxParam(GetModuleHandle(NULL),
+                                          MAKEINTRESOURCE(IDD_RELOCATE_LIBRARYBOX),
+                                          hwnd,
+                                          relocate_dialog_proc,
+                                          (LPARAM)&data);
+
+    if (result == IDRELOCATE_RELOCATE) {
+        worker_job* job = worker_create_job(JOB_RELOCATE, hwnd, 1);
+        if (!job) {
+            MessageBox(hwnd, "Failed to relocate library.", "Error relocating library", MB_OK | MB_ICONERROR);
+            return;
+        }
+
+        job->libraries[0] = data.library;
+        StringCchCopyA(job->new_path, MAX_PATH, join_paths(data.new_path, data.library->name));
+        start_main_window_job(hwnd, job, "Relocating library...");
+    }
+}
+
+void on_view_log(HWND hwnd) {
+    if (H_LOG_VIEWER && IsWindow(H_LOG_VIEWER)) {
+        SetForegroundWindow(H_LOG_VIEWER);
+        return;
+    }
+
+    WNDCLASS wc      = {0};
+    wc.lpfnWndProc   = log_viewer_proc;
+    wc.hInstance     = GetModuleHandle(NULL);
+    wc.lpszClassName = _LOGVIEW_CLASS;
+    wc.hCursor       = LoadCursor(NULL, IDC_ARROW);
+    wc.hbrBackground = (HBRUSH)(COLOR_WINDOW + 1);
+    wc.hIcon         = LoadIcon(GetModuleHandle(NULL), MAKEINTRESOURCE(IDI_APPICON));
+
+    if (!GetClassInfo(GetModuleHandle(NULL), _LOGVIEW_CLASS, &wc)) {
+        RegisterClass(&wc);
+    }
+
+    RECT parent_rect;
+    GetWindowRect(hwnd, &parent_rect);
+    const int parent_x = parent_rect.left;
+    const int parent_y = parent_rect.top;
+    const int parent_w = parent_rect.right - parent_rect.left;
+    const int parent_h = parent_rect.bottom - parent_rect.top;
+    const int log_x    = parent_x + (parent_w - _LOGVIEW_W) / 2;
+    const int log_y    = parent_y + (parent_h - _LOGVIEW_H) / 2;
+
+    H_LOG_VIEWER = CreateWindowEx(WS_EX_TOOLWINDOW,
+                                  _LOGVIEW_CLASS,
+                                  _LOGVIEW_TITLE,
+                                  WS_OVERLAPPEDWINDOW,
+                                  log_x,
+                                  log_y,
+                                  _LOGVIEW_W,
+                                  _LOGVIEW_H,
+                                  hwnd,
+                                  NULL,
+                                  GetModuleHandle(NULL),
+                                  NULL);
+
+    if (H_LOG_VIEWER) {
+        ShowWindow(H_LOG_VIEWER, SW_SHOW);
+    } else {
+        MessageBox(hwnd, "Failed to create log viewer window.", "Error", MB_OK | MB_ICONERROR);
+    }
+}
+
+void on_watcher_changed(HWND hwnd) {
+    SetTimer(hwnd, IDT_WATCHER_REFRESH, _WATCHER_DEBOUNCE_MS, NULL);
+}
+
+void on_watcher_timer(HWND hwnd) {
+    // Jobs and modal dialogs (which disable the main window) hold pointers into the library table, so the rescan
+    // waits for them by letting the timer fire again
+    if (ACTIVE_JOB || !IsWindowEnabled(hwnd))
+        return;
+
+    KillTimer(hwnd, IDT_WATCHER_REFRESH);
+    if (!scan_libraries())
+        _WARN("Failed to refresh libraries after a change notification");
+}
+
+void on_toggle_verbose_log(HWND hwnd) {
+    const BOOL verbose = !log_is_verbose();
+    log_set_verbosity(verbose ? LOG_VERBOSE : LOG_DEBUG);
+    CheckMenuItem(GetMenu(hwnd), ID_MENU_VERBOSE_LOG, MF_BYCOMMAND | (verbose ? MF_CHECKED : MF_UNCHECKED));
+    _INFO("Verbose logging %s", verbose ? "enabled" : "disabled");
+}
+
+void on_toggle_stats_report(HWND hwnd) {
+    const BOOL enabled = !stats_report_enabled();
+    stats_set_report(enabled);
+    CheckMenuItem(GetMenu(hwnd), ID_MENU_STATS_REPORT, MF_BYCOMMAND | (enabled ? MF_CHECKED : MF_UNCHECKED));
+    _INFO("Stats report %s (%s)", enabled ? "enabled" : "disabled", _STATS_FILENAME);
+}
+
+void on_toggle_db3_delete(HWND hwnd) {
+    DB3_MODE         = DB3_MODE == DB3_DELETE ? DB3_EDIT : DB3_DELETE;
+    const HMENU menu = GetMenu(hwnd);
+    CheckMenuItem(menu, ID_MENU_DB3_DELETE, MF_BYCOMMAND | (DB3_MODE == DB3_DELETE ? MF_CHECKED : MF_UNCHECKED));
+    // Compacting only applies to a database that's edited
+    EnableMenuItem(menu, ID_MENU_DB3_VACUUM, MF_BYCOMMAND | (DB3_MODE == DB3_DELETE ? MF_GRAYED : MF_ENABLED));
+    _INFO("Removals will %s komplete.db3",
+          DB3_MODE == DB3_DELETE ? "delete all of" : "only delete the removed libraries' rows from");
+}
+
+void on_toggle_db3_vacuum(HWND hwnd) {
+    DB3_VACUUM = !DB3_VACUUM;
+    CheckMenuItem(GetMenu(hwnd), ID_MENU_DB3_VACUUM, MF_BYCOMMAND | (DB3_VACUUM ? MF_CHECKED : MF_UNCHECKED));
+    _INFO("Compacting komplete.db3 after removals %s", DB3_VACUUM ? "enabled" : "disabled");
+}
+
+void on_reload_libraries(HWND hwnd) {
+    const int response =
+      MessageBox(hwnd, "Search for libraries again?", "Confirm Reload", MB_YESNO | MB_ICONQUESTION);
+    if (response == IDYES) {
+        const BOOL query_result = query_libraries(hwnd);
+        if (!query_result) {
+            MessageBox(hwnd, "Failed to query libraries. Are you admin?", "Error querying", MB_OK | MB_ICONERROR);
+        }
+    }
+}
+
+void on_restore_backup(HWND hwnd) {
+    if (ACTIVE_JOB)
+        return;
+
+    char snapshot_path[MAX_PATH] = {0};
+    if (!open_snapshot_dialog(hwnd, snapshot_path, MAX_PATH))
+        return;
+
+    const int response = message_box_utf8(hwnd,
+                                          strpool_sprintf("Restore the files and registry keys backed up in '%s'?\n\n"
+                                                          "Files that exist at the same paths will be replaced.",
+                                                          PathFindFileNameA(snapshot_path)),
+                                          "Confirm Restore",
+                                          MB_YESNO | MB_ICONQUESTION);
+    if (response != IDYES)
+        return;
 
-            HWND h_list = GetDlgItem(hwnd, IDC_BATCH_LIBRARY_LIST);
-            ListView_SetExtendedListViewStyle(h_list, LVS_EX_CHECKBOXES | LVS_EX_FULLROWSELECT);
+    worker_job* job = worker_create_job(JOB_RESTORE, hwnd, 1);
+    if (!job)
+        return;
 
-            LVCOLUMN lvc = {0};
-            lvc.mask     = LVCF_TEXT | LVCF_WIDTH;
-            lvc.cx       = 340;
-            lvc.pszText  = "Library Name";
-            ListView_InsertColumn(h_list, 0, &lvc);
+    StringCchCopyA(job->snapshot_path, MAX_PATH, snapshot_path);
+    start_main_window_job(hwnd, job, "Restoring backup...");
+}
 
-            LVITEM lvi = {0};
-            lvi.mask   = LVIF_TEXT;
+void on_find_orphans(HWND hwnd) {
+    if (ACTIVE_JOB)
+        return;
 
-            for (int i = 0; i < data->lib_count; i++) {
-                lvi.iItem   = i;
-                lvi.pszText = (char*)data->libraries[i].name;
-                ListView_InsertItem(h_list, &lvi);
+    worker_job* job = worker_create_job(JOB_ORPHANS, hwnd, 1);
+    if (!job)
+        return;
 
-                ListView_SetCheckState(h_list, i, data->selected[i]);
-            }
+    // Taken now, since the checkboxes are what the confirmation and the removal that follows go by
+    job->backup_files   = _IS_CHECKED(IDC_CHECKBOX_BACKUP);
+    job->remove_content = _IS_CHECKED(IDC_CHECKBOX_REMOVE_LIB_FOLDER);
 
-            CheckDlgButton(hwnd, IDC_BATCH_BACKUP_CHECK, data->backup_files ? BST_CHECKED : BST_UNCHECKED);
-            CheckDlgButton(hwnd, IDC_BATCH_FOLDER_CHECK, data->remove_library_folder ? BST_CHECKED : BST_UNCHECKED);
+    job->orphans = (orphan_report*)calloc(1, sizeof(orphan_report));
+    if (!job->orphans) {
+        worker_free_job(job);
+        return;
+    }
+    start_main_window_job(hwnd, job, "Looking for orphans...");
+}
 
-            update_batch_count_label(hwnd, data->selected_count);
+void on_exit(HWND hwnd) {
+    const char* message = ACTIVE_JOB ? "A library operation is still running. Cancel it and exit?"
+                                     : "Are you sure you want exit?";
+    const int response  = MessageBox(hwnd, message, "Confirm Exit", MB_YESNO | MB_ICONQUESTION);
+    if (response == IDYES) {
+        worker_cancel_job(ACTIVE_JOB);
+        PostQuitMessage(0);
+    }
+}
 
-            RECT parent_rect, dlg_rect;
-            HWND h_parent = GetParent(hwnd);
-            GetWindowRect(h_parent, &parent_rect);
-            GetWindowRect(hwnd, &dlg_rect);
+void on_about(HWND hwnd) {
+    const char* version = VER_PRODUCTVERSION_STR;
+    ensure_control_classes(ICC_LINK_CLASS);
+    DialogBoxParam(GetModuleHandle(NULL), MAKEINTRESOURCE(IDD_ABOUTBOX), hwnd, about_dialog_proc, (LPARAM)version);
+}
 
-            int dlg_w    = dlg_rect.right - dlg_rect.left;
-            int dlg_h    = dlg_rect.bottom - dlg_rect.top;
-            int parent_x = parent_rect.left;
-            int parent_y = parent_rect.top;
-            int parent_w = parent_rect.right - parent_rect.left;
-            int parent_h = parent_rect.bottom - parent_rect.top;
+#pragma endregion
+//===================================================================//
+//                      -- WINDOW CALLBACK --                        //
+//===================================================================//
+#pragma region window callbacks
 
-            int x = parent_x + (parent_w - dlg_w) / 2;
-            int y = parent_y + (parent_h - dlg_h) / 2;
+LRESULT CALLBACK wnd_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam) {
+    switch (umsg) {
+        case WM_CREATE:
+            return on_create(hwnd);
 
-            SetWindowPos(hwnd, NULL, x, y, 0, 0, SWP_NOSIZE | SWP_NOZORDER);
+        case WM_SHOWWINDOW:
+            return on_show(hwnd);
 
-            return (INT_PTR)TRUE;
+        case WM_ERASEBKGND: {
+            HDC hdc = (HDC)wparam;
+            RECT rect;
+            GetClientRect(hwnd, &rect);
+            FillRect(hdc, &rect, GetSysColorBrush(COLOR_WINDOW));
+            return 1;
         }
 
-        case WM_NOTIFY: {
-            LPNMHDR pnmh = (LPNMHDR)lparam;
+        case WM_CTLCOLORSTATIC: {
+            HDC hdc = (HDC)wparam;
+            SetBkMode(hdc, TRANSPARENT);
+            return (LRESULT)GetSysColorBrush(COLOR_WINDOW);
+        }
 
-            if (pnmh->idFrom == IDC_BATCH_LIBRARY_LIST) {
-                HWND h_list = GetDlgItem(hwnd, IDC_BATCH_LIBRARY_LIST);
+        case WM_CTLCOLORLISTBOX: {
+            HDC hdc = (HDC)wparam;
+            SetBkColor(hdc, GetSysColor(COLOR_WINDOW));
+            return (LRESULT)GetSysColorBrush(COLOR_WINDOW);
+        }
+
+        case WM_COMMAND: {
+            switch (LOWORD(wparam)) {
+                case ID_MENU_VIEW_LOG: {
+                    on_view_log(hwnd);
+                    break;
+                }
+
+                case ID_MENU_VERBOSE_LOG: {
+                    on_toggle_verbose_log(hwnd);
+                    break;
+                }
 
-                if (pnmh->code == LVN_ITEMCHANGED) {
-                    LPNMLISTVIEW pnmlv = (LPNMLISTVIEW)lparam;
+                case ID_MENU_STATS_REPORT: {
+                    on_toggle_stats_report(hwnd);
+                    break;
+                }
+                case ID_MENU_DB3_DELETE: {
+                    on_toggle_db3_delete(hwnd);
+                    break;
+                }
+                case ID_MENU_DB3_VACUUM: {
+                    on_toggle_db3_vacuum(hwnd);
+                    break;
+                }
 
-                    if ((pnmlv->uChanged & LVIF_STATE) &&
-                        ((pnmlv->uNewState & LVIS_STATEIMAGEMASK) != (pnmlv->uOldState & LVIS_STATEIMAGEMASK))) {
-                        data->selected[pnmlv->iItem] = ListView_GetCheckState(h_list, pnmlv->iItem);
+                case ID_MENU_RELOAD_LIBRARIES: {
+                    on_reload_libraries(hwnd);
+                    break;
+                }
 
-                        int count = 0;
-                        for (int i = 0; i < data->lib_count; i++) {
-                            if (data->selected[i]) {
-                                count++;
-                            }
-                        }
-                        data->selected_count = count;
+                case ID_MENU_RESTORE_BACKUP: {
+                    on_restore_backup(hwnd);
+                    break;
+                }
 
-                        update_batch_count_label(hwnd, count);
-                        EnableWindow(GetDlgItem(hwnd, IDREMOVE_BATCH), count > 0);
-                    }
+                case ID_MENU_FIND_ORPHANS: {
+                    on_find_orphans(hwnd);
+                    break;
+                }
+
+                case ID_MENU_EXIT: {
+                    on_exit(hwnd);
+                    break;
+                }
+
+                case ID_MENU_CHECK_UPDATES: {
+                    check_for_updates(hwnd, TRUE);
+                    break;
+                }
+
+                case ID_MENU_ABOUT: {
+                    on_about(hwnd);
+                    break;
+                }
+
+                case IDC_REMOVE_ALL_BUTTON: {
+                    on_remove_all(hwnd);
+                    break;
+                }
+
+                case IDC_REMOVE_BUTTON: {
+                    on_remove_selected(hwnd);
+                    break;
+                }
+
+                case IDC_FILTER_EDIT: {
+                    if (HIWORD(wparam) == EN_CHANGE)
+                        on_filter_changed(hwnd);
+                    break;
+                }
+
+                case IDC_RELOCATE_BUTTON: {
+                    on_relocate_selected(hwnd);
+                    break;
                 }
             }
+
+            return 0;
+        }
+
+        case WM_WORKER_PROGRESS: {
+            on_worker_progress(hwnd, (int)wparam, (int)lparam);
+            return 0;
+        }
+
+        case WM_WORKER_DONE: {
+            on_worker_done(hwnd, (worker_job*)lparam);
+            return 0;
+        }
+
+        case WM_UPDATE_CHECKED: {
+            on_update_checked(hwnd, (update_check*)lparam);
+            return 0;
+        }
+
+        case WM_SIZE_INDEXED: {
+            on_size_indexed(hwnd, (int)wparam, (LONG)lparam);
+            return 0;
+        }
+
+        case WM_NOTIFY: {
+            const NMHDR* header = (const NMHDR*)lparam;
+            if (header->idFrom == IDC_LIBRARY_LIST)
+                return on_library_list_notify(hwnd, header);
             break;
         }
 
-        case WM_COMMAND: {
-            HWND h_list = GetDlgItem(hwnd, IDC_BATCH_LIBRARY_LIST);
+        case WM_WATCHER_CHANGED: {
+            on_watcher_changed(hwnd);
+            return 0;
+        }
 
-            switch (LOWORD(wparam)) {
-                case IDC_BATCH_SELECT_ALL: {
-                    for (int i = 0; i < data->lib_count; i++) {
-                        ListView_SetCheckState(h_list, i, TRUE);
-                        data->selected[i] = TRUE;
-                    }
-                    data->selected_count = data->lib_count;
-                    update_batch_count_label(hwnd, data->selected_count);
-                    EnableWindow(GetDlgItem(hwnd, IDREMOVE_BATCH), TRUE);
-                    return (INT_PTR)TRUE;
-                }
+        case WM_TIMER: {
+            if (wparam == IDT_WATCHER_REFRESH)
+                on_watcher_timer(hwnd);
+            return 0;
+        }
 
-                case IDC_BATCH_DESELECT_ALL: {
-                    for (int i = 0; i < data->lib_count; i++) {
-                        ListView_SetCheckState(h_list, i, FALSE);
-                        data->selected[i] = FALSE;
-                    }
-                    data->selected_count = 0;
-                    update_batch_count_label(hwnd, 0);
-                    EnableWindow(GetDlgItem(hwnd, IDREMOVE_BATCH), FALSE);
-                    return (INT_PTR)TRUE;
-                }
+        case WM_CLOSE: {
+            if (ACTIVE_JOB) {
+                const int response = MessageBox(hwnd,
+                                                "A library operation is still running. Cancel it and exit?",
+                                                "Confirm Exit",
+                                                MB_YESNO | MB_ICONWARNING);
+                if (response != IDYES)
+                    return 0;
+                worker_cancel_job(ACTIVE_JOB);
+            }
+
+            DestroyWindow(hwnd);
+            return 0;
+        }
+
+        case WM_DESTROY: {
+            PostQuitMessage(0);
+            return 0;
+        }
+    }
+
+    return DefWindowProc(hwnd, umsg, wparam, lparam);
+}
+
+#pragma endregion
+
+//===================================================================//
+//                        -- COMMAND LINE --                         //
+//===================================================================//
+#pragma region command line
+
+typedef enum {
+    CLI_EXIT_OK        = 0,  // Everything requested succeeded
+    CLI_EXIT_FAILED    = 1,  // At least one library failed to be removed or relocated
+    CLI_EXIT_USAGE     = 2,  // Invalid command line
+    CLI_EXIT_QUERY     = 3,  // The library list couldn't be read (usually not running as administrator)
+    CLI_EXIT_NOT_FOUND = 4,  // A name or pattern matched no installed library
+    CLI_EXIT_CANCELLED = 5,  // Interrupted with Ctrl+C before finishing
+} cli_exit_code;
+
+typedef enum {
+    CLI_NONE,
+    CLI_HELP,
+    CLI_LIST,
+    CLI_REMOVE,
+    CLI_REMOVE_ALL,
+    CLI_RELOCATE,
+    CLI_RESTORE,
+    CLI_ORPHANS,
+    CLI_REMOVE_ORPHANS,
+} cli_command;
+
+typedef struct {
+    cli_command command;
+    // Operands of --remove, or of --except for --remove-all
+    const char** patterns;
+    int pattern_count;
+    const char* relocate_name;
+    const char* relocate_path;
+    const char* snapshot;  // Operand of --restore
+    // Offline image to work on instead of this machine
+    const char* target;       // Where its system drive is mounted
+    const char* target_hive;  // Its SOFTWARE hive, if not at the usual place below `target`
+    const char* target_user;  // Profile whose Kontakt caches are cleaned
+    BOOL no_backup;
+    BOOL keep_content;
+    BOOL reset_db3;
+    BOOL vacuum_db3;
+    BOOL dry_run;
+    BOOL verbose;
+    BOOL stats;
+} cli_options;
+
+static const char* CLI_USAGE =
+  "Usage: K8-LRT.exe <command> [options]\n"
+  "\n"
+  "Commands:\n"
+  "  --list                            List installed libraries\n"
+  "  --remove <name|glob>...           Remove the matching libraries\n"
+  "  --remove-all [--except <name|glob>...]\n"
+  "                                    Remove every library except the matching ones\n"
+  "  --relocate <name> <folder>        Move a library's content into <folder>\\<name>\n"
+  "  --restore <snapshot>              Put back what a removal backed up (name or path of a .k8snap file)\n"
+  "  --orphans                         List XML files and content directories left behind without a registry key,\n"
+  "                                    and content directories registered by more than one library\n"
+  "  --remove-orphans                  Remove the orphaned XML files and content directories\n"
+  "  --help                            Show this message\n"
+  "\n"
+  "Options:\n"
+  "  --no-backup                       Don't take a backup snapshot before removing\n"
+  "  --keep-content                    Don't delete library content directories\n"
+  "  --reset-db3                       Delete all of komplete.db3 instead of only the removed libraries' rows\n"
+  "  --vacuum-db3                      Compact komplete.db3 after deleting rows from it\n"
+  "  --dry-run                         Print what --remove, --remove-all or --remove-orphans would delete and\n"
+  "                                    change nothing\n"
+  "  --verbose                         Log every file and registry key that is touched\n"
+  "  --stats                           Write timings and counters for each operation to K8-LRT.stats.json\n"
+  "\n"
+  "Offline images:\n"
+  "  --target <root>                   Work on the Windows image whose system drive is mounted at <root>\n"
+  "  --target-hive <file>              Use this SOFTWARE hive (default: <root>\\Windows\\System32\\config\\SOFTWARE).\n"
+  "                                    Without --target only registry keys are removed\n"
+  "  --target-user <name>              Also clean Kontakt's caches of the image's user <name>\n"
+  "\n"
+  "Results are written to stdout as JSON. Exit codes: 0 success, 1 failure, 2 invalid usage,\n"
+  "3 libraries couldn't be queried (run as administrator), 4 no matching library, 5 cancelled.\n";
+
+// Set while a removal or relocation runs so Ctrl+C can cancel it cleanly
+static worker_job* CLI_JOB = NULL;
+
+// Holds the parsed arguments, which have to outlive the strpool_reset() done by every library scan
+static arena CLI_ARENA;
+
+BOOL WINAPI cli_ctrl_handler(DWORD ctrl_type) {
+    if ((ctrl_type == CTRL_C_EVENT || ctrl_type == CTRL_BREAK_EVENT) && CLI_JOB) {
+        worker_cancel_job(CLI_JOB);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+// GUI-subsystem processes start without a console. Output goes wherever the caller redirected it, or else to the
+// console of the shell we were started from.
+void cli_attach_output(void) {
+    const HANDLE out = GetStdHandle(STD_OUTPUT_HANDLE);
+    if (out && out != INVALID_HANDLE_VALUE && GetFileType(out) != FILE_TYPE_UNKNOWN)
+        return;
+
+    if (!ATTACHED_TO_CONSOLE && AttachConsole(ATTACH_PARENT_PROCESS)) {
+        FILE* f_dummy;
+        freopen_s(&f_dummy, "CONOUT$", "w", stdout);
+        freopen_s(&f_dummy, "CONOUT$", "w", stderr);
+        ATTACHED_TO_CONSOLE = TRUE;
+    }
+}
+
+// Arguments are converted to UTF-8, matching the library names and content directories read from the registry
+char* cli_arg(const wchar_t* arg) {
+    return arena_wide_to_utf8(&CLI_ARENA, arg);
+}
+
+BOOL is_cli_flag(const char* arg) {
+    return strncmp(arg, "--", 2) == 0;
+}
+
+void json_write_string(FILE* out, const char* str) {
+    if (!str) {
+        fputs("null", out);
+        return;
+    }
+
+    fputc('"', out);
+    for (const unsigned char* c = (const unsigned char*)str; *c; c++) {
+        switch (*c) {
+            case '"':
+                fputs("\\\"", out);
+                break;
+            case '\\':
+                fputs("\\\\", out);
+                break;
+            case '\n':
+                fputs("\\n", out);
+                break;
+            case '\r':
+                fputs("\\r", out);
+                break;
+            case '\t':
+                fputs("\\t", out);
+                break;
+            default:
+                if (*c < 0x20)
+                    fprintf(out, "\\u%04x", *c);
+                else
+                    fputc(*c, out);
+                break;
+        }
+    }
+    fputc('"', out);
+}
+
+int cli_fail(cli_exit_code code, const char* message) {
+    fputs("{\"error\": ", stdout);
+    json_write_string(stdout, message);
+    fputs("}\n", stdout);
+    _ERROR("%s", message);
+    return code;
+}
+
+BOOL parse_cli_options(int argc, char** argv, cli_options* options, const char** error) {
+    options->patterns = (const char**)arena_alloc(&CLI_ARENA, (argc + 1) * sizeof(char*));
+    if (!options->patterns) {
+        *error = "Out of memory";
+        return FALSE;
+    }
+
+    for (int i = 0; i < argc; i++) {
+        const char* arg           = argv[i];
+        cli_command command       = CLI_NONE;
+        const BOOL takes_operands = _STREQ(arg, "--remove") || _STREQ(arg, "--except");
+
+        if (_STREQ(arg, "--no-backup")) {
+            options->no_backup = TRUE;
+            continue;
+        } else if (_STREQ(arg, "--keep-content")) {
+            options->keep_content = TRUE;
+            continue;
+        } else if (_STREQ(arg, "--reset-db3")) {
+            options->reset_db3 = TRUE;
+            continue;
+        } else if (_STREQ(arg, "--vacuum-db3")) {
+            options->vacuum_db3 = TRUE;
+            continue;
+        } else if (_STREQ(arg, "--dry-run")) {
+            options->dry_run = TRUE;
+            continue;
+        } else if (_STREQ(arg, "--verbose")) {
+            options->verbose = TRUE;
+            continue;
+        } else if (_STREQ(arg, "--stats")) {
+            options->stats = TRUE;
+            continue;
+        } else if (_STREQ(arg, "--target") || _STREQ(arg, "--target-hive") || _STREQ(arg, "--target-user")) {
+            if (i + 1 >= argc || is_cli_flag(argv[i + 1])) {
+                *error = strpool_sprintf("%s requires an operand", arg);
+                return FALSE;
+            }
+            const char* operand = argv[++i];
+            if (_STREQ(arg, "--target"))
+                options->target = operand;
+            else if (_STREQ(arg, "--target-hive"))
+                options->target_hive = operand;
+            else
+                options->target_user = operand;
+            continue;
+        } else if (_STREQ(arg, "--help") || _STREQ(arg, "-h") || _STREQ(arg, "/?")) {
+            command = CLI_HELP;
+        } else if (_STREQ(arg, "--list")) {
+            command = CLI_LIST;
+        } else if (_STREQ(arg, "--remove")) {
+            command = CLI_REMOVE;
+        } else if (_STREQ(arg, "--remove-all")) {
+            command = CLI_REMOVE_ALL;
+        } else if (_STREQ(arg, "--orphans")) {
+            command = CLI_ORPHANS;
+        } else if (_STREQ(arg, "--remove-orphans")) {
+            command = CLI_REMOVE_ORPHANS;
+        } else if (_STREQ(arg, "--except")) {
+            if (options->command != CLI_REMOVE_ALL) {
+                *error = "--except must follow --remove-all";
+                return FALSE;
+            }
+        } else if (_STREQ(arg, "--relocate")) {
+            if (i + 2 >= argc || is_cli_flag(argv[i + 1]) || is_cli_flag(argv[i + 2])) {
+                *error = "--relocate requires a library name and a destination folder";
+                return FALSE;
+            }
+            command                = CLI_RELOCATE;
+            options->relocate_name = argv[++i];
+            options->relocate_path = argv[++i];
+        } else if (_STREQ(arg, "--restore")) {
+            if (i + 1 >= argc || is_cli_flag(argv[i + 1])) {
+                *error = "--restore requires a backup snapshot";
+                return FALSE;
+            }
+            command           = CLI_RESTORE;
+            options->snapshot = argv[++i];
+        } else {
+            *error = strpool_sprintf("Unknown argument: '%s'", arg);
+            return FALSE;
+        }
+
+        if (command == CLI_HELP || options->command == CLI_HELP) {
+            options->command = CLI_HELP;
+        } else if (command != CLI_NONE) {
+            if (options->command != CLI_NONE) {
+                *error = "Only one command may be given";
+                return FALSE;
+            }
+            options->command = command;
+        }
+
+        if (takes_operands) {
+            while (i + 1 < argc && !is_cli_flag(argv[i + 1]))
+                options->patterns[options->pattern_count++] = argv[++i];
+        }
+    }
+
+    if (options->command == CLI_NONE) {
+        *error = "No command given";
+        return FALSE;
+    }
+
+    if (options->command == CLI_REMOVE && options->pattern_count == 0) {
+        *error = "--remove requires at least one library name or pattern";
+        return FALSE;
+    }
+
+    if (options->dry_run && options->command != CLI_REMOVE && options->command != CLI_REMOVE_ALL &&
+        options->command != CLI_REMOVE_ORPHANS && options->command != CLI_HELP) {
+        *error = "--dry-run only applies to --remove, --remove-all and --remove-orphans";
+        return FALSE;
+    }
 
-                case IDREMOVE_BATCH: {
-                    if (data->selected_count == 0) {
-                        MessageBox(hwnd,
-                                   "Please select at least one library to remove.",
-                                   "No Selection",
-                                   MB_OK | MB_ICONINFORMATION);
-                        return (INT_PTR)TRUE;
-                    }
+    // A relocated library would be copied with this machine's paths and point the image at them
+    if ((options->target || options->target_hive) && options->command == CLI_RELOCATE) {
+        *error = "--relocate can't be used on an offline image";
+        return FALSE;
+    }
 
-                    data->backup_files          = (IsDlgButtonChecked(hwnd, IDC_BATCH_BACKUP_CHECK) == BST_CHECKED);
-                    data->remove_library_folder = (IsDlgButtonChecked(hwnd, IDC_BATCH_FOLDER_CHECK) == BST_CHECKED);
+    if (options->target_user && !options->target) {
+        *error = "--target-user requires --target";
+        return FALSE;
+    }
 
-                    for (int i = 0; i < data->lib_count; i++) {
-                        data->selected[i] = ListView_GetCheckState(h_list, i);
-                    }
+    return TRUE;
+}
 
-                    EndDialog(hwnd, IDREMOVE_BATCH);
-                    return (INT_PTR)TRUE;
-                }
+// Loads an offline image's SOFTWARE hive and points PATHS at its mounted system drive. RegLoadAppKeyW() hives are
+// private to the process that loaded them, so separate processes can work on any number of images side by side.
+BOOL target_open(const cli_options* options, const char** error) {
+    if (!options->target && !options->target_hive)
+        return TRUE;
 
-                case IDCANCEL_BATCH:
-                case IDCANCEL: {
-                    EndDialog(hwnd, IDCANCEL);
-                    return (INT_PTR)TRUE;
-                }
-            }
-            break;
+    if (options->target) {
+        const wchar_t* wide = utf8_to_wide(options->target);
+        wchar_t full[MAX_PATH];
+        DWORD len = wide ? GetFullPathNameW(wide, MAX_PATH, full, NULL) : 0;
+        if (len == 0 || len >= MAX_PATH) {
+            *error = strpool_sprintf("Invalid offline image root: '%s'", options->target);
+            return FALSE;
         }
 
-        case WM_CLOSE: {
-            EndDialog(hwnd, IDCANCEL);
-            return (INT_PTR)TRUE;
+        // Paths are joined onto the root with their own separator
+        while (len > 0 && _IS_PATH_SEPARATOR(full[len - 1]))
+            full[--len] = L'\0';
+        TARGET.root = cli_arg(full);
+        if (!TARGET.root || !directory_exists(join_str(TARGET.root, "\\"))) {
+            *error = strpool_sprintf("Offline image root doesn't exist: '%s'", options->target);
+            TARGET.root = NULL;
+            return FALSE;
         }
     }
 
-    return (INT_PTR)FALSE;
+    const char* hive =
+      options->target_hive ? options->target_hive : join_paths(TARGET.root, "Windows\\System32\\config\\SOFTWARE");
+    const wchar_t* wide_hive = utf8_to_wide(hive);
+    const LSTATUS status =
+      wide_hive ? RegLoadAppKeyW(wide_hive, &TARGET.software, KEY_ALL_ACCESS, 0, 0) : ERROR_NOT_ENOUGH_MEMORY;
+    if (status != ERROR_SUCCESS) {
+        *error = strpool_sprintf("Failed to load registry hive: '%s' (Error: %ld)", hive, status);
+        ZeroMemory(&TARGET, sizeof(TARGET));
+        return FALSE;
+    }
+
+    // Spelled out in full, since removal journals are only recovered with the hive they were written for
+    wchar_t full_hive[MAX_PATH];
+    const DWORD hive_len = GetFullPathNameW(wide_hive, MAX_PATH, full_hive, NULL);
+    TARGET.hive          = cli_arg(hive_len > 0 && hive_len < MAX_PATH ? full_hive : wide_hive);
+
+    TARGET.user = options->target_user;
+    _INFO("Working on offline image: '%s' (registry hive: '%s')", TARGET.root ? TARGET.root : "-", hive);
+
+    known_paths_destroy();
+    known_paths_init();
+    return TRUE;
 }
 
-INT_PTR CALLBACK relocate_dialog_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam) {
-    static relocate_lib_dialog_data* data = NULL;
+void target_close(void) {
+    if (TARGET.software)
+        RegCloseKey(TARGET.software);
+    ZeroMemory(&TARGET, sizeof(TARGET));
+}
 
-    switch (umsg) {
-        case WM_INITDIALOG: {
-            data = (relocate_lib_dialog_data*)lparam;
+// Names match case-insensitively like registry keys do; patterns with wildcards go through PathMatchSpec
+BOOL cli_matches(const char* name, const char* pattern) {
+    if (strpbrk(pattern, "*?"))
+        return PathMatchSpec(name, pattern);
+    return _stricmp(name, pattern) == 0;
+}
 
-            HWND h_name_label = GetDlgItem(hwnd, IDC_LIB_NAME_LABEL);
-            SetWindowTextA(h_name_label, data->library->name);
+int cli_list(void) {
+    fputs("{\"libraries\": [", stdout);
+    for (int i = 0; i < LIB_COUNT; i++) {
+        fputs(i > 0 ? ", {\"name\": " : "{\"name\": ", stdout);
+        json_write_string(stdout, LIBRARIES[i].name);
+        fputs(", \"content_dir\": ", stdout);
+        json_write_string(stdout, LIBRARIES[i].content_dir);
+        fputc('}', stdout);
+    }
+    fputs("]}\n", stdout);
 
-            HFONT h_font = CreateFont(16,
-                                      0,
-                                      0,
-                                      0,
-                                      FW_BOLD,
-                                      FALSE,
-                                      FALSE,
-                                      FALSE,
-                                      DEFAULT_CHARSET,
-                                      OUT_DEFAULT_PRECIS,
-                                      CLIP_DEFAULT_PRECIS,
-                                      DEFAULT_QUALITY,
-                                      DEFAULT_PITCH | FF_DONTCARE,
-                                      "Segoe UI");
-            SendMessage(h_name_label, WM_SETFONT, (WPARAM)h_font, TRUE);
+    return CLI_EXIT_OK;
+}
 
-            HWND h_content_dir_label = GetDlgItem(hwnd, IDC_CONTENT_DIR_LABEL);
-            SetWindowTextA(h_content_dir_label, data->library->content_dir);
+void cli_write_names(const char* key, const char** names, int count, BOOL trailing_comma) {
+    fprintf(stdout, "\"%s\": [", key);
+    for (int i = 0; i < count; i++) {
+        if (i > 0)
+            fputs(", ", stdout);
+        json_write_string(stdout, names[i]);
+    }
+    fputs(trailing_comma ? "], " : "]", stdout);
+}
 
-            RECT parent_rect, dlg_rect;
-            HWND h_parent = GetParent(hwnd);
-            GetWindowRect(h_parent, &parent_rect);
-            GetWindowRect(hwnd, &dlg_rect);
+// Full name of a registry key a plan deletes. With an offline target it's named below the hive file, whose root is
+// the image's SOFTWARE key, since the machine's own HKEY_LOCAL_MACHINE isn't touched.
+const char* cli_plan_key_path(const char* path) {
+    if (!TARGET.software)
+        return join_paths("HKEY_LOCAL_MACHINE", path);
 
-            int dlg_w    = dlg_rect.right - dlg_rect.left;
-            int dlg_h    = dlg_rect.bottom - dlg_rect.top;
-            int parent_x = parent_rect.left;
-            int parent_y = parent_rect.top;
-            int parent_w = parent_rect.right - parent_rect.left;
-            int parent_h = parent_rect.bottom - parent_rect.top;
+    const size_t prefix = strlen(_TARGET_HIVE_KEY);
+    if (_strnicmp(path, _TARGET_HIVE_KEY, prefix) == 0)
+        path += prefix;
+    return join_paths(TARGET.hive ? TARGET.hive : "", path);
+}
 
-            int x = parent_x + (parent_w - dlg_w) / 2;
-            int y = parent_y + (parent_h - dlg_h) / 2;
+void cli_write_plan_step(const removal_step* step, BOOL leading_comma) {
+    fprintf(stdout, "%s{\"action\": \"%s\", \"path\": ", leading_comma ? ", " : "", REMOVAL_STEP_ACTIONS[step->kind]);
+    json_write_string(stdout, step->kind == PLAN_REGISTRY_KEY ? cli_plan_key_path(step->path) : step->path);
+    if (step->size_known)
+        fprintf(stdout, ", \"size\": %llu}", step->size);
+    else
+        fputs(", \"size\": null}", stdout);
+}
 
-            SetWindowPos(hwnd, NULL, x, y, 0, 0, SWP_NOSIZE | SWP_NOZORDER);
+// Writes the plan a removal of `targets` would follow without changing anything. Content directories the indexer
+// hasn't measured are walked here. Returns FALSE if a library couldn't be planned, which a removal would skip.
+BOOL cli_write_plan(const library_entry* targets[], int count, BOOL remove_content) {
+    registry_removal registry;
+    registry_removal_open(&registry);
+
+    removal_plan plan;
+    BOOL planned = build_removal_plan(&plan, &registry, targets, count, remove_content);
+    registry_removal_close(&registry);
+    if (planned)
+        plan_shared_files(&plan, targets, count);
+
+    const volatile LONG never_cancelled = 0;
+    ULONGLONG total_bytes               = 0;
+    for (int i = 0; i < plan.step_count; i++) {
+        removal_step* step = &plan.steps[i];
+        if (step->kind == PLAN_CONTENT_DIR && !step->size_known) {
+            size_index_item item = {.name = targets[step->library]->name, .root = make_long_path(step->path)};
+            step->size_known     = item.root && size_index_walk(&item, &never_cancelled);
+            step->size           = item.bytes;
+        }
+        if (step->size_known)
+            total_bytes += step->size;
+    }
 
-            return (INT_PTR)TRUE;
+    fputs("\"libraries\": [", stdout);
+    for (int i = 0; i < count; i++) {
+        const BOOL removable = planned && plan.states[i] == LIBRARY_PLANNED;
+        fputs(i > 0 ? ", {\"name\": " : "{\"name\": ", stdout);
+        json_write_string(stdout, targets[i]->name);
+        fprintf(stdout, ", \"removable\": %s, \"steps\": [", removable ? "true" : "false");
+
+        int n = 0;
+        for (int s = 0; removable && s < plan.step_count; s++) {
+            if (plan.steps[s].library == i)
+                cli_write_plan_step(&plan.steps[s], n++ > 0);
         }
+        fputs("]}", stdout);
 
-        case WM_COMMAND: {
-            switch (LOWORD(wparam)) {
-                case IDC_RELOCATE_BROWSE_BTN: {
-                    char selected_path[MAX_PATH] = {0};
-                    if (open_folder_dialog(hwnd, selected_path, MAX_PATH)) {
-                        SetDlgItemText(hwnd, IDC_RELOCATE_PATH_EDIT, selected_path);
-                    }
-                    return (INT_PTR)TRUE;
-                }
+        if (!removable)
+            planned = FALSE;
+    }
 
-                case IDRELOCATE_RELOCATE: {
-                    GetDlgItemText(hwnd, IDC_RELOCATE_PATH_EDIT, data->new_path, MAX_PATH);
+    fputs("], \"shared\": [", stdout);
+    int n = 0;
+    for (int s = 0; s < plan.step_count; s++) {
+        if (plan.steps[s].library < 0)
+            cli_write_plan_step(&plan.steps[s], n++ > 0);
+    }
+    fprintf(stdout, "], \"total_bytes\": %llu, ", total_bytes);
 
-                    if (strlen(data->new_path) == 0) {
-                        MessageBox(hwnd, "Please select a destination folder.", "Error", MB_ICONWARNING);
-                        return (INT_PTR)TRUE;
-                    }
+    plan_destroy(&plan);
+    return planned;
+}
 
-                    EndDialog(hwnd, IDRELOCATE_RELOCATE);
-                    return (INT_PTR)TRUE;
-                }
+int cli_remove(const cli_options* options) {
+    const BOOL remove_all = options->command == CLI_REMOVE_ALL;
+
+    const library_entry** targets = (const library_entry**)calloc(LIB_COUNT + 1, sizeof(library_entry*));
+    BOOL* matched                 = (BOOL*)calloc(options->pattern_count + 1, sizeof(BOOL));
+    BOOL* results                 = (BOOL*)calloc(LIB_COUNT + 1, sizeof(BOOL));
+    const char** names            = (const char**)calloc(LIB_COUNT + options->pattern_count + 1, sizeof(char*));
+    if (!targets || !matched || !results || !names) {
+        free(targets);
+        free(matched);
+        free(results);
+        free(names);
+        return cli_fail(CLI_EXIT_FAILED, "Out of memory");
+    }
 
-                case IDCANCEL_RELOCATE:
-                case IDCANCEL: {
-                    EndDialog(hwnd, IDCANCEL);
-                    return (INT_PTR)TRUE;
-                }
+    int target_count = 0;
+    for (int i = 0; i < LIB_COUNT; i++) {
+        BOOL hit = FALSE;
+        for (int p = 0; p < options->pattern_count; p++) {
+            if (cli_matches(LIBRARIES[i].name, options->patterns[p])) {
+                matched[p] = TRUE;
+                hit        = TRUE;
             }
-            break;
         }
 
-        case WM_CLOSE: {
-            EndDialog(hwnd, IDCANCEL);
-            return (INT_PTR)TRUE;
+        // --remove takes what matched, --remove-all everything but the exceptions
+        if (hit != remove_all)
+            targets[target_count++] = &LIBRARIES[i];
+    }
+
+    removal_summary summary   = {0};
+    summary.shared_cleanup_ok = TRUE;
+    BOOL cancelled            = FALSE;
+    BOOL planned              = TRUE;
+
+    if (options->dry_run) {
+        fprintf(stdout,
+                "{\"dry_run\": true, \"pending_recovery\": %s, ",
+                file_exists(_REMOVAL_JOURNAL) ? "true" : "false");
+        planned = cli_write_plan(targets, target_count, !options->keep_content);
+    } else if (target_count > 0) {
+        worker_job* job = worker_create_job(JOB_REMOVE, NULL, target_count);
+        CLI_JOB         = job;
+        remove_libraries(targets, target_count, !options->keep_content, &summary, job, results);
+        cancelled = worker_is_cancelled(job);
+        CLI_JOB   = NULL;
+        worker_free_job(job);
+    }
+
+    const int attempted = target_count - summary.skipped;
+    int n               = 0;
+
+    if (!options->dry_run) {
+        fputc('{', stdout);
+        for (int i = 0; i < attempted; i++) {
+            if (results[i])
+                names[n++] = targets[i]->name;
+        }
+        cli_write_names("removed", names, n, TRUE);
+
+        n = 0;
+        for (int i = 0; i < attempted; i++) {
+            if (!results[i])
+                names[n++] = targets[i]->name;
         }
+        cli_write_names("failed", names, n, TRUE);
+
+        n = 0;
+        for (int i = attempted; i < target_count; i++)
+            names[n++] = targets[i]->name;
+        cli_write_names("skipped", names, n, TRUE);
     }
 
-    return (INT_PTR)FALSE;
+    int unmatched = 0;
+    for (int p = 0; p < options->pattern_count; p++) {
+        if (!matched[p])
+            names[unmatched++] = options->patterns[p];
+    }
+    cli_write_names("unmatched", names, unmatched, !options->dry_run);
+
+    if (options->dry_run)
+        fputs("}\n", stdout);
+    else
+        fprintf(stdout, "\"shared_cleanup_ok\": %s}\n", summary.shared_cleanup_ok ? "true" : "false");
+
+    free(targets);
+    free(matched);
+    free(results);
+    free(names);
+
+    if (cancelled)
+        return CLI_EXIT_CANCELLED;
+    if (summary.failed > 0 || !summary.shared_cleanup_ok || !planned)
+        return CLI_EXIT_FAILED;
+    // Unmatched exceptions to --remove-all are harmless; unmatched --remove targets likely are a typo
+    if ((!remove_all && unmatched > 0) || (!remove_all && target_count == 0))
+        return CLI_EXIT_NOT_FOUND;
+    return CLI_EXIT_OK;
 }
 
-#pragma endregion
-//===================================================================//
-//                     -- WNDPROC CALLBACKS --                       //
-//===================================================================//
-#pragma region wndproc callbacks
-
-LRESULT on_create(HWND hwnd) {
-    UI_FONT = CreateFont(16,
-                         0,
-                         0,
-                         0,
-                         FW_NORMAL,
-                         FALSE,
-                         FALSE,
-                         FALSE,
-                         DEFAULT_CHARSET,
-                         OUT_DEFAULT_PRECIS,
-                         CLIP_DEFAULT_PRECIS,
-                         DEFAULT_QUALITY,
-                         DEFAULT_PITCH | FF_DONTCARE,
-                         "Segoe UI");
-    if (!UI_FONT) {
-        _WARN("Failed to create UI font. Falling back to system default.");
+int cli_relocate(const cli_options* options) {
+    const library_entry* library = find_library(options->relocate_name);
+    if (!library) {
+        for (int i = 0; i < LIB_COUNT && !library; i++) {
+            if (cli_matches(LIBRARIES[i].name, options->relocate_name))
+                library = &LIBRARIES[i];
+        }
     }
 
-    create_menu_bar(hwnd);
+    if (!library)
+        return cli_fail(CLI_EXIT_NOT_FOUND, strpool_sprintf("Library not found: '%s'", options->relocate_name));
 
-    create_label(&H_SELECT_LIB_LABEL, "Select a library to remove:", 10, 10, 265, 36, hwnd);
-    create_listbox(&H_LISTBOX, 10, 36, 265, 240, hwnd, IDC_LISTBOX);
+    if (!library->content_dir)
+        return cli_fail(CLI_EXIT_FAILED, strpool_sprintf("Library has no content directory: '%s'", library->name));
 
-    create_checkbox(&H_BACKUP_CHECKBOX,
-                    "Backup cache files before deleting",
-                    10,
-                    260,
-                    220,
-                    20,
-                    hwnd,
-                    IDC_CHECKBOX_BACKUP,
-                    TRUE,
-                    FALSE);
-    create_checkbox(&H_REMOVE_LIB_FOLDER_CHECKBOX,
-                    "Delete library content directory",
-                    10,
-                    280,
-                    220,
-                    20,
-                    hwnd,
-                    IDC_CHECKBOX_REMOVE_LIB_FOLDER,
-                    TRUE,
-                    FALSE);
+    // Same layout as the relocate dialog: the library's folder goes inside the chosen destination
+    const char* new_path = join_paths(options->relocate_path, library->name);
+    if (directory_exists(new_path))
+        return cli_fail(CLI_EXIT_FAILED, strpool_sprintf("Destination already exists: '%s'", new_path));
 
-    create_button(&H_REMOVE_ALL_BUTTON, "Remove All...", 10, 312, 131, 30, hwnd, IDC_REMOVE_ALL_BUTTON, FALSE);
-    create_button(&H_REMOVE_BUTTON, "Remove Selected", 145, 312, 131, 30, hwnd, IDC_REMOVE_BUTTON, TRUE);
-    create_button(&H_RELOCATE_BUTTON, "Relocate Selected", 10, 346, 266, 26, hwnd, IDC_RELOCATE_BUTTON, TRUE);
+    worker_job* job = worker_create_job(JOB_RELOCATE, NULL, 1);
+    if (!job)
+        return cli_fail(CLI_EXIT_FAILED, "Out of memory");
 
-    return 0;
+    const char* old_path = library->content_dir;
+
+    CLI_JOB              = job;
+    const BOOL relocated = relocate_library(library, new_path, job);
+    const BOOL cancelled = worker_is_cancelled(job);
+    CLI_JOB              = NULL;
+    worker_free_job(job);
+
+    fputs("{\"library\": ", stdout);
+    json_write_string(stdout, library->name);
+    fputs(", \"from\": ", stdout);
+    json_write_string(stdout, old_path);
+    fputs(", \"to\": ", stdout);
+    json_write_string(stdout, new_path);
+    fprintf(stdout, ", \"relocated\": %s}\n", relocated ? "true" : "false");
+
+    if (relocated)
+        return CLI_EXIT_OK;
+    return cancelled ? CLI_EXIT_CANCELLED : CLI_EXIT_FAILED;
 }
 
-LRESULT on_show(HWND hwnd) {
-    // Search registry for key entries in `HKEY_LOCAL_MACHINE/SOFTWARE/Native Instruments/..`
-    const BOOL query_result = query_libraries(hwnd);
-    if (!query_result) {
-        MessageBox(hwnd,
-                   "Failed to query libraries. Do you have any Kontakt libraries installed?\n\nCheck "
-                   "'K8-LRT.log' for details.",
-                   "Error",
-                   MB_OK | MB_ICONERROR);
-        PostQuitMessage(0);
-    }
+int cli_restore(const cli_options* options) {
+    // Accept a bare snapshot name as well as a path to the manifest
+    const char* path = options->snapshot;
+    if (!file_exists(path))
+        path = strpool_sprintf("%s\\%s%s", _BACKUP_SNAPSHOTS, options->snapshot, _SNAPSHOT_EXT);
+    if (!file_exists(path))
+        return cli_fail(CLI_EXIT_NOT_FOUND,
+                        strpool_sprintf("Backup snapshot not found: '%s'", options->snapshot));
+
+    worker_job* job = worker_create_job(JOB_RESTORE, NULL, 1);
+    if (!job)
+        return cli_fail(CLI_EXIT_FAILED, "Out of memory");
+
+    CLI_JOB              = job;
+    const BOOL restored  = restore_snapshot(path, job);
+    const BOOL cancelled = worker_is_cancelled(job);
+    CLI_JOB              = NULL;
+    worker_free_job(job);
+
+    fputs("{\"snapshot\": ", stdout);
+    json_write_string(stdout, path);
+    fprintf(stdout, ", \"restored\": %s}\n", restored ? "true" : "false");
+
+    if (restored)
+        return CLI_EXIT_OK;
+    return cancelled ? CLI_EXIT_CANCELLED : CLI_EXIT_FAILED;
+}
 
-    check_for_updates(hwnd, FALSE);
+void cli_write_orphans(const orphan_report* report, BOOL remove_content) {
+    ULONGLONG total_bytes = 0;
+    fputs("\"orphans\": [", stdout);
+    for (int i = 0; i < report->count; i++) {
+        const orphan_entry* entry = &report->entries[i];
+        const BOOL removable      = is_removable_orphan(entry, remove_content);
+        if (removable)
+            total_bytes += entry->size;
+
+        fprintf(stdout, "%s{\"kind\": \"%s\", ", i > 0 ? ", " : "", ORPHAN_KINDS[entry->kind]);
+        if (entry->kind == ORPHAN_SHARED_DIR) {
+            const char* libraries[] = {entry->name, entry->other};
+            cli_write_names("libraries", libraries, 2, TRUE);
+        } else {
+            fputs("\"name\": ", stdout);
+            json_write_string(stdout, entry->name);
+            fputs(", ", stdout);
+        }
 
-    return 0;
+        fputs("\"path\": ", stdout);
+        json_write_string(stdout, entry->path);
+        if (entry->size_known)
+            fprintf(stdout, ", \"bytes\": %llu", entry->size);
+        else if (entry->kind != ORPHAN_SHARED_DIR)
+            fputs(", \"bytes\": null", stdout);
+        fprintf(stdout, ", \"removable\": %s}", removable ? "true" : "false");
+    }
+    fprintf(stdout, "], \"total_bytes\": %llu", total_bytes);
 }
 
-void on_selection_changed(HWND hwnd) {
-    const int sel = (int)SendMessage(H_LISTBOX, LB_GETCURSEL, 0, 0);
-    if (sel != LB_ERR) {
-        SELECTED_INDEX = sel;
+int cli_orphans(const cli_options* options) {
+    const BOOL remove         = options->command == CLI_REMOVE_ORPHANS && !options->dry_run;
+    const BOOL remove_content = !options->keep_content;
+
+    orphan_report report = {0};
+    worker_job* job      = worker_create_job(JOB_ORPHANS, NULL, 1);
+    if (!job)
+        return cli_fail(CLI_EXIT_FAILED, "Out of memory");
+
+    job->backup_files   = BACKUP_FILES;
+    job->remove_content = remove_content;
+
+    CLI_JOB          = job;
+    const BOOL found = find_orphans(&report, job);
+    BOOL removed     = TRUE;
+    if (found && remove && !worker_is_cancelled(job))
+        removed = remove_orphans(&report, job);
+    const BOOL cancelled = worker_is_cancelled(job);
+    CLI_JOB              = NULL;
+    worker_free_job(job);
+
+    fputs(options->dry_run ? "{\"dry_run\": true, " : "{", stdout);
+    cli_write_orphans(&report, remove_content);
+    if (remove) {
+        const char** names = (const char**)calloc(report.count + 1, sizeof(char*));
+        int n              = 0;
+        fputs(", ", stdout);
+        for (int i = 0; names && i < report.count; i++) {
+            if (report.entries[i].removed)
+                names[n++] = report.entries[i].path;
+        }
+        cli_write_names("removed", names, n, TRUE);
+
+        n = 0;
+        for (int i = 0; names && i < report.count; i++) {
+            if (!report.entries[i].removed && is_removable_orphan(&report.entries[i], remove_content))
+                names[n++] = report.entries[i].path;
+        }
+        cli_write_names("failed", names, n, FALSE);
+        free(names);
     }
-    EnableWindow(H_REMOVE_BUTTON, (sel != LB_ERR));
-    EnableWindow(H_RELOCATE_BUTTON, (sel != LB_ERR));
+    fputs("}\n", stdout);
+
+    orphan_report_destroy(&report);
+    if (cancelled)
+        return CLI_EXIT_CANCELLED;
+    if (!found)
+        return CLI_EXIT_QUERY;
+    return removed ? CLI_EXIT_OK : CLI_EXIT_FAILED;
 }
 
-void on_remove_selected(HWND hwnd) {
-    BACKUP_FILES       = _IS_CHECKED(IDC_CHECKBOX_BACKUP);
-    REMOVE_CONTENT_DIR = _IS_CHECKED(IDC_CHECKBOX_REMOVE_LIB_FOLDER);
+// Runs a command-line invocation without creating any windows or checking for updates
+int run_cli(int argc, char** argv) {
+    cli_options options = {0};
+    const char* error   = NULL;
 
-    remove_lib_dialog_data data = {
-      .library            = &LIBRARIES[SELECTED_INDEX],
-      .backup_files       = BACKUP_FILES,
-      .remove_content_dir = REMOVE_CONTENT_DIR,
-    };
+    if (!parse_cli_options(argc, argv, &options, &error)) {
+        fputs(CLI_USAGE, stderr);
+        return cli_fail(CLI_EXIT_USAGE, error);
+    }
 
-    const INT_PTR result = DialogBoxParam(GetModuleHandle(NULL),
-                                          MAKEINTRESOURCE(IDD_REMOVE_LIBRARYBOX),
-                                          hwnd,
-                                          remove_library_dialog_proc,
-                                          (LPARAM)&data);
+    if (options.command == CLI_HELP) {
+        fputs(CLI_USAGE, stdout);
+        return CLI_EXIT_OK;
+    }
 
-    if (result == IDREMOVE) {
-        BACKUP_FILES       = data.backup_files;
-        REMOVE_CONTENT_DIR = data.remove_content_dir;
+    BACKUP_FILES       = !options.no_backup;
+    REMOVE_CONTENT_DIR = !options.keep_content;
+    DB3_MODE           = options.reset_db3 ? DB3_DELETE : DB3_EDIT;
+    DB3_VACUUM         = options.vacuum_db3;
+    if (options.verbose)
+        log_set_verbosity(LOG_VERBOSE);
+    if (options.stats)
+        stats_set_report(TRUE);
+
+    // Everything below, journal recovery included, works on the offline image if one was given
+    if (!target_open(&options, &error))
+        return cli_fail(CLI_EXIT_USAGE, error);
+
+    // An interrupted removal is rolled back or finished before the libraries are read. A dry run leaves it alone and
+    // only reports it.
+    if (!options.dry_run)
+        recover_removal_journal(NULL);
+
+    if (!scan_libraries())
+        return cli_fail(CLI_EXIT_QUERY,
+                        TARGET.software ? "Failed to query libraries in the offline image's registry hive"
+                                        : "Failed to query libraries. Is K8-LRT running as administrator?");
+
+    SetConsoleCtrlHandler(cli_ctrl_handler, TRUE);
+
+    int code = CLI_EXIT_OK;
+    switch (options.command) {
+        case CLI_LIST:
+            code = cli_list();
+            break;
 
-        const BOOL removed = remove_selected_library();
-        if (!removed) {
-            MessageBox(hwnd, "Failed to remove library. Check K8-LRT.log for details.", "Error", MB_OK | MB_ICONERROR);
-            return;
-        } else {
-            const BOOL query_result = query_libraries(hwnd);
-            if (query_result) {
-                EnableWindow(H_REMOVE_BUTTON, FALSE);
-                MessageBox(hwnd, "Successfully removed library.", "Success", MB_OK | MB_ICONINFORMATION);
-            } else {
-                MessageBox(hwnd,
-                           "Failed to query libraries. Do you have any Kontakt libraries "
-                           "installed?\n\nCheck 'K8-LRT.log' for details.",
-                           "Error",
-                           MB_OK | MB_ICONERROR);
-                PostQuitMessage(0);
-            }
-        }
+        case CLI_REMOVE:
+        case CLI_REMOVE_ALL:
+            code = cli_remove(&options);
+            break;
+
+        case CLI_RELOCATE:
+            code = cli_relocate(&options);
+            break;
+
+        case CLI_RESTORE:
+            code = cli_restore(&options);
+            break;
+
+        case CLI_ORPHANS:
+        case CLI_REMOVE_ORPHANS:
+            code = cli_orphans(&options);
+            break;
+
+        default:
+            break;
     }
+
+    SetConsoleCtrlHandler(cli_ctrl_handler, FALSE);
+    fflush(stdout);
+    return code;
 }
 
-void on_remove_all(HWND hwnd) {
-    if (LIB_COUNT == 0) {
-        MessageBox(hwnd, "No libraries found to remove.", "No Libraries", MB_OK | MB_ICONINFORMATION);
-        return;
-    }
+// Converts the process command line for run_cli. Returns 0 arguments when there are no "--" options, which means
+// the GUI should start.
+int get_cli_args(char*** argv_out) {
+    *argv_out = NULL;
 
-    BACKUP_FILES       = _IS_CHECKED(IDC_CHECKBOX_BACKUP);
-    REMOVE_CONTENT_DIR = _IS_CHECKED(IDC_CHECKBOX_REMOVE_LIB_FOLDER);
+    int argc_w     = 0;
+    LPWSTR* argv_w = CommandLineToArgvW(GetCommandLineW(), &argc_w);
+    if (!argv_w)
+        return 0;
 
-    BOOL* selected = (BOOL*)malloc(sizeof(BOOL) * LIB_COUNT);
-    for (int i = 0; i < LIB_COUNT; i++) {
-        selected[i] = TRUE;  // All selected by default
+    BOOL headless = FALSE;
+    for (int i = 1; i < argc_w; i++) {
+        if (wcsncmp(argv_w[i], L"--", 2) == 0 || wcscmp(argv_w[i], L"-h") == 0 || wcscmp(argv_w[i], L"/?") == 0)
+            headless = TRUE;
     }
 
-    batch_removal_dialog_data dialog_data = {.libraries             = LIBRARIES,
-                                             .lib_count             = LIB_COUNT,
-                                             .selected              = selected,
-                                             .backup_files          = BACKUP_FILES,
-                                             .remove_library_folder = REMOVE_CONTENT_DIR,
-                                             .selected_count        = LIB_COUNT};
+    int argc = 0;
+    if (headless) {
+        char** argv = (char**)arena_alloc(&CLI_ARENA, argc_w * sizeof(char*));
+        for (int i = 1; argv && i < argc_w; i++) {
+            char* arg = cli_arg(argv_w[i]);
+            if (arg)
+                argv[argc++] = arg;
+        }
+        *argv_out = argv;
+    }
+
+    LocalFree(argv_w);
+    return argc;
+}
+
+#pragma endregion
 
-    const INT_PTR result = DialogBoxParam(GetModuleHandle(NULL),
-                                          MAKEINTRESOURCE(IDD_BATCH_REMOVEBOX),
-                                          hwnd,
-                                          batch_remove_dialog_proc,
-                                          (LPARAM)&dialog_data);
+//===================================================================//
+//                         -- BENCHMARK --                         //
+//===================================================================//
+#pragma region benchmark
+
+#ifdef K8LRT_BENCH
+    #define _BENCH_REGISTRY_KEY L"Software\\K8-LRT Bench"  // Scratch key HKEY_LOCAL_MACHINE is redirected to
+    #define _BENCH_FANOUT 4                                // Subdirectories per level of a generated library
+    #define _BENCH_WRITE_CHUNK (1024 * 1024)
+
+static const char* BENCH_USAGE =
+  "Usage: K8-LRT-bench.exe [options]\n"
+  "\n"
+  "Generates synthetic libraries and registry keys, then times the scan, backup, copy, relocate and delete engines.\n"
+  "\n"
+  "Options:\n"
+  "  --libraries <n>     Number of libraries to generate (default 8)\n"
+  "  --files <n>         Files per library (default 2000)\n"
+  "  --depth <n>         Directory levels per library, 4 subdirectories each (default 3)\n"
+  "  --min-size <bytes>  Smallest file (default 4096)\n"
+  "  --max-size <bytes>  Largest file; sizes are log-uniform in between (default 8388608)\n"
+  "  --repeat <n>        Number of registry scans (default 5)\n"
+  "  --seed <n>          Seed for the file sizes (default 1)\n"
+  "  --root <folder>     Folder to create for everything (default K8-LRT.bench), must not exist\n"
+  "  --keep              Leave the generated files and the scratch registry key behind\n";
 
-    if (result == IDREMOVE_BATCH) {
-        BACKUP_FILES       = dialog_data.backup_files;
-        REMOVE_CONTENT_DIR = dialog_data.remove_library_folder;
+typedef struct {
+    int libraries;
+    int files;  // Per library
+    int depth;
+    ULONGLONG min_size;
+    ULONGLONG max_size;
+    int repeat;
+    ULONGLONG seed;
+    const char* root;
+    BOOL keep;
+} bench_options;
 
-        int removed_count = 0;
-        int failed_count  = 0;
-
-        for (int i = 0; i < dialog_data.lib_count; i++) {
-            if (dialog_data.selected[i]) {
-                const BOOL removed = remove_library(&LIBRARIES[i], REMOVE_CONTENT_DIR);
-                if (removed) {
-                    removed_count++;
-                } else {
-                    failed_count++;
-                    _ERROR("Failed to remove library: '%s'", LIBRARIES[i]);
-                }
-            }
-        }
+typedef struct {
+    const char* root;  // Absolute, since it's written to the registry as each library's ContentDir
+    ULONGLONG files;
+    ULONGLONG bytes;
+    BYTE* chunk;  // Filler written to every file
+} bench_tree;
+
+// xorshift64*, so a seed always generates the same trees
+ULONGLONG bench_random(ULONGLONG* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ull;
+}
 
-        const BOOL query_result = query_libraries(hwnd);
+// Log-uniform between the two bounds: mostly small files with a few large ones, like sample libraries
+ULONGLONG bench_file_size(const bench_options* options, ULONGLONG* state) {
+    if (options->max_size <= options->min_size)
+        return options->min_size;
 
-        if (failed_count == 0) {
-            MessageBox(hwnd,
-                       strpool_sprintf("Successfully removed %d library(ies).", removed_count),
-                       "Success",
-                       MB_OK | MB_ICONINFORMATION);
-        } else {
-            MessageBox(hwnd,
-                       strpool_sprintf("Removed %d library(ies).\n%d failed.\n\nCheck K8-LRT.log for details.",
-                                       removed_count,
-                                       failed_count),
-                       "Partial Success",
-                       MB_OK | MB_ICONWARNING);
-        }
+    const double lo = log((double)max(options->min_size, 1));
+    const double hi = log((double)options->max_size);
+    const double u  = (double)(bench_random(state) >> 11) / 9007199254740992.0;
+    return (ULONGLONG)exp(lo + (hi - lo) * u);
+}
 
-        if (!query_result) {
-            MessageBox(hwnd,
-                       "Failed to query libraries.\n\nCheck 'K8-LRT.log' for details.",
-                       "Error",
-                       MB_OK | MB_ICONERROR);
-        }
+// Files are spread over _BENCH_FANOUT^depth leaf directories. `create` makes the directories on the way down.
+char* bench_file_path(const char* library_dir, int depth, int index, BOOL create) {
+    char* path  = strpool_strdup(library_dir);
+    int divisor = 1;
+    for (int level = 0; path && level < depth; level++) {
+        path = strpool_sprintf("%s\\d%d", path, (index / divisor) % _BENCH_FANOUT);
+        if (create && path)
+            CreateDirectoryW(make_long_path(path), NULL);
+        divisor *= _BENCH_FANOUT;
+    }
+    return path ? strpool_sprintf("%s\\f%06d.bin", path, index) : NULL;
+}
 
-        EnableWindow(H_REMOVE_BUTTON, FALSE);
-        SELECTED_INDEX = -1;
+const char* bench_library_name(int index) {
+    return strpool_sprintf("K8-LRT Bench %04d", index);
+}
+
+BOOL bench_write_file(const char* path, const BYTE* chunk, ULONGLONG size) {
+    const HANDLE h_file = CreateFileW(make_long_path(path), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+    if (h_file == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    BOOL wrote = TRUE;
+    for (ULONGLONG offset = 0; wrote && offset < size; offset += _BENCH_WRITE_CHUNK) {
+        const DWORD length = (DWORD)min(size - offset, _BENCH_WRITE_CHUNK);
+        DWORD written      = 0;
+        wrote              = WriteFile(h_file, chunk, length, &written, NULL) && written == length;
     }
 
-    free(selected);
+    CloseHandle(h_file);
+    return wrote;
 }
 
-void on_relocate_selected(HWND hwnd) {
-    relocate_lib_dialog_data data = {.library = &LIBRARIES[SELECTED_INDEX]};
-    const INT_PTR result          = DialogBoxParam(GetModuleHandle(NULL),
-                                          MAKEINTRESOURCE(IDD_RELOCATE_LIBRARYBOX),
-                                          hwnd,
-                                          relocate_dialog_proc,
-                                          (LPARAM)&data);
+// Writes every library below tree->root and registers it under the scratch key HKEY_LOCAL_MACHINE points at
+BOOL bench_generate(const bench_options* options, bench_tree* tree) {
+    ULONGLONG state = options->seed ? options->seed : 1;
+    for (int i = 0; i < _BENCH_WRITE_CHUNK; i++)
+        tree->chunk[i] = (BYTE)bench_random(&state);
 
-    if (result == IDRELOCATE_RELOCATE) {
-        _INFO("Relocating library '%s'", data.library->name);
-        _INFO("Old Path: %s", data.library->content_dir);
-        _INFO("New Path: %s", data.new_path);
+    int leaf_count = 1;
+    for (int level = 0; level < options->depth; level++)
+        leaf_count *= _BENCH_FANOUT;
 
-        const char* new_path_full = join_paths(data.new_path, data.library->name);
+    CreateDirectoryW(make_long_path(join_paths(tree->root, "libraries")), NULL);
+    for (int lib = 0; lib < options->libraries; lib++) {
+        strpool_reset();
 
-        if (!copy_directory(data.library->content_dir, new_path_full)) {
-            const char* msg = strpool_sprintf("Failed to copy content directory to new location: '%s'", new_path_full);
-            _ERROR(msg);
-            MessageBox(hwnd, msg, "Error relocating library", MB_OK | MB_ICONERROR);
-            return;
+        const char* name = bench_library_name(lib);
+        const char* dir  = strpool_sprintf("%s\\libraries\\%s", tree->root, name);
+        if (!CreateDirectoryW(make_long_path(dir), NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+            _ERROR("Failed to create benchmark library: '%s'", dir);
+            return FALSE;
         }
 
-        if (!rm_rf(make_long_path(data.library->content_dir))) {
-            _WARN(
-              "Library (%s) was copied to new location but K8-LRT was unable to delete the original library content "
-              "directory.",
-              data.library->name);
-        }
-
-        HKEY regkey;
-        const char* key_path = join_paths("SOFTWARE\\Native Instruments", data.library->name);
-        const BOOL open      = open_registry_key(&regkey, HKEY_LOCAL_MACHINE, key_path, KEY_SET_VALUE);
-        if (open) {
-            if (!set_registry_value_str(regkey, "ContentDir", new_path_full)) {
-                close_registry_key(&regkey);
-                _ERROR("Failed to update ContentDir value in registry key");
-                MessageBox(hwnd,
-                           "Failed to update ContentDir value in registry key",
-                           "Error relocating library",
-                           MB_OK | MB_ICONERROR);
-                return;
+        for (int f = 0; f < options->files; f++) {
+            const char* path     = bench_file_path(dir, options->depth, f, f < leaf_count);
+            const ULONGLONG size = bench_file_size(options, &state);
+            if (!path || !bench_write_file(path, tree->chunk, size)) {
+                _ERROR("Failed to write benchmark file: '%s'", path ? path : dir);
+                return FALSE;
             }
+            tree->files++;
+            tree->bytes += size;
         }
-        close_registry_key(&regkey);
-
-        _INFO("Finished relocating library");
-        MessageBox(hwnd, "Library has been successfully relocated", "Success", MB_OK | MB_ICONINFORMATION);
 
-        const BOOL query_result = query_libraries(hwnd);
-        if (!query_result) {
-            MessageBox(hwnd,
-                       "Failed to query libraries.\n\nCheck 'K8-LRT.log' for details.",
-                       "Error",
-                       MB_OK | MB_ICONERROR);
+        const wchar_t* key   = utf8_to_wide(strpool_sprintf("%s\\%s", _LIBRARY_REGISTRY_PATH, name));
+        const wchar_t* value = utf8_to_wide(dir);
+        if (!key || !value ||
+            RegSetKeyValueW(HKEY_LOCAL_MACHINE,
+                            key,
+                            L"ContentDir",
+                            REG_SZ,
+                            value,
+                            (DWORD)((wcslen(value) + 1) * sizeof(wchar_t))) != ERROR_SUCCESS) {
+            _ERROR("Failed to register benchmark library: '%s'", name);
+            return FALSE;
         }
-
-        SELECTED_INDEX = -1;
     }
+
+    return TRUE;
 }
 
-void on_view_log(HWND hwnd) {
-    if (H_LOG_VIEWER && IsWindow(H_LOG_VIEWER)) {
-        SetForegroundWindow(H_LOG_VIEWER);
-        return;
+// Points HKEY_LOCAL_MACHINE at an empty scratch key below HKEY_CURRENT_USER for the rest of the process, so
+// scans and relocations only ever see the generated libraries
+BOOL bench_registry_open(HKEY* scratch) {
+    RegDeleteTreeW(HKEY_CURRENT_USER, _BENCH_REGISTRY_KEY);
+    if (RegCreateKeyExW(HKEY_CURRENT_USER, _BENCH_REGISTRY_KEY, 0, NULL, 0, KEY_ALL_ACCESS, NULL, scratch, NULL) !=
+        ERROR_SUCCESS) {
+        _ERROR("Failed to create scratch registry key");
+        return FALSE;
     }
 
-    WNDCLASS wc      = {0};
-    wc.lpfnWndProc   = log_viewer_proc;
-    wc.hInstance     = GetModuleHandle(NULL);
-    wc.lpszClassName = _LOGVIEW_CLASS;
-    wc.hCursor       = LoadCursor(NULL, IDC_ARROW);
-    wc.hbrBackground = (HBRUSH)(COLOR_WINDOW + 1);
-    wc.hIcon         = LoadIcon(GetModuleHandle(NULL), MAKEINTRESOURCE(IDI_APPICON));
-
-    if (!GetClassInfo(GetModuleHandle(NULL), _LOGVIEW_CLASS, &wc)) {
-        RegisterClass(&wc);
+    if (RegOverridePredefKey(HKEY_LOCAL_MACHINE, *scratch) != ERROR_SUCCESS) {
+        _ERROR("Failed to redirect HKEY_LOCAL_MACHINE to the scratch registry key");
+        RegCloseKey(*scratch);
+        *scratch = NULL;
+        return FALSE;
     }
 
-    RECT parent_rect;
-    GetWindowRect(hwnd, &parent_rect);
-    const int parent_x = parent_rect.left;
-    const int parent_y = parent_rect.top;
-    const int parent_w = parent_rect.right - parent_rect.left;
-    const int parent_h = parent_rect.bottom - parent_rect.top;
-    const int log_x    = parent_x + (parent_w - _LOGVIEW_W) / 2;
-    const int log_y    = parent_y + (parent_h - _LOGVIEW_H) / 2;
+    return TRUE;
+}
 
-    H_LOG_VIEWER = CreateWindowEx(WS_EX_TOOLWINDOW,
-                                  _LOGVIEW_CLASS,
-                                  _LOGVIEW_TITLE,
-                                  WS_OVERLAPPEDWINDOW,
-                                  log_x,
-                                  log_y,
-                                  _LOGVIEW_W,
-                                  _LOGVIEW_H,
-                                  hwnd,
-                                  NULL,
-                                  GetModuleHandle(NULL),
-                                  NULL);
+void bench_registry_close(HKEY scratch, BOOL keep) {
+    RegOverridePredefKey(HKEY_LOCAL_MACHINE, NULL);
+    RegCloseKey(scratch);
+    if (!keep)
+        RegDeleteTreeW(HKEY_CURRENT_USER, _BENCH_REGISTRY_KEY);
+}
 
-    if (H_LOG_VIEWER) {
-        ShowWindow(H_LOG_VIEWER, SW_SHOW);
-    } else {
-        MessageBox(hwnd, "Failed to create log viewer window.", "Error", MB_OK | MB_ICONERROR);
+BOOL bench_begin_phase(ULONGLONG expected_samples) {
+    free(BENCH_SAMPLES);
+    BENCH_SAMPLE_COUNT    = 0;
+    BENCH_SAMPLE_CAPACITY = (LONG)min(expected_samples, MAXLONG);
+    BENCH_SAMPLES         = (LONGLONG*)malloc(max(BENCH_SAMPLE_CAPACITY, 1) * sizeof(LONGLONG));
+    if (!BENCH_SAMPLES)
+        BENCH_SAMPLE_CAPACITY = 0;
+    return BENCH_SAMPLES != NULL;
+}
+
+int compare_ticks(const void* a, const void* b) {
+    const LONGLONG x = *(const LONGLONG*)a;
+    const LONGLONG y = *(const LONGLONG*)b;
+    return (x > y) - (x < y);
+}
+
+// Prints one row of the report from the samples the phase recorded. `items` are files, or libraries for the
+// phases that work a library at a time.
+void bench_end_phase(const char* phase, LONGLONG ticks, ULONGLONG items, ULONGLONG bytes, BOOL ok) {
+    const LONG count = min(BENCH_SAMPLE_COUNT, BENCH_SAMPLE_CAPACITY);
+    BENCH_SAMPLE_CAPACITY = 0;  // Nothing else is recorded until the next phase
+
+    double p50 = 0.0, p99 = 0.0;
+    if (count > 0) {
+        qsort(BENCH_SAMPLES, count, sizeof(LONGLONG), compare_ticks);
+        p50 = ticks_to_ms(BENCH_SAMPLES[(count - 1) * 50 / 100]);
+        p99 = ticks_to_ms(BENCH_SAMPLES[(count - 1) * 99 / 100]);
     }
+
+    PROCESS_MEMORY_COUNTERS memory = {0};
+    GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory));
+
+    const double seconds = max(ticks_to_ms(ticks), 0.001) / 1000.0;
+    fprintf(stdout,
+            "%-10s %10llu %12.1f %10.1f %12.0f %10.1f %10.3f %10.3f %10.1f%s\n",
+            phase,
+            items,
+            (double)bytes / (1024.0 * 1024.0),
+            seconds * 1000.0,
+            (double)items / seconds,
+            (double)bytes / (1024.0 * 1024.0) / seconds,
+            p50,
+            p99,
+            (double)memory.PeakWorkingSetSize / (1024.0 * 1024.0),
+            ok ? "" : "  (failed, see K8-LRT.log)");
+    fflush(stdout);
+    _INFO("Benchmark phase '%s': %llu item(s), %llu bytes in %.2f ms", phase, items, bytes, seconds * 1000.0);
 }
 
-void on_reload_libraries(HWND hwnd) {
-    const int response =
-      MessageBox(hwnd, "Clear found libraries and search again?", "Confirm Reload", MB_YESNO | MB_ICONQUESTION);
-    if (response == IDYES) {
-        const BOOL query_result = query_libraries(hwnd);
-        if (!query_result) {
-            MessageBox(hwnd, "Failed to query libraries. Are you admin?", "Error querying", MB_OK | MB_ICONERROR);
+// Backs up every generated file into a fresh snapshot, the way a removal stores the cache files it deletes. Files
+// are left in place, so the store is filled by compressing (or cloning) rather than moving them.
+BOOL bench_backup(const bench_options* options, const bench_tree* tree) {
+    backup_snapshot snapshot;
+    if (!snapshot_begin(&snapshot))
+        return FALSE;
+
+    BOOL ok = TRUE;
+    for (int lib = 0; ok && lib < options->libraries; lib++) {
+        strpool_reset();
+        const char* dir = strpool_sprintf("%s\\libraries\\%s", tree->root, bench_library_name(lib));
+
+        for (int f = 0; ok && f < options->files; f++) {
+            const wpath* path = strpool_wpath(bench_file_path(dir, options->depth, f, FALSE));
+            _BENCH_SAMPLE_BEGIN();
+            ok = path && snapshot_add_file(&snapshot, path, NULL);
+            _BENCH_SAMPLE_END();
         }
     }
+
+    snapshot_finish(&snapshot);
+    return ok;
 }
 
-void on_exit(HWND hwnd) {
-    const int response = MessageBox(hwnd, "Are you sure you want exit?", "Confirm Exit", MB_YESNO | MB_ICONQUESTION);
-    if (response == IDYES) {
-        PostQuitMessage(0);
-    }
+BOOL bench_copy(const bench_options* options, const bench_tree* tree) {
+    BOOL ok          = TRUE;
+    const char* dest = join_paths(tree->root, "copies");
+    CreateDirectoryW(make_long_path(dest), NULL);
+    dest = arena_strdup(&CLI_ARENA, dest);
+
+    for (int i = 0; ok && i < LIB_COUNT; i++)
+        ok = copy_directory(LIBRARIES[i].content_dir, join_paths(dest, LIBRARIES[i].name), NULL, NULL);
+    return ok;
 }
 
-void on_about(HWND hwnd) {
-    const char* version = VER_PRODUCTVERSION_STR;
-    DialogBoxParam(GetModuleHandle(NULL), MAKEINTRESOURCE(IDD_ABOUTBOX), hwnd, about_dialog_proc, (LPARAM)version);
+// Relocates every library into a sibling folder on the same volume, so this times the rename and registry update
+// path end to end
+BOOL bench_relocate(const bench_options* options, const bench_tree* tree) {
+    BOOL ok          = TRUE;
+    const char* dest = join_paths(tree->root, "relocated");
+    CreateDirectoryW(make_long_path(dest), NULL);
+    dest = arena_strdup(&CLI_ARENA, dest);
+
+    for (int i = 0; ok && i < LIB_COUNT; i++) {
+        _BENCH_SAMPLE_BEGIN();
+        ok = relocate_library(&LIBRARIES[i], join_paths(dest, LIBRARIES[i].name), NULL);
+        _BENCH_SAMPLE_END();
+    }
+
+    // Picked up by a rescan, like the window does once a relocation finishes
+    return ok && scan_libraries();
 }
 
-#pragma endregion
-//===================================================================//
-//                      -- WINDOW CALLBACK --                        //
-//===================================================================//
-#pragma region window callbacks
+// Deletes the relocated libraries through remove_content_dirs(), one worker per drive, then the copies
+BOOL bench_delete(const bench_options* options, const bench_tree* tree) {
+    const library_entry** libraries = (const library_entry**)calloc(LIB_COUNT + 1, sizeof(library_entry*));
+    BOOL* results                   = (BOOL*)calloc(LIB_COUNT + 1, sizeof(BOOL));
+    BOOL ok                         = libraries && results;
 
-LRESULT CALLBACK wnd_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam) {
-    switch (umsg) {
-        case WM_CREATE:
-            return on_create(hwnd);
+    for (int i = 0; ok && i < LIB_COUNT; i++) {
+        libraries[i] = &LIBRARIES[i];
+        results[i]   = TRUE;
+    }
+    if (ok)
+        remove_content_dirs(libraries, results, LIB_COUNT, NULL);
+    for (int i = 0; ok && i < LIB_COUNT; i++)
+        ok = results[i];
 
-        case WM_SHOWWINDOW:
-            return on_show(hwnd);
+    free(libraries);
+    free(results);
 
-        case WM_ERASEBKGND: {
-            HDC hdc = (HDC)wparam;
-            RECT rect;
-            GetClientRect(hwnd, &rect);
-            FillRect(hdc, &rect, GetSysColorBrush(COLOR_WINDOW));
-            return 1;
-        }
+    strpool_reset();
+    return rm_rf(make_long_path(join_paths(tree->root, "copies")), NULL) && ok;
+}
 
-        case WM_CTLCOLORSTATIC: {
-            HDC hdc = (HDC)wparam;
-            SetBkMode(hdc, TRANSPARENT);
-            return (LRESULT)GetSysColorBrush(COLOR_WINDOW);
+typedef BOOL (*bench_phase_fn)(const bench_options* options, const bench_tree* tree);
+
+typedef struct {
+    const char* name;
+    bench_phase_fn run;
+    int passes;  // How many times the phase goes over every generated file; 0 if it works a library at a time
+} bench_phase;
+
+static const bench_phase BENCH_PHASES[] = {
+  {"backup", bench_backup, 1},
+  {"copy", bench_copy, 1},
+  {"relocate", bench_relocate, 0},
+  {"delete", bench_delete, 2},
+};
+
+BOOL parse_bench_options(int argc, char** argv, bench_options* options, const char** error) {
+    options->libraries = 8;
+    options->files     = 2000;
+    options->depth     = 3;
+    options->min_size  = 4096;
+    options->max_size  = 8ull * 1024 * 1024;
+    options->repeat    = 5;
+    options->seed      = 1;
+    options->root      = "K8-LRT.bench";
+
+    for (int i = 0; i < argc; i++) {
+        const char* arg = argv[i];
+        if (_STREQ(arg, "--keep")) {
+            options->keep = TRUE;
+            continue;
         }
 
-        case WM_CTLCOLORLISTBOX: {
-            HDC hdc = (HDC)wparam;
-            SetBkColor(hdc, GetSysColor(COLOR_WINDOW));
-            return (LRESULT)GetSysColorBrush(COLOR_WINDOW);
+        if (i + 1 >= argc) {
+            *error = strpool_sprintf("Missing value for '%s'", arg);
+            return FALSE;
         }
 
-        case WM_COMMAND: {
-            switch (LOWORD(wparam)) {
-                case ID_MENU_VIEW_LOG: {
-                    on_view_log(hwnd);
-                    break;
-                }
+        const char* value          = argv[++i];
+        const unsigned long long n = _strtoui64(value, NULL, 10);
+        if (_STREQ(arg, "--root")) {
+            options->root = value;
+        } else if (_STREQ(arg, "--libraries")) {
+            options->libraries = (int)min(n, 10000);
+        } else if (_STREQ(arg, "--files")) {
+            options->files = (int)min(n, 1000000);
+        } else if (_STREQ(arg, "--depth")) {
+            options->depth = (int)min(n, 8);
+        } else if (_STREQ(arg, "--min-size")) {
+            options->min_size = n;
+        } else if (_STREQ(arg, "--max-size")) {
+            options->max_size = n;
+        } else if (_STREQ(arg, "--repeat")) {
+            options->repeat = (int)min(max(n, 1), 1000);
+        } else if (_STREQ(arg, "--seed")) {
+            options->seed = n;
+        } else {
+            *error = strpool_sprintf("Unknown argument: '%s'", arg);
+            return FALSE;
+        }
+    }
 
-                case ID_MENU_RELOAD_LIBRARIES: {
-                    on_reload_libraries(hwnd);
-                    break;
-                }
+    if (options->libraries == 0 || options->files == 0) {
+        *error = "--libraries and --files must be at least 1";
+        return FALSE;
+    }
 
-                case ID_MENU_EXIT: {
-                    on_exit(hwnd);
-                    break;
-                }
+    return TRUE;
+}
 
-                case ID_MENU_CHECK_UPDATES: {
-                    check_for_updates(hwnd, TRUE);
-                    break;
-                }
+// Runs every phase against freshly generated data. The working directory moves into the benchmark root, so the
+// log, backup store and journals it produces never mix with a real installation's.
+int run_bench(int argc, char** argv) {
+    strpool_init();
+    HEADLESS = TRUE;
 
-                case ID_MENU_ABOUT: {
-                    on_about(hwnd);
-                    break;
-                }
+    bench_options options = {0};
+    const char* error     = NULL;
+    if (argc > 0 && (_STREQ(argv[0], "--help") || _STREQ(argv[0], "-h"))) {
+        fputs(BENCH_USAGE, stdout);
+        return 0;
+    }
+    if (!parse_bench_options(argc, argv, &options, &error)) {
+        fprintf(stderr, "%s\n\n%s", error, BENCH_USAGE);
+        return 2;
+    }
 
-                case IDC_REMOVE_ALL_BUTTON: {
-                    on_remove_all(hwnd);
-                    break;
-                }
+    char root[MAX_PATH];
+    char previous_dir[MAX_PATH];
+    if (!GetFullPathNameA(options.root, MAX_PATH, root, NULL)) {
+        fprintf(stderr, "Invalid benchmark folder: '%s'\n", options.root);
+        return 2;
+    }
 
-                case IDC_REMOVE_BUTTON: {
-                    on_remove_selected(hwnd);
-                    break;
-                }
+    // The whole folder is deleted afterwards, so it has to be one the harness creates
+    if (GetFileAttributesA(root) != INVALID_FILE_ATTRIBUTES) {
+        fprintf(stderr, "Benchmark folder already exists, delete it or pick a new one: '%s'\n", root);
+        return 2;
+    }
 
-                case IDC_LISTBOX: {
-                    if (HIWORD(wparam) == LBN_SELCHANGE) {
-                        on_selection_changed(hwnd);
-                    }
+    if (!GetCurrentDirectoryA(MAX_PATH, previous_dir) || !ensure_directory(root) || !SetCurrentDirectoryA(root)) {
+        fprintf(stderr, "Failed to create benchmark folder: '%s'\n", options.root);
+        return 1;
+    }
 
-                    break;
-                }
+    log_init(_LOG_FILENAME);
+    if (!worker_init())
+        _FATAL("Failed to initialize worker pool");
+
+    bench_tree tree = {0};
+    tree.root       = arena_strdup(&CLI_ARENA, root);
+    tree.chunk      = (BYTE*)malloc(_BENCH_WRITE_CHUNK);
+
+    HKEY scratch = NULL;
+    BOOL ok      = tree.root && tree.chunk && bench_registry_open(&scratch);
+
+    fprintf(stdout,
+            "%d libraries x %d files, depth %d, %llu-%llu bytes per file, in '%s'\n\n",
+            options.libraries,
+            options.files,
+            options.depth,
+            options.min_size,
+            options.max_size,
+            root);
+    fprintf(stdout,
+            "%-10s %10s %12s %10s %12s %10s %10s %10s %10s\n",
+            "phase",
+            "items",
+            "MB",
+            "ms",
+            "items/s",
+            "MB/s",
+            "p50 ms",
+            "p99 ms",
+            "peak WS MB");
+
+    if (ok) {
+        const LONGLONG start = query_ticks();
+        ok                   = bench_generate(&options, &tree);
+        bench_end_phase("generate", query_ticks() - start, tree.files, tree.bytes, ok);
+    }
 
-                case IDC_RELOCATE_BUTTON: {
-                    on_relocate_selected(hwnd);
-                    break;
-                }
-            }
+    if (ok) {
+        // Every pass starts from an empty table so each one reads every key
+        bench_begin_phase((ULONGLONG)options.libraries * options.repeat);
+        const LONGLONG start = query_ticks();
+        for (int i = 0; ok && i < options.repeat; i++)
+            ok = (LIB_COUNT == 0 || set_libraries(NULL, 0)) && scan_libraries();
+        bench_end_phase("scan", query_ticks() - start, (ULONGLONG)LIB_COUNT * options.repeat, 0, ok);
+        ok = ok && LIB_COUNT == options.libraries;
+    }
 
-            return 0;
-        }
+    for (int p = 0; ok && p < (int)(sizeof(BENCH_PHASES) / sizeof(BENCH_PHASES[0])); p++) {
+        const bench_phase* phase = &BENCH_PHASES[p];
+        const ULONGLONG items    = phase->passes ? tree.files * phase->passes : (ULONGLONG)LIB_COUNT;
 
-        case WM_DESTROY: {
-            PostQuitMessage(0);
-            return 0;
-        }
+        bench_begin_phase(items);
+        const LONGLONG start = query_ticks();
+        ok                   = phase->run(&options, &tree);
+        bench_end_phase(phase->name, query_ticks() - start, items, tree.bytes * max(phase->passes, 1), ok);
     }
 
-    return DefWindowProc(hwnd, umsg, wparam, lparam);
+    if (scratch)
+        bench_registry_close(scratch, options.keep);
+
+    free(BENCH_SAMPLES);
+    free(tree.chunk);
+    worker_shutdown();
+    log_close();
+    arena_destroy(&LIBRARY_ARENA);
+    arena_destroy(&EXCLUSION_ARENA);
+
+    // The log lives in the benchmark folder too, so the folder goes once it's closed
+    SetCurrentDirectoryA(previous_dir);
+    if (!options.keep && !rm_rf(make_long_path(root), NULL))
+        fprintf(stderr, "Failed to delete benchmark folder: '%s'\n", root);
+
+    arena_destroy(&CLI_ARENA);
+    strpool_destroy();
+    return ok ? 0 : 1;
 }
+#endif
 
 #pragma endregion
 
@@ -2395,24 +11793,58 @@ LRESULT CALLBACK wnd_proc(HWND hwnd, UINT umsg, WPARAM wparam, LPARAM lparam) {
 //                         -- ENTRYPOINT --                          //
 //===================================================================//
 
+#ifdef K8LRT_BENCH
+// The benchmark build is a console program that only runs the harness
+int main(int argc, char** argv) {
+    return run_bench(argc - 1, argv + 1);
+}
+#else
 int WINAPI WinMain(HINSTANCE h_instance, HINSTANCE h_prev_instance, LPSTR lp_cmd_line, int n_cmd_show) {
+    STARTUP_TICKS = query_ticks();
+    strpool_init();
+
+    char** cli_argv    = NULL;
+    const int cli_argc = get_cli_args(&cli_argv);
+    HEADLESS           = cli_argc > 0;
+
+    if (HEADLESS) {
+        cli_attach_output();
+    } else {
 #ifndef NDEBUG
-    attach_console();
+        attach_console();
 #endif
+    }
 
-    strpool_init();
     enable_backup_privilege();
-    log_init("K8-LRT.log");
+    log_init(_LOG_FILENAME);
+    known_paths_init();
 
     const HRESULT hr = CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE);
     if (FAILED(hr))
         return 1;
 
-    // Initialize common controls
-    INITCOMMONCONTROLSEX icc;
-    icc.dwSize = sizeof(icc);
-    icc.dwICC  = ICC_WIN95_CLASSES | ICC_STANDARD_CLASSES;
-    InitCommonControlsEx(&icc);
+    if (!worker_init())
+        _FATAL("Failed to initialize worker pool");
+
+    if (HEADLESS) {
+        const int code = run_cli(cli_argc, cli_argv);
+
+        arena_destroy(&CLI_ARENA);
+        worker_shutdown();
+        CoUninitialize();
+        log_close();
+        arena_destroy(&LIBRARY_ARENA);
+        arena_destroy(&EXCLUSION_ARENA);
+        arena_destroy(&CACHE_MAP.arena);
+        known_paths_destroy();
+        target_close();
+        strpool_destroy();
+
+        return code;
+    }
+
+    // Only what the main window needs; dialogs register the rest when they first open
+    ensure_control_classes(ICC_LISTVIEW_CLASSES | ICC_STANDARD_CLASSES);
 
     WNDCLASS wc      = {0};
     wc.lpfnWndProc   = wnd_proc;
@@ -2461,10 +11893,21 @@ int WINAPI WinMain(HINSTANCE h_instance, HINSTANCE h_prev_instance, LPSTR lp_cmd
     }
 #endif
 
+    watcher_stop();
+    size_index_stop();
+
+    // Waits for any job that was cancelled on exit
+    worker_shutdown();
+
     CoUninitialize();
 
     log_close();
+    arena_destroy(&LIBRARY_ARENA);
+    arena_destroy(&EXCLUSION_ARENA);
+    arena_destroy(&CACHE_MAP.arena);
+    known_paths_destroy();
     strpool_destroy();
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -2,12 +2,13 @@
 #define RESOURCE_H
 
 // Main window
-#define IDC_LISTBOX 101
+#define IDC_LIBRARY_LIST 101
 #define IDC_REMOVE_BUTTON 102
 #define IDC_REMOVE_ALL_BUTTON 103
 #define IDC_CHECKBOX_BACKUP 104
 #define IDC_CHECKBOX_REMOVE_LIB_FOLDER 105
 #define IDC_RELOCATE_BUTTON 106
+#define IDC_FILTER_EDIT 107
 
 // Menu bar
 #define ID_MENU_VIEW_LOG 201
@@ -15,10 +16,18 @@
 #define ID_MENU_EXIT 203
 #define ID_MENU_CHECK_UPDATES 204
 #define ID_MENU_ABOUT 205
-#define ID_MENU_COLLECT_BACKUPS 206
+#define ID_MENU_RESTORE_BACKUP 206
+#define ID_MENU_VERBOSE_LOG 207
+#define ID_MENU_STATS_REPORT 208
+#define ID_MENU_DB3_DELETE 209
+#define ID_MENU_DB3_VACUUM 210
+#define ID_MENU_FIND_ORPHANS 211
 
-// Log viewer edit
-#define IDC_LOGVIEW_EDIT 301
+// Log viewer
+#define IDC_LOGVIEW_LIST 301
+#define IDC_LOGVIEW_INFO 302
+#define IDC_LOGVIEW_WARN 303
+#define IDC_LOGVIEW_ERROR 304
 
 // About dialog
 #define IDD_ABOUTBOX 401
@@ -46,6 +55,8 @@
 #define IDC_BATCH_COUNT_LABEL 607
 #define IDREMOVE_BATCH 608
 #define IDCANCEL_BATCH 609
+#define IDC_BATCH_PROGRESS 610
+#define IDC_BATCH_FILTER 611
 
 // Relocate dialog
 #define IDD_RELOCATE_LIBRARYBOX 701